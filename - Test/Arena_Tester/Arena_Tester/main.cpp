@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "../../../HIRT_Multichannel_Convolution/Convolver.h"
+
+using namespace HISSTools;
+
+// Replace impulses of random lengths (resizing each time) whilst crossfading, processing a varying number of blocks between sets
+// Every set should succeed in an arena sized by getArenaSize() and the arena should be empty once the convolver is destroyed
+
+bool testReplacement(uint32_t numIO, uintptr_t maxLength, bool asyncTail)
+{
+    const uintptr_t blockSize = 256;
+    const int blockChoices[] = { 0, 0, 1, 2, 5, 20 };
+    
+    auto arena = std::make_shared<ConvolveArena>(Convolver::getArenaSize(numIO, kLatencyZero, maxLength, asyncTail));
+    
+    std::mt19937 generator(1);
+    std::uniform_real_distribution<float> distribution(-0.1f, 0.1f);
+    
+    std::vector<float> impulse(maxLength);
+    std::vector<float> input(blockSize);
+    std::vector<float> output(numIO * blockSize);
+    std::vector<const float *> ins(numIO, input.data());
+    std::vector<float *> outs(numIO);
+    
+    for (auto it = impulse.begin(); it != impulse.end(); it++)
+        *it = distribution(generator);
+    
+    for (auto it = input.begin(); it != input.end(); it++)
+        *it = distribution(generator);
+    
+    for (uint32_t i = 0; i < numIO; i++)
+        outs[i] = output.data() + i * blockSize;
+    
+    int failures = 0;
+    
+    {
+        Convolver convolver(numIO, kLatencyZero, 1, asyncTail, arena);
+        
+        convolver.setCrossfade(4096);
+        
+        for (int i = 0; i < 300; i++)
+        {
+            for (uint32_t j = 0; j < numIO; j++)
+            {
+                uintptr_t length = maxLength / 4 + generator() % (maxLength - maxLength / 4 + 1);
+                
+                if (convolver.set(j, j, impulse.data(), length, true) != CONVOLVE_ERR_NONE)
+                    failures++;
+            }
+            
+            for (int j = blockChoices[generator() % 6]; j > 0; j--)
+                convolver.process(ins.data(), outs.data(), numIO, numIO, blockSize);
+        }
+    }
+    
+    bool passed = !failures && !arena->getUsed();
+    
+    std::cout << "Replacement (" << maxLength << " samples" << (asyncTail ? ", async tail): " : "): ");
+    std::cout << failures << " failed sets, peak " << arena->getPeak() << " of " << arena->getSize() << (passed ? " - ok\n" : " - FAILED\n");
+    
+    return passed;
+}
+
+// Process blocks larger than the declared maximum block size (which are processed in chunks) and compare with an unconstrained convolver
+
+bool testBlockSize(bool N2M)
+{
+    const uint32_t numIO = 2;
+    const uintptr_t length = 30000;
+    const uintptr_t maxBlockSize = 64;
+    const uintptr_t blockSize = 1000;
+    
+    auto arena = std::make_shared<ConvolveArena>(N2M ? (64 << 20) : Convolver::getArenaSize(numIO, kLatencyZero, length, false, 4, maxBlockSize));
+    
+    std::mt19937 generator(1);
+    std::uniform_real_distribution<float> distribution(-0.1f, 0.1f);
+    
+    std::vector<float> impulse(length);
+    std::vector<float> input(numIO * blockSize);
+    std::vector<float> output1(numIO * blockSize);
+    std::vector<float> output2(numIO * blockSize);
+    
+    for (auto it = impulse.begin(); it != impulse.end(); it++)
+        *it = distribution(generator);
+    
+    double maxDiff = 0.0;
+    int failures = 0;
+    
+    {
+        std::unique_ptr<Convolver> convolver1;
+        std::unique_ptr<Convolver> convolver2;
+        
+        if (N2M)
+        {
+            convolver1.reset(new Convolver(numIO, numIO, kLatencyZero, 1, arena));
+            convolver2.reset(new Convolver(numIO, numIO, kLatencyZero));
+        }
+        else
+        {
+            convolver1.reset(new Convolver(numIO, kLatencyZero, 1, false, arena));
+            convolver2.reset(new Convolver(numIO, kLatencyZero));
+        }
+        
+        if (convolver1->setMaxBlockSize(maxBlockSize) != CONVOLVE_ERR_NONE)
+            failures++;
+        
+        for (uint32_t i = 0; i < numIO; i++)
+        {
+            for (uint32_t j = 0; j < numIO; j++)
+            {
+                if (N2M || i == j)
+                {
+                    if (convolver1->set(i, j, impulse.data() + (i + j) * 100, length - 300, true) != CONVOLVE_ERR_NONE)
+                        failures++;
+                    
+                    convolver2->set(i, j, impulse.data() + (i + j) * 100, length - 300, true);
+                }
+            }
+        }
+        
+        for (int i = 0; i < 100; i++)
+        {
+            const float *ins[numIO];
+            float *outs1[numIO];
+            float *outs2[numIO];
+            
+            for (auto it = input.begin(); it != input.end(); it++)
+                *it = distribution(generator);
+            
+            for (uint32_t j = 0; j < numIO; j++)
+            {
+                ins[j] = input.data() + j * blockSize;
+                outs1[j] = output1.data() + j * blockSize;
+                outs2[j] = output2.data() + j * blockSize;
+            }
+            
+            convolver1->process(ins, outs1, numIO, numIO, blockSize);
+            convolver2->process(ins, outs2, numIO, numIO, blockSize);
+            
+            for (uintptr_t j = 0; j < numIO * blockSize; j++)
+                maxDiff = std::max(maxDiff, static_cast<double>(std::fabs(output1[j] - output2[j])));
+        }
+    }
+    
+    bool passed = !failures && maxDiff < 1e-5 && !arena->getUsed();
+    
+    std::cout << "Block size (" << (N2M ? "N-to-M" : "N-to-N") << "): " << failures << " failures, max difference " << maxDiff << (passed ? " - ok\n" : " - FAILED\n");
+    
+    return passed;
+}
+
+int main(int argc, const char * argv[])
+{
+    bool passed = true;
+    
+    passed = testReplacement(2, 48000, false) && passed;
+    passed = testReplacement(2, 48000, true) && passed;
+    passed = testReplacement(1, 200000, false) && passed;
+    passed = testReplacement(1, 200000, true) && passed;
+    passed = testBlockSize(false) && passed;
+    passed = testBlockSize(true) && passed;
+    
+    return passed ? 0 : 1;
+}
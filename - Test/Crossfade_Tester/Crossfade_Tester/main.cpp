@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "../../../HIRT_Multichannel_Convolution/MonoConvolve.h"
+
+using namespace HISSTools;
+
+// Replace an impulse part way through a crossfade and compare with a convolver that only made the first replacement
+// The outputs should not step apart when the second impulse arrives (which would be heard as a click)
+// Once the second fade has completed the output should match a convolver that started the final impulse at the same time
+
+bool testMidFade(uintptr_t fadeOffset, uint32_t fadeLevels, bool asyncTail)
+{
+    const uintptr_t length = 60000;
+    const uintptr_t blockSize = 64;
+    const uintptr_t fadeLength = 4096;
+    const uintptr_t switch1 = 30016;
+    const uintptr_t switch2 = switch1 + fadeOffset;
+    const uintptr_t total = switch2 + fadeLength + 8192;
+    const uintptr_t onset = 32;
+    
+    LatencyMode latency = asyncTail ? kLatencyShort : kLatencyZero;
+    
+    std::mt19937 generator(1);
+    std::normal_distribution<float> distribution;
+    
+    std::vector<float> impulses[3];
+    std::vector<float> input(total);
+    std::vector<float> output(total);
+    std::vector<float> reference(total);
+    std::vector<float> final(total);
+    std::vector<float> temp(blockSize);
+    
+    for (auto& impulse : impulses)
+    {
+        impulse.resize(length);
+        
+        for (uintptr_t i = 0; i < length; i++)
+            impulse[i] = distribution(generator) * std::exp(-static_cast<float>(i) / 12000.f) * 0.02f;
+    }
+    
+    for (auto it = input.begin(); it != input.end(); it++)
+        *it = distribution(generator);
+    
+    MonoConvolve convolver(length, latency, asyncTail);
+    MonoConvolve referenceConvolver(length, latency, asyncTail);
+    MonoConvolve finalConvolver(length, latency, asyncTail);
+    
+    convolver.setCrossfade(fadeLength, fadeLevels);
+    referenceConvolver.setCrossfade(fadeLength, fadeLevels);
+    
+    convolver.set(impulses[0].data(), length, true);
+    referenceConvolver.set(impulses[0].data(), length, true);
+    finalConvolver.set(impulses[0].data(), length, true);
+    
+    for (uintptr_t i = 0; i < total; i += blockSize)
+    {
+        if (i == switch1)
+        {
+            convolver.set(impulses[1].data(), length, false);
+            referenceConvolver.set(impulses[1].data(), length, false);
+        }
+        
+        if (i == switch2)
+        {
+            convolver.set(impulses[2].data(), length, false);
+            finalConvolver.set(impulses[2].data(), length, false);
+        }
+        
+        convolver.process(input.data() + i, temp.data(), output.data() + i, blockSize);
+        referenceConvolver.process(input.data() + i, temp.data(), reference.data() + i, blockSize);
+        finalConvolver.process(input.data() + i, temp.data(), final.data() + i, blockSize);
+    }
+    
+    double level = 0.0;
+    double step = 0.0;
+    double finalError = 0.0;
+    
+    for (uintptr_t i = switch1; i < switch2; i++)
+        level = std::max(level, static_cast<double>(std::fabs(reference[i])));
+    
+    for (uintptr_t i = switch2; i < switch2 + onset; i++)
+        step = std::max(step, static_cast<double>(std::fabs(output[i] - reference[i])));
+    
+    for (uintptr_t i = switch2 + fadeLength; i < total; i++)
+        finalError = std::max(finalError, static_cast<double>(std::fabs(output[i] - final[i])));
+    
+    bool passed = step < 0.05 * level && finalError < 1e-3;
+    
+    std::cout << "Mid-fade replacement (offset " << fadeOffset << ", " << fadeLevels << " levels" << (asyncTail ? ", async tail): " : "): ");
+    std::cout << "step " << step << " of " << level << ", final error " << finalError << (passed ? " - ok\n" : " - FAILED\n");
+    
+    return passed;
+}
+
+// Replace an impulse and compare the start of the fade with a convolver that kept the original impulse
+// Every level of the previous impulse (including any background partition) should fade or ramp out rather than stop
+
+bool testFadeStart(uint32_t fadeLevels, bool asyncTail)
+{
+    const uintptr_t length = 60000;
+    const uintptr_t blockSize = 64;
+    const uintptr_t fadeLength = 4096;
+    const uintptr_t switchTime = 30016;
+    const uintptr_t total = switchTime + 256;
+    const uintptr_t onset = 32;
+    
+    LatencyMode latency = asyncTail ? kLatencyShort : kLatencyZero;
+    
+    std::mt19937 generator(2);
+    std::normal_distribution<float> distribution;
+    
+    std::vector<float> impulses[2];
+    std::vector<float> input(total);
+    std::vector<float> output(total);
+    std::vector<float> reference(total);
+    std::vector<float> temp(blockSize);
+    
+    for (auto& impulse : impulses)
+    {
+        impulse.resize(length);
+        
+        for (uintptr_t i = 0; i < length; i++)
+            impulse[i] = distribution(generator) * std::exp(-static_cast<float>(i) / 12000.f) * 0.02f;
+    }
+    
+    for (auto it = input.begin(); it != input.end(); it++)
+        *it = distribution(generator);
+    
+    MonoConvolve convolver(length, latency, asyncTail);
+    MonoConvolve referenceConvolver(length, latency, asyncTail);
+    
+    convolver.setCrossfade(fadeLength, fadeLevels);
+    convolver.set(impulses[0].data(), length, true);
+    referenceConvolver.set(impulses[0].data(), length, true);
+    
+    for (uintptr_t i = 0; i < total; i += blockSize)
+    {
+        if (i == switchTime)
+            convolver.set(impulses[1].data(), length, false);
+        
+        convolver.process(input.data() + i, temp.data(), output.data() + i, blockSize);
+        referenceConvolver.process(input.data() + i, temp.data(), reference.data() + i, blockSize);
+    }
+    
+    double level = 0.0;
+    double step = 0.0;
+    
+    for (uintptr_t i = switchTime - 4096; i < switchTime; i++)
+        level = std::max(level, static_cast<double>(std::fabs(reference[i])));
+    
+    for (uintptr_t i = switchTime; i < switchTime + onset; i++)
+        step = std::max(step, static_cast<double>(std::fabs(output[i] - reference[i])));
+    
+    bool passed = step < 0.05 * level;
+    
+    std::cout << "Fade start (" << fadeLevels << " levels" << (asyncTail ? ", async tail): " : "): ");
+    std::cout << "step " << step << " of " << level << (passed ? " - ok\n" : " - FAILED\n");
+    
+    return passed;
+}
+
+int main(int argc, const char * argv[])
+{
+    bool passed = true;
+    
+    for (bool asyncTail : { false, true })
+    {
+        for (uint32_t fadeLevels : { 5, 3 })
+        {
+            passed = testFadeStart(fadeLevels, asyncTail) && passed;
+            passed = testMidFade(1024, fadeLevels, asyncTail) && passed;
+            passed = testMidFade(3072, fadeLevels, asyncTail) && passed;
+        }
+    }
+    
+    return passed ? 0 : 1;
+}
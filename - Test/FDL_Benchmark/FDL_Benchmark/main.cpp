@@ -0,0 +1,174 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "../../../HIRT_Multichannel_Convolution/ConvolveKernels.h"
+#include "../../../HIRT_Multichannel_Convolution/PartitionedConvolve.h"
+
+using namespace HISSTools;
+
+// Compare the fused multiply-accumulate of consecutive partitions with accumulating one partition at a time
+// Then compare the ring frequency domain delay line (FDL) with the mirrored layout for complete convolutions
+// Both comparisons should give identical output (the best of several runs is reported)
+
+typedef FFTTypes<float>::Split FloatSplit;
+
+template <class Fn>
+double bestTime(int numRuns, Fn fn)
+{
+    double best = 1e9;
+    
+    for (int i = 0; i < numRuns; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    
+    return best;
+}
+
+// The time for the partitions of one hop (the real values of all partitions are followed by all imaginary values)
+
+bool benchmarkKernel(uintptr_t fftSize, uintptr_t length)
+{
+    uintptr_t numBins = fftSize >> 1;
+    uintptr_t numPartitions = (length + numBins - 1) / numBins;
+    uintptr_t size = numPartitions * fftSize;
+    int numRepeats = static_cast<int>(std::max(uintptr_t(1), uintptr_t(1 << 24) / size));
+    
+    float *input = static_cast<float *>(ALIGNED_MALLOC(size * sizeof(float)));
+    float *impulse = static_cast<float *>(ALIGNED_MALLOC(size * sizeof(float)));
+    float *output1 = static_cast<float *>(ALIGNED_MALLOC(fftSize * sizeof(float)));
+    float *output2 = static_cast<float *>(ALIGNED_MALLOC(fftSize * sizeof(float)));
+    
+    std::mt19937 generator(1);
+    std::uniform_real_distribution<float> distribution(-1.f, 1.f);
+    
+    for (uintptr_t i = 0; i < size; i++)
+    {
+        input[i] = distribution(generator);
+        impulse[i] = distribution(generator);
+    }
+    
+    FloatSplit in1 { input, input + numPartitions * numBins };
+    FloatSplit in2 { impulse, impulse + numPartitions * numBins };
+    FloatSplit out1 { output1, output1 + numBins };
+    FloatSplit out2 { output2, output2 + numBins };
+    
+    double single = bestTime(5, [&]()
+    {
+        for (int i = 0; i < numRepeats; i++)
+        {
+            std::fill_n(output1, fftSize, 0.f);
+            
+            for (uintptr_t j = 0; j < numPartitions; j++)
+            {
+                FloatSplit partition1 { in1.realp + j * numBins, in1.imagp + j * numBins };
+                FloatSplit partition2 { in2.realp + j * numBins, in2.imagp + j * numBins };
+                
+                processPartition(partition1, partition2, out1, numBins);
+            }
+        }
+    });
+    
+    double fused = bestTime(5, [&]()
+    {
+        for (int i = 0; i < numRepeats; i++)
+        {
+            std::fill_n(output2, fftSize, 0.f);
+            processPartitions(in1, in2, out2, numBins, numPartitions);
+        }
+    });
+    
+    bool identical = std::equal(output1, output1 + fftSize, output2);
+    
+    std::cout << "Kernel FFT " << std::setw(4) << fftSize << ", IR " << std::setw(6) << length << " (" << std::setw(4) << numPartitions << " partitions): ";
+    std::cout << "single " << std::fixed << std::setprecision(2) << single * 1e6 / numRepeats << " us, fused " << fused * 1e6 / numRepeats << " us per hop ";
+    std::cout << "(" << single / fused << "x) " << (identical ? "- identical\n" : "- DIFFERENT\n");
+    
+    ALIGNED_FREE(input);
+    ALIGNED_FREE(impulse);
+    ALIGNED_FREE(output1);
+    ALIGNED_FREE(output2);
+    
+    return identical;
+}
+
+// The time for 20 seconds of input in blocks of 64 samples
+
+double runConvolution(uintptr_t fftSize, uintptr_t length, bool mirrored, std::vector<float>& output)
+{
+    const uintptr_t inputLength = 48000 * 20;
+    const uintptr_t blockSize = 64;
+    
+    std::mt19937 generator(5);
+    std::uniform_real_distribution<float> distribution(-1.f, 1.f);
+    
+    std::vector<float> impulse(length);
+    std::vector<float> input(inputLength);
+    
+    for (uintptr_t i = 0; i < length; i++)
+        impulse[i] = distribution(generator) * std::exp(-3.f * i / length);
+    
+    for (auto it = input.begin(); it != input.end(); it++)
+        *it = distribution(generator);
+    
+    PartitionedConvolve convolver(fftSize, length, 0, 0);
+    
+    convolver.setFFTSize(fftSize);
+    convolver.setMirrored(mirrored);
+    convolver.setResetOffset(0);
+    convolver.set(impulse.data(), length);
+    
+    output.resize(inputLength);
+    
+    auto start = std::chrono::steady_clock::now();
+    
+    for (uintptr_t i = 0; i < inputLength; i += blockSize)
+        convolver.process(input.data() + i, output.data() + i, blockSize);
+    
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool benchmarkLayout(uintptr_t fftSize, uintptr_t length)
+{
+    std::vector<float> output1;
+    std::vector<float> output2;
+    
+    double ring = 1e9;
+    double mirrored = 1e9;
+    
+    for (int i = 0; i < 5; i++)
+    {
+        ring = std::min(ring, runConvolution(fftSize, length, false, output1));
+        mirrored = std::min(mirrored, runConvolution(fftSize, length, true, output2));
+    }
+    
+    bool identical = output1 == output2;
+    
+    std::cout << "Layout FFT " << std::setw(4) << fftSize << ", IR " << std::setw(6) << length << ": ";
+    std::cout << "ring " << std::fixed << std::setprecision(1) << ring * 1e3 << " ms, mirrored " << mirrored * 1e3 << " ms ";
+    std::cout << "(" << std::showpos << 100.0 * (mirrored - ring) / ring << std::noshowpos << "%) " << (identical ? "- identical\n" : "- DIFFERENT\n");
+    
+    return identical;
+}
+
+int main(int argc, const char * argv[])
+{
+    bool passed = true;
+    
+    for (uintptr_t length : { 48000, 48000 * 6 })
+        for (uintptr_t fftSize : { 128, 256, 1024, 4096 })
+            passed = benchmarkKernel(fftSize, length) && passed;
+    
+    for (uintptr_t length : { 48000, 48000 * 6 })
+        for (uintptr_t fftSize : { 128, 256, 1024, 4096 })
+            passed = benchmarkLayout(fftSize, length) && passed;
+    
+    return passed ? 0 : 1;
+}
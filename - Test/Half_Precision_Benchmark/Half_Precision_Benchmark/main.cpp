@@ -0,0 +1,142 @@
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "../../../HIRT_Multichannel_Convolution/MonoConvolve.h"
+#include "../../../HIRT_Multichannel_Convolution/PartitionedConvolve.h"
+
+using namespace HISSTools;
+
+// Measure the error of half-precision (bfloat16) tail spectra and the speed of half-precision partitions
+// Sizes are chosen so that the spectra fit in L2, fit in L3 and exceed L3 (where the halved bandwidth matters most)
+
+void makeImpulse(std::vector<float>& impulse, uintptr_t length, unsigned int seed)
+{
+    std::mt19937 generator(seed);
+    std::uniform_real_distribution<float> distribution(-0.5f, 0.5f);
+    
+    impulse.resize(length);
+    
+    for (uintptr_t i = 0; i < length; i++)
+        impulse[i] = distribution(generator) * std::exp(-3.f * i / length);
+}
+
+// The error of a convolver with a half-precision tail relative to the output of a full precision convolver
+
+template <class T>
+void testAccuracy(uintptr_t length)
+{
+    const uintptr_t blockSize = 256;
+    const uintptr_t inputLength = 96000;
+    
+    std::vector<float> impulse;
+    makeImpulse(impulse, length, 1);
+    
+    MonoConvolveT<T> full(length, kLatencyZero);
+    MonoConvolveT<T> half(length, kLatencyZero);
+    
+    half.setHalfPrecisionTail(true);
+    full.set(impulse.data(), length, true);
+    half.set(impulse.data(), length, true);
+    
+    std::mt19937 generator(2);
+    std::uniform_real_distribution<double> distribution(-0.5, 0.5);
+    
+    std::vector<T> input(blockSize);
+    std::vector<T> temp(blockSize);
+    std::vector<T> output1(blockSize);
+    std::vector<T> output2(blockSize);
+    
+    double signal = 0.0;
+    double error = 0.0;
+    
+    for (uintptr_t i = 0; i < length + inputLength; i += blockSize)
+    {
+        for (auto it = input.begin(); it != input.end(); it++)
+            *it = i < inputLength ? static_cast<T>(distribution(generator)) : T(0);
+        
+        full.process(input.data(), temp.data(), output1.data(), blockSize);
+        half.process(input.data(), temp.data(), output2.data(), blockSize);
+        
+        for (uintptr_t j = 0; j < blockSize; j++)
+        {
+            signal += static_cast<double>(output1[j]) * output1[j];
+            error += static_cast<double>(output1[j] - output2[j]) * (output1[j] - output2[j]);
+        }
+    }
+    
+    std::cout << (sizeof(T) == sizeof(float) ? "float " : "double") << " (" << length << " samples): error ";
+    std::cout << std::fixed << std::setprecision(1) << 10.0 * std::log10(error / signal) << " dB relative to the output\n";
+}
+
+// The time to process one second of audio through a number of partitioned convolvers at full and half precision
+
+void benchmark(int numChans, uintptr_t length, uintptr_t fftSize)
+{
+    const uintptr_t blockSize = 512;
+    
+    double times[2];
+    size_t bytes[2];
+    
+    for (int half = 0; half < 2; half++)
+    {
+        std::vector<std::unique_ptr<PartitionedConvolve>> convolvers;
+        std::vector<float> impulse;
+        
+        for (int i = 0; i < numChans; i++)
+        {
+            makeImpulse(impulse, length, 10 + i);
+            convolvers.emplace_back(new PartitionedConvolve(fftSize, length, 0, 0));
+            convolvers.back()->setHalfPrecision(half);
+            convolvers.back()->set(impulse.data(), length);
+        }
+        
+        bytes[half] = numChans * ((length + fftSize / 2 - 1) / (fftSize / 2)) * fftSize * (half ? 2 : 4);
+        
+        std::vector<float> input(blockSize);
+        std::vector<float> output(blockSize);
+        
+        std::mt19937 generator(3);
+        std::uniform_real_distribution<float> distribution(-0.5f, 0.5f);
+        
+        for (auto it = input.begin(); it != input.end(); it++)
+            *it = distribution(generator);
+        
+        // Time one second of audio once the delay lines are full
+        
+        uintptr_t warmup = length + fftSize;
+        std::chrono::steady_clock::time_point start;
+        
+        for (uintptr_t i = 0; i < warmup + 48000; i += blockSize)
+        {
+            if (i >= warmup && i < warmup + blockSize)
+                start = std::chrono::steady_clock::now();
+            
+            for (auto& convolver : convolvers)
+                convolver->process(input.data(), output.data(), blockSize);
+        }
+        
+        times[half] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    
+    std::cout << std::setw(2) << numChans << " x " << std::setw(7) << length << " samples, FFT " << std::setw(5) << fftSize << ": ";
+    std::cout << "spectra " << std::setprecision(1) << bytes[0] / 1e6 << " MB -> " << bytes[1] / 1e6 << " MB, ";
+    std::cout << "1s of audio " << std::setprecision(3) << times[0] << "s -> " << times[1] << "s (" << std::setprecision(2) << times[0] / times[1] << "x)\n";
+}
+
+int main(int argc, const char * argv[])
+{
+    testAccuracy<float>(480000);
+    testAccuracy<double>(480000);
+    
+    benchmark(1, 48000, 1024);
+    benchmark(4, 240000, 1024);
+    benchmark(24, 1440000, 1024);
+    benchmark(24, 1440000, 16384);
+    
+    return 0;
+}
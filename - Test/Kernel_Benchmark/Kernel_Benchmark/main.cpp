@@ -0,0 +1,75 @@
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+
+#include "../../../HIRT_Multichannel_Convolution/ConvolveKernels.h"
+
+// Time the partition multiply-accumulate using four-wide vectors and the widest vectors enabled by the build flags
+// Each run accumulates every partition of an impulse into one accumulator (the best of 15 runs is reported)
+// N.B. build with the relevant flags (e.g. -mavx2 -mfma or -mavx512f) to compare against the wide kernels
+
+typedef FFTTypes<float>::Split FloatSplit;
+
+template <class T>
+double timeKernel(const FloatSplit& input, const FloatSplit& impulse, const FloatSplit& accumulator, uintptr_t fftSize, uintptr_t numPartitions)
+{
+    double best = 1e9;
+    
+    for (int i = 0; i < 15; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        
+        for (uintptr_t j = 0; j < numPartitions; j++)
+        {
+            FloatSplit in1 { input.realp + j * fftSize, input.imagp + j * fftSize };
+            FloatSplit in2 { impulse.realp + j * fftSize, impulse.imagp + j * fftSize };
+            
+            processPartition<T>(in1, in2, accumulator, fftSize >> 1);
+        }
+        
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    
+    return best;
+}
+
+void benchmark(uintptr_t fftSize, uintptr_t length)
+{
+    uintptr_t numPartitions = std::max(uintptr_t(1), length / (fftSize >> 1));
+    
+    float *input = static_cast<float *>(ALIGNED_MALLOC(numPartitions * fftSize * sizeof(float)));
+    float *impulse = static_cast<float *>(ALIGNED_MALLOC(numPartitions * fftSize * sizeof(float)));
+    float *accumulator = static_cast<float *>(ALIGNED_MALLOC(fftSize * sizeof(float)));
+    
+    for (uintptr_t i = 0; i < numPartitions * fftSize; i++)
+        input[i] = impulse[i] = (i % 13) * 0.01f;
+    
+    std::fill_n(accumulator, fftSize, 0.f);
+    
+    // Partitions are stored with the real values followed by the imaginary values
+    
+    FloatSplit inputSplit { input, input + (fftSize >> 1) };
+    FloatSplit impulseSplit { impulse, impulse + (fftSize >> 1) };
+    FloatSplit accumulatorSplit { accumulator, accumulator + (fftSize >> 1) };
+    
+    double narrow = timeKernel<FloatVector>(inputSplit, impulseSplit, accumulatorSplit, fftSize, numPartitions);
+    double wide = timeKernel<WideFloatVector>(inputSplit, impulseSplit, accumulatorSplit, fftSize, numPartitions);
+    
+    std::cout << "FFT " << std::setw(5) << fftSize << ", IR " << std::setw(7) << length << " (" << std::setw(4) << numPartitions << " partitions): ";
+    std::cout << "4-wide " << std::fixed << std::setprecision(1) << narrow * 1e6 << " us, ";
+    std::cout << WideFloatVector::size << "-wide " << wide * 1e6 << " us, speedup " << std::setprecision(2) << narrow / wide << "x\n";
+    
+    ALIGNED_FREE(input);
+    ALIGNED_FREE(impulse);
+    ALIGNED_FREE(accumulator);
+}
+
+int main(int argc, const char * argv[])
+{
+    for (uintptr_t fftSize : { 1024, 16384 })
+        for (uintptr_t length : { 16384, 262144, 1048576 })
+            benchmark(fftSize, length);
+    
+    return 0;
+}
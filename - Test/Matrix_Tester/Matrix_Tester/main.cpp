@@ -0,0 +1,66 @@
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "../../../HIRT_Multichannel_Convolution/Convolver.h"
+
+using namespace HISSTools;
+
+// The memory held by an N-to-M convolver with the given number of routes (chosen at random with a fixed seed)
+
+size_t getUsage(uint32_t numIO, uint32_t numRoutes, const std::vector<float>& impulse)
+{
+    auto counter = std::make_shared<ConvolveCounter>();
+    
+    Convolver convolver(numIO, numIO, kLatencyShort, 1, counter);
+    
+    std::vector<uint32_t> pairs(numIO * numIO);
+    std::mt19937 generator(1);
+    
+    for (uint32_t i = 0; i < numIO * numIO; i++)
+        pairs[i] = i;
+    
+    std::shuffle(pairs.begin(), pairs.end(), generator);
+    
+    for (uint32_t i = 0; i < numRoutes; i++)
+        convolver.set(pairs[i] % numIO, pairs[i] / numIO, impulse.data(), impulse.size(), true);
+    
+    return counter->getUsed();
+}
+
+// Memory should scale with the number of inputs and outputs and the number of routes (and not with the number of possible pairs)
+
+bool testSparseUsage(uintptr_t length)
+{
+    std::vector<float> impulse(length, 0.01f);
+    
+    size_t empty4 = getUsage(4, 0, impulse);
+    size_t empty16 = getUsage(16, 0, impulse);
+    size_t route16 = getUsage(16, 1, impulse);
+    size_t sparse16 = getUsage(16, 26, impulse);
+    size_t dense16 = getUsage(16, 256, impulse);
+    
+    size_t perRoute = route16 - empty16;
+    
+    bool emptyPassed = empty16 < empty4 * 5;
+    bool sparsePassed = sparse16 <= empty16 + perRoute * 26 + perRoute / 10;
+    bool densePassed = dense16 <= empty16 + perRoute * 256 + perRoute / 10;
+    
+    std::cout << "Sparse usage (" << length << " samples): empty 4x4 " << empty4 << " 16x16 " << empty16 << (emptyPassed ? " - ok\n" : " - FAILED\n");
+    std::cout << "    one route " << perRoute << " 10% " << sparse16 << (sparsePassed ? " - ok" : " - FAILED") << " all " << dense16 << (densePassed ? " - ok\n" : " - FAILED\n");
+    
+    return emptyPassed && sparsePassed && densePassed;
+}
+
+int main(int argc, const char * argv[])
+{
+    bool passed = true;
+    
+    passed = testSparseUsage(16384) && passed;
+    passed = testSparseUsage(96000) && passed;
+    
+    return passed ? 0 : 1;
+}
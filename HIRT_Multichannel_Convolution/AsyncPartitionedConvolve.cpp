@@ -0,0 +1,205 @@
+
+/*
+ *  AsyncPartitionedConvolve
+ *
+ *    AsyncPartitionedConvolve runs a large PartitionedConvolve on a background thread.
+ *
+ *    The audio thread only copies samples to and from double-buffered handoff buffers.
+ *    At each hop boundary the last hop of input is passed to the background thread, which must process it before the next boundary.
+ *    If the background thread is late the audio thread waits for it, so that the output is always complete.
+ *
+ */
+
+#include "AsyncPartitionedConvolve.h"
+#include "ConvolveSIMD.h"
+#include "ConvolveThreadPool.h"
+
+#include "../ThreadLocks.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <new>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+template <class T>
+HISSTools::AsyncPartitionedConvolve<T>::AsyncPartitionedConvolve(uintptr_t hopSize, AllocatorPtr allocator)
+: mPart(nullptr)
+, mHopSize(hopSize)
+, mPosition(0)
+, mAllocator(ConvolveAllocator::select(allocator))
+, mAudioInput(0)
+, mAudioOutput(0)
+, mJobPart(nullptr)
+, mJobInput(0)
+, mJobOutput(1)
+, mJobReset(false)
+, mResetNext(false)
+, mDiscardJob(false)
+, mJobPending(false)
+, mExit(false)
+, mDeadlineMisses(0)
+, mRealtime(false)
+{
+    // Allocate and zero buffers
+    
+    mInputBuffers[0] = mAllocator->allocate<T>(hopSize * 4);
+    
+    if (!mInputBuffers[0])
+        throw std::bad_alloc();
+    
+    mInputBuffers[1] = mInputBuffers[0] + hopSize;
+    mOutputBuffers[0] = mInputBuffers[1] + hopSize;
+    mOutputBuffers[1] = mOutputBuffers[0] + hopSize;
+    
+    std::fill_n(mInputBuffers[0], hopSize * 4, T(0));
+    
+    mThread = std::thread(&AsyncPartitionedConvolve::workerLoop, this);
+}
+
+template <class T>
+HISSTools::AsyncPartitionedConvolve<T>::~AsyncPartitionedConvolve()
+{
+    mExit.store(true);
+    mCondition.notify_one();
+    mThread.join();
+    
+    mAllocator->deallocate(mInputBuffers[0]);
+}
+
+template <class T>
+void HISSTools::AsyncPartitionedConvolve<T>::reset()
+{
+    // Silence the current output, discard any result in progress and reset the partition with the next job
+    
+    std::fill_n(mOutputBuffers[mAudioOutput], mHopSize, T(0));
+    
+    mPosition = 0;
+    mResetNext = true;
+    mDiscardJob = true;
+}
+
+template <class T>
+bool HISSTools::AsyncPartitionedConvolve<T>::process(const T *in, T *out, uintptr_t numSamples)
+{
+    while (numSamples)
+    {
+        uintptr_t loopSize = std::min(numSamples, mHopSize - mPosition);
+        
+        // Store input and retrieve output
+        
+        std::copy_n(in, loopSize, mInputBuffers[mAudioInput] + mPosition);
+        std::copy_n(mOutputBuffers[mAudioOutput] + mPosition, loopSize, out);
+        
+        // Updates
+        
+        in += loopSize;
+        out += loopSize;
+        numSamples -= loopSize;
+        mPosition += loopSize;
+        
+        if (mPosition == mHopSize)
+        {
+            handoff();
+            mPosition = 0;
+        }
+    }
+    
+    return true;
+}
+
+template <class T>
+void HISSTools::AsyncPartitionedConvolve<T>::handoff()
+{
+    // The result of the previous job is required now
+    
+    waitForJob();
+    
+    uint32_t nextOutput = mJobOutput;
+    
+    if (mDiscardJob)
+    {
+        std::fill_n(mOutputBuffers[nextOutput], mHopSize, T(0));
+        mDiscardJob = false;
+    }
+    
+    // Pass the completed input and the now free output to the background thread
+    
+    mJobPart = mPart;
+    mJobInput = mAudioInput;
+    mJobOutput = mAudioOutput;
+    mJobReset = mResetNext;
+    mResetNext = false;
+    
+    mJobPending.store(true, std::memory_order_release);
+    mCondition.notify_one();
+    
+    // Swap buffers
+    
+    mAudioInput = 1 - mAudioInput;
+    mAudioOutput = nextOutput;
+}
+
+template <class T>
+void HISSTools::AsyncPartitionedConvolve<T>::waitForJob()
+{
+    if (!mJobPending.load(std::memory_order_acquire))
+        return;
+    
+    mDeadlineMisses.fetch_add(1, std::memory_order_relaxed);
+    
+    for (int i = 0; mJobPending.load(std::memory_order_acquire); i++)
+    {
+        if (i > 1000)
+            OS_Specific::thread_nano_sleep();
+    }
+}
+
+template <class T>
+void HISSTools::AsyncPartitionedConvolve<T>::workerLoop()
+{
+    // Match the denormal settings and the priority of the audio thread
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+    _mm_setcsr(_mm_getcsr() | 0x8040);
+#endif
+    
+    mRealtime.store(ConvolveThreadPool::setRealtimePriority());
+    
+    while (true)
+    {
+        {
+            // N.B. notification is not made under the mutex so we wait with a timeout in case a notification is missed
+            
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCondition.wait_for(lock, std::chrono::milliseconds(1), [this]() { return mJobPending.load() || mExit.load(); });
+        }
+        
+        if (mExit.load())
+            break;
+        
+        if (!mJobPending.load(std::memory_order_acquire))
+            continue;
+        
+        // Process
+        
+        PartitionedConvolveT<T> *part = mJobPart;
+        T *input = mInputBuffers[mJobInput];
+        T *output = mOutputBuffers[mJobOutput];
+        
+        if (part && mJobReset)
+            part->reset();
+        
+        if (!part || !part->process(input, output, mHopSize))
+            std::fill_n(output, mHopSize, T(0));
+        
+        mJobPending.store(false, std::memory_order_release);
+    }
+}
+
+// Explicit instantiations
+
+template class HISSTools::AsyncPartitionedConvolve<float>;
+template class HISSTools::AsyncPartitionedConvolve<double>;
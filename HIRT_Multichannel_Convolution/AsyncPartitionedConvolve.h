@@ -0,0 +1,96 @@
+
+#pragma once
+
+#include "PartitionedConvolve.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+namespace HISSTools
+{
+    // AsyncPartitionedConvolve runs a PartitionedConvolve on a background thread one hop at a time
+    // Each hop of input is handed over at a hop boundary and the result is due by the following boundary
+    // The output is therefore delayed by two hops relative to running the PartitionedConvolve directly
+    
+    template <class T>
+    class AsyncPartitionedConvolve
+    {
+    public:
+        
+        AsyncPartitionedConvolve(uintptr_t hopSize, AllocatorPtr allocator = nullptr);
+        ~AsyncPartitionedConvolve();
+        
+        // Non-moveable and copyable
+        
+        AsyncPartitionedConvolve(AsyncPartitionedConvolve& obj) = delete;
+        AsyncPartitionedConvolve& operator = (AsyncPartitionedConvolve& obj) = delete;
+        AsyncPartitionedConvolve(AsyncPartitionedConvolve&& obj) = delete;
+        AsyncPartitionedConvolve& operator = (AsyncPartitionedConvolve&& obj) = delete;
+        
+        // The partition is used from the next handoff and must remain valid whilst it is returned by getJobPartition()
+        // N.B. the partition must not be processed elsewhere and its reset offset must be zero (aligning hops with handoffs)
+        
+        void setPartition(PartitionedConvolveT<T> *part) { mPart = part; }
+        PartitionedConvolveT<T> *getJobPartition() const { return mJobPart; }
+        bool isJobPending() const { return mJobPending.load(std::memory_order_acquire); }
+        
+        void reset();
+        
+        bool process(const T *in, T *out, uintptr_t numSamples);
+        
+        // The number of handoffs at which the background thread had not finished (and the audio thread had to wait)
+        
+        uint64_t getDeadlineMisses() const { return mDeadlineMisses.load(std::memory_order_relaxed); }
+    
+        // The background thread requests realtime priority as the audio thread waits for it when it is late (this may need privileges)
+        
+        bool isRealtime() const { return mRealtime.load(); }
+    
+    private:
+        
+        void handoff();
+        void waitForJob();
+        void workerLoop();
+        
+        // Data
+        
+        PartitionedConvolveT<T> *mPart;
+        
+        uintptr_t mHopSize;
+        uintptr_t mPosition;
+        
+        // Buffers (the audio thread and the background thread always use different buffers)
+        
+        AllocatorPtr mAllocator;
+        
+        T *mInputBuffers[2];
+        T *mOutputBuffers[2];
+        
+        uint32_t mAudioInput;
+        uint32_t mAudioOutput;
+        
+        // Job state
+        
+        PartitionedConvolveT<T> *mJobPart;
+        uint32_t mJobInput;
+        uint32_t mJobOutput;
+        bool mJobReset;
+        
+        bool mResetNext;
+        bool mDiscardJob;
+        
+        std::atomic<bool> mJobPending;
+        std::atomic<bool> mExit;
+        std::atomic<uint64_t> mDeadlineMisses;
+        std::atomic<bool> mRealtime;
+        
+        // Thread
+        
+        std::mutex mMutex;
+        std::condition_variable mCondition;
+        std::thread mThread;
+    };
+}
@@ -0,0 +1,128 @@
+
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+// AtomicSwap publishes heap objects to a single realtime reader which never blocks or allocates
+// Writers publish a complete new object with a single atomic exchange and retire the previous one
+// Retired objects are freed by writers once none of the reader's hazard slots refer to them
+// N.B. writer methods must not be called concurrently (writers should be serialised by the owner)
+
+template <class T, int N = 1>
+class AtomicSwap
+{
+public:
+    
+    AtomicSwap() : mCurrent(nullptr)
+    {
+        for (int i = 0; i < N; i++)
+            mHazards[i].store(nullptr);
+    }
+    
+    ~AtomicSwap()
+    {
+        delete mCurrent.load();
+        
+        for (auto it = mRetired.begin(); it != mRetired.end(); it++)
+            delete *it;
+    }
+    
+    // Moveable (but not whilst in use) and not copyable
+    
+    AtomicSwap(const AtomicSwap&) = delete;
+    AtomicSwap& operator = (const AtomicSwap&) = delete;
+    
+    AtomicSwap(AtomicSwap&& obj)
+    : mCurrent(obj.mCurrent.exchange(nullptr))
+    , mRetired(std::move(obj.mRetired))
+    {
+        for (int i = 0; i < N; i++)
+            mHazards[i].store(nullptr);
+    }
+
+    AtomicSwap& operator = (AtomicSwap&& obj)
+    {
+        delete mCurrent.exchange(obj.mCurrent.exchange(nullptr));
+
+        for (auto it = mRetired.begin(); it != mRetired.end(); it++)
+            delete *it;
+
+        mRetired = std::move(obj.mRetired);
+
+        for (int i = 0; i < N; i++)
+            mHazards[i].store(nullptr);
+
+        return *this;
+    }
+
+    // Reader - returns the current object which remains valid until the next call
+    
+    T *acquire()
+    {
+        T *ptr = mCurrent.load();
+        
+        // Protect the object and check it was not replaced before the protection became visible
+        
+        while (true)
+        {
+            mHazards[0].store(ptr);
+            
+            T *check = mCurrent.load();
+            
+            if (check == ptr)
+                return ptr;
+            
+            ptr = check;
+        }
+    }
+    
+    // Reader - keep an object protected in a further slot (it must already be protected when this is called)
+    
+    void protect(int slot, T *ptr) { mHazards[slot].store(ptr); }
+    
+    // Writers
+    
+    T *current() { return mCurrent.load(); }
+    
+    void publish(T *ptr)
+    {
+        T *previous = mCurrent.exchange(ptr);
+        
+        if (previous)
+            mRetired.push_back(previous);
+        
+        reclaim();
+    }
+    
+    void reclaim()
+    {
+        for (auto it = mRetired.begin(); it != mRetired.end(); )
+        {
+            if (isProtected(*it))
+                it++;
+            else
+            {
+                delete *it;
+                it = mRetired.erase(it);
+            }
+        }
+    }
+
+private:
+    
+    // N.B. slots are read in order as the reader only moves an object to a later slot
+    
+    bool isProtected(T *ptr)
+    {
+        for (int i = 0; i < N; i++)
+            if (mHazards[i].load() == ptr)
+                return true;
+        
+        return false;
+    }
+    
+    std::atomic<T *> mCurrent;
+    std::atomic<T *> mHazards[N];
+    std::vector<T *> mRetired;
+};
@@ -0,0 +1,219 @@
+
+#include "BatchConvolve.h"
+#include "ConvolveKernels.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+// Standard Constructor
+
+template <class T>
+HISSTools::BatchConvolve<T>::BatchConvolve(uint32_t numChans, uintptr_t maxLength, LatencyMode latency)
+: mNumChans(numChans)
+, mSizeAllocated(maxLength)
+, mFinalOffset(0)
+, mInputPointers(numChans, nullptr)
+, mOutputPointers(numChans, nullptr)
+, mReset(false)
+, mRandGenerator(std::random_device()())
+{
+    switch (latency)
+    {
+        case kLatencyZero:      setPartitions(maxLength, true, 256, 1024, 4096, 16384);     break;
+        case kLatencyShort:     setPartitions(maxLength, false, 256, 1024, 4096, 16384);    break;
+        case kLatencyMedium:    setPartitions(maxLength, false, 1024, 4096, 16384, 0);      break;
+    }
+}
+
+// Constructor (custom partitioning)
+
+template <class T>
+HISSTools::BatchConvolve<T>::BatchConvolve(uint32_t numChans, uintptr_t maxLength, bool zeroLatency, uint32_t A, uint32_t B, uint32_t C, uint32_t D)
+: mNumChans(numChans)
+, mSizeAllocated(maxLength)
+, mFinalOffset(0)
+, mInputPointers(numChans, nullptr)
+, mOutputPointers(numChans, nullptr)
+, mReset(false)
+, mRandGenerator(std::random_device()())
+{
+    setPartitions(maxLength, zeroLatency, A, B, C, D);
+}
+
+template <class T>
+void HISSTools::BatchConvolve<T>::setResetOffset(intptr_t offset)
+{
+    if (offset < 0)
+        offset = mRandDistribution(mRandGenerator);
+    
+    mLock.acquire();
+    
+    for (size_t i = 0; i + 1 < numSizes(); i++)
+        mParts[i]->setResetOffset(offset + (mSizes[i + 1] >> 3));
+    
+    mParts.back()->setResetOffset(offset);
+    
+    mLock.release();
+}
+
+template <class T>
+ConvolveError HISSTools::BatchConvolve<T>::resize(uintptr_t length)
+{
+    uintptr_t largestSize = mSizes.back();
+    
+    // Lock to ensure we have exclusive access (impulses are kept up to the new length)
+    
+    mLock.acquire();
+    
+    ConvolveError error = mParts.back()->resize(std::max(length, uintptr_t(largestSize)) - mFinalOffset);
+    mSizeAllocated = error == CONVOLVE_ERR_NONE ? length : 0;
+    
+    mLock.release();
+    
+    return error;
+}
+
+template <class T>
+ConvolveError HISSTools::BatchConvolve<T>::set(uint32_t chan, const float *input, uintptr_t length, bool requestResize)
+{
+    return setImpulse(chan, input, length, requestResize);
+}
+
+template <class T>
+ConvolveError HISSTools::BatchConvolve<T>::set(uint32_t chan, const double *input, uintptr_t length, bool requestResize)
+{
+    return setImpulse(chan, input, length, requestResize);
+}
+
+template <class T>
+template <class U>
+ConvolveError HISSTools::BatchConvolve<T>::setImpulse(uint32_t chan, const U *input, uintptr_t length, bool requestResize)
+{
+    if (chan >= mNumChans)
+        return CONVOLVE_ERR_IN_CHAN_OUT_OF_RANGE;
+    
+    if (requestResize && length > mSizeAllocated)
+        resize(length);
+    
+    // Lock to ensure that audio finishes processing before we replace
+    
+    mLock.acquire();
+    
+    if (mTimes.size())
+        mTimes[chan]->set(input, length);
+    
+    for (auto it = mParts.begin(); it != mParts.end(); it++)
+        (*it)->set(chan, input, length);
+    
+    mLock.release();
+    
+    return (length && !mSizeAllocated) ? CONVOLVE_ERR_MEM_UNAVAILABLE : (length > mSizeAllocated) ? CONVOLVE_ERR_MEM_ALLOC_TOO_SMALL : CONVOLVE_ERR_NONE;
+}
+
+template <class T>
+void HISSTools::BatchConvolve<T>::reset()
+{
+    mReset = true;
+}
+
+template <class T>
+void HISSTools::BatchConvolve<T>::process(const T * const* ins, T **outs, size_t numSamples, size_t activeChans)
+{
+    activeChans = std::min(activeChans, size_t(mNumChans));
+    
+    // Zero outputs then convolve
+    
+    for (size_t i = 0; i < activeChans; i++)
+        std::fill_n(outs[i], numSamples, T(0));
+    
+    if (!mLock.attempt())
+        return;
+    
+    if (mReset)
+    {
+        for (auto it = mTimes.begin(); it != mTimes.end(); it++)
+            (*it)->reset();
+        
+        for (auto it = mParts.begin(); it != mParts.end(); it++)
+            (*it)->reset();
+        
+        mReset = false;
+    }
+    
+    // Time domain convolution (per channel - this writes the outputs, which are then accumulated by the partitions)
+    
+    for (size_t i = 0; i < mTimes.size() && i < activeChans; i++)
+        mTimes[i]->process(ins[i], outs[i], numSamples);
+    
+    // Partitioned convolution (all channels at once for each partition size)
+    
+    for (uint32_t i = 0; i < mNumChans; i++)
+    {
+        mInputPointers[i] = i < activeChans ? ins[i] : nullptr;
+        mOutputPointers[i] = i < activeChans ? outs[i] : nullptr;
+    }
+    
+    for (auto it = mParts.begin(); it != mParts.end(); it++)
+        (*it)->process(mInputPointers.data(), mOutputPointers.data(), numSamples);
+    
+    mLock.release();
+}
+
+template <class T>
+void HISSTools::BatchConvolve<T>::setPartitions(uintptr_t maxLength, bool zeroLatency, uint32_t A, uint32_t B, uint32_t C, uint32_t D)
+{
+    // Utilities
+    
+    auto checkAndStoreFFTSize = [this](int size, int prev)
+    {
+        if ((size >= (1 << 5)) && (size <= (1 << 20)) && size > prev)
+            mSizes.push_back(size);
+        else if (size)
+            throw std::runtime_error("invalid FFT size or order");
+    };
+    
+    // Sanity checks
+    
+    checkAndStoreFFTSize(A, 0);
+    checkAndStoreFFTSize(B, A);
+    checkAndStoreFFTSize(C, B);
+    checkAndStoreFFTSize(D, C);
+    
+    if (!numSizes())
+        throw std::runtime_error("no valid FFT sizes given");
+    
+    uint32_t offset = zeroLatency ? mSizes[0] >> 1 : 0;
+    uint32_t largestSize = mSizes[numSizes() - 1];
+    
+    // Allocate time domain convolvers for each channel
+    
+    if (zeroLatency)
+    {
+        for (uint32_t i = 0; i < mNumChans; i++)
+            mTimes.emplace_back(new TimeDomainConvolveT<T>(0, mSizes[0] >> 1));
+    }
+    
+    // Allocate fixed size partitions
+    
+    for (size_t i = 0; i + 1 < numSizes(); i++)
+    {
+        uint32_t length = (mSizes[i + 1] - mSizes[i]) >> 1;
+        mParts.emplace_back(new PartitionedBatchConvolve<T>(mNumChans, mSizes[i], length, offset, length));
+        offset += length;
+    }
+    
+    // Allocate the final resizeable partition
+    
+    mParts.emplace_back(new PartitionedBatchConvolve<T>(mNumChans, largestSize, std::max(maxLength, uintptr_t(largestSize)) - offset, offset, 0));
+    mFinalOffset = offset;
+    
+    // Set offsets
+    
+    mRandDistribution = std::uniform_int_distribution<uintptr_t>(0, (largestSize >> 1) - 1);
+    setResetOffset();
+}
+
+// Explicit instantiations
+
+template class HISSTools::BatchConvolve<float>;
+template class HISSTools::BatchConvolve<double>;
@@ -0,0 +1,86 @@
+
+#pragma once
+
+#include "MonoConvolve.h"
+#include "PartitionedBatchConvolve.h"
+#include "TimeDomainConvolve.h"
+#include "ConvolveErrors.h"
+
+#include "../ThreadLocks.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace HISSTools
+{
+    // BatchConvolve convolves several independent channels (each input with its own impulse to the matching output)
+    // The partitions of all channels are stored and processed together for each partition size (see PartitionedBatchConvolve)
+    // This suits buses of channels with impulses of similar length, as every channel is processed to the length of the longest
+    
+    template <class T>
+    class BatchConvolve
+    {
+        typedef std::unique_ptr<HISSTools::TimeDomainConvolveT<T>> TimeUniquePtr;
+        typedef std::unique_ptr<HISSTools::PartitionedBatchConvolve<T>> PartUniquePtr;
+    
+    public:
+        
+        BatchConvolve(uint32_t numChans, uintptr_t maxLength, LatencyMode latency);
+        BatchConvolve(uint32_t numChans, uintptr_t maxLength, bool zeroLatency, uint32_t A, uint32_t B = 0, uint32_t C = 0, uint32_t D = 0);
+        
+        // Non-moveable and copyable
+        
+        BatchConvolve(BatchConvolve& obj) = delete;
+        BatchConvolve& operator = (BatchConvolve& obj) = delete;
+        BatchConvolve(BatchConvolve&& obj) = delete;
+        BatchConvolve& operator = (BatchConvolve&& obj) = delete;
+        
+        void setResetOffset(intptr_t offset = -1);
+        
+        // The allocated length is shared by all channels (a resize requested on setting only ever grows it)
+        
+        ConvolveError resize(uintptr_t length);
+        ConvolveError set(uint32_t chan, const float *input, uintptr_t length, bool requestResize);
+        ConvolveError set(uint32_t chan, const double *input, uintptr_t length, bool requestResize);
+        
+        // N.B. all channels share scheduling so resetting resets every channel
+        
+        void reset();
+        
+        void process(const T * const* ins, T **outs, size_t numSamples, size_t activeChans);
+    
+    private:
+        
+        void setPartitions(uintptr_t maxLength, bool zeroLatency, uint32_t A, uint32_t B, uint32_t C, uint32_t D);
+        
+        template <class U>
+        ConvolveError setImpulse(uint32_t chan, const U *input, uintptr_t length, bool requestResize);
+        
+        size_t numSizes() { return mSizes.size(); }
+        
+        // Data
+        
+        uint32_t mNumChans;
+        
+        std::vector<uint32_t> mSizes;
+        
+        std::vector<TimeUniquePtr> mTimes;
+        std::vector<PartUniquePtr> mParts;
+        
+        uintptr_t mSizeAllocated;
+        uintptr_t mFinalOffset;
+        
+        std::vector<const T *> mInputPointers;
+        std::vector<T *> mOutputPointers;
+        
+        thread_lock mLock;
+        bool mReset;
+        
+        // Random Number Generation
+        
+        std::default_random_engine mRandGenerator;
+        std::uniform_int_distribution<uintptr_t> mRandDistribution;
+    };
+}
@@ -0,0 +1,222 @@
+
+#include "ConvolveAllocator.h"
+#include "ConvolveSIMD.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+// Utilities
+
+static_assert(HISSTools::ConvolveArena::ALIGNMENT >= SIMD_ALIGNMENT, "arena blocks must be aligned for the widest vector");
+
+size_t roundToMultiple(size_t size, size_t multiple)
+{
+    return ((size + multiple - 1) / multiple) * multiple;
+}
+
+void *allocateArena(size_t size)
+{
+#ifdef _WIN32
+    return _aligned_malloc(size, HISSTools::ConvolveArena::PAGE_SIZE);
+#else
+    void *ptr = nullptr;
+    return posix_memalign(&ptr, HISSTools::ConvolveArena::PAGE_SIZE, size) ? nullptr : ptr;
+#endif
+}
+
+void freeArena(void *ptr)
+{
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+// ConvolveAllocator
+
+std::shared_ptr<HISSTools::ConvolveAllocator> HISSTools::ConvolveAllocator::getDefault()
+{
+    static std::shared_ptr<ConvolveAllocator> allocator(new ConvolveAllocator());
+    
+    return allocator;
+}
+
+void *HISSTools::ConvolveAllocator::allocateBytes(size_t bytes)
+{
+    return ALIGNED_MALLOC(bytes);
+}
+
+void HISSTools::ConvolveAllocator::deallocateBytes(void *ptr)
+{
+    ALIGNED_FREE(ptr);
+}
+
+// ConvolveArena
+
+HISSTools::ConvolveArena::ConvolveArena(size_t size)
+: mMemory(nullptr)
+, mSize(roundToMultiple(std::max(size, ALIGNMENT * 2), PAGE_SIZE))
+, mUsed(0)
+, mPeak(0)
+{
+    mMemory = static_cast<char *>(allocateArena(mSize));
+    
+    if (!mMemory)
+        throw std::bad_alloc();
+    
+    // Touch every page now so that the memory is committed before use (and start with a single free block)
+    
+    std::fill_n(mMemory, mSize, 0);
+    
+    *getHeader(0) = { mSize, 0, true };
+}
+
+HISSTools::ConvolveArena::~ConvolveArena()
+{
+    freeArena(mMemory);
+}
+
+size_t HISSTools::ConvolveArena::getBlockSize(size_t bytes)
+{
+    return roundToMultiple(std::max(bytes, size_t(1)), ALIGNMENT) + ALIGNMENT;
+}
+
+size_t HISSTools::ConvolveArena::getUsed()
+{
+    mLock.acquire();
+    size_t used = mUsed;
+    mLock.release();
+    
+    return used;
+}
+
+size_t HISSTools::ConvolveArena::getPeak()
+{
+    mLock.acquire();
+    size_t peak = mPeak;
+    mLock.release();
+    
+    return peak;
+}
+
+void *HISSTools::ConvolveArena::allocateBytes(size_t bytes)
+{
+    size_t size = getBlockSize(bytes);
+    void *ptr = nullptr;
+    
+    mLock.acquire();
+    
+    // Take the first free block that is large enough (splitting off any remainder that can hold a further block)
+    
+    for (size_t offset = 0; offset < mSize; offset += getHeader(offset)->mSize)
+    {
+        Header *header = getHeader(offset);
+        
+        if (!header->mFree || header->mSize < size)
+            continue;
+        
+        if (header->mSize - size >= ALIGNMENT * 2)
+        {
+            *getHeader(offset + size) = { header->mSize - size, size, true };
+            
+            if (offset + header->mSize < mSize)
+                getHeader(offset + header->mSize)->mPrevSize = header->mSize - size;
+            
+            header->mSize = size;
+        }
+        
+        header->mFree = false;
+        mUsed += header->mSize;
+        mPeak = std::max(mPeak, mUsed);
+        ptr = mMemory + offset + ALIGNMENT;
+        break;
+    }
+    
+    mLock.release();
+    
+    return ptr;
+}
+
+void HISSTools::ConvolveArena::deallocateBytes(void *ptr)
+{
+    size_t offset = (static_cast<char *>(ptr) - mMemory) - ALIGNMENT;
+    
+    mLock.acquire();
+    
+    Header *header = getHeader(offset);
+    
+    header->mFree = true;
+    mUsed -= header->mSize;
+    
+    // Merge with the following and then the preceding block if they are free
+    
+    if (offset + header->mSize < mSize && getHeader(offset + header->mSize)->mFree)
+        header->mSize += getHeader(offset + header->mSize)->mSize;
+    
+    if (offset && getHeader(offset - header->mPrevSize)->mFree)
+    {
+        Header *previous = getHeader(offset - header->mPrevSize);
+        
+        previous->mSize += header->mSize;
+        header = previous;
+    }
+    
+    if (getOffset(header) + header->mSize < mSize)
+        getHeader(getOffset(header) + header->mSize)->mPrevSize = header->mSize;
+    
+    mLock.release();
+}
+
+// ConvolveCounter (the size of each allocation is stored before it)
+
+size_t HISSTools::ConvolveCounter::getUsed()
+{
+    mLock.acquire();
+    size_t used = mUsed;
+    mLock.release();
+    
+    return used;
+}
+
+size_t HISSTools::ConvolveCounter::getPeak()
+{
+    mLock.acquire();
+    size_t peak = mPeak;
+    mLock.release();
+    
+    return peak;
+}
+
+void *HISSTools::ConvolveCounter::allocateBytes(size_t bytes)
+{
+    char *ptr = static_cast<char *>(ALIGNED_MALLOC(bytes + ConvolveArena::ALIGNMENT));
+    
+    if (!ptr)
+        return nullptr;
+    
+    *reinterpret_cast<size_t *>(ptr) = ConvolveArena::getBlockSize(bytes);
+    
+    mLock.acquire();
+    mUsed += ConvolveArena::getBlockSize(bytes);
+    mPeak = std::max(mPeak, mUsed);
+    mLock.release();
+    
+    return ptr + ConvolveArena::ALIGNMENT;
+}
+
+void HISSTools::ConvolveCounter::deallocateBytes(void *ptr)
+{
+    char *block = static_cast<char *>(ptr) - ConvolveArena::ALIGNMENT;
+    
+    mLock.acquire();
+    mUsed -= *reinterpret_cast<size_t *>(block);
+    mLock.release();
+    
+    ALIGNED_FREE(block);
+}
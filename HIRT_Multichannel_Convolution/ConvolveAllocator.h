@@ -0,0 +1,126 @@
+
+#pragma once
+
+#include "../ThreadLocks.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace HISSTools
+{
+    // ConvolveAllocator provides the buffers of the convolution engines (following the allocator concept of Allocator.hpp)
+    // The base class allocates aligned memory from the system and is used by any object given a null allocator
+    // N.B. allocations return null on failure (and objects that cannot allocate their buffers throw std::bad_alloc)
+    
+    class ConvolveAllocator
+    {
+    public:
+        
+        virtual ~ConvolveAllocator() {}
+        
+        template <typename T>
+        T *allocate(size_t size) { return static_cast<T *>(allocateBytes(size * sizeof(T))); }
+        
+        template <typename T>
+        void deallocate(T *ptr) { if (ptr) deallocateBytes(ptr); }
+        
+        // The shared system allocator
+        
+        static std::shared_ptr<ConvolveAllocator> getDefault();
+        
+        // Returns the allocator given or the system allocator if it is null
+        
+        static std::shared_ptr<ConvolveAllocator> select(std::shared_ptr<ConvolveAllocator> allocator)
+        {
+            return allocator ? allocator : getDefault();
+        }
+    
+    protected:
+        
+        virtual void *allocateBytes(size_t bytes);
+        virtual void deallocateBytes(void *ptr);
+    };
+    
+    typedef std::shared_ptr<ConvolveAllocator> AllocatorPtr;
+    
+    // ConvolveArena serves every allocation from one contiguous (page aligned) block reserved and touched on construction
+    // Blocks are cache line aligned, and freed blocks are reused first fit (with neighbouring free blocks merged)
+    // N.B. nothing is allocated from the system after construction, so allocations fail once the arena is exhausted
+    
+    class ConvolveArena : public ConvolveAllocator
+    {
+        struct Header
+        {
+            size_t mSize;
+            size_t mPrevSize;
+            bool mFree;
+        };
+    
+    public:
+        
+        static constexpr size_t ALIGNMENT = 64;
+        static constexpr size_t PAGE_SIZE = 4096;
+        
+        ConvolveArena(size_t size);
+        ~ConvolveArena();
+        
+        // Non-moveable and copyable
+        
+        ConvolveArena(ConvolveArena& obj) = delete;
+        ConvolveArena& operator = (ConvolveArena& obj) = delete;
+        ConvolveArena(ConvolveArena&& obj) = delete;
+        ConvolveArena& operator = (ConvolveArena&& obj) = delete;
+        
+        // The space taken in an arena by an allocation of the given number of bytes (including its header)
+        
+        static size_t getBlockSize(size_t bytes);
+        
+        // Usage (in bytes including headers)
+        
+        size_t getSize() const  { return mSize; }
+        size_t getUsed();
+        size_t getPeak();
+    
+    protected:
+        
+        void *allocateBytes(size_t bytes) override;
+        void deallocateBytes(void *ptr) override;
+    
+    private:
+        
+        Header *getHeader(size_t offset) { return reinterpret_cast<Header *>(mMemory + offset); }
+        size_t getOffset(Header *header) { return reinterpret_cast<char *>(header) - mMemory; }
+        
+        char *mMemory;
+        size_t mSize;
+        size_t mUsed;
+        size_t mPeak;
+        
+        thread_lock mLock;
+    };
+    
+    // ConvolveCounter allocates from the system but counts the space that its allocations would take in an arena (for sizing arenas)
+    
+    class ConvolveCounter : public ConvolveAllocator
+    {
+    public:
+        
+        ConvolveCounter() : mUsed(0), mPeak(0) {}
+        
+        size_t getUsed();
+        size_t getPeak();
+    
+    protected:
+        
+        void *allocateBytes(size_t bytes) override;
+        void deallocateBytes(void *ptr) override;
+    
+    private:
+        
+        size_t mUsed;
+        size_t mPeak;
+        
+        thread_lock mLock;
+    };
+}
@@ -0,0 +1,32 @@
+
+#pragma once
+
+#include "../HISSTools_FFT/HISSTools_FFT.h"
+
+#include <cstdint>
+
+// FFT setup and split complex types for each sample type
+
+template <class T> struct FFTTypes {};
+
+template <>
+struct FFTTypes<float>
+{
+    typedef FFT_SETUP_F Setup;
+    typedef FFT_SPLIT_COMPLEX_F Split;
+};
+
+template <>
+struct FFTTypes<double>
+{
+    typedef FFT_SETUP_D Setup;
+    typedef FFT_SPLIT_COMPLEX_D Split;
+};
+
+// Split complex storage as bfloat16 (the upper 16 bits of a float) for compact impulse spectra
+
+struct HalfSplit
+{
+    uint16_t *realp;
+    uint16_t *imagp;
+};
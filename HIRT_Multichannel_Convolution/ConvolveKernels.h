@@ -0,0 +1,319 @@
+
+#pragma once
+
+#include "../HISSTools_FFT/HISSTools_FFT.h"
+
+#include "ConvolveFFTTypes.h"
+#include "ConvolveSIMD.h"
+
+#include <cstdint>
+#include <cstring>
+
+// Kernels shared by the partitioned convolution engines
+
+// Pointer Utility
+
+template <class T>
+void offsetSplitPointer(T &complex1, const T &complex2, uintptr_t offset)
+{
+    complex1.realp = complex2.realp + offset;
+    complex1.imagp = complex2.imagp + offset;
+}
+
+// Complex multiply-accumulate of one vector of bins
+
+template<class T>
+void multiplyAccumulate(T& oReal, T& oImag, const T& real1, const T& imag1, const T& real2, const T& imag2)
+{
+    oReal = fnmadd(imag1, imag2, fmadd(real1, real2, oReal));
+    oImag = fmadd(imag1, real2, fmadd(real1, imag2, oImag));
+}
+
+// Complex multiply-accumulate of one partition (the inputs are not modified so they may be shared between threads)
+
+template<class T = WideFloatVector, class Split = typename FFTTypes<typename T::scalar_type>::Split>
+void processPartition(const Split& in1, const Split& in2, const Split& out, uintptr_t numBins)
+{
+    typedef typename T::scalar_type S;
+    
+    uintptr_t numVecs = numBins / T::size;
+    
+    const T *iReal1 = reinterpret_cast<const T *>(in1.realp);
+    const T *iImag1 = reinterpret_cast<const T *>(in1.imagp);
+    const T *iReal2 = reinterpret_cast<const T *>(in2.realp);
+    const T *iImag2 = reinterpret_cast<const T *>(in2.imagp);
+    T *oReal = reinterpret_cast<T *>(out.realp);
+    T *oImag = reinterpret_cast<T *>(out.imagp);
+    
+    // Calculate the DC and Nyquist bins (packed into the first bin) separately
+    
+    S DC = out.realp[0] + in1.realp[0] * in2.realp[0];
+    S nyquist = out.imagp[0] + in1.imagp[0] * in2.imagp[0];
+    
+    // Do all bins (loop unrolled with any remaining vectors done singly for wider vectors and small FFT sizes)
+    
+    uintptr_t i = 0;
+    
+    for (; i + 3 < numVecs; i += 4)
+    {
+        multiplyAccumulate(oReal[i + 0], oImag[i + 0], iReal1[i + 0], iImag1[i + 0], iReal2[i + 0], iImag2[i + 0]);
+        multiplyAccumulate(oReal[i + 1], oImag[i + 1], iReal1[i + 1], iImag1[i + 1], iReal2[i + 1], iImag2[i + 1]);
+        multiplyAccumulate(oReal[i + 2], oImag[i + 2], iReal1[i + 2], iImag1[i + 2], iReal2[i + 2], iImag2[i + 2]);
+        multiplyAccumulate(oReal[i + 3], oImag[i + 3], iReal1[i + 3], iImag1[i + 3], iReal2[i + 3], iImag2[i + 3]);
+    }
+    
+    for (; i < numVecs; i++)
+        multiplyAccumulate(oReal[i], oImag[i], iReal1[i], iImag1[i], iReal2[i], iImag2[i]);
+    
+    // Replace the DC and Nyquist bins
+    
+    out.realp[0] = DC;
+    out.imagp[0] = nyquist;
+}
+
+// Complex multiply-accumulate of consecutive partitions (the bins of each partition follow those of the previous one in both inputs)
+// Partitions are accumulated in groups so the output is loaded and stored once per group (the order of accumulation is unchanged)
+
+template<class T = WideFloatVector, class Split = typename FFTTypes<typename T::scalar_type>::Split>
+void processPartitions(const Split& in1, const Split& in2, const Split& out, uintptr_t numBins, uintptr_t numPartitions)
+{
+    typedef typename T::scalar_type S;
+    
+    constexpr uintptr_t groupSize = 4;
+    
+    uintptr_t numVecs = numBins / T::size;
+    uintptr_t partition = 0;
+    
+    T *oReal = reinterpret_cast<T *>(out.realp);
+    T *oImag = reinterpret_cast<T *>(out.imagp);
+    
+    for (; partition + groupSize <= numPartitions; partition += groupSize)
+    {
+        const T *iReal1 = reinterpret_cast<const T *>(in1.realp + partition * numBins);
+        const T *iImag1 = reinterpret_cast<const T *>(in1.imagp + partition * numBins);
+        const T *iReal2 = reinterpret_cast<const T *>(in2.realp + partition * numBins);
+        const T *iImag2 = reinterpret_cast<const T *>(in2.imagp + partition * numBins);
+        
+        // Calculate the DC and Nyquist bins (packed into the first bin of each partition) separately
+        
+        S DC = out.realp[0];
+        S nyquist = out.imagp[0];
+        
+        for (uintptr_t j = 0, k = partition * numBins; j < groupSize; j++, k += numBins)
+        {
+            DC += in1.realp[k] * in2.realp[k];
+            nyquist += in1.imagp[k] * in2.imagp[k];
+        }
+        
+        // Do all bins (accumulating the group in registers)
+        
+        for (uintptr_t i = 0; i < numVecs; i++)
+        {
+            T real = oReal[i];
+            T imag = oImag[i];
+            
+            for (uintptr_t j = 0, k = i; j < groupSize; j++, k += numVecs)
+                multiplyAccumulate(real, imag, iReal1[k], iImag1[k], iReal2[k], iImag2[k]);
+            
+            oReal[i] = real;
+            oImag[i] = imag;
+        }
+        
+        // Replace the DC and Nyquist bins
+        
+        out.realp[0] = DC;
+        out.imagp[0] = nyquist;
+    }
+    
+    // Do any remaining partitions singly
+    
+    for (; partition < numPartitions; partition++)
+    {
+        Split partition1, partition2;
+        
+        offsetSplitPointer(partition1, in1, partition * numBins);
+        offsetSplitPointer(partition2, in2, partition * numBins);
+        processPartition<T>(partition1, partition2, out, numBins);
+    }
+}
+
+// Complex multiply-accumulate of one partition for several channels (the bins of each channel follow those of the previous channel)
+// The packed DC and Nyquist bins start each channel, so they are calculated separately for groups of channels
+
+template<class T = WideFloatVector, class Split = typename FFTTypes<typename T::scalar_type>::Split>
+void processPartition(const Split& in1, const Split& in2, const Split& out, uintptr_t numBins, uintptr_t numChans)
+{
+    typedef typename T::scalar_type S;
+    
+    constexpr uintptr_t groupSize = 16;
+    
+    S DC[groupSize];
+    S nyquist[groupSize];
+    
+    const T *iReal1 = reinterpret_cast<const T *>(in1.realp);
+    const T *iImag1 = reinterpret_cast<const T *>(in1.imagp);
+    const T *iReal2 = reinterpret_cast<const T *>(in2.realp);
+    const T *iImag2 = reinterpret_cast<const T *>(in2.imagp);
+    T *oReal = reinterpret_cast<T *>(out.realp);
+    T *oImag = reinterpret_cast<T *>(out.imagp);
+    
+    for (uintptr_t chan = 0; chan < numChans; chan += groupSize)
+    {
+        uintptr_t groupChans = (numChans - chan) < groupSize ? (numChans - chan) : groupSize;
+        uintptr_t i = (chan * numBins) / T::size;
+        uintptr_t numVecs = ((chan + groupChans) * numBins) / T::size;
+        
+        // Calculate the DC and Nyquist bins of the group
+        
+        for (uintptr_t j = 0, k = chan * numBins; j < groupChans; j++, k += numBins)
+        {
+            DC[j] = out.realp[k] + in1.realp[k] * in2.realp[k];
+            nyquist[j] = out.imagp[k] + in1.imagp[k] * in2.imagp[k];
+        }
+        
+        // Do all bins of the group in a single loop (unrolled with any remaining vectors done singly)
+        
+        for (; i + 3 < numVecs; i += 4)
+        {
+            multiplyAccumulate(oReal[i + 0], oImag[i + 0], iReal1[i + 0], iImag1[i + 0], iReal2[i + 0], iImag2[i + 0]);
+            multiplyAccumulate(oReal[i + 1], oImag[i + 1], iReal1[i + 1], iImag1[i + 1], iReal2[i + 1], iImag2[i + 1]);
+            multiplyAccumulate(oReal[i + 2], oImag[i + 2], iReal1[i + 2], iImag1[i + 2], iReal2[i + 2], iImag2[i + 2]);
+            multiplyAccumulate(oReal[i + 3], oImag[i + 3], iReal1[i + 3], iImag1[i + 3], iReal2[i + 3], iImag2[i + 3]);
+        }
+        
+        for (; i < numVecs; i++)
+            multiplyAccumulate(oReal[i], oImag[i], iReal1[i], iImag1[i], iReal2[i], iImag2[i]);
+        
+        // Replace the DC and Nyquist bins
+        
+        for (uintptr_t j = 0, k = chan * numBins; j < groupChans; j++, k += numBins)
+        {
+            out.realp[k] = DC[j];
+            out.imagp[k] = nyquist[j];
+        }
+    }
+}
+
+// bfloat16 conversion (rounding to nearest even, so the relative error of each value is at most 2^-8)
+
+inline uint16_t floatToHalf(float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(float));
+    
+    if ((bits & 0x7FFFFFFF) > 0x7F800000)
+        return static_cast<uint16_t>((bits >> 16) | 0x40);
+    
+    return static_cast<uint16_t>((bits + 0x7FFF + ((bits >> 16) & 1)) >> 16);
+}
+
+inline float halfToFloat(uint16_t value)
+{
+    uint32_t bits = static_cast<uint32_t>(value) << 16;
+    float result;
+    std::memcpy(&result, &bits, sizeof(float));
+    
+    return result;
+}
+
+// Complex multiply-accumulate of one partition with a bfloat16 impulse (which is widened as it is loaded)
+
+template<class T = WideFloatVector, class Split = typename FFTTypes<typename T::scalar_type>::Split>
+void processPartition(const Split& in1, const HalfSplit& in2, const Split& out, uintptr_t numBins)
+{
+    typedef typename T::scalar_type S;
+    
+    uintptr_t numVecs = numBins / T::size;
+    
+    const T *iReal1 = reinterpret_cast<const T *>(in1.realp);
+    const T *iImag1 = reinterpret_cast<const T *>(in1.imagp);
+    const uint16_t *iReal2 = in2.realp;
+    const uint16_t *iImag2 = in2.imagp;
+    T *oReal = reinterpret_cast<T *>(out.realp);
+    T *oImag = reinterpret_cast<T *>(out.imagp);
+    
+    // Calculate the DC and Nyquist bins (packed into the first bin) separately
+    
+    S DC = out.realp[0] + in1.realp[0] * static_cast<S>(halfToFloat(in2.realp[0]));
+    S nyquist = out.imagp[0] + in1.imagp[0] * static_cast<S>(halfToFloat(in2.imagp[0]));
+    
+    // Do all bins (loop unrolled with any remaining vectors done singly)
+    
+    uintptr_t i = 0;
+    
+    for (; i + 1 < numVecs; i += 2)
+    {
+        const T real2a = T::bfloat16_load(iReal2 + (i + 0) * T::size);
+        const T imag2a = T::bfloat16_load(iImag2 + (i + 0) * T::size);
+        const T real2b = T::bfloat16_load(iReal2 + (i + 1) * T::size);
+        const T imag2b = T::bfloat16_load(iImag2 + (i + 1) * T::size);
+        
+        multiplyAccumulate(oReal[i + 0], oImag[i + 0], iReal1[i + 0], iImag1[i + 0], real2a, imag2a);
+        multiplyAccumulate(oReal[i + 1], oImag[i + 1], iReal1[i + 1], iImag1[i + 1], real2b, imag2b);
+    }
+    
+    for (; i < numVecs; i++)
+        multiplyAccumulate(oReal[i], oImag[i], iReal1[i], iImag1[i], T::bfloat16_load(iReal2 + i * T::size), T::bfloat16_load(iImag2 + i * T::size));
+    
+    // Replace the DC and Nyquist bins
+    
+    out.realp[0] = DC;
+    out.imagp[0] = nyquist;
+}
+
+// Scale and store the output of an inverse FFT (overlap-save)
+
+template<class T = WideFloatVector>
+void scaleStore(typename T::scalar_type *out, typename T::scalar_type *temp, uintptr_t FFTSize, bool offset)
+{
+    typedef typename T::scalar_type S;
+    
+    T *outPtr = reinterpret_cast<T *>(out + (offset ? FFTSize >> 1: 0));
+    T *tempPtr = reinterpret_cast<T *>(temp);
+    T scaleMul(S(1) / static_cast<S>(FFTSize << 2));
+    
+    for (uintptr_t i = 0; i < (FFTSize / (T::size * 2)); i++)
+        *(outPtr++) = *(tempPtr++) * scaleMul;
+}
+
+// Summing utility (host buffers may not be aligned for wider vectors so unaligned access is used)
+
+template<class T>
+void sum(const T *temp, T *out, uintptr_t numSamples)
+{
+    typedef WideVector<T> VecType;
+    
+    uintptr_t numVecs = numSamples / VecType::size;
+    
+    for (uintptr_t i = 0; i < numVecs; i++, out += VecType::size, temp += VecType::size)
+        (VecType::unaligned_load(out) + VecType::unaligned_load(temp)).unaligned_store(out);
+    
+    for (uintptr_t i = numVecs * VecType::size; i < numSamples; i++)
+        *out++ += *temp++;
+}
+
+// Silence detection (only exact zeros count as silence, so that skipping silent input does not change the output)
+
+template<class T>
+bool isSilent(const T *in, uintptr_t numSamples)
+{
+    for (uintptr_t i = 0; i < numSamples; i++)
+        if (in[i] != T(0))
+            return false;
+    
+    return true;
+}
+
+// Process an object and optionally sum the results into the output (returning whether there was any output)
+
+template<class T, class U>
+bool processAndSum(T *obj, const U *in, U *temp, U *out, uintptr_t numSamples, bool accumulate)
+{
+    if (!obj || !obj->process(in, accumulate ? temp : out, numSamples))
+        return false;
+    
+    if (accumulate)
+        sum(temp, out, numSamples);
+    
+    return true;
+}
@@ -0,0 +1,351 @@
+
+/*
+ *  ConvolveRenderer
+ *
+ *    ConvolveRenderer performs offline convolution of whole audio files with uniform partitioned overlap-save convolution.
+ *
+ *    Latency does not matter offline, so a single partition size is chosen to minimise the estimated work per sample.
+ *    Each chunk of the file is processed in two parallel stages: the forward FFTs of every hop of every input, then the
+ *    multiply-accumulates and inverse FFT of every hop of every output (each hop has its own accumulator so hops are independent).
+ *
+ */
+
+#include "ConvolveRenderer.h"
+#include "ConvolveKernels.h"
+#include "SharedSpectra.h"
+
+#include <algorithm>
+
+template <class T>
+HISSTools::ConvolveRenderer<T>::ConvolveRenderer(uint32_t numIns, uint32_t numOuts, uint32_t numThreads)
+: mNumIns(numIns)
+, mNumOuts(numOuts)
+, mBlockSizeLog2(MIN_BLOCK_SIZE_LOG2)
+, mImpulses(numIns * numOuts)
+{
+    if (numThreads > 1)
+        mThreadPool.reset(new ConvolveThreadPool(numThreads));
+}
+
+template <class T>
+ConvolveError HISSTools::ConvolveRenderer<T>::checkChannels(uint32_t inChan, uint32_t outChan)
+{
+    if (inChan >= mNumIns)
+        return CONVOLVE_ERR_IN_CHAN_OUT_OF_RANGE;
+    
+    if (outChan >= mNumOuts)
+        return CONVOLVE_ERR_OUT_CHAN_OUT_OF_RANGE;
+    
+    return CONVOLVE_ERR_NONE;
+}
+
+template <class T>
+ConvolveError HISSTools::ConvolveRenderer<T>::set(uint32_t inChan, uint32_t outChan, const float *input, uintptr_t length)
+{
+    return setImpulse(inChan, outChan, input, length);
+}
+
+template <class T>
+ConvolveError HISSTools::ConvolveRenderer<T>::set(uint32_t inChan, uint32_t outChan, const double *input, uintptr_t length)
+{
+    return setImpulse(inChan, outChan, input, length);
+}
+
+template <class T>
+template <class U>
+ConvolveError HISSTools::ConvolveRenderer<T>::setImpulse(uint32_t inChan, uint32_t outChan, const U *input, uintptr_t length)
+{
+    ConvolveError error = checkChannels(inChan, outChan);
+    
+    if (error != CONVOLVE_ERR_NONE)
+        return error;
+    
+    std::vector<T>& impulse = mImpulses[getPairIndex(inChan, outChan)];
+    
+    try
+    {
+        impulse.assign(input, input + (input ? length : 0));
+    }
+    catch (std::bad_alloc&)
+    {
+        impulse.clear();
+        return CONVOLVE_ERR_MEM_UNAVAILABLE;
+    }
+    
+    return CONVOLVE_ERR_NONE;
+}
+
+template <class T>
+void HISSTools::ConvolveRenderer<T>::clear()
+{
+    for (auto it = mImpulses.begin(); it != mImpulses.end(); it++)
+        it->clear();
+}
+
+template <class T>
+uintptr_t HISSTools::ConvolveRenderer<T>::getMaxImpulseLength()
+{
+    uintptr_t length = 0;
+    
+    for (auto it = mImpulses.begin(); it != mImpulses.end(); it++)
+        length = std::max(length, static_cast<uintptr_t>(it->size()));
+    
+    return length;
+}
+
+template <class T>
+uintptr_t HISSTools::ConvolveRenderer<T>::chooseBlockSizeLog2(uintptr_t outputLength)
+{
+    // Blocks longer than the output only add work, so the search stops at the first size that covers it
+    
+    uintptr_t maxBlockSizeLog2 = MIN_BLOCK_SIZE_LOG2;
+    
+    while (maxBlockSizeLog2 < MAX_BLOCK_SIZE_LOG2 && (uintptr_t(1) << maxBlockSizeLog2) < outputLength)
+        maxBlockSizeLog2++;
+    
+    uintptr_t bestBlockSizeLog2 = MIN_BLOCK_SIZE_LOG2;
+    double bestCost = 0.0;
+    
+    for (uintptr_t i = MIN_BLOCK_SIZE_LOG2; i <= maxBlockSizeLog2; i++)
+    {
+        // Estimated operations per sample: an fft per input and output (~5 log2 N per sample) and a complex multiply-add per bin per partition
+        
+        uintptr_t blockSize = uintptr_t(1) << i;
+        double numPartitions = 0.0;
+        
+        for (auto it = mImpulses.begin(); it != mImpulses.end(); it++)
+            numPartitions += static_cast<double>((it->size() + blockSize - 1) >> i);
+        
+        double cost = (mNumIns + mNumOuts) * 5.0 * static_cast<double>(i + 1) + numPartitions * 8.0;
+        
+        if (i == MIN_BLOCK_SIZE_LOG2 || cost < bestCost)
+        {
+            bestBlockSizeLog2 = i;
+            bestCost = cost;
+        }
+    }
+    
+    return bestBlockSizeLog2;
+}
+
+template <class T>
+ConvolveError HISSTools::ConvolveRenderer<T>::render(IAudioFile& input, OAudioFile& output, bool includeTail)
+{
+    if (!input.isOpen() || !output.isOpen())
+        return CONVOLVE_ERR_FILE_ERROR;
+    
+    uintptr_t impulseLength = getMaxImpulseLength();
+    uintptr_t inputLength = input.getFrames();
+    uintptr_t outputLength = inputLength + ((includeTail && impulseLength) ? impulseLength - 1 : 0);
+    
+    // Sizes (each chunk of the file is a whole number of hops, with at least one hop for each thread)
+    
+    mBlockSizeLog2 = chooseBlockSizeLog2(outputLength);
+    
+    uintptr_t blockSize = getBlockSize();
+    uintptr_t FFTSize = blockSize << 1;
+    uintptr_t FFTSizeLog2 = mBlockSizeLog2 + 1;
+    uintptr_t numThreads = mThreadPool ? mThreadPool->getNumThreads() : 1;
+    uintptr_t numHops = std::max((uintptr_t(1) << CHUNK_SIZE_LOG2) >> mBlockSizeLog2, numThreads);
+    uintptr_t chunkSize = numHops * blockSize;
+    uintptr_t numPartitions = (impulseLength + blockSize - 1) >> mBlockSizeLog2;
+    uintptr_t numSlots = std::max(numPartitions, uintptr_t(1)) + numHops - 1;
+    uint32_t numPairs = mNumIns * mNumOuts;
+    uint16_t numInChans = input.getChannels();
+    uint16_t numOutChans = output.getChannels();
+    
+    // Allocate the impulse spectra, the delay lines of input spectra, the input and output audio and an accumulator per task
+    
+    std::vector<uintptr_t> pairPartitions(numPairs);
+    std::vector<uintptr_t> pairOffsets(numPairs);
+    std::vector<uint8_t> silentSlots(mNumIns * numSlots, 1);
+    std::vector<T> interleaved;
+    
+    uintptr_t impulseSize = 0;
+    
+    for (uint32_t i = 0; i < numPairs; i++)
+    {
+        pairPartitions[i] = (mImpulses[i].size() + blockSize - 1) >> mBlockSizeLog2;
+        pairOffsets[i] = impulseSize;
+        impulseSize += pairPartitions[i] * FFTSize;
+    }
+    
+    try
+    {
+        interleaved.resize(chunkSize * std::max(std::max(numInChans, numOutChans), uint16_t(1)));
+    }
+    catch (std::bad_alloc&)
+    {
+        return CONVOLVE_ERR_MEM_UNAVAILABLE;
+    }
+    
+    uintptr_t delaySize = mNumIns * numSlots * FFTSize;
+    uintptr_t inputSize = mNumIns * (chunkSize + blockSize);
+    uintptr_t outputSize = mNumOuts * chunkSize;
+    uintptr_t accumSize = mNumOuts * numHops * FFTSize * 2;
+    
+    T *memory = (T *) ALIGNED_MALLOC((impulseSize + delaySize + inputSize + outputSize + accumSize) * sizeof(T));
+    
+    if (!memory)
+        return CONVOLVE_ERR_MEM_UNAVAILABLE;
+    
+    T *impulses = memory;
+    T *delayLines = impulses + impulseSize;
+    T *inputs = delayLines + delaySize;
+    T *outputs = inputs + inputSize;
+    T *accums = outputs + outputSize;
+    
+    std::shared_ptr<const SharedFFTSetup<T>> setup = SharedFFTSetup<T>::acquire(FFTSizeLog2);
+    ConvolveThreadPool *pool = mThreadPool.get();
+    
+    auto getSplit = [&](T *buffer)
+    {
+        Split split;
+        split.realp = buffer;
+        split.imagp = buffer + blockSize;
+        return split;
+    };
+    
+    // Transform the impulses
+    
+    auto transformImpulse = [&](uint32_t pair)
+    {
+        for (uintptr_t i = 0; i < pairPartitions[pair]; i++)
+        {
+            Split split = getSplit(impulses + pairOffsets[pair] + i * FFTSize);
+            uintptr_t numSamples = std::min(blockSize, mImpulses[pair].size() - i * blockSize);
+            
+            hisstools_rfft(setup->get(), mImpulses[pair].data() + i * blockSize, &split, numSamples, FFTSizeLog2);
+        }
+    };
+    
+    parallelFor(pool, numPairs, transformImpulse);
+    
+    // Forward transform a hop of an input (silent frames are marked rather than transformed)
+    
+    uintptr_t firstHop = 0;
+    
+    auto transformInput = [&](uint32_t task)
+    {
+        uintptr_t inChan = task / numHops;
+        uintptr_t hop = task % numHops;
+        uintptr_t slot = (firstHop + hop) % numSlots;
+        
+        const T *frame = inputs + inChan * (chunkSize + blockSize) + hop * blockSize;
+        uint8_t silent = isSilent(frame, FFTSize) ? 1 : 0;
+        
+        silentSlots[inChan * numSlots + slot] = silent;
+        
+        if (!silent)
+        {
+            Split split = getSplit(delayLines + (inChan * numSlots + slot) * FFTSize);
+            hisstools_rfft(setup->get(), frame, &split, FFTSize, FFTSizeLog2);
+        }
+    };
+    
+    // Accumulate and inverse transform a hop of an output (the valid output of overlap-save is the second half of the ifft)
+    
+    auto processOutput = [&](uint32_t task)
+    {
+        uintptr_t outChan = task / numHops;
+        uintptr_t hop = task % numHops;
+        uintptr_t absoluteHop = firstHop + hop;
+        
+        T *accum = accums + task * FFTSize * 2;
+        T *out = outputs + outChan * chunkSize + hop * blockSize;
+        Split accumSplit = getSplit(accum);
+        bool signal = false;
+        
+        std::fill_n(accum, FFTSize, T(0));
+        
+        for (uint32_t i = 0; i < mNumIns; i++)
+        {
+            uint32_t pair = static_cast<uint32_t>(getPairIndex(i, static_cast<uint32_t>(outChan)));
+            
+            for (uintptr_t j = 0; j < pairPartitions[pair] && j <= absoluteHop; j++)
+            {
+                uintptr_t slot = (absoluteHop - j) % numSlots;
+                
+                if (silentSlots[i * numSlots + slot])
+                    continue;
+                
+                Split inSplit = getSplit(delayLines + (i * numSlots + slot) * FFTSize);
+                Split impulseSplit = getSplit(impulses + pairOffsets[pair] + j * FFTSize);
+                
+                processPartition<WideVector<T>>(inSplit, impulseSplit, accumSplit, blockSize);
+                signal = true;
+            }
+        }
+        
+        if (!signal)
+        {
+            std::fill_n(out, blockSize, T(0));
+            return;
+        }
+        
+        T *temp = accum + FFTSize;
+        T scale = T(1) / static_cast<T>(FFTSize << 2);
+        
+        hisstools_rifft(setup->get(), &accumSplit, temp, FFTSizeLog2);
+        
+        for (uintptr_t i = 0; i < blockSize; i++)
+            out[i] = temp[blockSize + i] * scale;
+    };
+    
+    // Process the file in chunks (the hop before each chunk is kept as the first half of the first frame)
+    
+    std::fill_n(inputs, inputSize, T(0));
+    input.seek(0);
+    
+    for (uintptr_t done = 0; done < outputLength; done += chunkSize, firstHop += numHops)
+    {
+        uintptr_t numFrames = std::min(chunkSize, outputLength - done);
+        uintptr_t numRead = done < inputLength ? std::min(chunkSize, inputLength - done) : 0;
+        
+        // Read and deinterleave (with silence beyond the end of the file or the channels in it)
+        
+        if (numRead)
+            input.readInterleaved(interleaved.data(), static_cast<IAudioFile::FrameCount>(numRead));
+        
+        for (uint32_t i = 0; i < mNumIns; i++)
+        {
+            T *audio = inputs + i * (chunkSize + blockSize) + blockSize;
+            uintptr_t numSamples = i < numInChans ? numRead : 0;
+            
+            for (uintptr_t j = 0; j < numSamples; j++)
+                audio[j] = interleaved[j * numInChans + i];
+            
+            std::fill_n(audio + numSamples, chunkSize - numSamples, T(0));
+        }
+        
+        // Process
+        
+        parallelFor(pool, static_cast<uint32_t>(mNumIns * numHops), transformInput);
+        parallelFor(pool, static_cast<uint32_t>(mNumOuts * numHops), processOutput);
+        
+        // Interleave and write
+        
+        for (uintptr_t j = 0; j < numFrames; j++)
+            for (uint16_t i = 0; i < numOutChans; i++)
+                interleaved[j * numOutChans + i] = i < mNumOuts ? outputs[i * chunkSize + j] : T(0);
+        
+        output.writeInterleaved(interleaved.data(), static_cast<OAudioFile::FrameCount>(numFrames));
+        
+        // Keep the last hop of input
+        
+        for (uint32_t i = 0; i < mNumIns; i++)
+        {
+            T *audio = inputs + i * (chunkSize + blockSize);
+            std::copy_n(audio + chunkSize, blockSize, audio);
+        }
+    }
+    
+    ALIGNED_FREE(memory);
+    
+    return (input.getIsError() || output.getIsError()) ? CONVOLVE_ERR_FILE_ERROR : CONVOLVE_ERR_NONE;
+}
+
+// Explicit instantiations
+
+template class HISSTools::ConvolveRenderer<float>;
+template class HISSTools::ConvolveRenderer<double>;
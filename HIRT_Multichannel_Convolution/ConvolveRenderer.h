@@ -0,0 +1,78 @@
+
+#pragma once
+
+#include "ConvolveErrors.h"
+#include "ConvolveFFTTypes.h"
+#include "ConvolveThreadPool.h"
+
+#include "../AudioFile/IAudioFile.h"
+#include "../AudioFile/OAudioFile.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace HISSTools
+{
+    // ConvolveRenderer convolves whole files offline (N inputs to M outputs) using uniform partitions of one size
+    // The partition size is chosen from the impulse and file lengths (a single partition when that is cheapest)
+    // Files are streamed in chunks so memory use depends on the impulses and not on the length of the file
+    
+    template <class T>
+    class ConvolveRenderer
+    {
+        typedef typename FFTTypes<T>::Split Split;
+        
+        static constexpr uintptr_t MIN_BLOCK_SIZE_LOG2 = 8;
+        static constexpr uintptr_t MAX_BLOCK_SIZE_LOG2 = 19;
+        static constexpr uintptr_t CHUNK_SIZE_LOG2 = 16;
+    
+    public:
+        
+        // Work is spread over blocks and channels using the calling thread and (numThreads - 1) additional threads
+        
+        ConvolveRenderer(uint32_t numIns, uint32_t numOuts, uint32_t numThreads = 1);
+        
+        // Non-moveable and copyable
+        
+        ConvolveRenderer(ConvolveRenderer& obj) = delete;
+        ConvolveRenderer& operator = (ConvolveRenderer& obj) = delete;
+        ConvolveRenderer(ConvolveRenderer&& obj) = delete;
+        ConvolveRenderer& operator = (ConvolveRenderer&& obj) = delete;
+        
+        ConvolveError set(uint32_t inChan, uint32_t outChan, const float *input, uintptr_t length);
+        ConvolveError set(uint32_t inChan, uint32_t outChan, const double *input, uintptr_t length);
+        void clear();
+        
+        // Render the whole of the input file (and the tail of the impulses if requested) to the output file
+        // Input channels beyond those in the file are silent and output channels beyond the number of outputs are written silent
+        
+        ConvolveError render(IAudioFile& input, OAudioFile& output, bool includeTail = true);
+        
+        // The block size used by the last render
+        
+        uintptr_t getBlockSize() const { return uintptr_t(1) << mBlockSizeLog2; }
+    
+    private:
+        
+        template <class U>
+        ConvolveError setImpulse(uint32_t inChan, uint32_t outChan, const U *input, uintptr_t length);
+        
+        ConvolveError checkChannels(uint32_t inChan, uint32_t outChan);
+        uintptr_t getPairIndex(uint32_t inChan, uint32_t outChan) { return outChan * mNumIns + inChan; }
+        
+        uintptr_t getMaxImpulseLength();
+        uintptr_t chooseBlockSizeLog2(uintptr_t outputLength);
+        
+        // Data
+        
+        uint32_t mNumIns;
+        uint32_t mNumOuts;
+        
+        uintptr_t mBlockSizeLog2;
+        
+        std::vector<std::vector<T>> mImpulses;
+        
+        std::unique_ptr<ConvolveThreadPool> mThreadPool;
+    };
+}
@@ -1,6 +1,9 @@
 
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+
 template <class T, class U, int vec_size>
 struct SIMDVector
 {
@@ -27,6 +30,11 @@ struct ARMFloat : public SIMDVector<float, float32x4_t, 4>
     friend ARMFloat operator - (const ARMFloat& a, const ARMFloat& b) { return vsubq_f32(a.mVal, b.mVal); }
     friend ARMFloat operator * (const ARMFloat& a, const ARMFloat& b) { return vmulq_f32(a.mVal, b.mVal); }
     
+    // Multiply-add operations (a * b + c and c - a * b - fused where available)
+    
+    friend ARMFloat fmadd(const ARMFloat& a, const ARMFloat& b, const ARMFloat& c) { return vmlaq_f32(c.mVal, a.mVal, b.mVal); }
+    friend ARMFloat fnmadd(const ARMFloat& a, const ARMFloat& b, const ARMFloat& c) { return vmlsq_f32(c.mVal, a.mVal, b.mVal); }
+    
     ARMFloat operator += (const ARMFloat& a)
     {
         *this = *this + a;
@@ -35,6 +43,10 @@ struct ARMFloat : public SIMDVector<float, float32x4_t, 4>
     
     static ARMFloat unaligned_load(const float* ptr) { return vld1q_f32(ptr); }
     
+    // Load bfloat16 values and widen them (the values become the upper halves of floats)
+    
+    static ARMFloat bfloat16_load(const uint16_t* ptr) { return vreinterpretq_f32_u32(vshll_n_u16(vld1_u16(ptr), 16)); }
+    
     void unaligned_store(float* ptr)
     {
         vst1q_f32(ptr, mVal);
@@ -48,7 +60,46 @@ struct ARMFloat : public SIMDVector<float, float32x4_t, 4>
     }
 };
 
+// N.B. double vectors require AArch64
+
+struct ARMDouble : public SIMDVector<double, float64x2_t, 2>
+{
+    ARMDouble() {}
+    ARMDouble(float64x2_t a) : SIMDVector(a) {}
+    ARMDouble(double a) : SIMDVector(vdupq_n_f64(a)) {}
+    
+    friend ARMDouble operator + (const ARMDouble& a, const ARMDouble& b) { return vaddq_f64(a.mVal, b.mVal); }
+    friend ARMDouble operator - (const ARMDouble& a, const ARMDouble& b) { return vsubq_f64(a.mVal, b.mVal); }
+    friend ARMDouble operator * (const ARMDouble& a, const ARMDouble& b) { return vmulq_f64(a.mVal, b.mVal); }
+    
+    // Multiply-add operations (a * b + c and c - a * b - fused where available)
+    
+    friend ARMDouble fmadd(const ARMDouble& a, const ARMDouble& b, const ARMDouble& c) { return vfmaq_f64(c.mVal, a.mVal, b.mVal); }
+    friend ARMDouble fnmadd(const ARMDouble& a, const ARMDouble& b, const ARMDouble& c) { return vfmsq_f64(c.mVal, a.mVal, b.mVal); }
+    
+    ARMDouble operator += (const ARMDouble& a)
+    {
+        *this = *this + a;
+        return *this;
+    }
+    
+    static ARMDouble unaligned_load(const double* ptr) { return vld1q_f64(ptr); }
+    
+    static ARMDouble bfloat16_load(const uint16_t* ptr)
+    {
+        uint16_t values[4] = { ptr[0], ptr[1], 0, 0 };
+        return vcvt_f64_f32(vget_low_f32(vreinterpretq_f32_u32(vshll_n_u16(vld1_u16(values), 16))));
+    }
+    
+    void unaligned_store(double* ptr)
+    {
+        vst1q_f64(ptr, mVal);
+    }
+};
+
 typedef ARMFloat FloatVector;
+typedef ARMFloat WideFloatVector;
+typedef ARMDouble WideDoubleVector;
 
 #else
 
@@ -69,6 +120,16 @@ struct SSEFloat : public SIMDVector<float, __m128, 4>
     friend SSEFloat operator - (const SSEFloat& a, const SSEFloat& b) { return _mm_sub_ps(a.mVal, b.mVal); }
     friend SSEFloat operator * (const SSEFloat& a, const SSEFloat& b) { return _mm_mul_ps(a.mVal, b.mVal); }
     
+    // Multiply-add operations (a * b + c and c - a * b - fused where available)
+    
+#ifdef __FMA__
+    friend SSEFloat fmadd(const SSEFloat& a, const SSEFloat& b, const SSEFloat& c) { return _mm_fmadd_ps(a.mVal, b.mVal, c.mVal); }
+    friend SSEFloat fnmadd(const SSEFloat& a, const SSEFloat& b, const SSEFloat& c) { return _mm_fnmadd_ps(a.mVal, b.mVal, c.mVal); }
+#else
+    friend SSEFloat fmadd(const SSEFloat& a, const SSEFloat& b, const SSEFloat& c) { return (a * b) + c; }
+    friend SSEFloat fnmadd(const SSEFloat& a, const SSEFloat& b, const SSEFloat& c) { return c - (a * b); }
+#endif
+    
     SSEFloat operator += (const SSEFloat& a)
     {
         *this = *this + a;
@@ -77,6 +138,13 @@ struct SSEFloat : public SIMDVector<float, __m128, 4>
     
     static SSEFloat unaligned_load(const float* ptr) { return _mm_loadu_ps(ptr); }
     
+    // Load bfloat16 values and widen them (the values become the upper halves of floats)
+    
+    static SSEFloat bfloat16_load(const uint16_t* ptr)
+    {
+        return _mm_castsi128_ps(_mm_unpacklo_epi16(_mm_setzero_si128(), _mm_loadl_epi64(reinterpret_cast<const __m128i *>(ptr))));
+    }
+    
     void unaligned_store(float* ptr)
     {
         _mm_storeu_ps(ptr, mVal);
@@ -90,18 +158,258 @@ struct SSEFloat : public SIMDVector<float, __m128, 4>
     }
 };
 
+struct SSEDouble : public SIMDVector<double, __m128d, 2>
+{
+    SSEDouble() {}
+    SSEDouble(__m128d a) : SIMDVector(a) {}
+    SSEDouble(double a) : SIMDVector(_mm_set1_pd(a)) {}
+    
+    friend SSEDouble operator + (const SSEDouble& a, const SSEDouble& b) { return _mm_add_pd(a.mVal, b.mVal); }
+    friend SSEDouble operator - (const SSEDouble& a, const SSEDouble& b) { return _mm_sub_pd(a.mVal, b.mVal); }
+    friend SSEDouble operator * (const SSEDouble& a, const SSEDouble& b) { return _mm_mul_pd(a.mVal, b.mVal); }
+    
+    // Multiply-add operations (a * b + c and c - a * b - fused where available)
+
+#ifdef __FMA__
+    friend SSEDouble fmadd(const SSEDouble& a, const SSEDouble& b, const SSEDouble& c) { return _mm_fmadd_pd(a.mVal, b.mVal, c.mVal); }
+    friend SSEDouble fnmadd(const SSEDouble& a, const SSEDouble& b, const SSEDouble& c) { return _mm_fnmadd_pd(a.mVal, b.mVal, c.mVal); }
+#else
+    friend SSEDouble fmadd(const SSEDouble& a, const SSEDouble& b, const SSEDouble& c) { return (a * b) + c; }
+    friend SSEDouble fnmadd(const SSEDouble& a, const SSEDouble& b, const SSEDouble& c) { return c - (a * b); }
+#endif
+    
+    SSEDouble operator += (const SSEDouble& a)
+    {
+        *this = *this + a;
+        return *this;
+    }
+    
+    static SSEDouble unaligned_load(const double* ptr) { return _mm_loadu_pd(ptr); }
+    
+    static SSEDouble bfloat16_load(const uint16_t* ptr)
+    {
+        uint32_t values = ptr[0] | (static_cast<uint32_t>(ptr[1]) << 16);
+        return _mm_cvtps_pd(_mm_castsi128_ps(_mm_unpacklo_epi16(_mm_setzero_si128(), _mm_cvtsi32_si128(static_cast<int>(values)))));
+    }
+    
+    void unaligned_store(double* ptr)
+    {
+        _mm_storeu_pd(ptr, mVal);
+    }
+};
+
 typedef SSEFloat FloatVector;
 
+#if defined __AVX__
+
+#include <immintrin.h>
+
+struct AVXFloat : public SIMDVector<float, __m256, 8>
+{
+    AVXFloat() {}
+    AVXFloat(__m256 a) : SIMDVector(a) {}
+    AVXFloat(float a) : SIMDVector(_mm256_set1_ps(a)) {}
+    
+    friend AVXFloat operator + (const AVXFloat& a, const AVXFloat& b) { return _mm256_add_ps(a.mVal, b.mVal); }
+    friend AVXFloat operator - (const AVXFloat& a, const AVXFloat& b) { return _mm256_sub_ps(a.mVal, b.mVal); }
+    friend AVXFloat operator * (const AVXFloat& a, const AVXFloat& b) { return _mm256_mul_ps(a.mVal, b.mVal); }
+    
+    // Multiply-add operations (a * b + c and c - a * b - fused where available)
+    
+#ifdef __FMA__
+    friend AVXFloat fmadd(const AVXFloat& a, const AVXFloat& b, const AVXFloat& c) { return _mm256_fmadd_ps(a.mVal, b.mVal, c.mVal); }
+    friend AVXFloat fnmadd(const AVXFloat& a, const AVXFloat& b, const AVXFloat& c) { return _mm256_fnmadd_ps(a.mVal, b.mVal, c.mVal); }
+#else
+    friend AVXFloat fmadd(const AVXFloat& a, const AVXFloat& b, const AVXFloat& c) { return (a * b) + c; }
+    friend AVXFloat fnmadd(const AVXFloat& a, const AVXFloat& b, const AVXFloat& c) { return c - (a * b); }
+#endif
+    
+    AVXFloat operator += (const AVXFloat& a)
+    {
+        *this = *this + a;
+        return *this;
+    }
+    
+    static AVXFloat unaligned_load(const float* ptr) { return _mm256_loadu_ps(ptr); }
+    
+    // Load bfloat16 values and widen them (in two halves as 256 bit integer operations require AVX2)
+    
+    static AVXFloat bfloat16_load(const uint16_t* ptr)
+    {
+        __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr));
+        __m128 lo = _mm_castsi128_ps(_mm_unpacklo_epi16(_mm_setzero_si128(), values));
+        __m128 hi = _mm_castsi128_ps(_mm_unpackhi_epi16(_mm_setzero_si128(), values));
+        return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+    }
+    
+    void unaligned_store(float* ptr)
+    {
+        _mm256_storeu_ps(ptr, mVal);
+    }
+};
+
+struct AVXDouble : public SIMDVector<double, __m256d, 4>
+{
+    AVXDouble() {}
+    AVXDouble(__m256d a) : SIMDVector(a) {}
+    AVXDouble(double a) : SIMDVector(_mm256_set1_pd(a)) {}
+    
+    friend AVXDouble operator + (const AVXDouble& a, const AVXDouble& b) { return _mm256_add_pd(a.mVal, b.mVal); }
+    friend AVXDouble operator - (const AVXDouble& a, const AVXDouble& b) { return _mm256_sub_pd(a.mVal, b.mVal); }
+    friend AVXDouble operator * (const AVXDouble& a, const AVXDouble& b) { return _mm256_mul_pd(a.mVal, b.mVal); }
+    
+    // Multiply-add operations (a * b + c and c - a * b - fused where available)
+
+#ifdef __FMA__
+    friend AVXDouble fmadd(const AVXDouble& a, const AVXDouble& b, const AVXDouble& c) { return _mm256_fmadd_pd(a.mVal, b.mVal, c.mVal); }
+    friend AVXDouble fnmadd(const AVXDouble& a, const AVXDouble& b, const AVXDouble& c) { return _mm256_fnmadd_pd(a.mVal, b.mVal, c.mVal); }
+#else
+    friend AVXDouble fmadd(const AVXDouble& a, const AVXDouble& b, const AVXDouble& c) { return (a * b) + c; }
+    friend AVXDouble fnmadd(const AVXDouble& a, const AVXDouble& b, const AVXDouble& c) { return c - (a * b); }
 #endif
+    
+    AVXDouble operator += (const AVXDouble& a)
+    {
+        *this = *this + a;
+        return *this;
+    }
+    
+    static AVXDouble unaligned_load(const double* ptr) { return _mm256_loadu_pd(ptr); }
+    
+    static AVXDouble bfloat16_load(const uint16_t* ptr) { return _mm256_cvtps_pd(SSEFloat::bfloat16_load(ptr).mVal); }
+    
+    void unaligned_store(double* ptr)
+    {
+        _mm256_storeu_pd(ptr, mVal);
+    }
+};
 
-#ifdef __APPLE__
+#endif
+
+#if defined __AVX512F__
+
+struct AVX512Float : public SIMDVector<float, __m512, 16>
+{
+    AVX512Float() {}
+    AVX512Float(__m512 a) : SIMDVector(a) {}
+    AVX512Float(float a) : SIMDVector(_mm512_set1_ps(a)) {}
+    
+    friend AVX512Float operator + (const AVX512Float& a, const AVX512Float& b) { return _mm512_add_ps(a.mVal, b.mVal); }
+    friend AVX512Float operator - (const AVX512Float& a, const AVX512Float& b) { return _mm512_sub_ps(a.mVal, b.mVal); }
+    friend AVX512Float operator * (const AVX512Float& a, const AVX512Float& b) { return _mm512_mul_ps(a.mVal, b.mVal); }
+    
+    // Multiply-add operations (a * b + c and c - a * b - always fused with AVX-512)
+    
+    friend AVX512Float fmadd(const AVX512Float& a, const AVX512Float& b, const AVX512Float& c) { return _mm512_fmadd_ps(a.mVal, b.mVal, c.mVal); }
+    friend AVX512Float fnmadd(const AVX512Float& a, const AVX512Float& b, const AVX512Float& c) { return _mm512_fnmadd_ps(a.mVal, b.mVal, c.mVal); }
+    
+    AVX512Float operator += (const AVX512Float& a)
+    {
+        *this = *this + a;
+        return *this;
+    }
+    
+    static AVX512Float unaligned_load(const float* ptr) { return _mm512_loadu_ps(ptr); }
+    
+    // Load bfloat16 values and widen them (the values become the upper halves of floats)
+    
+    static AVX512Float bfloat16_load(const uint16_t* ptr)
+    {
+        return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(ptr))), 16));
+    }
+    
+    void unaligned_store(float* ptr)
+    {
+        _mm512_storeu_ps(ptr, mVal);
+    }
+};
+
+struct AVX512Double : public SIMDVector<double, __m512d, 8>
+{
+    AVX512Double() {}
+    AVX512Double(__m512d a) : SIMDVector(a) {}
+    AVX512Double(double a) : SIMDVector(_mm512_set1_pd(a)) {}
+    
+    friend AVX512Double operator + (const AVX512Double& a, const AVX512Double& b) { return _mm512_add_pd(a.mVal, b.mVal); }
+    friend AVX512Double operator - (const AVX512Double& a, const AVX512Double& b) { return _mm512_sub_pd(a.mVal, b.mVal); }
+    friend AVX512Double operator * (const AVX512Double& a, const AVX512Double& b) { return _mm512_mul_pd(a.mVal, b.mVal); }
+    
+    // Multiply-add operations (a * b + c and c - a * b - always fused with AVX-512)
+    
+    friend AVX512Double fmadd(const AVX512Double& a, const AVX512Double& b, const AVX512Double& c) { return _mm512_fmadd_pd(a.mVal, b.mVal, c.mVal); }
+    friend AVX512Double fnmadd(const AVX512Double& a, const AVX512Double& b, const AVX512Double& c) { return _mm512_fnmadd_pd(a.mVal, b.mVal, c.mVal); }
+    
+    AVX512Double operator += (const AVX512Double& a)
+    {
+        *this = *this + a;
+        return *this;
+    }
+    
+    static AVX512Double unaligned_load(const double* ptr) { return _mm512_loadu_pd(ptr); }
+    
+    static AVX512Double bfloat16_load(const uint16_t* ptr) { return _mm512_cvtps_pd(AVXFloat::bfloat16_load(ptr).mVal); }
+    
+    void unaligned_store(double* ptr)
+    {
+        _mm512_storeu_pd(ptr, mVal);
+    }
+};
+
+#endif
+
+// The widest vectors available are used for the spectral kernels (selected by build flags)
+// N.B. FloatVector remains four wide for code that assumes this (such as the time domain convolution)
+
+#if defined __AVX512F__
+typedef AVX512Float WideFloatVector;
+typedef AVX512Double WideDoubleVector;
+#elif defined __AVX__
+typedef AVXFloat WideFloatVector;
+typedef AVXDouble WideDoubleVector;
+#else
+typedef SSEFloat WideFloatVector;
+typedef SSEDouble WideDoubleVector;
+#endif
+
+#endif
+
+// The widest vector for each sample type
+
+template <class T> struct WideVectorType {};
+template <> struct WideVectorType<float> { typedef WideFloatVector type; };
+template <> struct WideVectorType<double> { typedef WideDoubleVector type; };
+
+template <class T>
+using WideVector = typename WideVectorType<T>::type;
+
+// Memory must be aligned for the widest vector
+
+static constexpr size_t SIMD_ALIGNMENT = sizeof(WideFloatVector);
+
+#if defined __APPLE__ && !defined __AVX__
 #define ALIGNED_MALLOC malloc
 #define ALIGNED_FREE free
 #elif defined _WIN32
 #include <malloc.h>
-#define ALIGNED_MALLOC(x)  _aligned_malloc(x, 16)
+#define ALIGNED_MALLOC(x)  _aligned_malloc(x, SIMD_ALIGNMENT)
 #define ALIGNED_FREE(x)  _aligned_free(x)
+#elif defined __APPLE__
+#include <cstdlib>
+inline void *alignedMalloc(size_t size)
+{
+    void *ptr = nullptr;
+    return posix_memalign(&ptr, SIMD_ALIGNMENT, size) ? nullptr : ptr;
+}
+#define ALIGNED_MALLOC(x) alignedMalloc(x)
+#define ALIGNED_FREE free
 #else
-#define ALIGNED_MALLOC(x) aligned_alloc(16, x);
+#include <cstdlib>
+inline void *alignedMalloc(size_t size)
+{
+    // N.B. aligned_alloc requires the size to be a multiple of the alignment
+    
+    return aligned_alloc(SIMD_ALIGNMENT, ((size + SIMD_ALIGNMENT - 1) / SIMD_ALIGNMENT) * SIMD_ALIGNMENT);
+}
+#define ALIGNED_MALLOC(x) alignedMalloc(x)
 #define ALIGNED_FREE free
 #endif
@@ -0,0 +1,194 @@
+
+/*
+ *  ConvolveStats
+ *
+ *    Lock-free counters for the costs of realtime convolution.
+ *
+ *    Block times are accumulated in a histogram with four logarithmically spaced buckets per octave of ticks.
+ *    Percentiles are estimated from the histogram (as the upper edge of a bucket) so they are conservative by up to a quarter octave.
+ *
+ */
+
+#include "ConvolveStats.h"
+
+#include <algorithm>
+#include <cmath>
+
+HISSTools::ConvolveStats::ConvolveStats()
+: mDeadlinePerSample(0.0)
+{
+    getTicksPerSecond();
+    reset();
+}
+
+void HISSTools::ConvolveStats::setSampleRate(double sampleRate)
+{
+    mDeadlinePerSample.store(sampleRate > 0.0 ? getTicksPerSecond() / sampleRate : 0.0, std::memory_order_relaxed);
+}
+
+HISSTools::ConvolveStats::Snapshot HISSTools::ConvolveStats::getSnapshot() const
+{
+    Snapshot snapshot;
+    
+    auto load = [](const std::atomic<uint64_t>& counter) { return counter.load(std::memory_order_relaxed); };
+    
+    snapshot.mTicksPerSecond = getTicksPerSecond();
+    
+    snapshot.mBlocks = load(mBlocks);
+    snapshot.mSamples = load(mSamples);
+    snapshot.mTicks = load(mTicks);
+    snapshot.mMaxTicks = load(mMaxTicks);
+    snapshot.mSkippedBlocks = load(mSkippedBlocks);
+    snapshot.mDeadlineMisses = load(mDeadlineMisses);
+    snapshot.mBackgroundMisses = load(mBackgroundMisses);
+    
+    for (uint32_t i = 0; i < NUM_BUCKETS; i++)
+        snapshot.mHistogram[i] = load(mHistogram[i]);
+    
+    for (uint32_t i = 0; i < NUM_LEVELS; i++)
+    {
+        snapshot.mLevels[i].mBlocks = load(mLevels[i].mBlocks);
+        snapshot.mLevels[i].mTicks = load(mLevels[i].mTicks);
+        snapshot.mLevels[i].mMaxTicks = load(mLevels[i].mMaxTicks);
+        snapshot.mLevels[i].mFFTs = load(mLevels[i].mFFTs);
+        snapshot.mLevels[i].mMACs = load(mLevels[i].mMACs);
+        snapshot.mLevels[i].mMaxFFTs = load(mLevels[i].mMaxFFTs);
+        snapshot.mLevels[i].mMaxMACs = load(mLevels[i].mMaxMACs);
+    }
+    
+    return snapshot;
+}
+
+void HISSTools::ConvolveStats::reset()
+{
+    auto clear = [](std::atomic<uint64_t>& counter) { counter.store(0, std::memory_order_relaxed); };
+    
+    clear(mBlocks);
+    clear(mSamples);
+    clear(mTicks);
+    clear(mMaxTicks);
+    clear(mSkippedBlocks);
+    clear(mDeadlineMisses);
+    clear(mBackgroundMisses);
+    
+    for (uint32_t i = 0; i < NUM_BUCKETS; i++)
+        clear(mHistogram[i]);
+    
+    for (uint32_t i = 0; i < NUM_LEVELS; i++)
+    {
+        clear(mLevels[i].mBlocks);
+        clear(mLevels[i].mTicks);
+        clear(mLevels[i].mMaxTicks);
+        clear(mLevels[i].mFFTs);
+        clear(mLevels[i].mMACs);
+        clear(mLevels[i].mMaxFFTs);
+        clear(mLevels[i].mMaxMACs);
+    }
+}
+
+// Recording
+
+void HISSTools::ConvolveStats::recordBlock(uint64_t ticks, uintptr_t numSamples)
+{
+    double deadlinePerSample = mDeadlinePerSample.load(std::memory_order_relaxed);
+    
+    add(mBlocks, 1);
+    add(mSamples, numSamples);
+    add(mTicks, ticks);
+    max(mMaxTicks, ticks);
+    add(mHistogram[getBucket(ticks)], 1);
+    
+    if (deadlinePerSample && ticks > deadlinePerSample * numSamples)
+        add(mDeadlineMisses, 1);
+}
+
+void HISSTools::ConvolveStats::recordLevel(uint32_t level, uint64_t ticks, uint64_t FFTs, uint64_t MACs)
+{
+    Level& stats = mLevels[std::min(level, NUM_LEVELS - 1)];
+    
+    add(stats.mBlocks, 1);
+    add(stats.mTicks, ticks);
+    max(stats.mMaxTicks, ticks);
+    add(stats.mFFTs, FFTs);
+    add(stats.mMACs, MACs);
+    max(stats.mMaxFFTs, FFTs);
+    max(stats.mMaxMACs, MACs);
+}
+
+// Ticks
+
+double HISSTools::ConvolveStats::getTicksPerSecond()
+{
+    // The rate of a cycle counter is measured once against the monotonic clock (over roughly 10ms)
+    
+    auto calibrate = []()
+    {
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+        auto start = std::chrono::steady_clock::now();
+        uint64_t startTicks = getTicks();
+        std::chrono::duration<double> elapsed;
+        
+        do
+            elapsed = std::chrono::steady_clock::now() - start;
+        while (elapsed.count() < 0.01);
+        
+        return (getTicks() - startTicks) / elapsed.count();
+#else
+        return static_cast<double>(std::chrono::steady_clock::period::den) / std::chrono::steady_clock::period::num;
+#endif
+    };
+    
+    static const double ticksPerSecond = calibrate();
+    
+    return ticksPerSecond;
+}
+
+// Histogram
+
+uint32_t HISSTools::ConvolveStats::getBucket(uint64_t ticks)
+{
+    // Values below four have their own buckets and then each octave is split into quarters
+    
+    if (ticks < 4)
+        return static_cast<uint32_t>(ticks);
+    
+    uint32_t octave = 0;
+    
+    for (uint64_t value = ticks; value >>= 1; octave++);
+    
+    return ((octave - 1) << 2) + static_cast<uint32_t>((ticks >> (octave - 2)) & 3);
+}
+
+uint64_t HISSTools::ConvolveStats::Snapshot::getPercentile(double proportion) const
+{
+    uint64_t total = 0;
+    
+    for (uint32_t i = 0; i < NUM_BUCKETS; i++)
+        total += mHistogram[i];
+    
+    if (!total)
+        return 0;
+    
+    uint64_t target = static_cast<uint64_t>(std::ceil(std::min(std::max(proportion, 0.0), 1.0) * total));
+    uint64_t count = 0;
+    
+    for (uint32_t i = 0; i < NUM_BUCKETS; i++)
+    {
+        count += mHistogram[i];
+        
+        if (count && count >= target)
+        {
+            // Return the upper edge of the bucket (but never more than the worst block)
+            
+            if (i < 4)
+                return std::min(uint64_t(i), mMaxTicks);
+            
+            uint32_t octave = (i >> 2) + 1;
+            double edge = std::ldexp(5.0 + (i & 3), octave - 2) - 1.0;
+            
+            return edge >= mMaxTicks ? mMaxTicks : static_cast<uint64_t>(edge);
+        }
+    }
+    
+    return mMaxTicks;
+}
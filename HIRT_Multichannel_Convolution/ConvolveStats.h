@@ -0,0 +1,155 @@
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace HISSTools
+{
+    // ConvolveStats collects the costs of realtime convolution for monitoring
+    // Convolution objects record into a stats object when one is attached (otherwise instrumentation costs a single test per block)
+    // All counters are relaxed atomics, so recording is lock-free and a snapshot may be taken from any thread at any time
+    // N.B. a snapshot is not a consistent cut across counters, but every counter is exact
+    
+    class ConvolveStats
+    {
+    public:
+        
+        // Level 0 is the time domain head and levels 1 to 4 are the partition sizes (the largest is always level 4)
+        
+        static constexpr uint32_t NUM_LEVELS = 5;
+        
+        // Block times are kept in a histogram with four buckets per octave
+        
+        static constexpr uint32_t NUM_BUCKETS = 256;
+        
+        struct LevelSnapshot
+        {
+            uint64_t mBlocks;
+            uint64_t mTicks;
+            uint64_t mMaxTicks;
+            
+            // Work counts (transforms and partition multiply-accumulates of PartitionedConvolve objects in the audio thread)
+            
+            uint64_t mFFTs;
+            uint64_t mMACs;
+            uint64_t mMaxFFTs;
+            uint64_t mMaxMACs;
+        };
+        
+        struct Snapshot
+        {
+            // The block time (in ticks) within which the given proportion of blocks completed (estimated from the histogram)
+            
+            uint64_t getPercentile(double proportion) const;
+            
+            double toSeconds(uint64_t ticks) const { return ticks / mTicksPerSecond; }
+            
+            double mTicksPerSecond;
+            
+            uint64_t mBlocks;
+            uint64_t mSamples;
+            uint64_t mTicks;
+            uint64_t mMaxTicks;
+            
+            // Blocks output as silence because a lock or memory could not be acquired
+            
+            uint64_t mSkippedBlocks;
+            
+            // Blocks slower than realtime (if a sample rate is set) and waits for a background final partition
+            
+            uint64_t mDeadlineMisses;
+            uint64_t mBackgroundMisses;
+            
+            uint64_t mHistogram[NUM_BUCKETS];
+            LevelSnapshot mLevels[NUM_LEVELS];
+        };
+        
+        ConvolveStats();
+        
+        // Non-moveable and copyable
+        
+        ConvolveStats(ConvolveStats& obj) = delete;
+        ConvolveStats& operator = (ConvolveStats& obj) = delete;
+        ConvolveStats(ConvolveStats&& obj) = delete;
+        ConvolveStats& operator = (ConvolveStats&& obj) = delete;
+        
+        // A block misses its deadline if it takes longer than its duration at the sample rate (zero disables deadline checks)
+        
+        void setSampleRate(double sampleRate);
+        
+        Snapshot getSnapshot() const;
+        void reset();
+        
+        // Recording (from the audio thread or the threads of a thread pool)
+        
+        void recordBlock(uint64_t ticks, uintptr_t numSamples);
+        void recordLevel(uint32_t level, uint64_t ticks, uint64_t FFTs, uint64_t MACs);
+        void recordSkipped()                        { add(mSkippedBlocks, 1); }
+        void recordBackgroundMisses(uint64_t count) { add(mBackgroundMisses, count); }
+        
+        // The cycle counter where available (otherwise a monotonic clock)
+        
+        static uint64_t getTicks()
+        {
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+            return __rdtsc();
+#elif defined(__aarch64__)
+            uint64_t ticks;
+            asm volatile("mrs %0, cntvct_el0" : "=r" (ticks));
+            return ticks;
+#else
+            return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+        }
+        
+        static double getTicksPerSecond();
+    
+    private:
+        
+        struct Level
+        {
+            std::atomic<uint64_t> mBlocks;
+            std::atomic<uint64_t> mTicks;
+            std::atomic<uint64_t> mMaxTicks;
+            std::atomic<uint64_t> mFFTs;
+            std::atomic<uint64_t> mMACs;
+            std::atomic<uint64_t> mMaxFFTs;
+            std::atomic<uint64_t> mMaxMACs;
+        };
+        
+        static void add(std::atomic<uint64_t>& counter, uint64_t value)
+        {
+            counter.fetch_add(value, std::memory_order_relaxed);
+        }
+        
+        static void max(std::atomic<uint64_t>& counter, uint64_t value)
+        {
+            uint64_t current = counter.load(std::memory_order_relaxed);
+            
+            while (value > current && !counter.compare_exchange_weak(current, value, std::memory_order_relaxed));
+        }
+        
+        static uint32_t getBucket(uint64_t ticks);
+        
+        std::atomic<uint64_t> mBlocks;
+        std::atomic<uint64_t> mSamples;
+        std::atomic<uint64_t> mTicks;
+        std::atomic<uint64_t> mMaxTicks;
+        std::atomic<uint64_t> mSkippedBlocks;
+        std::atomic<uint64_t> mDeadlineMisses;
+        std::atomic<uint64_t> mBackgroundMisses;
+        
+        std::atomic<uint64_t> mHistogram[NUM_BUCKETS];
+        Level mLevels[NUM_LEVELS];
+        
+        std::atomic<double> mDeadlinePerSample;
+    };
+}
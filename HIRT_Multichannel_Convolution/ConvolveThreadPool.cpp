@@ -0,0 +1,165 @@
+
+#include "ConvolveThreadPool.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#elif defined(__APPLE__)
+#include <pthread.h>
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/thread_policy.h>
+#else
+#include <windows.h>
+#endif
+
+HISSTools::ConvolveThreadPool::ConvolveThreadPool(uint32_t numThreads)
+: mState(0)
+, mNumTasks(0)
+, mTasksDone(0)
+, mExit(false)
+, mNumRealtime(0)
+, mNumParked(0)
+, mTask(nullptr)
+, mContext(nullptr)
+{
+    for (uint32_t i = 1; i < numThreads; i++)
+        mThreads.emplace_back(&ConvolveThreadPool::workerLoop, this);
+}
+
+HISSTools::ConvolveThreadPool::~ConvolveThreadPool()
+{
+    // Notify under the mutex so that no parked worker can miss the exit
+    
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mExit.store(true);
+    }
+    
+    mCondition.notify_all();
+    
+    for (auto it = mThreads.begin(); it != mThreads.end(); it++)
+        it->join();
+}
+
+void HISSTools::ConvolveThreadPool::runTasks(uint32_t numTasks, TaskFunc task, void *context)
+{
+    // Publish the tasks by moving to the next generation with the task index reset to zero
+    
+    uint64_t generation = (mState.load(std::memory_order_relaxed) >> 32) + 1;
+    
+    mTask = task;
+    mContext = context;
+    mNumTasks.store(numTasks, std::memory_order_relaxed);
+    mTasksDone.store(0, std::memory_order_relaxed);
+    
+    // N.B. the store and the parked count load are sequentially consistent so that they cannot be reordered
+    // (otherwise a worker could park on the old generation without being counted here and sleep through the run)
+    
+    mState.store(generation << 32, std::memory_order_seq_cst);
+    
+    if (mNumParked.load(std::memory_order_seq_cst))
+        mCondition.notify_all();
+    
+    // Work alongside the worker threads and then wait for any tasks still in progress (yielding if they take a while)
+    
+    while (doTask(generation));
+    
+    for (uint32_t i = 0; mTasksDone.load(std::memory_order_acquire) != numTasks; i++)
+    {
+        if (i > 4096)
+            std::this_thread::yield();
+    }
+}
+
+bool HISSTools::ConvolveThreadPool::doTask(uint64_t generation)
+{
+    uint64_t state = mState.load(std::memory_order_acquire);
+    
+    // Claim a task index (failing if the generation has moved on or there are no tasks remaining)
+    
+    do
+    {
+        if ((state >> 32) != generation || (state & 0xFFFFFFFF) >= mNumTasks.load(std::memory_order_relaxed))
+            return false;
+    }
+    while (!mState.compare_exchange_weak(state, state + 1, std::memory_order_acq_rel, std::memory_order_acquire));
+    
+    mTask(mContext, static_cast<uint32_t>(state & 0xFFFFFFFF));
+    mTasksDone.fetch_add(1, std::memory_order_release);
+    
+    return true;
+}
+
+bool HISSTools::ConvolveThreadPool::setRealtimePriority()
+{
+    // Request the priority given to audio threads (this is best effort and may fail without the relevant privileges)
+
+#if defined(__linux__)
+    sched_param param;
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+    
+    return !pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+#elif defined(__APPLE__)
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    
+    // Tasks are short bursts (so ask for up to half a millisecond of computation in each two milliseconds)
+    
+    double ticksPerMS = (1000000.0 * timebase.denom) / timebase.numer;
+    
+    thread_time_constraint_policy_data_t policy;
+    policy.period = static_cast<uint32_t>(2.0 * ticksPerMS);
+    policy.computation = static_cast<uint32_t>(0.5 * ticksPerMS);
+    policy.constraint = static_cast<uint32_t>(2.0 * ticksPerMS);
+    policy.preemptible = true;
+    
+    return thread_policy_set(pthread_mach_thread_np(pthread_self()), THREAD_TIME_CONSTRAINT_POLICY, (thread_policy_t) &policy, THREAD_TIME_CONSTRAINT_POLICY_COUNT) == KERN_SUCCESS;
+#else
+    return SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) != 0;
+#endif
+}
+
+void HISSTools::ConvolveThreadPool::workerLoop()
+{
+    // Match the denormal settings and the priority of the audio thread
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+    _mm_setcsr(_mm_getcsr() | 0x8040);
+#endif
+    
+    if (setRealtimePriority())
+        mNumRealtime++;
+    
+    uint64_t lastGeneration = 0;
+    uint32_t idleCount = 0;
+    
+    while (!mExit.load(std::memory_order_relaxed))
+    {
+        uint64_t generation = mState.load(std::memory_order_acquire) >> 32;
+        
+        if (generation != lastGeneration)
+        {
+            while (doTask(generation));
+            lastGeneration = generation;
+            idleCount = 0;
+        }
+        else if (++idleCount > 4096)
+        {
+            // Park until the generation moves on (a missed notification only means that the next run proceeds without this worker)
+            
+            std::unique_lock<std::mutex> lock(mMutex);
+            
+            mNumParked++;
+            mCondition.wait(lock, [&]() { return mExit.load() || (mState.load(std::memory_order_acquire) >> 32) != lastGeneration; });
+            mNumParked--;
+            idleCount = 0;
+        }
+        else if (idleCount > 1024)
+            std::this_thread::yield();
+    }
+}
@@ -0,0 +1,99 @@
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace HISSTools
+{
+    // A realtime-safe pool of worker threads for fanning out convolution tasks
+    // The calling thread participates in the work and run() returns only once all tasks are complete
+    // No allocation or locking happens on the calling thread (idle workers spin briefly and then park until there is work)
+    // N.B. the calling thread waits for any tasks in progress, so workers request realtime priority (which may need privileges)
+    
+    class ConvolveThreadPool
+    {
+        typedef void (*TaskFunc)(void *, uint32_t);
+    
+    public:
+        
+        // The number of threads includes the calling thread
+        
+        ConvolveThreadPool(uint32_t numThreads);
+        ~ConvolveThreadPool();
+        
+        // Non-moveable and copyable
+        
+        ConvolveThreadPool(ConvolveThreadPool& obj) = delete;
+        ConvolveThreadPool& operator = (ConvolveThreadPool& obj) = delete;
+        ConvolveThreadPool(ConvolveThreadPool&& obj) = delete;
+        ConvolveThreadPool& operator = (ConvolveThreadPool&& obj) = delete;
+        
+        uint32_t getNumThreads() const { return static_cast<uint32_t>(mThreads.size() + 1); }
+        
+        // Workers that did not gain realtime priority may be preempted whilst the calling thread waits for them
+        
+        uint32_t getNumRealtimeWorkers() const { return mNumRealtime.load(); }
+        
+        // Request the priority given to audio threads for the calling thread (returning whether this succeeded)
+        
+        static bool setRealtimePriority();
+        
+        // Run fn(taskIndex) for each task index (a task is always run entirely on one thread)
+        
+        template <typename Fn>
+        void run(uint32_t numTasks, Fn& fn)
+        {
+            runTasks(numTasks, &callTask<Fn>, &fn);
+        }
+    
+    private:
+        
+        template <typename Fn>
+        static void callTask(void *fn, uint32_t taskIndex)
+        {
+            (*reinterpret_cast<Fn *>(fn))(taskIndex);
+        }
+        
+        void runTasks(uint32_t numTasks, TaskFunc task, void *context);
+        bool doTask(uint64_t generation);
+        void workerLoop();
+        
+        // The state holds the generation in the upper 32 bits and the next task index in the lower 32 bits
+        
+        std::atomic<uint64_t> mState;
+        std::atomic<uint32_t> mNumTasks;
+        std::atomic<uint32_t> mTasksDone;
+        std::atomic<bool> mExit;
+        std::atomic<uint32_t> mNumRealtime;
+        
+        // Parked workers wait on the condition (which the calling thread notifies without locking the mutex)
+        
+        std::atomic<uint32_t> mNumParked;
+        std::mutex mMutex;
+        std::condition_variable mCondition;
+        
+        TaskFunc mTask;
+        void *mContext;
+        
+        std::vector<std::thread> mThreads;
+    };
+    
+    // Run tasks on a pool if one is present (or serially in index order otherwise)
+    
+    template <typename Fn>
+    void parallelFor(ConvolveThreadPool *pool, uint32_t numTasks, Fn fn)
+    {
+        if (pool && numTasks > 1)
+            pool->run(numTasks, fn);
+        else
+        {
+            for (uint32_t i = 0; i < numTasks; i++)
+                fn(i);
+        }
+    }
+}
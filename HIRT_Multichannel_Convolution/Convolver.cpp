@@ -2,8 +2,14 @@
 #include "Convolver.h"
 #include "ConvolveSIMD.h"
 
-HISSTools::Convolver::Convolver(uint32_t numIns, uint32_t numOuts, LatencyMode latency)
-: mTemporaryMemory(0)
+#include <algorithm>
+
+template <class T>
+HISSTools::ConvolverT<T>::ConvolverT(uint32_t numIns, uint32_t numOuts, LatencyMode latency, uint32_t numThreads, AllocatorPtr allocator)
+: mAllocator(ConvolveAllocator::select(allocator))
+, mTemporaryMemory(0)
+, mMaxBlockSize(0)
+, mStats(nullptr)
 {
     numIns = numIns < 1 ? 1 : numIns;
     
@@ -12,17 +18,30 @@ HISSTools::Convolver::Convolver(uint32_t numIns, uint32_t numOuts, LatencyMode l
     mNumOuts = numOuts;
     
     for (uint32_t i = 0; i < numIns; i++)
+    {
         mInTemps.push_back(nullptr);
+        mInPointers.push_back(nullptr);
+    }
     
     for (uint32_t i = 0; i < numOuts; i++)
-        mConvolvers.push_back(new NToMonoConvolve(numIns, 16384, latency));
+    {
+        mOutTemps.push_back(nullptr);
+        mTemps.push_back(nullptr);
+        mOutPointers.push_back(nullptr);
+    }
     
-    mTemp1 = nullptr;
-    mTemp2 = nullptr;
+    mMatrix.reset(new MatrixConvolve<T>(numIns, numOuts, 16384, latency, allocator));
+    
+    if (numThreads > 1)
+        mThreadPool.reset(new ConvolveThreadPool(numThreads));
 }
 
-HISSTools::Convolver::Convolver(uint32_t numIO, LatencyMode latency)
-: mTemporaryMemory(0)
+template <class T>
+HISSTools::ConvolverT<T>::ConvolverT(uint32_t numIO, LatencyMode latency, uint32_t numThreads, bool asyncTail, AllocatorPtr allocator)
+: mAllocator(ConvolveAllocator::select(allocator))
+, mTemporaryMemory(0)
+, mMaxBlockSize(0)
+, mStats(nullptr)
 {
     numIO = numIO < 1 ? 1 : numIO;
     
@@ -32,23 +51,58 @@ HISSTools::Convolver::Convolver(uint32_t numIO, LatencyMode latency)
     
     for (uint32_t i = 0; i < numIO; i++)
     {
-        mConvolvers.push_back(new NToMonoConvolve(1, 16384, latency));
+        mConvolvers.push_back(new NToMonoConvolveT<T>(1, 16384, latency, asyncTail, allocator));
         mInTemps.push_back(nullptr);
+        mOutTemps.push_back(nullptr);
+        mTemps.push_back(nullptr);
     }
     
-    mTemp1 = nullptr;
-    mTemp2 = nullptr;
+    if (numThreads > 1)
+        mThreadPool.reset(new ConvolveThreadPool(numThreads));
 }
 
-HISSTools::Convolver::~Convolver() throw()
+template <class T>
+HISSTools::ConvolverT<T>::~ConvolverT() throw()
 {
-    for (uint32_t i = 0; i < mNumOuts; i++)
+    for (uint32_t i = 0; i < mConvolvers.size(); i++)
         delete mConvolvers[i];
 }
 
+template <class T>
+size_t HISSTools::ConvolverT<T>::getArenaSize(uint32_t numIO, LatencyMode latency, uintptr_t maxLength, bool asyncTail, uint32_t numSets, uintptr_t maxBlockSize)
+{
+    // Prepare (but do not publish) an impulse of the maximum length for one channel and count the memory for each stage
+    // N.B. the impulse is unlikely to match a spectrum already in use, and as it is not published no spectrum file is written
+    
+    auto counter = std::make_shared<ConvolveCounter>();
+    std::vector<T> impulse(maxLength);
+    size_t initialSize = 0;
+    size_t setSize = 0;
+    
+    for (uintptr_t i = 0; i < maxLength; i++)
+        impulse[i] = T(1) / static_cast<T>(i + 1);
+    
+    {
+        MonoConvolveT<T> convolver(maxLength, latency, asyncTail, counter);
+        initialSize = counter->getUsed();
+        auto loader = convolver.prepare(impulse.data(), maxLength, true);
+        setSize = counter->getUsed() - initialSize;
+    }
+    
+    // The initial set is allocated for the maximum length and so is counted as the first set (the last set is for fragmentation)
+    
+    numIO = numIO < 1 ? 1 : numIO;
+    numSets = numSets < 1 ? 1 : numSets;
+    
+    size_t tempSize = maxBlockSize ? ConvolveArena::getBlockSize(getTempSize(numIO, numIO, maxBlockSize) * sizeof(T)) : 0;
+    
+    return numIO * (initialSize + numSets * setSize) + tempSize;
+}
+
 // Clear IRs
 
-void HISSTools::Convolver::clear(bool resize)
+template <class T>
+void HISSTools::ConvolverT<T>::clear(bool resize)
 {
     if (mN2M)
     {
@@ -63,21 +117,19 @@ void HISSTools::Convolver::clear(bool resize)
     }
 }
 
-void HISSTools::Convolver::clear(uint32_t inChan, uint32_t outChan, bool resize)
+template <class T>
+void HISSTools::ConvolverT<T>::clear(uint32_t inChan, uint32_t outChan, bool resize)
 {
     set(inChan, outChan, (float *)nullptr, 0, resize);
 }
 
 // DSP Engine Reset
 
-void HISSTools::Convolver::reset()
+template <class T>
+void HISSTools::ConvolverT<T>::reset()
 {
     if (mN2M)
-    {
-        for (uint32_t i = 0; i < mNumOuts; i++)
-            for (uint32_t j = 0; j < mNumIns; j++)
-                reset(j, i);
-    }
+        mMatrix->reset();
     else
     {
         for (uint32_t i = 0; i < mNumOuts; i++)
@@ -85,11 +137,15 @@ void HISSTools::Convolver::reset()
     }
 }
 
-ConvolveError HISSTools::Convolver::reset(uint32_t inChan, uint32_t outChan)
+template <class T>
+ConvolveError HISSTools::ConvolverT<T>::reset(uint32_t inChan, uint32_t outChan)
 {
+    if (mN2M)
+        return mMatrix->reset(inChan, outChan);
+    
     // For Parallel operation you must pass the same in/out channel
     
-    if (!mN2M) inChan -= outChan;
+    inChan -= outChan;
     
     if (outChan < mNumOuts)
         return mConvolvers[outChan]->reset(inChan);
@@ -97,13 +153,77 @@ ConvolveError HISSTools::Convolver::reset(uint32_t inChan, uint32_t outChan)
         return CONVOLVE_ERR_OUT_CHAN_OUT_OF_RANGE;
 }
 
+// Crossfading
+
+template <class T>
+void HISSTools::ConvolverT<T>::setCrossfade(uintptr_t fadeLength, uint32_t fadeLevels)
+{
+    for (uint32_t i = 0; i < mConvolvers.size(); i++)
+        mConvolvers[i]->setCrossfade(fadeLength, fadeLevels);
+}
+
+// Silence skipping
+
+template <class T>
+void HISSTools::ConvolverT<T>::setSilenceThreshold(double threshold, bool trimTail)
+{
+    for (uint32_t i = 0; i < mConvolvers.size(); i++)
+        mConvolvers[i]->setSilenceThreshold(threshold, trimTail);
+}
+
+template <class T>
+void HISSTools::ConvolverT<T>::setHalfPrecisionTail(bool halfPrecision)
+{
+    for (uint32_t i = 0; i < mConvolvers.size(); i++)
+        mConvolvers[i]->setHalfPrecisionTail(halfPrecision);
+}
+
+template <class T>
+void HISSTools::ConvolverT<T>::setDistributedTail(bool distributed)
+{
+    for (uint32_t i = 0; i < mConvolvers.size(); i++)
+        mConvolvers[i]->setDistributedTail(distributed);
+}
+
+template <class T>
+void HISSTools::ConvolverT<T>::setScheduled(bool scheduled)
+{
+    for (uint32_t i = 0; i < mConvolvers.size(); i++)
+        mConvolvers[i]->setScheduled(scheduled);
+}
+
+template <class T>
+void HISSTools::ConvolverT<T>::setMultirateTail(uintptr_t start, uint32_t factor)
+{
+    for (uint32_t i = 0; i < mConvolvers.size(); i++)
+        mConvolvers[i]->setMultirateTail(start, factor);
+}
+
+template <class T>
+void HISSTools::ConvolverT<T>::setStats(ConvolveStats *stats)
+{
+    // Blocks are recorded here for parallel operation (rather than for each channel) and by the matrix otherwise
+    
+    mStats.store(stats, std::memory_order_relaxed);
+    
+    if (mN2M)
+        mMatrix->setStats(stats);
+    
+    for (uint32_t i = 0; i < mConvolvers.size(); i++)
+        mConvolvers[i]->setStats(stats, false);
+}
+
 // Resize and set IR
 
-ConvolveError HISSTools::Convolver::resize(uint32_t inChan, uint32_t outChan, uintptr_t length)
+template <class T>
+ConvolveError HISSTools::ConvolverT<T>::resize(uint32_t inChan, uint32_t outChan, uintptr_t length)
 {
+    if (mN2M)
+        return mMatrix->resize(inChan, outChan, length);
+    
     // For Parallel operation you must pass the same in/out channel
     
-    if (!mN2M) inChan -= outChan;
+    inChan -= outChan;
     
     if (outChan < mNumOuts)
         return mConvolvers[outChan]->resize(inChan, length);
@@ -111,11 +231,15 @@ ConvolveError HISSTools::Convolver::resize(uint32_t inChan, uint32_t outChan, ui
         return CONVOLVE_ERR_IN_CHAN_OUT_OF_RANGE;
 }
 
-ConvolveError HISSTools::Convolver::set(uint32_t inChan, uint32_t outChan, const float* input, uintptr_t length, bool resize)
+template <class T>
+ConvolveError HISSTools::ConvolverT<T>::set(uint32_t inChan, uint32_t outChan, const float* input, uintptr_t length, bool resize)
 {
+    if (mN2M)
+        return mMatrix->set(inChan, outChan, input, length, resize);
+    
     // For Parallel operation you must pass the same in/out channel
     
-    if (!mN2M) inChan -= outChan;
+    inChan -= outChan;
     
     if (outChan < mNumOuts)
         return mConvolvers[outChan]->set(inChan, input, length, resize);
@@ -123,78 +247,240 @@ ConvolveError HISSTools::Convolver::set(uint32_t inChan, uint32_t outChan, const
         return CONVOLVE_ERR_OUT_CHAN_OUT_OF_RANGE;
 }
 
-ConvolveError HISSTools::Convolver::set(uint32_t inChan, uint32_t outChan, const double* input, uintptr_t impulseLength, bool resize)
+template <class T>
+ConvolveError HISSTools::ConvolverT<T>::set(uint32_t inChan, uint32_t outChan, const double* input, uintptr_t length, bool resize)
 {
-    std::vector<float> inputFloat(impulseLength);
+    // N.B. conversion happens as each partition is loaded
+    
+    if (mN2M)
+        return mMatrix->set(inChan, outChan, input, length, resize);
+    
+    // For Parallel operation you must pass the same in/out channel
     
-    for (unsigned long i = 0; i < impulseLength; i++)
-        inputFloat[i] = static_cast<float>(input[i]);
+    inChan -= outChan;
     
-    return set(inChan, outChan, inputFloat.data(), impulseLength, resize);
+    if (outChan < mNumOuts)
+        return mConvolvers[outChan]->set(inChan, input, length, resize);
+    else
+        return CONVOLVE_ERR_OUT_CHAN_OUT_OF_RANGE;
+}
+
+// Staged loading
+
+template <class T>
+std::unique_ptr<typename HISSTools::MonoConvolveT<T>::Loader> HISSTools::ConvolverT<T>::prepare(uint32_t inChan, uint32_t outChan, const float* input, uintptr_t length, bool resize)
+{
+    return prepareImpulse(inChan, outChan, input, length, resize);
+}
+
+template <class T>
+std::unique_ptr<typename HISSTools::MonoConvolveT<T>::Loader> HISSTools::ConvolverT<T>::prepare(uint32_t inChan, uint32_t outChan, const double* input, uintptr_t length, bool resize)
+{
+    return prepareImpulse(inChan, outChan, input, length, resize);
+}
+
+template <class T>
+template <class U>
+std::unique_ptr<typename HISSTools::MonoConvolveT<T>::Loader> HISSTools::ConvolverT<T>::prepareImpulse(uint32_t inChan, uint32_t outChan, const U* input, uintptr_t length, bool resize)
+{
+    if (mN2M || outChan >= mNumOuts)
+        return nullptr;
+    
+    // For Parallel operation you must pass the same in/out channel
+    
+    return mConvolvers[outChan]->prepare(inChan - outChan, input, length, resize);
+}
+
+template <class T>
+ConvolveError HISSTools::ConvolverT<T>::publish(uint32_t inChan, uint32_t outChan, std::unique_ptr<typename MonoConvolveT<T>::Loader> loader)
+{
+    if (mN2M || outChan >= mNumOuts)
+        return CONVOLVE_ERR_OUT_CHAN_OUT_OF_RANGE;
+    
+    // For Parallel operation you must pass the same in/out channel
+    
+    return mConvolvers[outChan]->publish(inChan - outChan, std::move(loader));
 }
 
 // DSP
 
-void HISSTools::Convolver::process(const float * const* ins, float** outs, size_t numIns, size_t numOuts, size_t numSamples)
+template <class T>
+ConvolveError HISSTools::ConvolverT<T>::setMaxBlockSize(uintptr_t maxBlockSize)
 {
-    auto memPointer = mTemporaryMemory.grow((mNumIns + 2) * numSamples);
-    tempSetup(memPointer.get(), memPointer.getSize());
+    if (!maxBlockSize)
+    {
+        mMaxBlockSize.store(0, std::memory_order_relaxed);
+        return CONVOLVE_ERR_NONE;
+    }
+    
+    AllocatorPtr allocator = mAllocator;
+    
+    auto allocate = [allocator](uintptr_t size) { return allocator->allocate<T>(size); };
+    auto deallocate = [allocator](T *ptr) { allocator->deallocate(ptr); };
+    
+    // The size is stored once the memory is in place (if allocation fails the buffers grow as needed when processing)
+    
+    auto memPointer = mTemporaryMemory.equal(allocate, deallocate, getTempSize(mNumIns, mNumOuts, maxBlockSize));
+    
+    mMaxBlockSize.store(memPointer.get() ? maxBlockSize : 0, std::memory_order_relaxed);
+    
+    return memPointer.get() ? CONVOLVE_ERR_NONE : CONVOLVE_ERR_MEM_UNAVAILABLE;
+}
+
+template <class T>
+void HISSTools::ConvolverT<T>::process(const float * const* ins, float** outs, size_t numIns, size_t numOuts, size_t numSamples)
+{
+    processBlock(ins, outs, numIns, numOuts, numSamples);
+}
+
+template <class T>
+void HISSTools::ConvolverT<T>::process(const double * const* ins, double** outs, size_t numIns, size_t numOuts, size_t numSamples)
+{
+    processBlock(ins, outs, numIns, numOuts, numSamples);
+}
+
+template <class T>
+void HISSTools::ConvolverT<T>::processBlock(const T * const* ins, T** outs, size_t numIns, size_t numOuts, size_t numSamples)
+{
+    ConvolveStats *stats = mStats.load(std::memory_order_relaxed);
+    uint64_t start = stats ? ConvolveStats::getTicks() : 0;
+    
+    // With a declared maximum block size the temporary memory is only accessed here (and larger blocks are processed in chunks)
+    
+    bool fixed = mMaxBlockSize.load(std::memory_order_relaxed);
+    auto memPointer = fixed ? mTemporaryMemory.access() : mTemporaryMemory.grow(getTempSize(mNumIns, mNumOuts, numSamples));
+    uintptr_t chunkSize = tempSetup(memPointer.get(), memPointer.getSize());
     
     if (!memPointer.get())
+    {
         numIns = numOuts = 0;
+        chunkSize = numSamples;
+        
+        if (stats)
+            stats->recordSkipped();
+    }
+    
+    numIns = numIns > mNumIns ? mNumIns : numIns;
+    numOuts = numOuts > mNumOuts ? mNumOuts : numOuts;
     
     SIMDSettings settings;
     
-    for (size_t i = 0; i < numOuts; i++)
+    for (uintptr_t offset = 0; offset < numSamples; offset += chunkSize)
     {
-        const float *n2nIn[1] = { ins[i] };
+        uintptr_t loopSize = std::min(chunkSize, numSamples - offset);
+        
+        if (mN2M)
+        {
+            for (uintptr_t i = 0; i < numIns; i++)
+                mInPointers[i] = ins[i] + offset;
+            
+            for (uintptr_t i = 0; i < numOuts; i++)
+                mOutPointers[i] = outs[i] + offset;
+            
+            mMatrix->process(mInPointers.data(), mOutPointers.data(), mTemps.data(), loopSize, numIns, numOuts, mThreadPool.get());
+            continue;
+        }
         
-        mConvolvers[i]->process(mN2M ? ins : n2nIn, outs[i], mTemp1, numSamples, mN2M ? numIns : 1);
+        auto processChannel = [&](uint32_t i)
+        {
+            const T *n2nIn[1] = { ins[i] + offset };
+            
+            mConvolvers[i]->process(n2nIn, outs[i] + offset, mTemps[i], loopSize, 1);
+        };
+        
+        parallelFor(mThreadPool.get(), static_cast<uint32_t>(numOuts), processChannel);
     }
+    
+    // Blocks are recorded by the matrix for N-to-M convolution
+        
+    if (stats && !mN2M)
+        stats->recordBlock(ConvolveStats::getTicks() - start, numSamples);
 }
 
-void HISSTools::Convolver::process(const double * const* ins, double** outs, size_t numIns, size_t numOuts, size_t numSamples)
+template <class T>
+template <class U>
+void HISSTools::ConvolverT<T>::processBlock(const U * const* ins, U** outs, size_t numIns, size_t numOuts, size_t numSamples)
 {
-    auto memPointer = mTemporaryMemory.grow((mNumIns + 2) * numSamples);
-    tempSetup(memPointer.get(), memPointer.getSize());
+    ConvolveStats *stats = mStats.load(std::memory_order_relaxed);
+    uint64_t start = stats ? ConvolveStats::getTicks() : 0;
+    
+    // With a declared maximum block size the temporary memory is only accessed here (and larger blocks are processed in chunks)
+    
+    bool fixed = mMaxBlockSize.load(std::memory_order_relaxed);
+    auto memPointer = fixed ? mTemporaryMemory.access() : mTemporaryMemory.grow(getTempSize(mNumIns, mNumOuts, numSamples));
+    uintptr_t chunkSize = tempSetup(memPointer.get(), memPointer.getSize());
     
     if (!memPointer.get())
+    {
         numIns = numOuts = 0;
+        chunkSize = numSamples;
+        
+        if (stats)
+            stats->recordSkipped();
+    }
     
     numIns = numIns > mNumIns ? mNumIns : numIns;
     numOuts = numOuts > mNumOuts ? mNumOuts : numOuts;
     
-    for (uintptr_t i = 0; i < numIns; i++)
-        for (uintptr_t j = 0; j < numSamples; j++)
-            mInTemps[i][j] = static_cast<float>(ins[i][j]);
-    
     SIMDSettings settings;
     
-    for (uintptr_t i = 0; i < numOuts; i++)
+    for (uintptr_t offset = 0; offset < numSamples; offset += chunkSize)
     {
-    	const float *n2nIn[1] = { mInTemps[i] };
-    	const float * const *inTemps = mInTemps.data();
-    	
-    	mConvolvers[i]->process(mN2M ? inTemps : n2nIn, mTemp2, mTemp1, numSamples, mN2M ? numIns : 1);
+        uintptr_t loopSize = std::min(chunkSize, numSamples - offset);
+        
+        for (uintptr_t i = 0; i < numIns; i++)
+            for (uintptr_t j = 0; j < loopSize; j++)
+                mInTemps[i][j] = static_cast<T>(ins[i][offset + j]);
+        
+        if (mN2M)
+        {
+            mMatrix->process(mInTemps.data(), mOutTemps.data(), mTemps.data(), loopSize, numIns, numOuts, mThreadPool.get());
+            
+            for (uintptr_t i = 0; i < numOuts; i++)
+                for (uintptr_t j = 0; j < loopSize; j++)
+                    outs[i][offset + j] = static_cast<U>(mOutTemps[i][j]);
+            
+            continue;
+        }
+        
+        auto processChannel = [&](uint32_t i)
+        {
+            const T *n2nIn[1] = { mInTemps[i] };
+            
+            mConvolvers[i]->process(n2nIn, mOutTemps[i], mTemps[i], loopSize, 1);
+            
+            for (uintptr_t j = 0; j < loopSize; j++)
+                outs[i][offset + j] = static_cast<U>(mOutTemps[i][j]);
+        };
         
-        for (uintptr_t j = 0; j < numSamples; j++)
-            outs[i][j] = mTemp2[j];
+        parallelFor(mThreadPool.get(), static_cast<uint32_t>(numOuts), processChannel);
     }
+    
+    // Blocks are recorded by the matrix for N-to-M convolution
+        
+    if (stats && !mN2M)
+        stats->recordBlock(ConvolveStats::getTicks() - start, numSamples);
 }
 
-void HISSTools::Convolver::tempSetup(float* memPointer, uintptr_t maxFrameSize)
+template <class T>
+uintptr_t HISSTools::ConvolverT<T>::tempSetup(T* memPointer, uintptr_t maxFrameSize)
 {
-    maxFrameSize /= (mNumIns + 2);
-    mInTemps[0] = memPointer;
+    maxFrameSize /= getTempSize(mNumIns, mNumOuts, 1);
+    
+    for (uint32_t i = 0; i < mNumIns; i++)
+        mInTemps[i] = memPointer + (i * maxFrameSize);
+    
+    for (uint32_t i = 0; i < mNumOuts; i++)
+        mOutTemps[i] = memPointer + ((mNumIns + i) * maxFrameSize);
     
-    for (uint32_t i = 1; i < mNumIns; i++)
-        mInTemps[i] = mInTemps[0] + (i * maxFrameSize);
+    for (uint32_t i = 0; i < mNumOuts; i++)
+        mTemps[i] = memPointer + ((mNumIns + mNumOuts + i) * maxFrameSize);
     
-    mTemp1 = mInTemps[mNumIns - 1] + maxFrameSize;
-    mTemp2 = mTemp1 + maxFrameSize;
+    return maxFrameSize;
 }
 
-HISSTools::Convolver::SIMDSettings::SIMDSettings()
+template <class T>
+HISSTools::ConvolverT<T>::SIMDSettings::SIMDSettings()
 {
 #if defined(__i386__) || defined(__x86_64__)
     mOldMXCSR = _mm_getcsr();
@@ -202,9 +488,15 @@ HISSTools::Convolver::SIMDSettings::SIMDSettings()
 #endif
 }
 
-HISSTools::Convolver::SIMDSettings::~SIMDSettings()
+template <class T>
+HISSTools::ConvolverT<T>::SIMDSettings::~SIMDSettings()
 {
 #if defined(__i386__) || defined(__x86_64__)
     _mm_setcsr(mOldMXCSR);
 #endif
 }
+
+// Explicit instantiations
+
+template class HISSTools::ConvolverT<float>;
+template class HISSTools::ConvolverT<double>;
@@ -2,15 +2,22 @@
 #pragma once
 
 #include "MemorySwap.h"
+#include "MatrixConvolve.h"
 #include "NToMonoConvolve.h"
 #include "ConvolveErrors.h"
+#include "ConvolveThreadPool.h"
 
+#include <atomic>
 #include <cstdint>
+#include <memory>
 #include <vector>
 
 namespace HISSTools
 {
-    class Convolver
+    // The engine runs at the precision of T (float or double)
+    
+    template <class T>
+    class ConvolverT
     {
         struct SIMDSettings
         {
@@ -22,10 +29,21 @@ namespace HISSTools
         
     public:
         
-        Convolver(uint32_t numIns, uint32_t numOuts, LatencyMode latency);
-        Convolver(uint32_t numIO, LatencyMode latency);
+        // The number of threads includes the calling thread (values above one opt into multithreaded processing across outputs)
+        // For N-to-N convolution asyncTail moves the largest partition of each channel to its own background thread
+        // All buffers are taken from the allocator if one is given (for N-to-N convolution this may be an arena sized by getArenaSize())
         
-        virtual ~Convolver() throw();
+        ConvolverT(uint32_t numIns, uint32_t numOuts, LatencyMode latency, uint32_t numThreads = 1, AllocatorPtr allocator = nullptr);
+        ConvolverT(uint32_t numIO, LatencyMode latency, uint32_t numThreads = 1, bool asyncTail = false, AllocatorPtr allocator = nullptr);
+        
+        // The arena size for N-to-N convolution with impulses up to maxLength (measured for one channel with the default settings)
+        // Each set of partitions holds a complete copy - when crossfading a set may be active, fading, ramped out, replaced but not yet freed and being prepared
+        // A further set is allowed for fragmentation (as sets of differing lengths are freed and reused in any order)
+        // If maxBlockSize is given the temporary buffers for setMaxBlockSize() are included
+        
+        static size_t getArenaSize(uint32_t numIO, LatencyMode latency, uintptr_t maxLength, bool asyncTail = false, uint32_t numSets = 5, uintptr_t maxBlockSize = 0);
+        
+        virtual ~ConvolverT() throw();
         
         // Clear IRs
         
@@ -37,6 +55,34 @@ namespace HISSTools
         void reset();
         ConvolveError reset(uint32_t inChan, uint32_t outChan);
         
+        // Crossfade between impulses when they are replaced (N.B. only supported for parallel operation)
+        
+        void setCrossfade(uintptr_t fadeLength, uint32_t fadeLevels = 5);
+        
+        // Skip impulse partitions at or below a threshold RMS level from the next set (N.B. only supported for parallel operation)
+        
+        void setSilenceThreshold(double threshold, bool trimTail = false);
+        
+        // Store the spectra of the largest partitions as bfloat16 from the next set (N.B. only supported for parallel operation)
+        
+        void setHalfPrecisionTail(bool halfPrecision);
+        
+        // Spread the ffts of the largest partitions over each hop from the next set (N.B. only supported for parallel operation)
+        
+        void setDistributedTail(bool distributed);
+        
+        // Assign the hop phases with the PhaseScheduler from the next set (N.B. only supported for parallel operation)
+        
+        void setScheduled(bool scheduled);
+        
+        // Convolve the impulse from start at a reduced sample rate from the next set (N.B. only supported for parallel operation)
+        
+        void setMultirateTail(uintptr_t start, uint32_t factor = 2);
+        
+        // Record the cost of each block and level in a stats object (which must remain valid until it is replaced)
+        
+        void setStats(ConvolveStats *stats);
+        
         // Resize and set IR
         
         ConvolveError resize(uint32_t inChan, uint32_t outChan, uintptr_t impulseLength);
@@ -44,14 +90,36 @@ namespace HISSTools
         ConvolveError set(uint32_t inChan, uint32_t outChan, const float* input, uintptr_t length, bool resize);
         ConvolveError set(uint32_t inChan, uint32_t outChan, const double* input, uintptr_t length, bool resize);
         
-        // DSP
+        // Staged loading for large impulses (N.B. only supported for parallel operation - a null loader is returned otherwise)
+        // The loader may be run from any threads and then published to the same channels (see MonoConvolve)
+        
+        std::unique_ptr<typename MonoConvolveT<T>::Loader> prepare(uint32_t inChan, uint32_t outChan, const float* input, uintptr_t length, bool resize);
+        std::unique_ptr<typename MonoConvolveT<T>::Loader> prepare(uint32_t inChan, uint32_t outChan, const double* input, uintptr_t length, bool resize);
+        ConvolveError publish(uint32_t inChan, uint32_t outChan, std::unique_ptr<typename MonoConvolveT<T>::Loader> loader);
+        
+        // Allocate the temporary buffers for blocks of up to maxBlockSize (from the allocator and before processing)
+        // Once set no memory is allocated when processing (larger blocks are processed in chunks) - if not set the buffers grow as needed
+        
+        ConvolveError setMaxBlockSize(uintptr_t maxBlockSize);
+        
+        // DSP (the native sample type is processed directly and the other type is converted through temporary buffers)
         
         void process(const double * const* ins, double** outs, size_t numIns, size_t numOuts, size_t numSamples);
         void process(const float * const*  ins, float** outs, size_t numIns, size_t numOuts, size_t numSamples);
         
     private:
         
-        void tempSetup(float* memPointer, uintptr_t maxFrameSize);
+        static uintptr_t getTempSize(uint32_t numIns, uint32_t numOuts, uintptr_t numSamples) { return (numIns + numOuts * 2) * numSamples; }
+        
+        uintptr_t tempSetup(T* memPointer, uintptr_t maxFrameSize);
+        
+        void processBlock(const T * const* ins, T** outs, size_t numIns, size_t numOuts, size_t numSamples);
+        
+        template <class U>
+        void processBlock(const U * const* ins, U** outs, size_t numIns, size_t numOuts, size_t numSamples);
+        
+        template <class U>
+        std::unique_ptr<typename MonoConvolveT<T>::Loader> prepareImpulse(uint32_t inChan, uint32_t outChan, const U* input, uintptr_t length, bool resize);
         
         // Data
         
@@ -59,12 +127,25 @@ namespace HISSTools
         uint32_t mNumOuts;
         bool mN2M;
         
-        std::vector<float*> mInTemps;
-        float* mTemp1;
-        float* mTemp2;
+        std::vector<T*> mInTemps;
+        std::vector<T*> mOutTemps;
+        std::vector<T*> mTemps;
+        
+        // Pointers to the current chunk of each input and output (for N-to-M convolution)
+        
+        std::vector<const T*> mInPointers;
+        std::vector<T*> mOutPointers;
+        
+        AllocatorPtr mAllocator;
+        MemorySwap<T> mTemporaryMemory;
+        std::atomic<uintptr_t> mMaxBlockSize;
         
-        MemorySwap<float> mTemporaryMemory;
+        std::unique_ptr<ConvolveThreadPool> mThreadPool;
+        std::unique_ptr<MatrixConvolve<T>> mMatrix;
+        std::vector<NToMonoConvolveT<T>*> mConvolvers;
         
-        std::vector<NToMonoConvolve*> mConvolvers;
+        std::atomic<ConvolveStats *> mStats;
     };
+    
+    typedef ConvolverT<float> Convolver;
 }
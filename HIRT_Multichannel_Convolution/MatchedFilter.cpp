@@ -0,0 +1,237 @@
+/*
+ *  MatchedFilter
+ *
+ *    MatchedFilter performs streaming cross-correlation with a fixed template (a matched filter) and picks the peaks of the result.
+ *
+ *    The correlation is convolution with the reversed template, performed by PartitionedConvolve (so long templates are cheap and the latency is fixed).
+ *    For normalised output the energy of the input under the template is tracked with a running sum (recalculated each time the history wraps to avoid drift).
+ *
+ */
+
+#include "MatchedFilter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <new>
+
+template <class T>
+HISSTools::MatchedFilter<T>::MatchedFilter(uintptr_t FFTSize, uintptr_t maxLength, AllocatorPtr allocator)
+: mMaxLength(maxLength)
+, mLength(0)
+, mTemplateNorm(0.0)
+, mNormalised(true)
+, mDetecting(false)
+, mThreshold(0.0)
+, mSpacing(1)
+, mAllocator(ConvolveAllocator::select(allocator))
+, mInputBuffer(nullptr)
+{
+    mPart.reset(new PartitionedConvolveT<T>(FFTSize, maxLength, 0, 0, mAllocator));
+    mFFTSize = mPart->getFFTSize();
+    
+    // The history must hold the template and the latency beyond a chunk of input (rounded up to a power of two for wrapping)
+    
+    uintptr_t bufferSize = 1;
+    
+    while (bufferSize < maxLength + getLatency() + CHUNK_SIZE)
+        bufferSize <<= 1;
+    
+    mBufferMask = bufferSize - 1;
+    mInputBuffer = mAllocator->allocate<T>(bufferSize);
+    
+    if (!mInputBuffer)
+        throw std::bad_alloc();
+    
+    mDetections.reserve(MAX_DETECTIONS);
+    
+    reset();
+}
+
+template <class T>
+HISSTools::MatchedFilter<T>::~MatchedFilter()
+{
+    mAllocator->deallocate(mInputBuffer);
+}
+
+template <class T>
+ConvolveError HISSTools::MatchedFilter<T>::set(const float *input, uintptr_t length)
+{
+    return setTemplate(input, length);
+}
+
+template <class T>
+ConvolveError HISSTools::MatchedFilter<T>::set(const double *input, uintptr_t length)
+{
+    return setTemplate(input, length);
+}
+
+template <class T>
+template <class U>
+ConvolveError HISSTools::MatchedFilter<T>::setTemplate(const U *input, uintptr_t length)
+{
+    ConvolveError error = CONVOLVE_ERR_NONE;
+    
+    length = input ? length : 0;
+    
+    if (length > mMaxLength)
+    {
+        length = mMaxLength;
+        error = CONVOLVE_ERR_MEM_ALLOC_TOO_SMALL;
+    }
+    
+    // Reverse the template (the end of the template is then the first sample of the impulse)
+    
+    U *reversed = length ? mAllocator->allocate<U>(length) : nullptr;
+    
+    if (length && !reversed)
+    {
+        length = 0;
+        error = CONVOLVE_ERR_MEM_UNAVAILABLE;
+    }
+    
+    mTemplateNorm = 0.0;
+    
+    for (uintptr_t i = 0; i < length; i++)
+    {
+        reversed[i] = input[length - 1 - i];
+        mTemplateNorm += static_cast<double>(input[i]) * static_cast<double>(input[i]);
+    }
+    
+    mTemplateNorm = std::sqrt(mTemplateNorm);
+    
+    ConvolveError setError = mPart->set(reversed, length);
+    mLength = setError == CONVOLVE_ERR_NONE ? length : 0;
+    
+    mAllocator->deallocate(reversed);
+    reset();
+    
+    return error != CONVOLVE_ERR_NONE ? error : setError;
+}
+
+template <class T>
+void HISSTools::MatchedFilter<T>::reset()
+{
+    mPart->reset();
+    
+    std::fill_n(mInputBuffer, mBufferMask + 1, T(0));
+    mEnergy = 0.0;
+    
+    mDetections.clear();
+    mPosition = 0;
+    mBelowCount = 0;
+    mInPeak = false;
+}
+
+template <class T>
+void HISSTools::MatchedFilter<T>::setNormalised(bool normalised)
+{
+    mNormalised = normalised;
+}
+
+template <class T>
+void HISSTools::MatchedFilter<T>::setDetection(double threshold, uintptr_t spacing)
+{
+    mThreshold = threshold;
+    mSpacing = std::max(spacing, uintptr_t(1));
+    mDetecting = true;
+}
+
+template <class T>
+double HISSTools::MatchedFilter<T>::getWindowEnergy()
+{
+    // The window for the current output ends a latency before the current position (earlier samples are zero after a reset)
+    
+    double energy = 0.0;
+    
+    for (uintptr_t i = 1; i <= mLength; i++)
+    {
+        double value = mInputBuffer[(mPosition - getLatency() - i) & mBufferMask];
+        energy += value * value;
+    }
+    
+    return energy;
+}
+
+template <class T>
+void HISSTools::MatchedFilter<T>::detect(T value)
+{
+    // Only complete windows are considered (the start of the match would otherwise be before the reset)
+    
+    if (mPosition + 1 < getLatency() + mLength)
+        return;
+    
+    if (value >= mThreshold)
+    {
+        if (!mInPeak || value > mPeak.mValue)
+            mPeak = { mPosition + 1 - getLatency() - mLength, value };
+        
+        mInPeak = true;
+        mBelowCount = 0;
+    }
+    else if (mInPeak && ++mBelowCount >= mSpacing)
+    {
+        if (mDetections.size() < MAX_DETECTIONS)
+            mDetections.push_back(mPeak);
+        
+        mInPeak = false;
+    }
+}
+
+template <class T>
+bool HISSTools::MatchedFilter<T>::process(const T *in, T *out, uintptr_t numSamples)
+{
+    uintptr_t latency = getLatency();
+    
+    mDetections.clear();
+    
+    if (!mLength)
+    {
+        std::fill_n(out, numSamples, T(0));
+        return false;
+    }
+    
+    // Process in chunks (so that the history need only hold one chunk beyond the template and the latency)
+    
+    for (uintptr_t i = 0, loopSize = 0; i < numSamples; i += loopSize, in += loopSize, out += loopSize)
+    {
+        loopSize = std::min(numSamples - i, uintptr_t(CHUNK_SIZE));
+        
+        for (uintptr_t j = 0; j < loopSize; j++)
+            mInputBuffer[(mPosition + j) & mBufferMask] = in[j];
+        
+        mPart->process(in, out, loopSize);
+        
+        for (uintptr_t j = 0; j < loopSize; j++, mPosition++)
+        {
+            if (mNormalised)
+            {
+                // Update the energy under the template (summing afresh each time the history wraps)
+                
+                if (!(mPosition & mBufferMask))
+                    mEnergy = getWindowEnergy();
+                
+                double added = mInputBuffer[(mPosition - latency) & mBufferMask];
+                double removed = mInputBuffer[(mPosition - latency - mLength) & mBufferMask];
+                
+                mEnergy += (added * added) - (removed * removed);
+                
+                // Cauchy-Schwarz bounds the result (any excess is rounding error in the running sum)
+                
+                double norm = mTemplateNorm * std::sqrt(std::max(mEnergy, 0.0));
+                double value = norm > 0.0 ? out[j] / norm : 0.0;
+                
+                out[j] = static_cast<T>(std::min(std::max(value, -1.0), 1.0));
+            }
+            
+            if (mDetecting)
+                detect(out[j]);
+        }
+    }
+    
+    return true;
+}
+
+// Explicit instantiations
+
+template class HISSTools::MatchedFilter<float>;
+template class HISSTools::MatchedFilter<double>;
@@ -0,0 +1,111 @@
+
+#pragma once
+
+#include "PartitionedConvolve.h"
+#include "ConvolveErrors.h"
+#include "ConvolveAllocator.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace HISSTools
+{
+    // MatchedFilter streams the cross-correlation of its input with a fixed template and reports the peaks that match it
+    // The template is time-reversed and convolved by a PartitionedConvolve, so the output is delayed by half the fft size
+    // The output may be normalised by the energy of the input under the template (giving values from -1 to 1 for any input level)
+    
+    template <class T>
+    class MatchedFilter
+    {
+        // The maximum number of detections reported by one call to process() and the size of each chunk of processing
+        
+        static constexpr uintptr_t MAX_DETECTIONS = 256;
+        static constexpr uintptr_t CHUNK_SIZE = 512;
+    
+    public:
+        
+        // The position of a detection is the input sample (counted from the last reset) at which the matching segment starts
+        
+        struct Detection
+        {
+            uint64_t mPosition;
+            T mValue;
+        };
+        
+        // The fft size sets the latency (half the fft size) and the cost per sample (larger sizes are cheaper for long templates)
+        // Buffers (and the template spectrum) are taken from the allocator (or the system if it is null)
+        
+        MatchedFilter(uintptr_t FFTSize, uintptr_t maxLength, AllocatorPtr allocator = nullptr);
+        ~MatchedFilter();
+        
+        // Non-moveable and copyable
+        
+        MatchedFilter(MatchedFilter& obj) = delete;
+        MatchedFilter& operator = (MatchedFilter& obj) = delete;
+        MatchedFilter(MatchedFilter&& obj) = delete;
+        MatchedFilter& operator = (MatchedFilter&& obj) = delete;
+        
+        // Templates longer than the maximum length are truncated (and the filter is reset when a template is set)
+        // N.B. the template must not be set whilst processing
+        
+        ConvolveError set(const float *input, uintptr_t length);
+        ConvolveError set(const double *input, uintptr_t length);
+        void reset();
+        
+        void setNormalised(bool normalised);
+        
+        // Detections are the maxima of regions of output at or above the threshold (regions less than spacing samples apart are merged)
+        // A detection is reported once the output has been below the threshold for the spacing (detection is off until this is called)
+        
+        void setDetection(double threshold, uintptr_t spacing = 1);
+        
+        uintptr_t getLatency() const { return mFFTSize >> 1; }
+        
+        // The output is the correlation (zero until a template is set) and the detections are valid until the next call
+        
+        bool process(const T *in, T *out, uintptr_t numSamples);
+        
+        const std::vector<Detection>& getDetections() const { return mDetections; }
+    
+    private:
+        
+        template <class U>
+        ConvolveError setTemplate(const U *input, uintptr_t length);
+        
+        void detect(T value);
+        double getWindowEnergy();
+        
+        // Parameters
+        
+        uintptr_t mFFTSize;
+        uintptr_t mMaxLength;
+        uintptr_t mLength;
+        double mTemplateNorm;
+        
+        bool mNormalised;
+        bool mDetecting;
+        double mThreshold;
+        uintptr_t mSpacing;
+        
+        AllocatorPtr mAllocator;
+        
+        // The correlation (convolution with the reversed template)
+        
+        std::unique_ptr<PartitionedConvolveT<T>> mPart;
+        
+        // The input history (for the energy under the template, which is summed afresh each time the buffer wraps)
+        
+        T *mInputBuffer;
+        uintptr_t mBufferMask;
+        double mEnergy;
+        
+        // Peak picking
+        
+        std::vector<Detection> mDetections;
+        uint64_t mPosition;
+        Detection mPeak;
+        uintptr_t mBelowCount;
+        bool mInPeak;
+    };
+}
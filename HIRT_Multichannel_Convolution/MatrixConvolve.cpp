@@ -0,0 +1,391 @@
+
+#include "MatrixConvolve.h"
+#include "ConvolveKernels.h"
+
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+
+// Standard Constructor
+
+template <class T>
+HISSTools::MatrixConvolve<T>::MatrixConvolve(uint32_t numIns, uint32_t numOuts, uintptr_t maxLength, LatencyMode latency, AllocatorPtr allocator)
+: mNumIns(numIns)
+, mNumOuts(numOuts)
+, mAllocator(ConvolveAllocator::select(allocator))
+, mSizesAllocated(numIns * numOuts, maxLength)
+, mFinalOffset(0)
+, mInputPointers(numIns, nullptr)
+, mOutputPointers(numOuts, nullptr)
+, mReset(false)
+, mStats(nullptr)
+, mRandGenerator(std::random_device()())
+{
+    switch (latency)
+    {
+        case kLatencyZero:      setPartitions(maxLength, true, 256, 1024, 4096, 16384);     break;
+        case kLatencyShort:     setPartitions(maxLength, false, 256, 1024, 4096, 16384);    break;
+        case kLatencyMedium:    setPartitions(maxLength, false, 1024, 4096, 16384, 0);      break;
+    }
+}
+
+// Constructor (custom partitioning)
+
+template <class T>
+HISSTools::MatrixConvolve<T>::MatrixConvolve(uint32_t numIns, uint32_t numOuts, uintptr_t maxLength, bool zeroLatency, uint32_t A, uint32_t B, uint32_t C, uint32_t D, AllocatorPtr allocator)
+: mNumIns(numIns)
+, mNumOuts(numOuts)
+, mAllocator(ConvolveAllocator::select(allocator))
+, mSizesAllocated(numIns * numOuts, maxLength)
+, mFinalOffset(0)
+, mInputPointers(numIns, nullptr)
+, mOutputPointers(numOuts, nullptr)
+, mReset(false)
+, mStats(nullptr)
+, mRandGenerator(std::random_device()())
+{
+    setPartitions(maxLength, zeroLatency, A, B, C, D);
+}
+
+template <class T>
+void HISSTools::MatrixConvolve<T>::setResetOffset(intptr_t offset)
+{
+    if (offset < 0)
+        offset = mRandDistribution(mRandGenerator);
+    
+    mLock.acquire();
+    
+    for (size_t i = 0; i + 1 < numSizes(); i++)
+        mParts[i]->setResetOffset(offset + (mSizes[i + 1] >> 3));
+    
+    mParts.back()->setResetOffset(offset);
+    
+    mLock.release();
+}
+
+template <class T>
+ConvolveError HISSTools::MatrixConvolve<T>::checkChannels(uint32_t inChan, uint32_t outChan)
+{
+    if (inChan >= mNumIns)
+        return CONVOLVE_ERR_IN_CHAN_OUT_OF_RANGE;
+    
+    if (outChan >= mNumOuts)
+        return CONVOLVE_ERR_OUT_CHAN_OUT_OF_RANGE;
+    
+    return CONVOLVE_ERR_NONE;
+}
+
+template <class T>
+void HISSTools::MatrixConvolve<T>::updateTimeRoutes()
+{
+    for (uint32_t i = 0; i < mNumOuts && mTimes.size(); i++)
+    {
+        mTimeRoutes[i].clear();
+        
+        for (uint32_t j = 0; j < mNumIns; j++)
+        {
+            if (mTimes[getPairIndex(j, i)])
+                mTimeRoutes[i].push_back(j);
+        }
+    }
+}
+
+template <class T>
+ConvolveError HISSTools::MatrixConvolve<T>::resize(uint32_t inChan, uint32_t outChan, uintptr_t length)
+{
+    ConvolveError error = checkChannels(inChan, outChan);
+    
+    if (error != CONVOLVE_ERR_NONE)
+        return error;
+    
+    mSetLock.acquire();
+    error = resizePair(inChan, outChan, length);
+    mSetLock.release();
+    
+    return error;
+}
+
+template <class T>
+ConvolveError HISSTools::MatrixConvolve<T>::resizePair(uint32_t inChan, uint32_t outChan, uintptr_t length)
+{
+    uintptr_t pairIndex = getPairIndex(inChan, outChan);
+    uintptr_t largestSize = mSizes.back();
+    
+    // Lock to ensure we have exclusive access and clear the pair as the final partition contents are lost
+    
+    mLock.acquire();
+    
+    if (mTimes.size())
+        mTimes[pairIndex].reset();
+    
+    for (size_t i = 0; i + 1 < numSizes(); i++)
+        mParts[i]->set(inChan, outChan, (float *) nullptr, 0);
+    
+    ConvolveError error = mParts.back()->resize(inChan, outChan, std::max(length, uintptr_t(largestSize)) - mFinalOffset);
+    mSizesAllocated[pairIndex] = error == CONVOLVE_ERR_NONE ? length : 0;
+    
+    updateTimeRoutes();
+    
+    mLock.release();
+    
+    return error;
+}
+
+template <class T>
+ConvolveError HISSTools::MatrixConvolve<T>::set(uint32_t inChan, uint32_t outChan, const float *input, uintptr_t length, bool requestResize)
+{
+    return setImpulse(inChan, outChan, input, length, requestResize);
+}
+
+template <class T>
+ConvolveError HISSTools::MatrixConvolve<T>::set(uint32_t inChan, uint32_t outChan, const double *input, uintptr_t length, bool requestResize)
+{
+    return setImpulse(inChan, outChan, input, length, requestResize);
+}
+
+template <class T>
+template <class U>
+ConvolveError HISSTools::MatrixConvolve<T>::setImpulse(uint32_t inChan, uint32_t outChan, const U *input, uintptr_t length, bool requestResize)
+{
+    ConvolveError error = checkChannels(inChan, outChan);
+    
+    if (error != CONVOLVE_ERR_NONE)
+        return error;
+    
+    uintptr_t pairIndex = getPairIndex(inChan, outChan);
+    bool hasImpulse = input && length;
+    
+    mSetLock.acquire();
+    
+    if (requestResize && length != mSizesAllocated[pairIndex])
+        resizePair(inChan, outChan, length);
+    
+    // Transform the impulse for each partition size (the audio thread continues meanwhile)
+    // Partitions allocate their buffers on setting, so they may fail to allocate even if the length has been reserved
+    
+    std::vector<typename PartitionedMatrixConvolve<T>::Prepared> prepared(mParts.size());
+    
+    for (size_t i = 0; i < mParts.size(); i++)
+    {
+        if (mParts[i]->prepare(inChan, outChan, input, length, prepared[i]) == CONVOLVE_ERR_MEM_UNAVAILABLE)
+            error = CONVOLVE_ERR_MEM_UNAVAILABLE;
+    }
+    
+    // Time domain convolvers are created for pairs with an impulse and freed otherwise
+    
+    TimeUniquePtr time;
+    
+    if (mTimes.size() && hasImpulse && !mTimes[pairIndex])
+    {
+        try
+        {
+            time.reset(new TimeDomainConvolveT<T>(0, mSizes[0] >> 1, mAllocator));
+        }
+        catch (std::bad_alloc&)
+        {
+            error = CONVOLVE_ERR_MEM_UNAVAILABLE;
+        }
+    }
+    
+    // Lock to ensure that audio finishes processing before we swap (the replaced convolver and buffers are freed after)
+    
+    mLock.acquire();
+    
+    if (mTimes.size())
+    {
+        if (time || !hasImpulse)
+            std::swap(mTimes[pairIndex], time);
+        
+        if (mTimes[pairIndex])
+            mTimes[pairIndex]->set(input, length);
+        
+        updateTimeRoutes();
+    }
+    
+    for (size_t i = 0; i < mParts.size(); i++)
+        mParts[i]->publish(prepared[i]);
+    
+    mLock.release();
+    
+    for (size_t i = 0; i < mParts.size(); i++)
+        mParts[i]->release(prepared[i]);
+    
+    time.reset();
+    
+    uintptr_t sizeAllocated = mSizesAllocated[pairIndex];
+    
+    mSetLock.release();
+    
+    if (error != CONVOLVE_ERR_NONE)
+        return error;
+    
+    return (length && !sizeAllocated) ? CONVOLVE_ERR_MEM_UNAVAILABLE : (length > sizeAllocated) ? CONVOLVE_ERR_MEM_ALLOC_TOO_SMALL : CONVOLVE_ERR_NONE;
+}
+
+template <class T>
+ConvolveError HISSTools::MatrixConvolve<T>::reset(uint32_t inChan, uint32_t outChan)
+{
+    ConvolveError error = checkChannels(inChan, outChan);
+    
+    if (error != CONVOLVE_ERR_NONE)
+        return error;
+    
+    // Lock to ensure that the pair is not reset part way through processing
+    
+    mLock.acquire();
+    
+    if (mTimes.size() && mTimes[getPairIndex(inChan, outChan)])
+        mTimes[getPairIndex(inChan, outChan)]->reset();
+    
+    for (auto it = mParts.begin(); it != mParts.end(); it++)
+        (*it)->reset(inChan, outChan);
+    
+    mLock.release();
+    
+    return error;
+}
+
+template <class T>
+void HISSTools::MatrixConvolve<T>::reset()
+{
+    mReset = true;
+}
+
+template <class T>
+void HISSTools::MatrixConvolve<T>::process(const T * const* ins, T **outs, T **temps, size_t numSamples, size_t activeInChans, size_t activeOutChans, ConvolveThreadPool *pool)
+{
+    ConvolveStats *stats = mStats.load(std::memory_order_relaxed);
+    uint64_t start = stats ? ConvolveStats::getTicks() : 0;
+    uint64_t levelStart = start;
+    
+    // Record the time of a level (the final partition size is always the last level)
+    
+    auto recordLevel = [&](uint32_t level)
+    {
+        uint64_t end = ConvolveStats::getTicks();
+        stats->recordLevel(level, end - levelStart, 0, 0);
+        levelStart = end;
+    };
+    
+    // Zero outputs then convolve
+    
+    for (size_t i = 0; i < activeOutChans; i++)
+        std::fill_n(outs[i], numSamples, T(0));
+    
+    if (!mLock.attempt())
+    {
+        if (stats)
+            stats->recordSkipped();
+        return;
+    }
+    
+    if (mReset)
+    {
+        for (auto it = mTimes.begin(); it != mTimes.end(); it++)
+        {
+            if (*it)
+                (*it)->reset();
+        }
+        
+        for (auto it = mParts.begin(); it != mParts.end(); it++)
+            (*it)->reset();
+        
+        mReset = false;
+    }
+    
+    // Time domain convolution (per input / output pair)
+    
+    if (mTimes.size())
+    {
+        auto processOutput = [&](uint32_t i)
+        {
+            for (auto it = mTimeRoutes[i].begin(); it != mTimeRoutes[i].end() && *it < activeInChans; it++)
+                processAndSum(mTimes[getPairIndex(*it, i)].get(), ins[*it], temps[i], outs[i], numSamples, true);
+        };
+        
+        parallelFor(pool, static_cast<uint32_t>(std::min(activeOutChans, size_t(mNumOuts))), processOutput);
+        
+        if (stats)
+            recordLevel(0);
+    }
+    
+    // Partitioned convolution (inputs are transformed once per partition size and shared between outputs)
+    
+    for (uint32_t i = 0; i < mNumIns; i++)
+        mInputPointers[i] = i < activeInChans ? ins[i] : nullptr;
+    
+    for (uint32_t i = 0; i < mNumOuts; i++)
+        mOutputPointers[i] = i < activeOutChans ? outs[i] : nullptr;
+    
+    for (size_t i = 0; i < mParts.size(); i++)
+    {
+        mParts[i]->process(mInputPointers.data(), mOutputPointers.data(), numSamples, pool);
+        
+        if (stats)
+            recordLevel(static_cast<uint32_t>(ConvolveStats::NUM_LEVELS - mParts.size() + i));
+    }
+    
+    mLock.release();
+    
+    if (stats)
+        stats->recordBlock(ConvolveStats::getTicks() - start, numSamples);
+}
+
+template <class T>
+void HISSTools::MatrixConvolve<T>::setPartitions(uintptr_t maxLength, bool zeroLatency, uint32_t A, uint32_t B, uint32_t C, uint32_t D)
+{
+    // Utilities
+    
+    auto checkAndStoreFFTSize = [this](int size, int prev)
+    {
+        if ((size >= (1 << 5)) && (size <= (1 << 20)) && size > prev)
+            mSizes.push_back(size);
+        else if (size)
+            throw std::runtime_error("invalid FFT size or order");
+    };
+    
+    // Sanity checks
+    
+    checkAndStoreFFTSize(A, 0);
+    checkAndStoreFFTSize(B, A);
+    checkAndStoreFFTSize(C, B);
+    checkAndStoreFFTSize(D, C);
+    
+    if (!numSizes())
+        throw std::runtime_error("no valid FFT sizes given");
+    
+    uint32_t offset = zeroLatency ? mSizes[0] >> 1 : 0;
+    uint32_t largestSize = mSizes[numSizes() - 1];
+    
+    // Make space for time domain convolvers for each pair (they are allocated when an impulse is set)
+    
+    if (zeroLatency)
+    {
+        mTimes.resize(mNumIns * mNumOuts);
+        mTimeRoutes.resize(mNumOuts);
+    }
+    
+    // Allocate fixed size partitions
+    
+    for (size_t i = 0; i + 1 < numSizes(); i++)
+    {
+        uint32_t length = (mSizes[i + 1] - mSizes[i]) >> 1;
+        mParts.emplace_back(new PartitionedMatrixConvolve<T>(mNumIns, mNumOuts, mSizes[i], length, offset, length, mAllocator));
+        offset += length;
+    }
+    
+    // Allocate the final resizeable partition
+    
+    mParts.emplace_back(new PartitionedMatrixConvolve<T>(mNumIns, mNumOuts, largestSize, std::max(maxLength, uintptr_t(largestSize)) - offset, offset, 0, mAllocator));
+    mFinalOffset = offset;
+    
+    // Set offsets
+    
+    mRandDistribution = std::uniform_int_distribution<uintptr_t>(0, (largestSize >> 1) - 1);
+    setResetOffset();
+}
+
+// Explicit instantiations
+
+template class HISSTools::MatrixConvolve<float>;
+template class HISSTools::MatrixConvolve<double>;
@@ -0,0 +1,116 @@
+
+#pragma once
+
+#include "MonoConvolve.h"
+#include "PartitionedMatrixConvolve.h"
+#include "TimeDomainConvolve.h"
+#include "ConvolveAllocator.h"
+#include "ConvolveErrors.h"
+#include "ConvolveStats.h"
+#include "ConvolveThreadPool.h"
+
+#include "../ThreadLocks.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace HISSTools
+{
+    // MatrixConvolve convolves N inputs to M outputs sharing the input spectra of each partition size between all outputs
+    
+    template <class T>
+    class MatrixConvolve
+    {
+        typedef std::unique_ptr<HISSTools::TimeDomainConvolveT<T>> TimeUniquePtr;
+        typedef std::unique_ptr<HISSTools::PartitionedMatrixConvolve<T>> PartUniquePtr;
+    
+    public:
+        
+        // All buffers are taken from the allocator if one is given
+        
+        MatrixConvolve(uint32_t numIns, uint32_t numOuts, uintptr_t maxLength, LatencyMode latency, AllocatorPtr allocator = nullptr);
+        MatrixConvolve(uint32_t numIns, uint32_t numOuts, uintptr_t maxLength, bool zeroLatency, uint32_t A, uint32_t B = 0, uint32_t C = 0, uint32_t D = 0, AllocatorPtr allocator = nullptr);
+        
+        // Non-moveable and copyable
+        
+        MatrixConvolve(MatrixConvolve& obj) = delete;
+        MatrixConvolve& operator = (MatrixConvolve& obj) = delete;
+        MatrixConvolve(MatrixConvolve&& obj) = delete;
+        MatrixConvolve& operator = (MatrixConvolve&& obj) = delete;
+        
+        void setResetOffset(intptr_t offset = -1);
+        
+        // If a stats object is set the cost of each level and each block is recorded in it (including blocks skipped whilst setting)
+        // N.B. the time of a level includes waiting for the whole thread pool (work counts are not recorded)
+        
+        void setStats(ConvolveStats *stats) { mStats.store(stats, std::memory_order_relaxed); }
+        
+        // Impulses are transformed before the audio thread is locked out (which is then only for long enough to swap them in)
+        
+        ConvolveError resize(uint32_t inChan, uint32_t outChan, uintptr_t length);
+        ConvolveError set(uint32_t inChan, uint32_t outChan, const float *input, uintptr_t length, bool requestResize);
+        ConvolveError set(uint32_t inChan, uint32_t outChan, const double *input, uintptr_t length, bool requestResize);
+        
+        // Resetting a pair drops its input from before the reset (the other pairs are unaffected)
+        
+        ConvolveError reset(uint32_t inChan, uint32_t outChan);
+        void reset();
+        
+        // A temporary buffer of numSamples is required for each active output
+        // If a thread pool is provided the work is distributed across the pool (giving identical results to serial processing)
+        
+        void process(const T * const* ins, T **outs, T **temps, size_t numSamples, size_t activeInChans, size_t activeOutChans, ConvolveThreadPool *pool = nullptr);
+    
+    private:
+        
+        void setPartitions(uintptr_t maxLength, bool zeroLatency, uint32_t A, uint32_t B, uint32_t C, uint32_t D);
+        
+        ConvolveError resizePair(uint32_t inChan, uint32_t outChan, uintptr_t length);
+        
+        template <class U>
+        ConvolveError setImpulse(uint32_t inChan, uint32_t outChan, const U *input, uintptr_t length, bool requestResize);
+        
+        ConvolveError checkChannels(uint32_t inChan, uint32_t outChan);
+        void updateTimeRoutes();
+        uintptr_t getPairIndex(uint32_t inChan, uint32_t outChan) { return outChan * mNumIns + inChan; }
+        
+        size_t numSizes() { return mSizes.size(); }
+        
+        // Data
+        
+        uint32_t mNumIns;
+        uint32_t mNumOuts;
+        
+        AllocatorPtr mAllocator;
+        
+        std::vector<uint32_t> mSizes;
+        
+        // Time domain convolvers are only allocated for pairs with an impulse (and listed by output so that only these are visited)
+        
+        std::vector<TimeUniquePtr> mTimes;
+        std::vector<std::vector<uint32_t>> mTimeRoutes;
+        std::vector<PartUniquePtr> mParts;
+        
+        std::vector<uintptr_t> mSizesAllocated;
+        uintptr_t mFinalOffset;
+        
+        std::vector<const T *> mInputPointers;
+        std::vector<T *> mOutputPointers;
+        
+        // The set lock serialises setting (the lock shared with the audio thread is only held whilst swapping)
+        
+        thread_lock mSetLock;
+        thread_lock mLock;
+        bool mReset;
+        
+        std::atomic<ConvolveStats *> mStats;
+        
+        // Random Number Generation
+        
+        std::default_random_engine mRandGenerator;
+        std::uniform_int_distribution<uintptr_t> mRandDistribution;
+    };
+}
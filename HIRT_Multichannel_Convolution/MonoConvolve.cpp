@@ -1,26 +1,51 @@
 
 #include "MonoConvolve.h"
-#include "ConvolveSIMD.h"
+#include "ConvolveKernels.h"
 
 #include <algorithm>
 #include <cassert>
+#include <new>
 #include <stdexcept>
-
-// Free Utility
-
-void largeFree(HISSTools::PartitionedConvolve *largePartition)
-{
-    delete largePartition;
-}
+#include <thread>
 
 // Standard Constructor
 
-HISSTools::MonoConvolve::MonoConvolve(uintptr_t maxLength, LatencyMode latency)
-: mAllocator(nullptr)
-, mPart4(0)
-, mLength(0)
-, mPart4ResetOffset(0)
+template <class T>
+HISSTools::MonoConvolveT<T>::MonoConvolveT(uintptr_t maxLength, LatencyMode latency, bool asyncTail, AllocatorPtr allocator)
+: mZeroLatency(false)
+, mAllocator(ConvolveAllocator::select(allocator))
+, mActive(nullptr)
+, mFadeLength(0)
+, mFadeLevels(MAX_LEVELS)
+, mFading(nullptr)
+, mFadeGain(1)
+, mFadePosition(0)
+, mFadeTotal(0)
+, mDropPosition(0)
+, mRemoving(nullptr)
+, mRemoveGain(0)
+, mRemoveDropGain(0)
+, mRemoveLevels(0)
+, mRemovePosition(0)
+, mRemoveTotal(0)
+, mFadeBuffers(FADE_CHUNK_SIZE * 5)
+, mActiveBackground(0)
+, mFadeBackground(0)
+, mRemoveBackground(0)
+, mAsyncDelay(0)
+, mResetOffset(0)
+, mAsync(asyncTail)
 , mReset(false)
+, mSilenceThreshold(0.0)
+, mTrimTail(false)
+, mHalfPrecisionTail(false)
+, mDistributedTail(false)
+, mScheduled(false)
+, mMultirateStart(0)
+, mMultirateFactor(1)
+, mStats(nullptr)
+, mRecordBlocks(true)
+, mBackgroundMisses(0)
 , mRandGenerator(std::random_device()())
 {
     switch (latency)
@@ -33,110 +58,505 @@ HISSTools::MonoConvolve::MonoConvolve(uintptr_t maxLength, LatencyMode latency)
 
 // Constructor (custom partitioning)
 
-HISSTools::MonoConvolve::MonoConvolve(uintptr_t maxLength, bool zeroLatency, uint32_t A, uint32_t B, uint32_t C, uint32_t D)
-: mAllocator(nullptr)
-, mPart4(0)
-, mLength(0)
-, mPart4ResetOffset(0)
+template <class T>
+HISSTools::MonoConvolveT<T>::MonoConvolveT(uintptr_t maxLength, bool zeroLatency, uint32_t A, uint32_t B, uint32_t C, uint32_t D, AllocatorPtr allocator)
+: mZeroLatency(false)
+, mAllocator(ConvolveAllocator::select(allocator))
+, mActive(nullptr)
+, mFadeLength(0)
+, mFadeLevels(MAX_LEVELS)
+, mFading(nullptr)
+, mFadeGain(1)
+, mFadePosition(0)
+, mFadeTotal(0)
+, mDropPosition(0)
+, mRemoving(nullptr)
+, mRemoveGain(0)
+, mRemoveDropGain(0)
+, mRemoveLevels(0)
+, mRemovePosition(0)
+, mRemoveTotal(0)
+, mFadeBuffers(FADE_CHUNK_SIZE * 5)
+, mActiveBackground(0)
+, mFadeBackground(0)
+, mRemoveBackground(0)
+, mAsyncDelay(0)
+, mResetOffset(0)
+, mAsync(false)
 , mReset(false)
+, mSilenceThreshold(0.0)
+, mTrimTail(false)
+, mHalfPrecisionTail(false)
+, mDistributedTail(false)
+, mScheduled(false)
+, mMultirateStart(0)
+, mMultirateFactor(1)
+, mStats(nullptr)
+, mRecordBlocks(true)
+, mBackgroundMisses(0)
 , mRandGenerator(std::random_device()())
 {
     setPartitions(maxLength, zeroLatency, A, B, C, D);
 }
 
+// Constructor (partitioning from PartitionOptimizer)
+
+template <class T>
+HISSTools::MonoConvolveT<T>::MonoConvolveT(uintptr_t maxLength, const PartitionScheme& scheme, AllocatorPtr allocator)
+: MonoConvolveT(maxLength, scheme.mZeroLatency, scheme.mSizes[0], scheme.mSizes[1], scheme.mSizes[2], scheme.mSizes[3], allocator)
+{}
+
 // Move Constructor
 
-HISSTools::MonoConvolve::MonoConvolve(MonoConvolve&& obj)
-: mAllocator(obj.mAllocator)
-, mSizes(std::move(obj.mSizes))
-, mTime1(std::move(obj.mTime1))
-, mPart1(std::move(obj.mPart1))
-, mPart2(std::move(obj.mPart2))
-, mPart3(std::move(obj.mPart3))
-, mPart4(std::move(obj.mPart4))
-, mLength(obj.mLength)
-, mPart4ResetOffset(obj.mPart4ResetOffset)
+template <class T>
+HISSTools::MonoConvolveT<T>::MonoConvolveT(MonoConvolveT&& obj)
+: mSizes(std::move(obj.mSizes))
+, mZeroLatency(obj.mZeroLatency)
+, mAllocator(obj.mAllocator)
+, mPartitions(std::move(obj.mPartitions))
+, mActive(nullptr)
+, mFadeLength(obj.mFadeLength.load())
+, mFadeLevels(obj.mFadeLevels.load())
+, mFading(nullptr)
+, mFadeGain(1)
+, mFadePosition(0)
+, mFadeTotal(0)
+, mDropPosition(0)
+, mRemoving(nullptr)
+, mRemoveGain(0)
+, mRemoveDropGain(0)
+, mRemoveLevels(0)
+, mRemovePosition(0)
+, mRemoveTotal(0)
+, mFadeBuffers(std::move(obj.mFadeBuffers))
+, mActiveBackground(obj.mActiveBackground)
+, mFadeBackground(0)
+, mRemoveBackground(0)
+, mAsyncDelay(obj.mAsyncDelay)
+, mResetOffset(obj.mResetOffset)
+, mAsync(obj.mAsync)
 , mReset(true)
-{}
+, mSilenceThreshold(obj.mSilenceThreshold)
+, mTrimTail(obj.mTrimTail)
+, mHalfPrecisionTail(obj.mHalfPrecisionTail)
+, mDistributedTail(obj.mDistributedTail)
+, mScheduled(obj.mScheduled)
+, mMultirateStart(obj.mMultirateStart)
+, mMultirateFactor(obj.mMultirateFactor)
+, mStats(obj.mStats.load())
+, mRecordBlocks(obj.mRecordBlocks.load())
+, mBackgroundMisses(obj.mBackgroundMisses)
+, mRandDistribution(obj.mRandDistribution)
+{
+    for (uint32_t i = 0; i < NUM_BACKGROUND; i++)
+        mAsyncTails[i] = std::move(obj.mAsyncTails[i]);
+}
 
 // Move Assignment
 
-HISSTools::MonoConvolve& HISSTools::MonoConvolve::operator = (MonoConvolve&& obj)
+template <class T>
+HISSTools::MonoConvolveT<T>& HISSTools::MonoConvolveT<T>::operator = (MonoConvolveT&& obj)
 {
-    mAllocator = obj.mAllocator;
     mSizes = std::move(obj.mSizes);
-    mTime1 = std::move(obj.mTime1);
-    mPart1 = std::move(obj.mPart1);
-    mPart2 = std::move(obj.mPart2);
-    mPart3 = std::move(obj.mPart3);
-    mPart4 = std::move(obj.mPart4);
-    mLength = obj.mLength;
-    mPart4ResetOffset = obj.mPart4ResetOffset;
+    mZeroLatency = obj.mZeroLatency;
+    mAllocator = obj.mAllocator;
+    for (uint32_t i = 0; i < NUM_BACKGROUND; i++)
+        mAsyncTails[i] = std::move(obj.mAsyncTails[i]);
+    mPartitions = std::move(obj.mPartitions);
+    mActive = nullptr;
+    mFadeLength = obj.mFadeLength.load();
+    mFadeLevels = obj.mFadeLevels.load();
+    mFading = nullptr;
+    mFadeGain = 1;
+    mFadePosition = 0;
+    mFadeTotal = 0;
+    mDropPosition = 0;
+    mRemoving = nullptr;
+    mRemoveGain = 0;
+    mRemoveDropGain = 0;
+    mRemoveLevels = 0;
+    mRemovePosition = 0;
+    mRemoveTotal = 0;
+    mFadeBuffers = std::move(obj.mFadeBuffers);
+    mActiveBackground = obj.mActiveBackground;
+    mFadeBackground = 0;
+    mRemoveBackground = 0;
+    mAsyncDelay = obj.mAsyncDelay;
+    mResetOffset = obj.mResetOffset;
+    mAsync = obj.mAsync;
     mReset = true;
+    mSilenceThreshold = obj.mSilenceThreshold;
+    mTrimTail = obj.mTrimTail;
+    mHalfPrecisionTail = obj.mHalfPrecisionTail;
+    mDistributedTail = obj.mDistributedTail;
+    mScheduled = obj.mScheduled;
+    mMultirateStart = obj.mMultirateStart;
+    mMultirateFactor = obj.mMultirateFactor;
+    mStats = obj.mStats.load();
+    mRecordBlocks = obj.mRecordBlocks.load();
+    mBackgroundMisses = obj.mBackgroundMisses;
+    mRandDistribution = obj.mRandDistribution;
     
     return *this;
 }
 
-void HISSTools::MonoConvolve::setResetOffset(intptr_t offset)
+template <class T>
+void HISSTools::MonoConvolveT<T>::setResetOffset(intptr_t offset)
 {
-    PartPtr part4 = mPart4.access();
-
-    setResetOffset(part4, offset);
+    if (offset < 0)
+        offset = mRandDistribution(mRandGenerator);
+    
+    mLock.acquire();
+    mResetOffset = offset;
+    applyResetOffset(mPartitions.current());
+    mLock.release();
 }
 
-void HISSTools::MonoConvolve::setResetOffset(PartPtr& part4, intptr_t offset)
+template <class T>
+void HISSTools::MonoConvolveT<T>::applyResetOffset(PartitionSet *set)
 {
-    if (offset < 0)
-        offset = mRandDistribution(mRandGenerator);
+    if (set->mPart1) set->mPart1->setResetOffset(mResetOffset + (mSizes[numSizes() - 3] >> 3));
+    if (set->mPart2) set->mPart2->setResetOffset(mResetOffset + (mSizes[numSizes() - 2] >> 3));
+    if (set->mPart3) set->mPart3->setResetOffset(mResetOffset + (mSizes[numSizes() - 1] >> 3));
     
-    if (mPart1) mPart1.get()->setResetOffset(offset + (mSizes[numSizes() - 3] >> 3));
-    if (mPart2) mPart2.get()->setResetOffset(offset + (mSizes[numSizes() - 2] >> 3));
-    if (mPart3) mPart3.get()->setResetOffset(offset + (mSizes[numSizes() - 1] >> 3));
+    // N.B. a background partition must reset on a hop boundary to align with the handoffs
     
-    if (part4.get()) part4.get()->setResetOffset(offset);
+    set->mPart4->setResetOffset((mAsync || set->mPart4->getDistributed()) ? 0 : mResetOffset);
     
-    mPart4ResetOffset = offset;
+    if (set->mTail) set->mTail->setResetOffset(mResetOffset + (mSizes[numSizes() - 1] >> 2));
 }
 
-ConvolveError HISSTools::MonoConvolve::resize(uintptr_t length)
+template <class T>
+void HISSTools::MonoConvolveT<T>::setCrossfade(uintptr_t fadeLength, uint32_t fadeLevels)
 {
-    mLength = 0;
-    PartPtr part4 = mPart4.equal(mAllocator, largeFree, length);
-    
-    if (part4.get())
-        part4.get()->setResetOffset(mPart4ResetOffset);
+    // N.B. a fade in progress completes with the settings it started with
     
-    return part4.getSize() == length ? CONVOLVE_ERR_NONE : CONVOLVE_ERR_MEM_UNAVAILABLE;
+    mFadeLevels.store(fadeLevels, std::memory_order_relaxed);
+    mFadeLength.store(fadeLength, std::memory_order_relaxed);
+}
+
+template <class T>
+void HISSTools::MonoConvolveT<T>::setSilenceThreshold(double threshold, bool trimTail)
+{
+    mLock.acquire();
+    mSilenceThreshold = threshold;
+    mTrimTail = trimTail;
+    mLock.release();
+}
+
+template <class T>
+void HISSTools::MonoConvolveT<T>::setHalfPrecisionTail(bool halfPrecision)
+{
+    mLock.acquire();
+    mHalfPrecisionTail = halfPrecision;
+    mLock.release();
+}
+
+template <class T>
+void HISSTools::MonoConvolveT<T>::setDistributedTail(bool distributed)
+{
+    mLock.acquire();
+    mDistributedTail = distributed;
+    mLock.release();
 }
 
 template <class T>
-void setPart(T *obj, const float *input, uintptr_t length)
+void HISSTools::MonoConvolveT<T>::setScheduled(bool scheduled)
 {
-    if (obj) obj->set(input, length);
+    mLock.acquire();
+    mScheduled = scheduled;
+    mLock.release();
 }
 
-ConvolveError HISSTools::MonoConvolve::set(const float *input, uintptr_t length, bool requestResize)
+template <class T>
+void HISSTools::MonoConvolveT<T>::setMultirateTail(uintptr_t start, uint32_t factor)
+{
+    mLock.acquire();
+    mMultirateStart = start;
+    mMultirateFactor = factor;
+    mLock.release();
+}
+
+template <class T>
+void HISSTools::MonoConvolveT<T>::setStats(ConvolveStats *stats, bool recordBlocks)
 {
-    // Lock or resize first to ensure that audio finishes processing before we replace
+    mRecordBlocks.store(recordBlocks, std::memory_order_relaxed);
+    mStats.store(stats, std::memory_order_relaxed);
+}
+
+template <class T>
+typename HISSTools::MonoConvolveT<T>::PartitionSet *HISSTools::MonoConvolveT<T>::createSet(uintptr_t size)
+{
+    std::unique_ptr<PartitionSet> set(new PartitionSet());
+    
+    auto createPart = [&](PartUniquePtr& obj, uint32_t& offset, uint32_t size, uint32_t next, uint32_t extra)
+    {
+        uint32_t length = ((next - size) >> 1) + extra;
+        
+        obj.reset(new PartitionedConvolveT<T>(size, length, offset, length, mAllocator));
+        obj->setSilenceThreshold(mSilenceThreshold, mTrimTail);
+        obj->setScheduled(mScheduled);
+        offset += length;
+    };
+    
+    uint32_t offset = mZeroLatency ? mSizes[0] >> 1 : 0;
+    uint32_t largestSize = mSizes[numSizes() - 1];
+    uint32_t delay = static_cast<uint32_t>(getTailDelay());
     
-    mLength = 0;
-    PartPtr part4 = requestResize ? mPart4.equal(mAllocator, largeFree, length) : mPart4.access();
+    // Allocate paritions in unique pointers
+    
+    if (mZeroLatency) set->mTime1.reset(new TimeDomainConvolveT<T>(0, mSizes[0] >> 1, mAllocator));
+    if (numSizes() == 4) createPart(set->mPart1, offset, mSizes[0], mSizes[1], 0);
+    if (numSizes() > 2) createPart(set->mPart2, offset, mSizes[numSizes() - 3], mSizes[numSizes() - 2], 0);
+    if (numSizes() > 1) createPart(set->mPart3, offset, mSizes[numSizes() - 2], mSizes[numSizes() - 1], delay);
+    
+    // Allocate the multirate tail (if any) from a whole number of hops of the final partition size
     
-    if (part4.get())
+    uint32_t factor = MultirateConvolve<T>::getFactor(mMultirateFactor, largestSize);
+    uintptr_t tailStart = 0;
+    
+    if (mMultirateStart && factor > 1)
     {
-        setPart(mTime1.get(), input, length);
-        setPart(mPart1.get(), input, length);
-        setPart(mPart2.get(), input, length);
-        setPart(mPart3.get(), input, length);
-        setPart(part4.get(), input, length);
+        uintptr_t hopSize = largestSize >> 1;
+        uintptr_t start = std::max(std::max(mMultirateStart, MultirateConvolve<T>::getMinOffset(factor, largestSize)), uintptr_t(offset + hopSize));
         
-        part4.get()->setResetOffset(mPart4ResetOffset);
+        tailStart = offset + (((start - offset + hopSize - 1) / hopSize) * hopSize);
+    }
+    
+    if (tailStart && size > tailStart)
+    {
+        set->mTail.reset(new MultirateConvolve<T>(factor, largestSize, size, tailStart, mZeroLatency ? 0 : mSizes[0] >> 1, mAllocator));
+        set->mTail->setSilenceThreshold(mSilenceThreshold, mTrimTail);
+        set->mTail->setHalfPrecision(mHalfPrecisionTail);
+    }
+    
+    // Allocate the final partition for the requested size (or up to the multirate tail)
+    // A background final partition has two hops of extra delay (one if distributed) which are covered by extending the previous partition
+    
+    uintptr_t finalSize = set->mTail ? tailStart : size;
+    uintptr_t finalLength = set->mTail ? tailStart - offset : 0;
+    
+    set->mPart4.reset(new PartitionedConvolveT<T>(largestSize, std::max(finalSize, uintptr_t(largestSize + delay)) - offset, offset - delay, finalLength, mAllocator));
+    set->mPart4->setSilenceThreshold(mSilenceThreshold, mTrimTail);
+    set->mPart4->setHalfPrecision(mHalfPrecisionTail);
+    set->mPart4->setDistributed(isDistributedTail());
+    set->mPart4->setScheduled(mScheduled && !mAsync);
+    set->mSize = size;
+    
+    applyResetOffset(set.get());
+    
+    return set.release();
+}
+
+template <class T>
+ConvolveError HISSTools::MonoConvolveT<T>::resize(uintptr_t length)
+{
+    ConvolveError error = CONVOLVE_ERR_NONE;
+    
+    mLock.acquire();
+    
+    mPartitions.reclaim();
+    
+    try
+    {
+        mPartitions.publish(createSet(length));
+    }
+    catch (std::bad_alloc&)
+    {
+        error = CONVOLVE_ERR_MEM_UNAVAILABLE;
+    }
+    
+    mLock.release();
+    
+    return error;
+}
+
+// Staged Loading
+
+template <class T>
+bool HISSTools::MonoConvolveT<T>::Loader::load(uintptr_t numPartitions)
+{
+    for (uintptr_t i = 0; i < numPartitions; i++)
+    {
+        uintptr_t next = mNextPartition.fetch_add(1);
+        
+        if (next >= mTasks.size())
+            return true;
+        
+        if (mDoubleInput)
+            loadTask(mDoubleInput, mTasks[next]);
+        else
+            loadTask(mFloatInput, mTasks[next]);
         
-        mLength = length;
-        reset();
+        mPartitionsDone.fetch_add(1, std::memory_order_release);
     }
     
-    return (length && !part4.get()) ? CONVOLVE_ERR_MEM_UNAVAILABLE : (length > part4.getSize()) ? CONVOLVE_ERR_MEM_ALLOC_TOO_SMALL : CONVOLVE_ERR_NONE;
+    return mNextPartition.load() >= mTasks.size();
+}
+
+template <class T>
+template <class U>
+void HISSTools::MonoConvolveT<T>::Loader::loadTask(const U *input, const Task& task)
+{
+    task.mPart->setPartition(input + task.mOffset, mLength - task.mOffset, task.mPartition);
+}
+    
+template <class T>
+void HISSTools::MonoConvolveT<T>::Loader::loadAll(uint32_t numThreads)
+{
+    std::vector<std::thread> threads;
+    
+    for (uint32_t i = 1; i < numThreads; i++)
+        threads.emplace_back(&Loader::load, this, mTasks.size());
+    
+    load(mTasks.size());
+    
+    for (auto it = threads.begin(); it != threads.end(); it++)
+        it->join();
+}
+
+template <class T>
+double HISSTools::MonoConvolveT<T>::Loader::getProgress() const
+{
+    if (!mTasks.size())
+        return 1.0;
+    
+    return static_cast<double>(mPartitionsDone.load(std::memory_order_relaxed)) / static_cast<double>(mTasks.size());
+}
+
+template <class T>
+std::unique_ptr<typename HISSTools::MonoConvolveT<T>::Loader> HISSTools::MonoConvolveT<T>::prepare(const float *input, uintptr_t length, bool requestResize)
+{
+    return prepareImpulse(input, length, requestResize);
+}
+
+template <class T>
+std::unique_ptr<typename HISSTools::MonoConvolveT<T>::Loader> HISSTools::MonoConvolveT<T>::prepare(const double *input, uintptr_t length, bool requestResize)
+{
+    return prepareImpulse(input, length, requestResize);
+}
+
+template <class T>
+template <class U>
+std::unique_ptr<typename HISSTools::MonoConvolveT<T>::Loader> HISSTools::MonoConvolveT<T>::prepareImpulse(const U *input, uintptr_t length, bool requestResize)
+{
+    std::unique_ptr<Loader> loader;
+    
+    length = input ? length : 0;
+    
+    // Build an empty set here (the audio thread continues with the current set until the new one is published)
+    // Sets that are no longer in use are freed first (so that their memory can be reused even if the last set failed)
+    
+    mLock.acquire();
+    
+    mPartitions.reclaim();
+    
+    uintptr_t size = requestResize ? length : mPartitions.current()->mSize;
+    
+    try
+    {
+        loader.reset(new Loader());
+        loader->mSet.reset(createSet(size));
+    }
+    catch (std::bad_alloc&)
+    {
+        mLock.release();
+        return nullptr;
+    }
+    
+    loader->mTailOffset = getTailDelay();
+    
+    mLock.release();
+    
+    PartitionSet *set = loader->mSet.get();
+    
+    loader->mLength = length;
+    loader->mError = length > size ? CONVOLVE_ERR_MEM_ALLOC_TOO_SMALL : CONVOLVE_ERR_NONE;
+    set->mLength = length <= size ? length : 0;
+    
+    if (!set->mLength)
+        return loader;
+    
+    if (set->mTime1)
+        set->mTime1->set(input, length);
+    
+    if (set->mTail)
+        set->mTail->set(input, length);
+    
+    // List the partitions to load with the largest first (so that the last tasks to run are the shortest)
+    // A background partition is delayed by the handoff so it is given the impulse from later by the same amount
+    // N.B. there are no partitions to load for a spectrum that is shared with another object
+    
+    auto addTasks = [&](PartitionedConvolveT<T> *part, uintptr_t offset)
+    {
+        if (part && length > offset)
+        {
+            for (uintptr_t i = 0, numPartitions = part->prepareSet(input + offset, length - offset); i < numPartitions; i++)
+                loader->mTasks.push_back({ part, offset, i });
+        }
+    };
+    
+    try
+    {
+        addTasks(set->mPart4.get(), loader->mTailOffset);
+        addTasks(set->mPart3.get(), 0);
+        addTasks(set->mPart2.get(), 0);
+        addTasks(set->mPart1.get(), 0);
+    }
+    catch (std::bad_alloc&)
+    {
+        return nullptr;
+    }
+    
+    loader->setInput(input);
+    
+    return loader;
+}
+
+template <class T>
+ConvolveError HISSTools::MonoConvolveT<T>::publish(std::unique_ptr<Loader> loader)
+{
+    if (!loader)
+        return CONVOLVE_ERR_MEM_UNAVAILABLE;
+    
+    // Complete any remaining loading (including any started on other threads)
+    
+    loader->load(loader->mTasks.size());
+    
+    while (!loader->isComplete())
+        std::this_thread::yield();
+    
+    PartitionSet *set = loader->mSet.release();
+    uintptr_t length = set->mLength;
+    uintptr_t tailOffset = loader->mTailOffset;
+    
+    auto completePart = [](PartitionedConvolveT<T> *part, uintptr_t length)
+    {
+        if (part) part->completeSet(length);
+    };
+    
+    completePart(set->mPart1.get(), length);
+    completePart(set->mPart2.get(), length);
+    completePart(set->mPart3.get(), length);
+    completePart(set->mPart4.get(), length > tailOffset ? length - tailOffset : 0);
+    
+    mLock.acquire();
+    mPartitions.publish(set);
+    mLock.release();
+    
+    return loader->mError;
+}
+
+template <class T>
+ConvolveError HISSTools::MonoConvolveT<T>::set(const float *input, uintptr_t length, bool requestResize)
+{
+    return publish(prepare(input, length, requestResize));
+}
+
+template <class T>
+ConvolveError HISSTools::MonoConvolveT<T>::set(const double *input, uintptr_t length, bool requestResize)
+{
+    return publish(prepare(input, length, requestResize));
 }
 
 template <class T>
@@ -145,62 +565,376 @@ void resetPart(T *obj)
     if (obj) obj->reset();
 }
 
-ConvolveError HISSTools::MonoConvolve::reset()
+// Work counts for instrumentation (only partitioned levels do ffts)
+
+template <class T>
+uint64_t getFFTCount(T *) { return 0; }
+
+template <class T>
+uint64_t getFFTCount(HISSTools::PartitionedConvolveT<T> *obj) { return obj->getFFTCount(); }
+
+template <class T>
+uint64_t getMACCount(T *) { return 0; }
+
+template <class T>
+uint64_t getMACCount(HISSTools::PartitionedConvolveT<T> *obj) { return obj->getMACCount(); }
+
+template <class T>
+uint64_t getFFTCount(HISSTools::MultirateConvolve<T> *obj) { return obj->getFFTCount(); }
+
+template <class T>
+uint64_t getMACCount(HISSTools::MultirateConvolve<T> *obj) { return obj->getMACCount(); }
+
+// Process a level if it exists and the limit has not been reached (returning whether later levels should accumulate)
+// Levels beyond the limit are accumulated into the drop output if there is one
+
+template <class T, class U>
+bool processLevel(T *obj, uint32_t& numLevels, const U *in, U *temp, U *out, U *dropOut, uintptr_t numSamples, bool accumulate, HISSTools::ConvolveStats *stats, uint32_t level)
+{
+    if (obj && !numLevels && dropOut)
+        processAndSum(obj, in, temp, dropOut, numSamples, true);
+    
+    if (!obj || !numLevels)
+        return accumulate;
+    
+    numLevels--;
+    
+    // N.B. a level may have no output (if all of its partitions are silent and trimmed)
+    
+    if (!stats)
+        return processAndSum(obj, in, temp, out, numSamples, accumulate) || accumulate;
+    
+    uint64_t FFTs = getFFTCount(obj);
+    uint64_t MACs = getMACCount(obj);
+    uint64_t start = HISSTools::ConvolveStats::getTicks();
+    
+    accumulate = processAndSum(obj, in, temp, out, numSamples, accumulate) || accumulate;
+    
+    stats->recordLevel(level, HISSTools::ConvolveStats::getTicks() - start, getFFTCount(obj) - FFTs, getMACCount(obj) - MACs);
+    
+    return accumulate;
+}
+
+template <class T>
+ConvolveError HISSTools::MonoConvolveT<T>::reset()
 {
     mReset = true;
     return CONVOLVE_ERR_NONE;
 }
 
-template<class T>
-bool isUnaligned(const T* ptr)
+template <class T>
+void HISSTools::MonoConvolveT<T>::resetSet(PartitionSet *set)
 {
-    return reinterpret_cast<uintptr_t>(ptr) % 16;
+    resetPart(set->mTime1.get());
+    resetPart(set->mPart1.get());
+    resetPart(set->mPart2.get());
+    resetPart(set->mPart3.get());
+    resetPart(set->mTail.get());
+    
+    // N.B. a background partition may be in use by its thread and so is reset there (with the first job for the set)
+    
+    if (mAsync)
+        resetPart(mAsyncTails[mActiveBackground].get());
+    else
+        resetPart(set->mPart4.get());
 }
 
-template<class T>
-void sum(T *temp, T *out, uintptr_t numItems)
+template <class T>
+void HISSTools::MonoConvolveT<T>::processSet(PartitionSet *set, const T *in, T *temp, T *out, uintptr_t numSamples, bool accumulate, uint32_t numLevels, uint32_t background, T *dropOut)
 {
-    for (uintptr_t i = 0; i < numItems; i++, out++, temp++)
-        *out = *out + *temp;
+    if (!set->mLength)
+        return;
+    
+    ConvolveStats *stats = mStats.load(std::memory_order_relaxed);
+    
+    accumulate = processLevel(set->mTime1.get(), numLevels, in, temp, out, dropOut, numSamples, accumulate, stats, 0);
+    accumulate = processLevel(set->mPart1.get(), numLevels, in, temp, out, dropOut, numSamples, accumulate, stats, 1);
+    accumulate = processLevel(set->mPart2.get(), numLevels, in, temp, out, dropOut, numSamples, accumulate, stats, 2);
+    accumulate = processLevel(set->mPart3.get(), numLevels, in, temp, out, dropOut, numSamples, accumulate, stats, 3);
+    
+    // The multirate tail is processed (in the audio thread) only if the final level is (and is otherwise dropped with it)
+    
+    uint32_t tailLevels = numLevels;
+    
+    if (!mAsync)
+        accumulate = processLevel(set->mPart4.get(), numLevels, in, temp, out, dropOut, numSamples, accumulate, stats, 4);
+    else
+        accumulate = processBackground(set, background, numLevels, in, temp, out, dropOut, numSamples, accumulate, stats);
+    
+    processLevel(set->mTail.get(), tailLevels, in, temp, out, dropOut, numSamples, accumulate, stats, 4);
+}
+
+template <class T>
+bool HISSTools::MonoConvolveT<T>::processBackground(PartitionSet *set, uint32_t background, uint32_t numLevels, const T *in, T *temp, T *out, T *dropOut, uintptr_t numSamples, bool accumulate, ConvolveStats *stats)
+{
+    AsyncPartitionedConvolve<T> *async = mAsyncTails[background].get();
+    
+    // Like the other levels the background partition is processed, ramped out through the drop output or skipped
+    
+    if (!numLevels && !dropOut)
+        return accumulate;
+    
+    uint64_t start = stats ? ConvolveStats::getTicks() : 0;
+    
+    async->setPartition(set->mPart4.get());
+    
+    if (numLevels)
+        accumulate = processAndSum(async, in, temp, out, numSamples, accumulate) || accumulate;
+    else
+        processAndSum(async, in, temp, dropOut, numSamples, true);
+    
+    // The work of a background partition is not counted (only the time taken in the audio thread and any waits)
+    
+    if (stats && numLevels)
+    {
+        uint64_t misses = 0;
+        
+        for (auto& tail : mAsyncTails)
+            misses += tail->getDeadlineMisses();
+        
+        stats->recordLevel(4, ConvolveStats::getTicks() - start, 0, 0);
+        stats->recordBackgroundMisses(misses - mBackgroundMisses);
+        mBackgroundMisses = misses;
+    }
+    
+    // Once a job has been issued with this set it must remain protected until the job has completed
+    
+    if (async->getJobPartition() == set->mPart4.get())
+        mPartitions.protect(BACKGROUND_SLOT + background, set);
+    
+    return accumulate;
 }
 
-template<class T>
-void processAndSum(T *obj, const float *in, float *temp, float *out, uintptr_t numSamples, bool accumulate)
+template <class T>
+void HISSTools::MonoConvolveT<T>::processFade(PartitionSet *set, const T *in, T *temp, T *out, uintptr_t numSamples, bool accumulate)
 {
-    if (obj && obj->process(in, accumulate ? temp : out, numSamples) && accumulate)
+    T *newOut = mFadeBuffers.data();
+    T *oldOut = newOut + FADE_CHUNK_SIZE;
+    T *dropOut = oldOut + FADE_CHUNK_SIZE;
+    T *removeOut = dropOut + FADE_CHUNK_SIZE;
+    T *removeDropOut = removeOut + FADE_CHUNK_SIZE;
+    
+    const T fadeMul = T(1) / static_cast<T>(mFadeTotal);
+    const T dropMul = T(1) / static_cast<T>(DROP_LENGTH);
+    const T removeMul = mRemoving ? T(1) / static_cast<T>(mRemoveTotal) : T(0);
+    const uint32_t fadeLevels = mFadeLevels.load(std::memory_order_relaxed);
+    
+    // Process the sets in chunks and crossfade linearly
+    
+    while (numSamples && mFading)
     {
-        if ((numSamples % 4) || isUnaligned(out) || isUnaligned(temp))
-            sum(temp, out, numSamples);
-        else
-            sum(reinterpret_cast<FloatVector *>(temp), reinterpret_cast<FloatVector *>(out), numSamples / FloatVector::size);
+        uintptr_t loopSize = std::min(std::min(numSamples, uintptr_t(FADE_CHUNK_SIZE)), mFadeTotal - mFadePosition);
+        
+        // Levels of the previous set beyond the limit are ramped out at the start of the fade (in chunks that end with the ramp)
+        
+        bool dropping = fadeLevels < MAX_LEVELS && mDropPosition < DROP_LENGTH;
+        bool removing = mRemoving != nullptr;
+        
+        if (dropping)
+            loopSize = std::min(loopSize, DROP_LENGTH - mDropPosition);
+        
+        if (removing)
+            loopSize = std::min(loopSize, mRemoveTotal - mRemovePosition);
+        
+        std::fill_n(newOut, loopSize, T(0));
+        std::fill_n(oldOut, loopSize, T(0));
+        std::fill_n(dropOut, loopSize, T(0));
+        
+        processSet(set, in, temp, newOut, loopSize, true, MAX_LEVELS, mActiveBackground);
+        processSet(mFading, in, temp, oldOut, loopSize, true, fadeLevels, mFadeBackground, dropping ? dropOut : nullptr);
+        
+        if (removing)
+        {
+            std::fill_n(removeOut, loopSize, T(0));
+            std::fill_n(removeDropOut, loopSize, T(0));
+            
+            processSet(mRemoving, in, temp, removeOut, loopSize, true, mRemoveLevels, mRemoveBackground, mRemoveDropGain > T(0) ? removeDropOut : nullptr);
+        }
+        
+        for (uintptr_t i = 0; i < loopSize; i++)
+        {
+            T gain = static_cast<T>(mFadePosition + i) * fadeMul;
+            T dropGain = T(1) - static_cast<T>(mDropPosition + i) * dropMul;
+            T previous = mFadeGain * (dropping ? oldOut[i] + dropGain * dropOut[i] : oldOut[i]);
+            T value = previous + gain * (newOut[i] - previous);
+            
+            if (removing)
+            {
+                T removeGain = mRemoveGain * (T(1) - static_cast<T>(mRemovePosition + i) * removeMul);
+                value += removeGain * (removeOut[i] + mRemoveDropGain * removeDropOut[i]);
+            }
+            
+            out[i] = accumulate ? out[i] + value : value;
+        }
+        
+        // Updates
+        
+        in += loopSize;
+        out += loopSize;
+        numSamples -= loopSize;
+        mFadePosition += loopSize;
+        mDropPosition += dropping ? loopSize : 0;
+        mRemovePosition += removing ? loopSize : 0;
+        
+        if (removing && mRemovePosition == mRemoveTotal)
+            endRemove();
+        
+        if (mFadePosition == mFadeTotal)
+            endFade();
     }
+    
+    // Process any remaining samples normally
+    
+    if (numSamples)
+        processSet(set, in, temp, out, numSamples, accumulate, MAX_LEVELS, mActiveBackground);
+}
+
+template <class T>
+void HISSTools::MonoConvolveT<T>::startFade(PartitionSet *set, T gain)
+{
+    mFading = set;
+    mFadeGain = gain;
+    mDropPosition = 0;
+    mFadeBackground = mActiveBackground;
+    mPartitions.protect(2, mFading);
 }
 
-void HISSTools::MonoConvolve::process(const float *in, float *temp, float *out, uintptr_t numSamples, bool accumulate)
+template <class T>
+void HISSTools::MonoConvolveT<T>::startRemove(PartitionSet *set, T gain, uint32_t numLevels, T dropGain, uint32_t background, uintptr_t fadeLength)
 {
-    PartPtr part4 = mPart4.attempt();
+    // N.B. the ramp ends no later than the new fade so that the fade always completes with the set removed
+    
+    mRemoving = set;
+    mRemoveGain = gain;
+    mRemoveDropGain = dropGain;
+    mRemoveLevels = numLevels;
+    mRemovePosition = 0;
+    mRemoveTotal = std::min(DROP_LENGTH, fadeLength);
+    mRemoveBackground = background;
+    mPartitions.protect(3, mRemoving);
+}
+
+template <class T>
+void HISSTools::MonoConvolveT<T>::endFade()
+{
+    endRemove();
+    mFading = nullptr;
+    mPartitions.protect(2, nullptr);
+}
+
+template <class T>
+void HISSTools::MonoConvolveT<T>::endRemove()
+{
+    mRemoving = nullptr;
+    mPartitions.protect(3, nullptr);
+}
+
+template <class T>
+uint32_t HISSTools::MonoConvolveT<T>::freeBackground() const
+{
+    for (uint32_t i = 0; i < NUM_BACKGROUND - 1; i++)
+        if (!(mFading && i == mFadeBackground) && !(mRemoving && i == mRemoveBackground))
+            return i;
+    
+    return NUM_BACKGROUND - 1;
+}
+
+template <class T>
+void HISSTools::MonoConvolveT<T>::releaseBackground()
+{
+    // A background partition no longer in use keeps its set protected until its last job has completed
+    
+    for (uint32_t i = 0; i < NUM_BACKGROUND; i++)
+    {
+        if (i == mActiveBackground || (mFading && i == mFadeBackground) || (mRemoving && i == mRemoveBackground))
+            continue;
         
-    if (mLength && mLength <= part4.getSize())
+        if (!mAsyncTails[i]->isJobPending())
+            mPartitions.protect(BACKGROUND_SLOT + i, nullptr);
+    }
+}
+
+template <class T>
+void HISSTools::MonoConvolveT<T>::process(const T *in, T *temp, T *out, uintptr_t numSamples, bool accumulate)
+{
+    ConvolveStats *stats = mStats.load(std::memory_order_relaxed);
+    uint64_t start = stats ? ConvolveStats::getTicks() : 0;
+    
+    // Keep the previous set protected whilst acquiring, in case it needs to be faded out
+    
+    mPartitions.protect(1, mActive);
+    
+    PartitionSet *set = mPartitions.acquire();
+    
+    // A new set either fades in from the previous one or starts from silence
+    // N.B. unless resetting a new set waits whilst another is being ramped out (for no more than the ramp)
+    
+    if (set != mActive && (!mRemoving || mReset))
     {
-        if (mReset)
+        uintptr_t fadeLength = mFadeLength.load(std::memory_order_relaxed);
+        
+        if (fadeLength && mActive && mActive->mLength && !mReset)
         {
-            resetPart(mTime1.get());
-            resetPart(mPart1.get());
-            resetPart(mPart2.get());
-            resetPart(mPart3.get());
-            resetPart(part4.get());
-            mReset = false;
+            if (mFading)
+            {
+                // Part way through a fade the louder set fades out and the other is ramped out, both from their current gains
+            
+                const uint32_t fadeLevels = mFadeLevels.load(std::memory_order_relaxed);
+                
+                T activeGain = static_cast<T>(mFadePosition) / static_cast<T>(mFadeTotal);
+                T fadeGain = (T(1) - activeGain) * mFadeGain;
+                
+                if (activeGain >= fadeGain)
+                {
+                    bool dropping = fadeLevels < MAX_LEVELS && mDropPosition < DROP_LENGTH;
+                    T dropGain = dropping ? T(1) - static_cast<T>(mDropPosition) / static_cast<T>(DROP_LENGTH) : T(0);
+                    
+                    startRemove(mFading, fadeGain, fadeLevels, dropGain, mFadeBackground, fadeLength);
+                    startFade(mActive, activeGain);
+                }
+                else
+                {
+                    startRemove(mActive, activeGain, MAX_LEVELS, T(0), mActiveBackground, fadeLength);
+                    mFadeGain = fadeGain;
+                }
+            }
+            else
+                startFade(mActive, T(1));
+            
+            mActiveBackground = freeBackground();
+            mFadePosition = 0;
+            mFadeTotal = fadeLength;
         }
+        else
+            endFade();
         
-        processAndSum(mTime1.get(), in, temp, out, numSamples, accumulate);
-        processAndSum(mPart1.get(), in, temp, out, numSamples, accumulate || mTime1);
-        processAndSum(mPart2.get(), in, temp, out, numSamples, accumulate || mPart1);
-        processAndSum(mPart3.get(), in, temp, out, numSamples, accumulate || mPart2);
-        processAndSum(part4.get(), in, temp, out, numSamples, accumulate || mPart3);
+        mActive = set;
+        mReset = true;
+    }
+    else if (mReset)
+        endFade();
+    
+    if (mReset)
+    {
+        if (mActive->mLength)
+            resetSet(mActive);
+        mReset = false;
     }
+    
+    if (mFading)
+        processFade(mActive, in, temp, out, numSamples, accumulate);
+    else
+        processSet(mActive, in, temp, out, numSamples, accumulate, MAX_LEVELS, mActiveBackground);
+    
+    if (mAsync)
+        releaseBackground();
+    
+    if (stats && mRecordBlocks.load(std::memory_order_relaxed))
+        stats->recordBlock(ConvolveStats::getTicks() - start, numSamples);
 }
 
-void HISSTools::MonoConvolve::setPartitions(uintptr_t maxLength, bool zeroLatency, uint32_t A, uint32_t B, uint32_t C, uint32_t D)
+template <class T>
+void HISSTools::MonoConvolveT<T>::setPartitions(uintptr_t maxLength, bool zeroLatency, uint32_t A, uint32_t B, uint32_t C, uint32_t D)
 {
     // Utilities
     
@@ -212,14 +946,10 @@ void HISSTools::MonoConvolve::setPartitions(uintptr_t maxLength, bool zeroLatenc
             throw std::runtime_error("invalid FFT size or order");
     };
     
-    auto createPart = [](PartUniquePtr& obj, uint32_t& offset, uint32_t size, uint32_t next)
-    {
-        obj.reset(new PartitionedConvolve(size, (next - size) >> 1, offset, (next - size) >> 1));
-        offset += (next - size) >> 1;
-    };
-    
     // Sanity checks
     
+    mSizes.clear();
+    
     checkAndStoreFFTSize(A, 0);
     checkAndStoreFFTSize(B, A);
     checkAndStoreFFTSize(C, B);
@@ -228,31 +958,32 @@ void HISSTools::MonoConvolve::setPartitions(uintptr_t maxLength, bool zeroLatenc
     if (!numSizes())
         throw std::runtime_error("no valid FFT sizes given");
     
+    if (mAsync && numSizes() < 2)
+        throw std::runtime_error("background processing requires at least two FFT sizes");
+    
     // Lock to ensure we have exclusive access
     
-    PartPtr part4 = mPart4.access();
-
-    uint32_t offset = zeroLatency ? mSizes[0] >> 1 : 0;
+    mLock.acquire();
+    
     uint32_t largestSize = mSizes[numSizes() - 1];
-        
-    // Allocate paritions in unique pointers
-        
-    if (zeroLatency) mTime1.reset(new TimeDomainConvolve(0, mSizes[0] >> 1));
-    if (numSizes() == 4) createPart(mPart1, offset, mSizes[0], mSizes[1]);
-    if (numSizes() > 2) createPart(mPart2, offset, mSizes[numSizes() - 3], mSizes[numSizes() - 2]);
-    if (numSizes() > 1) createPart(mPart3, offset, mSizes[numSizes() - 2], mSizes[numSizes() - 1]);
-       
-    // Allocate the final resizeable partition
-        
-    mAllocator = [offset, largestSize](uintptr_t size)
-    {
-        return new HISSTools::PartitionedConvolve(largestSize, std::max(size, uintptr_t(largestSize)) - offset, offset, 0);
-    };
-       
-    part4.equal(mAllocator, largeFree, maxLength);
     
-    // Set offsets
+    mZeroLatency = zeroLatency;
+    mAsyncDelay = mAsync ? largestSize : 0;
+    
+    for (auto& async : mAsyncTails)
+        async.reset(mAsync ? new AsyncPartitionedConvolve<T>(largestSize >> 1, mAllocator) : nullptr);
+    
+    mRandDistribution = std::uniform_int_distribution<uintptr_t>(0, (largestSize >> 1) - 1);
+    mResetOffset = mRandDistribution(mRandGenerator);
     
-    mRandDistribution = std::uniform_int_distribution<uintptr_t>(0, (mSizes.back() >> 1) - 1);
-    setResetOffset(part4);
+    // Create an empty set
+    
+    mPartitions.publish(createSet(maxLength));
+    
+    mLock.release();
 }
+
+// Explicit instantiations
+
+template class HISSTools::MonoConvolveT<float>;
+template class HISSTools::MonoConvolveT<double>;
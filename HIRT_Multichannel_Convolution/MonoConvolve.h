@@ -2,10 +2,18 @@
 #pragma once
 
 #include "PartitionedConvolve.h"
+#include "AsyncPartitionedConvolve.h"
 #include "TimeDomainConvolve.h"
+#include "MultirateConvolve.h"
 #include "ConvolveErrors.h"
-#include "MemorySwap.h"
+#include "ConvolveAllocator.h"
+#include "ConvolveStats.h"
+#include "AtomicSwap.h"
+#include "PartitionOptimizer.h"
 
+#include "../ThreadLocks.hpp"
+
+#include <atomic>
 #include <cstdint>
 #include <memory>
 #include <random>
@@ -20,58 +28,257 @@ enum LatencyMode
 
 namespace HISSTools
 {
-    class MonoConvolve
+    template <class T>
+    class MonoConvolveT
     {
-        typedef MemorySwap<HISSTools::PartitionedConvolve>::Ptr PartPtr;
-        typedef std::unique_ptr<HISSTools::PartitionedConvolve> PartUniquePtr;
+        typedef std::unique_ptr<HISSTools::PartitionedConvolveT<T>> PartUniquePtr;
+        
+        // A complete set of partitions for one impulse (replaced as a whole when the impulse changes)
+        
+        struct PartitionSet
+        {
+            std::unique_ptr<TimeDomainConvolveT<T>> mTime1;
+            PartUniquePtr mPart1;
+            PartUniquePtr mPart2;
+            PartUniquePtr mPart3;
+            PartUniquePtr mPart4;
+            std::unique_ptr<MultirateConvolve<T>> mTail;
+            
+            uintptr_t mSize = 0;
+            uintptr_t mLength = 0;
+        };
 
     public:
         
-        MonoConvolve(uintptr_t maxLength, LatencyMode latency);
-        MonoConvolve(uintptr_t maxLength, bool zeroLatency, uint32_t A, uint32_t B = 0, uint32_t C = 0, uint32_t D = 0);
+        // If asyncTail is set the largest partition is processed on a background thread
+        // This removes the largest FFTs from the audio thread, at the cost of longer partitions in the previous size
+        // All buffers are taken from the allocator (or the system if it is null), which may be shared between objects (see ConvolveArena)
+        
+        MonoConvolveT(uintptr_t maxLength, LatencyMode latency, bool asyncTail = false, AllocatorPtr allocator = nullptr);
+        MonoConvolveT(uintptr_t maxLength, bool zeroLatency, uint32_t A, uint32_t B = 0, uint32_t C = 0, uint32_t D = 0, AllocatorPtr allocator = nullptr);
+        MonoConvolveT(uintptr_t maxLength, const PartitionScheme& scheme, AllocatorPtr allocator = nullptr);
         
         // Moveable but not copyable
         
-        MonoConvolve(MonoConvolve& obj) = delete;
-        MonoConvolve& operator = (MonoConvolve& obj) = delete;
-        MonoConvolve(MonoConvolve&& obj);
-        MonoConvolve& operator = (MonoConvolve&& obj);
+        MonoConvolveT(MonoConvolveT& obj) = delete;
+        MonoConvolveT& operator = (MonoConvolveT& obj) = delete;
+        MonoConvolveT(MonoConvolveT&& obj);
+        MonoConvolveT& operator = (MonoConvolveT&& obj);
         
         void setResetOffset(intptr_t offset = -1);
-
+        
+        // If a fade length is set a new impulse is crossfaded with the previous one rather than starting from silence
+        // During a fade only the first fadeLevels levels of the previous impulse are processed (shortest first) to cap the cost
+        // The other levels of the previous impulse are ramped out over the start of the fade (rather than stopping abruptly)
+        // The levels are the time domain head (if zero latency) and then each partition size (five levels at most)
+        // N.B. a background final partition always serves the new impulse so it stops for the previous one when a fade starts
+        
+        void setCrossfade(uintptr_t fadeLength, uint32_t fadeLevels = MAX_LEVELS);
+        
+        // Partitions at or below the threshold RMS level are skipped when the next impulse is set (see PartitionedConvolve)
+        
+        void setSilenceThreshold(double threshold, bool trimTail = false);
+        
+        // If set the final (largest) partition size stores its impulse spectrum as bfloat16 from the next set (see PartitionedConvolve)
+        // The final partitions hold most of a long impulse, so this nearly halves the memory and bandwidth whilst keeping the start accurate
+        
+        void setHalfPrecisionTail(bool halfPrecision);
+        
+        // If set the ffts of the final partition size are spread over each hop from the next set (see PartitionedConvolve)
+        // This flattens the worst-case cost of a block, at the cost of longer partitions in the previous size
+        // N.B. this has no effect with a background final partition (or a single partition size)
+        
+        void setDistributedTail(bool distributed);
+        
+        // If set the hop phases of all partition sizes are assigned by the PhaseScheduler from the next set (replacing the reset offset)
+        // N.B. a background final partition is not scheduled as it is not processed in the audio thread
+        
+        void setScheduled(bool scheduled);
+        
+        // If a start is set the impulse from there is convolved at a sample rate reduced by factor from the next set (see MultirateConvolve)
+        // Only content below roughly 80% of the reduced nyquist is kept, so this suits long reverb tails which have little high frequency energy
+        // The start is rounded up to a whole number of the largest partitions (and no earlier than needed) and its cost is recorded with the final level
+        // N.B. a start of zero (or a factor below two) disables the multirate tail
+        
+        void setMultirateTail(uintptr_t start, uint32_t factor = 2);
+        
+        // If a stats object is set the cost of each level is recorded in it (and each block unless recordBlocks is false)
+        // A level is recorded each time it is processed (so twice in a block whilst crossfading)
+        // N.B. the stats object must remain valid until it is replaced (it may be shared between objects and threads)
+        
+        void setStats(ConvolveStats *stats, bool recordBlocks = true);
+        
+        // Staged loading of an impulse (set() performs all stages in the calling thread)
+        // prepare() returns a loader for a new set which is swapped in by publish() without blocking the audio thread
+        // Loading can be done in chunks and from any number of threads (the input must remain valid until loading is complete)
+        // N.B. a loader must be published to the object that prepared it (and any remaining loading is completed first)
+        
+        class Loader
+        {
+            friend class MonoConvolveT;
+        
+        public:
+            
+            // Load up to numPartitions further partitions (returns true once there are no more to start)
+            
+            bool load(uintptr_t numPartitions);
+            
+            // Load all remaining partitions using the calling thread and (numThreads - 1) additional threads
+            
+            void loadAll(uint32_t numThreads = 1);
+            
+            double getProgress() const;
+            bool isComplete() const { return mPartitionsDone.load(std::memory_order_acquire) == mTasks.size(); }
+        
+        private:
+            
+            struct Task
+            {
+                PartitionedConvolveT<T> *mPart;
+                uintptr_t mOffset;
+                uintptr_t mPartition;
+            };
+            
+            Loader() : mFloatInput(nullptr), mDoubleInput(nullptr), mLength(0), mTailOffset(0), mError(CONVOLVE_ERR_NONE), mNextPartition(0), mPartitionsDone(0) {}
+            
+            void setInput(const float *input)   { mFloatInput = input; }
+            void setInput(const double *input)  { mDoubleInput = input; }
+            
+            template <class U>
+            void loadTask(const U *input, const Task& task);
+            
+            std::unique_ptr<PartitionSet> mSet;
+            std::vector<Task> mTasks;
+            
+            const float *mFloatInput;
+            const double *mDoubleInput;
+            uintptr_t mLength;
+            uintptr_t mTailOffset;
+            ConvolveError mError;
+            
+            std::atomic<uintptr_t> mNextPartition;
+            std::atomic<uintptr_t> mPartitionsDone;
+        };
+        
+        // A null loader is returned if memory cannot be allocated
+        
+        std::unique_ptr<Loader> prepare(const float *input, uintptr_t length, bool requestResize);
+        std::unique_ptr<Loader> prepare(const double *input, uintptr_t length, bool requestResize);
+        ConvolveError publish(std::unique_ptr<Loader> loader);
+        
+        // New impulses are prepared in the calling thread and then swapped in without blocking the audio thread
+        
         ConvolveError resize(uintptr_t length);
         ConvolveError set(const float *input, uintptr_t length, bool requestResize);
+        ConvolveError set(const double *input, uintptr_t length, bool requestResize);
         ConvolveError reset();
         
-        void process(const float *in, float *temp, float *out, uintptr_t numSamples, bool accumulate = false);
+        void process(const T *in, T *temp, T *out, uintptr_t numSamples, bool accumulate = false);
         
         void setPartitions(uintptr_t maxLength, bool zeroLatency, uint32_t A, uint32_t B = 0, uint32_t C = 0, uint32_t D = 0);
 
     private:
 
-        void setResetOffset(PartPtr &part4, intptr_t offset = -1);
-
+        PartitionSet *createSet(uintptr_t size);
+        
+        template <class U>
+        std::unique_ptr<Loader> prepareImpulse(const U *input, uintptr_t length, bool requestResize);
+        void applyResetOffset(PartitionSet *set);
+        
+        void resetSet(PartitionSet *set);
+        void processSet(PartitionSet *set, const T *in, T *temp, T *out, uintptr_t numSamples, bool accumulate, uint32_t numLevels, uint32_t background, T *dropOut = nullptr);
+        bool processBackground(PartitionSet *set, uint32_t background, uint32_t numLevels, const T *in, T *temp, T *out, T *dropOut, uintptr_t numSamples, bool accumulate, ConvolveStats *stats);
+        void processFade(PartitionSet *set, const T *in, T *temp, T *out, uintptr_t numSamples, bool accumulate);
+        void startFade(PartitionSet *set, T gain);
+        void startRemove(PartitionSet *set, T gain, uint32_t numLevels, T dropGain, uint32_t background, uintptr_t fadeLength);
+        void endFade();
+        void endRemove();
+        
+        uint32_t freeBackground() const;
+        void releaseBackground();
+        
         size_t numSizes() { return mSizes.size(); }
         
-        MemorySwap<PartitionedConvolve>::AllocFunc mAllocator;
-
+        bool isDistributedTail() { return mDistributedTail && !mAsync && numSizes() > 1; }
+        uintptr_t getTailDelay() { return isDistributedTail() ? mSizes[numSizes() - 1] >> 1 : mAsyncDelay; }
+        
         std::vector<uint32_t> mSizes;
+        bool mZeroLatency;
+        
+        AllocatorPtr mAllocator;
+        
+        // The audio thread protects the set in use (slot 0) and keeps the previous set for one more block (slot 1)
+        // Sets being faded out (slot 2) or ramped out (slot 3) and those used by the background threads (slots 4-6) are also protected
+        
+        static constexpr uint32_t NUM_BACKGROUND = 3;
+        static constexpr uint32_t BACKGROUND_SLOT = 4;
+        
+        AtomicSwap<PartitionSet, BACKGROUND_SLOT + NUM_BACKGROUND> mPartitions;
+        PartitionSet *mActive;
+        
+        // Crossfading (the buffers hold the new and previous outputs of each chunk of a fade and the levels being ramped out)
         
-        std::unique_ptr<TimeDomainConvolve> mTime1;
-        std::unique_ptr<PartitionedConvolve> mPart1;
-        std::unique_ptr<PartitionedConvolve> mPart2;
-        std::unique_ptr<PartitionedConvolve> mPart3;
+        static constexpr uint32_t MAX_LEVELS = 5;
+        static constexpr uintptr_t FADE_CHUNK_SIZE = 256;
+        static constexpr uintptr_t DROP_LENGTH = 1024;
         
-        MemorySwap<PartitionedConvolve> mPart4;
+        std::atomic<uintptr_t> mFadeLength;
+        std::atomic<uint32_t> mFadeLevels;
         
-        uintptr_t mLength;
+        PartitionSet *mFading;
+        T mFadeGain;
+        uintptr_t mFadePosition;
+        uintptr_t mFadeTotal;
+        uintptr_t mDropPosition;
         
-        intptr_t mPart4ResetOffset;
+        // A set replaced part way through a fade is ramped out from its current gain (with any levels still being dropped)
+        
+        PartitionSet *mRemoving;
+        T mRemoveGain;
+        T mRemoveDropGain;
+        uint32_t mRemoveLevels;
+        uintptr_t mRemovePosition;
+        uintptr_t mRemoveTotal;
+        
+        std::vector<T> mFadeBuffers;
+        
+        // Background partitions (one each for the active, fading and removed sets so that each keeps its state)
+        
+        std::unique_ptr<AsyncPartitionedConvolve<T>> mAsyncTails[NUM_BACKGROUND];
+        uint32_t mActiveBackground;
+        uint32_t mFadeBackground;
+        uint32_t mRemoveBackground;
+        
+        uintptr_t mAsyncDelay;
+        
+        intptr_t mResetOffset;
+        bool mAsync;
         bool mReset;
         
+        double mSilenceThreshold;
+        bool mTrimTail;
+        bool mHalfPrecisionTail;
+        bool mDistributedTail;
+        bool mScheduled;
+        
+        uintptr_t mMultirateStart;
+        uint32_t mMultirateFactor;
+        
+        // Instrumentation
+        
+        std::atomic<ConvolveStats *> mStats;
+        std::atomic<bool> mRecordBlocks;
+        uint64_t mBackgroundMisses;
+        
+        // Serialises changes from non-audio threads
+        
+        thread_lock mLock;
+        
         // Random Number Generation
         
         std::default_random_engine mRandGenerator;
         std::uniform_int_distribution<uintptr_t> mRandDistribution;
     };
+    
+    typedef MonoConvolveT<float> MonoConvolve;
 }
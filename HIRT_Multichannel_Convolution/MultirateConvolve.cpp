@@ -0,0 +1,376 @@
+
+/*
+ *  MultirateConvolve
+ *
+ *    MultirateConvolve performs partitioned convolution of the later part of an impulse at a decimated sample rate.
+ *
+ *    The input is decimated by a polyphase anti-alias filter, convolved with a decimated copy of the impulse and interpolated back to the full rate.
+ *    The decimated impulse is the impulse from the offset filtered by the same low-pass filter and advanced to compensate for the delay of all three filters.
+ *    The spectra and ffts of the decimated convolution are smaller by the decimation factor, at the cost of the filters (FILTER_TAPS multiply-adds per sample each).
+ *
+ */
+
+#include "MultirateConvolve.h"
+#include "ConvolveKernels.h"
+
+#include "../WindowFunctions.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <new>
+
+// Polyphase filtering (accumulates the correlation of the input with the reversed filter phase into the output)
+// Several vectors of outputs are calculated together so that the partial sums remain in registers
+
+template <class T, class S = typename T::scalar_type>
+void polyphaseBlock4(const S *in, const S *filter, S *output, uintptr_t L)
+{
+    T outputAccum1 = T::unaligned_load(output + T::size * 0);
+    T outputAccum2 = T::unaligned_load(output + T::size * 1);
+    T outputAccum3 = T::unaligned_load(output + T::size * 2);
+    T outputAccum4 = T::unaligned_load(output + T::size * 3);
+    
+    for (uintptr_t j = 0; j < L; j++, in++)
+    {
+        const T filterValue(filter[j]);
+        
+        outputAccum1 = fmadd(filterValue, T::unaligned_load(in + T::size * 0), outputAccum1);
+        outputAccum2 = fmadd(filterValue, T::unaligned_load(in + T::size * 1), outputAccum2);
+        outputAccum3 = fmadd(filterValue, T::unaligned_load(in + T::size * 2), outputAccum3);
+        outputAccum4 = fmadd(filterValue, T::unaligned_load(in + T::size * 3), outputAccum4);
+    }
+    
+    outputAccum1.unaligned_store(output + T::size * 0);
+    outputAccum2.unaligned_store(output + T::size * 1);
+    outputAccum3.unaligned_store(output + T::size * 2);
+    outputAccum4.unaligned_store(output + T::size * 3);
+}
+
+template <class T, class S = typename T::scalar_type>
+void polyphaseBlock1(const S *in, const S *filter, S *output, uintptr_t L)
+{
+    T outputAccum = T::unaligned_load(output);
+    
+    for (uintptr_t j = 0; j < L; j++, in++)
+        outputAccum = fmadd(T(filter[j]), T::unaligned_load(in), outputAccum);
+    
+    outputAccum.unaligned_store(output);
+}
+
+template <class T>
+void polyphaseFilter(const T *in, const T *filter, T *output, uintptr_t N, uintptr_t L)
+{
+    typedef WideVector<T> VecType;
+    
+    constexpr uintptr_t size = VecType::size;
+    constexpr uintptr_t blockSize = size * 4;
+    
+    uintptr_t i = 0;
+    
+    for (; i + blockSize <= N; i += blockSize)
+        polyphaseBlock4<VecType>(in + i, filter, output + i, L);
+    
+    for (; i + size <= N; i += size)
+        polyphaseBlock1<VecType>(in + i, filter, output + i, L);
+    
+    for (; i < N; i++)
+    {
+        T outputAccum = output[i];
+        
+        for (uintptr_t j = 0; j < L; j++)
+            outputAccum += filter[j] * in[i + j];
+        
+        output[i] = outputAccum;
+    }
+}
+
+template <class T>
+HISSTools::MultirateConvolve<T>::MultirateConvolve(uint32_t factor, uintptr_t FFTSize, uintptr_t maxLength, uintptr_t offset, uintptr_t latency, AllocatorPtr allocator)
+: mFactor(getFactor(factor, FFTSize))
+, mFFTSize(FFTSize)
+, mOffset(std::max(offset, getMinOffset(factor, FFTSize)))
+, mLatency(latency)
+, mAllocator(ConvolveAllocator::select(allocator))
+, mPhase(0)
+, mHasImpulse(false)
+, mReset(true)
+{
+    constexpr double kaiserBeta = 8.0;
+    constexpr double pi = 3.14159265358979323846;
+    
+    uintptr_t filterLength = getFilterLength();
+    uintptr_t delay = getFilterDelay();
+    uintptr_t hopSize = getHopSize() / mFactor;
+    uintptr_t chunkSize = CHUNK_SIZE / mFactor;
+    
+    // The decimated impulse can be no longer than this (see setImpulse())
+    
+    maxLength += mLatency;
+    mMaxLength = std::max(maxLength > delay ? ((maxLength - 1 - delay) / mFactor) + 1 : 0, hopSize);
+    
+    mPart.reset(new PartitionedConvolveT<T>(mFFTSize / mFactor, mMaxLength - hopSize, hopSize, 0, mAllocator));
+    
+    // Allocate the filters and buffers
+    
+    mFilter = mAllocator->allocate<double>(filterLength);
+    mPhaseFilters = mAllocator->allocate<T>(mFactor * FILTER_TAPS);
+    mImpulseBuffer = mAllocator->allocate<T>(mMaxLength);
+    mInputBuffer = mAllocator->allocate<T>(filterLength + CHUNK_SIZE + (chunkSize * 4) + (FILTER_TAPS * 2));
+    
+    // N.B. the destructor is not called if construction fails, so free any buffer that was allocated
+    
+    if (!mFilter || !mPhaseFilters || !mImpulseBuffer || !mInputBuffer)
+    {
+        freeBuffers();
+        throw std::bad_alloc();
+    }
+    mPhaseBuffer = mInputBuffer + filterLength + CHUNK_SIZE;
+    mDecimatedInput = mPhaseBuffer + chunkSize + FILTER_TAPS;
+    mDecimatedOutput = mDecimatedInput + chunkSize;
+    mTempBuffer = mDecimatedOutput + chunkSize + FILTER_TAPS;
+    
+    std::fill_n(mImpulseBuffer, mMaxLength, T(0));
+    
+    // Design a kaiser windowed sinc filter with a cutoff at the decimated nyquist (normalised for unity gain at DC)
+    
+    window_functions::kaiser(mFilter, static_cast<uint32_t>(filterLength - 1), 0, static_cast<uint32_t>(filterLength), window_functions::params(kaiserBeta));
+    
+    double sum = 0.0;
+    
+    for (uintptr_t i = 0; i < filterLength; i++)
+    {
+        double x = (static_cast<double>(i) - static_cast<double>(delay)) / mFactor;
+        
+        mFilter[i] *= x ? std::sin(pi * x) / (pi * x) : 1.0;
+        sum += mFilter[i];
+    }
+    
+    for (uintptr_t i = 0; i < filterLength; i++)
+        mFilter[i] /= sum;
+    
+    // Split the filter into phases (each reversed for correlation, with the filter padded to a whole number of taps per phase)
+    
+    for (uintptr_t i = 0; i < mFactor; i++)
+    {
+        for (uintptr_t j = 0; j < FILTER_TAPS; j++)
+        {
+            uintptr_t tap = ((FILTER_TAPS - 1 - j) * mFactor) + i;
+            mPhaseFilters[i * FILTER_TAPS + j] = tap < filterLength ? static_cast<T>(mFilter[tap]) : T(0);
+        }
+    }
+}
+
+template <class T>
+HISSTools::MultirateConvolve<T>::~MultirateConvolve()
+{
+    freeBuffers();
+}
+
+template <class T>
+void HISSTools::MultirateConvolve<T>::freeBuffers()
+{
+    mAllocator->deallocate(mFilter);
+    mAllocator->deallocate(mPhaseFilters);
+    mAllocator->deallocate(mImpulseBuffer);
+    mAllocator->deallocate(mInputBuffer);
+}
+
+template <class T>
+uint32_t HISSTools::MultirateConvolve<T>::getFactor(uint32_t factor, uintptr_t FFTSize)
+{
+    uint32_t result = 1;
+    
+    while ((result << 1) <= std::min(factor, uint32_t(MAX_FACTOR)) && (FFTSize / (result << 1)) >= 32)
+        result <<= 1;
+    
+    return result;
+}
+
+template <class T>
+uintptr_t HISSTools::MultirateConvolve<T>::getMinOffset(uint32_t factor, uintptr_t FFTSize)
+{
+    // The decimated convolution has the latency of a hop, and the three filters together reach a further three times their delay ahead
+    
+    uintptr_t delay = ((getFactor(factor, FFTSize) * FILTER_TAPS) - 2) >> 1;
+    
+    return (delay * 3) + (FFTSize >> 1);
+}
+
+template <class T>
+void HISSTools::MultirateConvolve<T>::setResetOffset(intptr_t offset)
+{
+    mPart->setResetOffset(offset < 0 ? offset : offset / mFactor);
+}
+
+template <class T>
+void HISSTools::MultirateConvolve<T>::setSilenceThreshold(double threshold, bool trimTail)
+{
+    mPart->setSilenceThreshold(threshold, trimTail);
+}
+
+template <class T>
+void HISSTools::MultirateConvolve<T>::setHalfPrecision(bool halfPrecision)
+{
+    mPart->setHalfPrecision(halfPrecision);
+}
+
+template <class T>
+ConvolveError HISSTools::MultirateConvolve<T>::set(const float *input, uintptr_t length)
+{
+    return setImpulse(input, length);
+}
+
+template <class T>
+ConvolveError HISSTools::MultirateConvolve<T>::set(const double *input, uintptr_t length)
+{
+    return setImpulse(input, length);
+}
+
+template <class T>
+template <class U>
+ConvolveError HISSTools::MultirateConvolve<T>::setImpulse(const U *input, uintptr_t length)
+{
+    ConvolveError error = CONVOLVE_ERR_NONE;
+    
+    intptr_t filterLength = static_cast<intptr_t>(getFilterLength());
+    intptr_t delay = static_cast<intptr_t>(getFilterDelay());
+    uintptr_t hopSize = getHopSize() / mFactor;
+    
+    // The impulse is scaled by the factor squared (once as it is decimated and once for the gain lost when interpolating)
+    
+    double gain = static_cast<double>(mFactor * mFactor);
+    
+    length = input ? length : 0;
+    
+    // Calculate the decimated length (after which the filtered impulse is zero)
+    
+    uintptr_t decimatedLength = length > mOffset ? ((length + mLatency - 1 - delay) / mFactor) + 1 : 0;
+    
+    if (decimatedLength > mMaxLength)
+    {
+        decimatedLength = mMaxLength;
+        error = CONVOLVE_ERR_MEM_ALLOC_TOO_SMALL;
+    }
+    
+    // Filter and decimate the impulse from the offset (each sample is taken three filter delays ahead, less any latency)
+    // The samples before the hop are never read, as the decimated convolution has the latency of a hop
+    
+    for (uintptr_t i = hopSize; i < decimatedLength; i++)
+    {
+        intptr_t position = static_cast<intptr_t>(i * mFactor) + (delay * 3) - static_cast<intptr_t>(mLatency);
+        intptr_t from = std::max(intptr_t(0), position - static_cast<intptr_t>(length - 1));
+        intptr_t to = std::min(filterLength - 1, position - static_cast<intptr_t>(mOffset));
+        
+        double sum = 0.0;
+        
+        for (intptr_t j = from; j <= to; j++)
+            sum += mFilter[j] * static_cast<double>(input[position - j]);
+        
+        mImpulseBuffer[i] = static_cast<T>(sum * gain);
+    }
+    
+    ConvolveError partError = mPart->set(mImpulseBuffer, decimatedLength);
+    
+    mHasImpulse = decimatedLength > hopSize;
+    reset();
+    
+    return error != CONVOLVE_ERR_NONE ? error : partError;
+}
+
+template <class T>
+void HISSTools::MultirateConvolve<T>::reset()
+{
+    mReset = true;
+}
+
+template <class T>
+void HISSTools::MultirateConvolve<T>::processChunk(const T *in, T *out, uintptr_t numSamples)
+{
+    uintptr_t filterLength = getFilterLength();
+    
+    // The position of the first sample on a decimated sample (and the number of decimated samples)
+    
+    uintptr_t first = (mFactor - mPhase) % mFactor;
+    uintptr_t count = first < numSamples ? ((numSamples - 1 - first) / mFactor) + 1 : 0;
+    
+    // Decimate (each phase of the input is gathered and filtered by the matching phase of the filter)
+    
+    std::copy_n(in, numSamples, mInputBuffer + filterLength);
+    std::fill_n(mDecimatedInput, count, T(0));
+    
+    for (uintptr_t i = 0; i < mFactor && count; i++)
+    {
+        const T *input = mInputBuffer + filterLength + first - i - ((FILTER_TAPS - 1) * mFactor);
+        
+        for (uintptr_t j = 0; j < count + FILTER_TAPS - 1; j++)
+            mPhaseBuffer[j] = input[j * mFactor];
+        
+        polyphaseFilter(mPhaseBuffer, mPhaseFilters + (i * FILTER_TAPS), mDecimatedInput, count, FILTER_TAPS);
+    }
+    
+    std::copy(mInputBuffer + numSamples, mInputBuffer + numSamples + filterLength, mInputBuffer);
+    
+    // Convolve at the decimated rate (the output follows the history required for interpolation)
+    
+    T *decimatedOutput = mDecimatedOutput + FILTER_TAPS;
+    
+    if (count && !mPart->process(mDecimatedInput, decimatedOutput, count))
+        std::fill_n(decimatedOutput, count, T(0));
+    
+    // Interpolate (the outputs of each phase are calculated together and then interleaved)
+    
+    for (uintptr_t i = 0; i < mFactor; i++)
+    {
+        uintptr_t start = (i + mFactor - mPhase) % mFactor;
+        
+        if (start >= numSamples)
+            continue;
+        
+        uintptr_t numOutputs = ((numSamples - 1 - start) / mFactor) + 1;
+        uintptr_t position = start >= first ? ((start - first) / mFactor) + 1 : 0;
+        
+        std::fill_n(mTempBuffer, numOutputs, T(0));
+        polyphaseFilter(mDecimatedOutput + position, mPhaseFilters + (i * FILTER_TAPS), mTempBuffer, numOutputs, FILTER_TAPS);
+        
+        for (uintptr_t j = 0; j < numOutputs; j++)
+            out[start + (j * mFactor)] = mTempBuffer[j];
+    }
+    
+    std::copy(mDecimatedOutput + count, mDecimatedOutput + count + FILTER_TAPS, mDecimatedOutput);
+    
+    mPhase = (mPhase + numSamples) % mFactor;
+}
+
+template <class T>
+bool HISSTools::MultirateConvolve<T>::process(const T *in, T *out, uintptr_t numSamples)
+{
+    if (!mHasImpulse)
+        return false;
+    
+    if (mReset)
+    {
+        std::fill_n(mInputBuffer, getFilterLength(), T(0));
+        std::fill_n(mDecimatedOutput, FILTER_TAPS, T(0));
+        mPart->reset();
+        mPhase = 0;
+        mReset = false;
+    }
+    
+    while (numSamples)
+    {
+        uintptr_t loopSize = std::min(numSamples, uintptr_t(CHUNK_SIZE));
+        
+        processChunk(in, out, loopSize);
+        
+        in += loopSize;
+        out += loopSize;
+        numSamples -= loopSize;
+    }
+    
+    return true;
+}
+
+// Explicit instantiations
+
+template class HISSTools::MultirateConvolve<float>;
+template class HISSTools::MultirateConvolve<double>;
@@ -0,0 +1,107 @@
+
+#pragma once
+
+#include "PartitionedConvolve.h"
+#include "ConvolveErrors.h"
+
+#include <cstdint>
+#include <memory>
+
+namespace HISSTools
+{
+    // MultirateConvolve convolves the part of an impulse from a given offset at a decimated sample rate
+    // The input is decimated and the output interpolated by polyphase filters, with the decimated impulse low-pass filtered to match
+    // Only content below roughly 80% of the decimated nyquist is reproduced, so this suits the late tails of reverb impulses
+    
+    template <class T>
+    class MultirateConvolve
+    {
+        // The anti-alias filter has FILTER_TAPS taps per phase (one less in total so that it has an integer delay)
+        
+        static constexpr uintptr_t FILTER_TAPS = 32;
+        static constexpr uintptr_t MAX_FACTOR = 8;
+        static constexpr uintptr_t CHUNK_SIZE = 512;
+    
+    public:
+        
+        // The factor is rounded down to a power of two (at most MAX_FACTOR and such that the decimated fft size is at least 32)
+        // FFTSize is the size at the full rate, so the decimated partitions span the same time as those of that size would
+        // The output is delayed by latency (to align with the partitions of a convolver that does not have zero latency)
+        // Buffers are taken from the allocator (or the system if it is null)
+        // N.B. the offset is raised to getMinOffset() if necessary so that the decimated convolution (and filters) can be in time
+        
+        MultirateConvolve(uint32_t factor, uintptr_t FFTSize, uintptr_t maxLength, uintptr_t offset, uintptr_t latency = 0, AllocatorPtr allocator = nullptr);
+        ~MultirateConvolve();
+        
+        // Non-moveable and copyable
+        
+        MultirateConvolve(MultirateConvolve& obj) = delete;
+        MultirateConvolve& operator = (MultirateConvolve& obj) = delete;
+        MultirateConvolve(MultirateConvolve&& obj) = delete;
+        MultirateConvolve& operator = (MultirateConvolve&& obj) = delete;
+        
+        static uint32_t getFactor(uint32_t factor, uintptr_t FFTSize);
+        static uintptr_t getMinOffset(uint32_t factor, uintptr_t FFTSize);
+        
+        // The reset offset is given at the full rate (see PartitionedConvolve for the other settings)
+        
+        void setResetOffset(intptr_t offset = -1);
+        void setSilenceThreshold(double threshold, bool trimTail = false);
+        void setHalfPrecision(bool halfPrecision);
+        
+        ConvolveError set(const float *input, uintptr_t length);
+        ConvolveError set(const double *input, uintptr_t length);
+        void reset();
+        
+        bool process(const T *in, T *out, uintptr_t numSamples);
+        
+        // Running counts of the work of the decimated convolution (for instrumentation)
+        
+        uint64_t getFFTCount() const { return mPart->getFFTCount(); }
+        uint64_t getMACCount() const { return mPart->getMACCount(); }
+    
+    private:
+        
+        template <class U>
+        ConvolveError setImpulse(const U *input, uintptr_t length);
+        
+        void processChunk(const T *in, T *out, uintptr_t numSamples);
+        void freeBuffers();
+        
+        uintptr_t getFilterLength() const   { return mFactor * FILTER_TAPS - 1; }
+        uintptr_t getFilterDelay() const    { return (getFilterLength() - 1) >> 1; }
+        uintptr_t getHopSize() const        { return mFFTSize >> 1; }
+        
+        // Parameters
+        
+        uint32_t mFactor;
+        uintptr_t mFFTSize;
+        uintptr_t mOffset;
+        uintptr_t mLatency;
+        uintptr_t mMaxLength;
+        
+        AllocatorPtr mAllocator;
+        
+        // The decimated convolution
+        
+        std::unique_ptr<PartitionedConvolveT<T>> mPart;
+        
+        // Filter (the full filter and its phases each reversed, as used by both the decimator and the interpolator)
+        
+        double *mFilter;
+        T *mPhaseFilters;
+        
+        // Buffers (the input and decimated output keep the history needed by the filters at the start)
+        
+        T *mImpulseBuffer;
+        T *mInputBuffer;
+        T *mPhaseBuffer;
+        T *mDecimatedInput;
+        T *mDecimatedOutput;
+        T *mTempBuffer;
+        
+        uintptr_t mPhase;
+        bool mHasImpulse;
+        bool mReset;
+    };
+}
@@ -1,15 +1,24 @@
 
 #include "NToMonoConvolve.h"
 
-HISSTools::NToMonoConvolve::NToMonoConvolve(uint32_t inChans, uintptr_t maxLength, LatencyMode latency)
+template <class T>
+HISSTools::NToMonoConvolveT<T>::NToMonoConvolveT(uint32_t inChans, uintptr_t maxLength, LatencyMode latency, bool asyncTail, AllocatorPtr allocator)
 :  mNumInChans(inChans)
 {
+    mConvolvers.reserve(mNumInChans);
+    
     for (uint32_t i = 0; i < mNumInChans; i++)
-        mConvolvers.emplace_back(maxLength, latency);
+        mConvolvers.emplace_back(maxLength, latency, asyncTail, allocator);
 }
 
+// Member pointer types for the overloaded set methods
+
+template <class T, class U>
+using SetMethod = ConvolveError (HISSTools::MonoConvolveT<T>::*)(const U *, uintptr_t, bool);
+
+template <class T>
 template<typename Method, typename... Args>
-ConvolveError HISSTools::NToMonoConvolve::doChannel(Method method, uint32_t inChan, Args...args)
+ConvolveError HISSTools::NToMonoConvolveT<T>::doChannel(Method method, uint32_t inChan, Args...args)
 {
     if (inChan < mNumInChans)
         return (mConvolvers[inChan].*method)(args...);
@@ -17,27 +26,112 @@ ConvolveError HISSTools::NToMonoConvolve::doChannel(Method method, uint32_t inCh
         return CONVOLVE_ERR_IN_CHAN_OUT_OF_RANGE;
 }
 
-ConvolveError HISSTools::NToMonoConvolve::resize(uint32_t inChan, uintptr_t impulse_length)
+template <class T>
+ConvolveError HISSTools::NToMonoConvolveT<T>::resize(uint32_t inChan, uintptr_t impulse_length)
+{
+    return doChannel(&MonoConvolveT<T>::resize, inChan, impulse_length);
+}
+
+template <class T>
+ConvolveError HISSTools::NToMonoConvolveT<T>::set(uint32_t inChan, const float *input, uintptr_t impulse_length, bool resize)
+{
+    return doChannel(static_cast<SetMethod<T, float>>(&MonoConvolveT<T>::set), inChan, input, impulse_length, resize);
+}
+
+template <class T>
+ConvolveError HISSTools::NToMonoConvolveT<T>::set(uint32_t inChan, const double *input, uintptr_t impulse_length, bool resize)
+{
+    return doChannel(static_cast<SetMethod<T, double>>(&MonoConvolveT<T>::set), inChan, input, impulse_length, resize);
+}
+
+template <class T>
+std::unique_ptr<typename HISSTools::MonoConvolveT<T>::Loader> HISSTools::NToMonoConvolveT<T>::prepare(uint32_t inChan, const float *input, uintptr_t impulse_length, bool resize)
+{
+    return inChan < mNumInChans ? mConvolvers[inChan].prepare(input, impulse_length, resize) : nullptr;
+}
+
+template <class T>
+std::unique_ptr<typename HISSTools::MonoConvolveT<T>::Loader> HISSTools::NToMonoConvolveT<T>::prepare(uint32_t inChan, const double *input, uintptr_t impulse_length, bool resize)
+{
+    return inChan < mNumInChans ? mConvolvers[inChan].prepare(input, impulse_length, resize) : nullptr;
+}
+
+template <class T>
+ConvolveError HISSTools::NToMonoConvolveT<T>::publish(uint32_t inChan, std::unique_ptr<typename MonoConvolveT<T>::Loader> loader)
+{
+    if (inChan < mNumInChans)
+        return mConvolvers[inChan].publish(std::move(loader));
+    else
+        return CONVOLVE_ERR_IN_CHAN_OUT_OF_RANGE;
+}
+
+template <class T>
+ConvolveError HISSTools::NToMonoConvolveT<T>::reset(uint32_t inChan)
 {
-    return doChannel(&MonoConvolve::resize, inChan, impulse_length);
+    return doChannel(&MonoConvolveT<T>::reset, inChan);
 }
 
-ConvolveError HISSTools::NToMonoConvolve::set(uint32_t inChan, const float *input, uintptr_t impulse_length, bool resize)
+template <class T>
+void HISSTools::NToMonoConvolveT<T>::setCrossfade(uintptr_t fadeLength, uint32_t fadeLevels)
 {
-    return doChannel(&MonoConvolve::set, inChan, input, impulse_length, resize);
+    for (uint32_t i = 0; i < mNumInChans; i++)
+        mConvolvers[i].setCrossfade(fadeLength, fadeLevels);
+}
+
+template <class T>
+void HISSTools::NToMonoConvolveT<T>::setSilenceThreshold(double threshold, bool trimTail)
+{
+    for (uint32_t i = 0; i < mNumInChans; i++)
+        mConvolvers[i].setSilenceThreshold(threshold, trimTail);
+}
+
+template <class T>
+void HISSTools::NToMonoConvolveT<T>::setHalfPrecisionTail(bool halfPrecision)
+{
+    for (uint32_t i = 0; i < mNumInChans; i++)
+        mConvolvers[i].setHalfPrecisionTail(halfPrecision);
+}
+
+template <class T>
+void HISSTools::NToMonoConvolveT<T>::setDistributedTail(bool distributed)
+{
+    for (uint32_t i = 0; i < mNumInChans; i++)
+        mConvolvers[i].setDistributedTail(distributed);
+}
+
+template <class T>
+void HISSTools::NToMonoConvolveT<T>::setScheduled(bool scheduled)
+{
+    for (uint32_t i = 0; i < mNumInChans; i++)
+        mConvolvers[i].setScheduled(scheduled);
+}
+
+template <class T>
+void HISSTools::NToMonoConvolveT<T>::setMultirateTail(uintptr_t start, uint32_t factor)
+{
+    for (uint32_t i = 0; i < mNumInChans; i++)
+        mConvolvers[i].setMultirateTail(start, factor);
 }
 
-ConvolveError HISSTools::NToMonoConvolve::reset(uint32_t inChan)
+template <class T>
+void HISSTools::NToMonoConvolveT<T>::setStats(ConvolveStats *stats, bool recordBlocks)
 {
-    return doChannel(&MonoConvolve::reset, inChan);
+    for (uint32_t i = 0; i < mNumInChans; i++)
+        mConvolvers[i].setStats(stats, recordBlocks);
 }
 
-void HISSTools::NToMonoConvolve::process(const float * const* ins, float *out, float *temp, size_t numSamples, size_t activeInChans)
+template <class T>
+void HISSTools::NToMonoConvolveT<T>::process(const T * const* ins, T *out, T *temp, size_t numSamples, size_t activeInChans)
 {
     // Zero output then convolve
     
-    std::fill_n(out, numSamples, 0.f);
+    std::fill_n(out, numSamples, T(0));
 	
 	for (uint32_t i = 0; i < mNumInChans && i < activeInChans ; i++)
 		mConvolvers[i].process(ins[i], temp, out, numSamples, true);
 }
+
+// Explicit instantiations
+
+template class HISSTools::NToMonoConvolveT<float>;
+template class HISSTools::NToMonoConvolveT<double>;
@@ -6,30 +6,50 @@
 
 #include <algorithm>
 #include <cstdint>
+#include <memory>
 #include <vector>
 
 namespace HISSTools
 {
-    class NToMonoConvolve
+    template <class T>
+    class NToMonoConvolveT
     {
         
     public:
         
-        NToMonoConvolve(uint32_t input_chans, uintptr_t maxLength, LatencyMode latency);
+        NToMonoConvolveT(uint32_t input_chans, uintptr_t maxLength, LatencyMode latency, bool asyncTail = false, AllocatorPtr allocator = nullptr);
         
         ConvolveError resize(uint32_t inChan, uintptr_t impulse_length);
         ConvolveError set(uint32_t inChan, const float *input, uintptr_t impulse_length, bool resize);
+        ConvolveError set(uint32_t inChan, const double *input, uintptr_t impulse_length, bool resize);
+        
+        // Staged loading (a null loader is returned if the channel is out of range or memory cannot be allocated)
+        
+        std::unique_ptr<typename MonoConvolveT<T>::Loader> prepare(uint32_t inChan, const float *input, uintptr_t impulse_length, bool resize);
+        std::unique_ptr<typename MonoConvolveT<T>::Loader> prepare(uint32_t inChan, const double *input, uintptr_t impulse_length, bool resize);
+        ConvolveError publish(uint32_t inChan, std::unique_ptr<typename MonoConvolveT<T>::Loader> loader);
+        
         ConvolveError reset(uint32_t inChan);
         
-        void process(const float * const* ins, float *out, float *temp, size_t numSamples, size_t active_in_chans);
+        void setCrossfade(uintptr_t fadeLength, uint32_t fadeLevels);
+        void setSilenceThreshold(double threshold, bool trimTail);
+        void setHalfPrecisionTail(bool halfPrecision);
+        void setDistributedTail(bool distributed);
+        void setScheduled(bool scheduled);
+        void setMultirateTail(uintptr_t start, uint32_t factor);
+        void setStats(ConvolveStats *stats, bool recordBlocks);
+        
+        void process(const T * const* ins, T *out, T *temp, size_t numSamples, size_t active_in_chans);
         
     private:
         
         template<typename Method, typename... Args>
         ConvolveError doChannel(Method method, uint32_t inChan, Args...args);
         
-        std::vector<MonoConvolve> mConvolvers;
+        std::vector<MonoConvolveT<T>> mConvolvers;
         
         uint32_t mNumInChans;
     };
+    
+    typedef NToMonoConvolveT<float> NToMonoConvolve;
 }
@@ -0,0 +1,385 @@
+
+/*
+ *  PartitionOptimizer
+ *
+ *    PartitionOptimizer chooses the partition sizes for MonoConvolve with the lowest estimated cost.
+ *
+ *    The model is calibrated by timing PartitionedConvolve at each FFT size with two numbers of partitions, giving a cost per hop and a cost per partition.
+ *    The difference is timed over many partitions (with a working set comparable to a long impulse), but is still noisy at small sizes, so each cost is floored by a rate fitted across all sizes.
+ *    The rates are per bin for partitions (a complex multiply-accumulate each) and per n log n for FFTs (and are dominated by the larger sizes).
+ *    Models whose costs do not increase with size are rejected (they are never saved or loaded).
+ *    TimeDomainConvolve is timed at two lengths, giving a cost per sample and a cost per tap.
+ *    The worst case assumes the FFTs of all sizes fall in the same block and so is conservative.
+ *
+ */
+
+#include "PartitionOptimizer.h"
+#include "PartitionedConvolve.h"
+#include "TimeDomainConvolve.h"
+#include "ConvolveSIMD.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+// Timing utility (the best of several runs over a number of samples)
+// The convolver is run for warm-up samples first (partitions are only processed once they have received input)
+
+template <class T>
+double timeProcess(T& convolver, uintptr_t numSamples, uintptr_t warmUpSamples)
+{
+    const uintptr_t blockSize = 256;
+    
+    std::vector<float> input(blockSize);
+    std::vector<float> output(blockSize);
+    
+    std::mt19937 generator(1);
+    std::uniform_real_distribution<float> distribution(-1.f, 1.f);
+    
+    for (auto it = input.begin(); it != input.end(); it++)
+        *it = distribution(generator);
+    
+    double best = std::numeric_limits<double>::infinity();
+    
+    convolver.reset();
+    
+    for (uintptr_t j = 0; j < warmUpSamples; j += blockSize)
+        convolver.process(input.data(), output.data(), blockSize);
+    
+    for (int i = 0; i < 3; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        
+        for (uintptr_t j = 0; j < numSamples; j += blockSize)
+            convolver.process(input.data(), output.data(), blockSize);
+        
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    
+    return best;
+}
+
+HISSTools::PartitionOptimizer::PartitionOptimizer(const char *cachePath)
+{
+    if (!cachePath || !load(cachePath))
+    {
+        if (calibrate() && cachePath)
+            save(cachePath);
+    }
+}
+
+bool HISSTools::PartitionOptimizer::calibrate()
+{
+    for (int i = 0; i < CALIBRATION_ATTEMPTS; i++)
+    {
+        measure();
+    
+        if (isValid())
+            return true;
+    }
+    
+    // Make the costs increase with size so that the model is usable
+    
+    for (int i = 1; i < NUM_SIZES; i++)
+    {
+        mFFTCosts[i] = std::max(mFFTCosts[i], mFFTCosts[i - 1]);
+        mPartitionCosts[i] = std::max(mPartitionCosts[i], mPartitionCosts[i - 1]);
+    }
+    
+    return false;
+}
+
+bool HISSTools::PartitionOptimizer::isValid(const double *FFTCosts, const double *partitionCosts, double timeSampleCost, double timeTapCost)
+{
+    auto positive = [](double cost) { return cost > 0.0 && std::isfinite(cost); };
+    
+    if (!positive(timeSampleCost) || !positive(timeTapCost))
+        return false;
+    
+    for (int i = 0; i < NUM_SIZES; i++)
+    {
+        if (!positive(FFTCosts[i]) || !positive(partitionCosts[i]))
+            return false;
+        
+        if (i && (FFTCosts[i] < FFTCosts[i - 1] || partitionCosts[i] < partitionCosts[i - 1]))
+            return false;
+    }
+    
+    return true;
+}
+
+void HISSTools::PartitionOptimizer::measure()
+{
+    // Many partitions are timed over a realistic working set (so that the partition costs include memory traffic)
+    
+    const uintptr_t minPartitions = 65;
+    const uintptr_t minTaps = uintptr_t(1) << 18;
+    
+    std::vector<float> impulse(std::max(minPartitions << (MAX_SIZE_LOG2 - 1), minTaps + (uintptr_t(1) << MAX_SIZE_LOG2)));
+    
+    std::mt19937 generator(1);
+    std::uniform_real_distribution<float> distribution(-1.f, 1.f);
+    
+    for (auto it = impulse.begin(); it != impulse.end(); it++)
+        *it = distribution(generator);
+    
+    // Partitioned convolution (cost per hop with one partition and with many partitions)
+    
+    double FFTRate = 0.0;
+    double partitionRate = 0.0;
+    double FFTWork = 0.0;
+    double partitionWork = 0.0;
+    
+    for (int i = 0; i < NUM_SIZES; i++)
+    {
+        uintptr_t FFTSize = uintptr_t(1) << (i + MIN_SIZE_LOG2);
+        uintptr_t hopSize = FFTSize >> 1;
+        uintptr_t numSamples = std::max(hopSize * 16, uintptr_t(1) << 16);
+        uintptr_t numPartitions[2] = { 1, std::max(minPartitions, minTaps / hopSize + 1) };
+        double costs[2];
+        
+        for (int j = 0; j < 2; j++)
+        {
+            PartitionedConvolve convolver(FFTSize, numPartitions[j] * hopSize, 0, 0);
+            
+            convolver.setResetOffset(0);
+            convolver.set(impulse.data(), numPartitions[j] * hopSize);
+            costs[j] = timeProcess(convolver, numSamples, (numPartitions[j] + 1) * hopSize) * hopSize / numSamples;
+        }
+        
+        mPartitionCosts[i] = std::max(0.0, (costs[1] - costs[0]) / (numPartitions[1] - numPartitions[0]));
+        mFFTCosts[i] = std::max(0.0, costs[0] - mPartitionCosts[i]);
+        
+        FFTRate += mFFTCosts[i];
+        partitionRate += mPartitionCosts[i];
+        FFTWork += static_cast<double>(FFTSize * (i + MIN_SIZE_LOG2));
+        partitionWork += static_cast<double>(hopSize);
+    }
+    
+    // Floor the costs by the rates fitted across all sizes
+    
+    FFTRate /= FFTWork;
+    partitionRate /= partitionWork;
+    
+    for (int i = 0; i < NUM_SIZES; i++)
+    {
+        uintptr_t FFTSize = uintptr_t(1) << (i + MIN_SIZE_LOG2);
+        
+        mFFTCosts[i] = std::max(mFFTCosts[i], FFTRate * static_cast<double>(FFTSize * (i + MIN_SIZE_LOG2)));
+        mPartitionCosts[i] = std::max(mPartitionCosts[i], partitionRate * static_cast<double>(FFTSize >> 1));
+    }
+    
+    // Time domain convolution (cost per sample at two lengths)
+    
+    const uintptr_t lengths[2] = { 64, 1024 };
+    const uintptr_t numSamples = uintptr_t(1) << 16;
+    double costs[2];
+    
+    for (int j = 0; j < 2; j++)
+    {
+        TimeDomainConvolve convolver(0, lengths[j]);
+        
+        convolver.set(impulse.data(), lengths[j]);
+        costs[j] = timeProcess(convolver, numSamples, lengths[j]) / numSamples;
+    }
+    
+    mTimeTapCost = std::max(0.0, (costs[1] - costs[0]) / (lengths[1] - lengths[0]));
+    mTimeSampleCost = std::max(0.0, costs[0] - mTimeTapCost * lengths[0]);
+}
+
+// Cache files (the SIMD width is stored as a model is only valid for the build that measured it)
+
+bool HISSTools::PartitionOptimizer::load(const char *path)
+{
+    std::ifstream file(path);
+    std::string tag;
+    int version = 0;
+    uintptr_t vectorSize = 0;
+    
+    file >> tag >> version >> vectorSize;
+    
+    if (!file || tag != "HISSTools_PartitionCosts" || version != FILE_VERSION || vectorSize != sizeof(WideFloatVector))
+        return false;
+    
+    double FFTCosts[NUM_SIZES];
+    double partitionCosts[NUM_SIZES];
+    double timeSampleCost, timeTapCost;
+    
+    file >> timeSampleCost >> timeTapCost;
+    
+    for (int i = 0; i < NUM_SIZES; i++)
+    {
+        uintptr_t FFTSize = 0;
+        
+        file >> FFTSize >> FFTCosts[i] >> partitionCosts[i];
+        
+        if (FFTSize != uintptr_t(1) << (i + MIN_SIZE_LOG2))
+            return false;
+    }
+    
+    if (!file || !isValid(FFTCosts, partitionCosts, timeSampleCost, timeTapCost))
+        return false;
+    
+    std::copy_n(FFTCosts, NUM_SIZES, mFFTCosts);
+    std::copy_n(partitionCosts, NUM_SIZES, mPartitionCosts);
+    mTimeSampleCost = timeSampleCost;
+    mTimeTapCost = timeTapCost;
+    
+    return true;
+}
+
+bool HISSTools::PartitionOptimizer::save(const char *path) const
+{
+    if (!isValid())
+        return false;
+    
+    std::ofstream file(path);
+    
+    file << std::setprecision(17);
+    file << "HISSTools_PartitionCosts " << FILE_VERSION << " " << sizeof(WideFloatVector) << "\n";
+    file << mTimeSampleCost << " " << mTimeTapCost << "\n";
+    
+    for (int i = 0; i < NUM_SIZES; i++)
+        file << (uintptr_t(1) << (i + MIN_SIZE_LOG2)) << " " << mFFTCosts[i] << " " << mPartitionCosts[i] << "\n";
+    
+    file.flush();
+    
+    return static_cast<bool>(file);
+}
+
+// Optimisation
+
+HISSTools::PartitionScheme HISSTools::PartitionOptimizer::optimize(uintptr_t length, uintptr_t blockSize, uintptr_t maxLatency, double worstWeight) const
+{
+    PartitionScheme best;
+    double bestCost = std::numeric_limits<double>::infinity();
+    
+    worstWeight = std::min(1.0, std::max(0.0, worstWeight));
+    
+    // Try every increasing set of up to four sizes with and without a time domain head
+    
+    for (uint32_t mask = 1; mask < (1U << NUM_SIZES); mask++)
+    {
+        uint32_t sizes[4] = { 0, 0, 0, 0 };
+        int numSizes = 0;
+        
+        for (int i = 0; i < NUM_SIZES; i++)
+        {
+            if (mask & (1U << i))
+            {
+                if (numSizes < 4)
+                    sizes[numSizes] = 1U << (i + MIN_SIZE_LOG2);
+                numSizes++;
+            }
+        }
+        
+        if (numSizes > 4)
+            continue;
+        
+        for (int zeroLatency = 0; zeroLatency < 2; zeroLatency++)
+        {
+            if (!zeroLatency && (sizes[0] >> 1) > maxLatency)
+                continue;
+            
+            PartitionScheme scheme = evaluate(length, blockSize, zeroLatency, sizes[0], sizes[1], sizes[2], sizes[3]);
+            double cost = (1.0 - worstWeight) * scheme.mAverageCost + worstWeight * scheme.mWorstCost;
+            
+            if (cost < bestCost)
+            {
+                best = scheme;
+                bestCost = cost;
+            }
+        }
+    }
+    
+    return best;
+}
+
+HISSTools::PartitionScheme HISSTools::PartitionOptimizer::evaluate(uintptr_t length, uintptr_t blockSize, bool zeroLatency, uint32_t A, uint32_t B, uint32_t C, uint32_t D) const
+{
+    PartitionScheme scheme;
+    
+    const uint32_t sizes[4] = { A, B, C, D };
+    int sizeIndices[4];
+    int numSizes = 0;
+    
+    scheme.mZeroLatency = zeroLatency;
+    scheme.mLatency = zeroLatency ? 0 : A >> 1;
+    
+    // Check the sizes are calibrated and increasing
+    
+    for (int i = 0; i < 4 && sizes[i]; i++, numSizes++)
+    {
+        sizeIndices[i] = -1;
+        
+        for (int j = 0; j < NUM_SIZES; j++)
+            if (sizes[i] == (1U << (j + MIN_SIZE_LOG2)) && (!i || sizes[i] > sizes[i - 1]))
+                sizeIndices[i] = j;
+        
+        if (sizeIndices[i] < 0)
+        {
+            scheme.mAverageCost = scheme.mWorstCost = std::numeric_limits<double>::infinity();
+            return scheme;
+        }
+        
+        scheme.mSizes[i] = sizes[i];
+    }
+    
+    if (!numSizes)
+    {
+        scheme.mAverageCost = scheme.mWorstCost = std::numeric_limits<double>::infinity();
+        return scheme;
+    }
+    
+    // The levels are laid out as in MonoConvolve (a time domain head then each size covering up to half the next size)
+    
+    uintptr_t offset = zeroLatency ? A >> 1 : 0;
+    
+    if (zeroLatency)
+    {
+        double timeCost = blockSize * (mTimeSampleCost + mTimeTapCost * std::min(length, offset));
+        
+        scheme.mAverageCost += timeCost;
+        scheme.mWorstCost += timeCost;
+    }
+    
+    for (int i = 0; i < numSizes; i++)
+    {
+        uintptr_t end = (i + 1 < numSizes) ? offset + ((sizes[i + 1] - sizes[i]) >> 1) : std::max(length, offset);
+        
+        addLevel(scheme, length, blockSize, sizeIndices[i], offset, end);
+        offset = end;
+    }
+    
+    return scheme;
+}
+
+void HISSTools::PartitionOptimizer::addLevel(PartitionScheme& scheme, uintptr_t length, uintptr_t blockSize, int sizeIdx, uintptr_t start, uintptr_t end) const
+{
+    // Only the part of the level covering the impulse is processed
+    
+    end = std::min(end, length);
+    
+    if (end <= start)
+        return;
+    
+    uintptr_t hopSize = uintptr_t(1) << (sizeIdx + MIN_SIZE_LOG2 - 1);
+    uintptr_t numPartitions = (end - start + hopSize - 1) / hopSize;
+    
+    // The FFTs happen once per hop and the partitions are spread evenly over the hop
+    
+    double hops = static_cast<double>(blockSize) / hopSize;
+    double maxHops = std::ceil(hops);
+    double FFTCost = mFFTCosts[sizeIdx] + mPartitionCosts[sizeIdx];
+    double spreadPartitions = hops * (numPartitions - 1);
+    
+    scheme.mAverageCost += hops * FFTCost + spreadPartitions * mPartitionCosts[sizeIdx];
+    scheme.mWorstCost += maxHops * FFTCost + std::ceil(spreadPartitions) * mPartitionCosts[sizeIdx];
+}
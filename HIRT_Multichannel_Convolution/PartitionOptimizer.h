@@ -0,0 +1,72 @@
+
+#pragma once
+
+#include <cstdint>
+
+namespace HISSTools
+{
+    // A partitioning for MonoConvolve (unused sizes are zero) with its estimated cost in seconds per host block
+    
+    struct PartitionScheme
+    {
+        bool mZeroLatency = true;
+        uint32_t mSizes[4] = { 0, 0, 0, 0 };
+        
+        uintptr_t mLatency = 0;
+        double mAverageCost = 0.0;
+        double mWorstCost = 0.0;
+    };
+    
+    // PartitionOptimizer chooses partition sizes using a cost model calibrated by timing the convolution engines on this machine
+    // Calibration takes a noticeable time, so the model can be saved to a file and loaded on the next run
+    
+    class PartitionOptimizer
+    {
+        static constexpr int MIN_SIZE_LOG2 = 6;
+        static constexpr int MAX_SIZE_LOG2 = 16;
+        static constexpr int NUM_SIZES = MAX_SIZE_LOG2 - MIN_SIZE_LOG2 + 1;
+        static constexpr int FILE_VERSION = 2;
+        static constexpr int CALIBRATION_ATTEMPTS = 3;
+    
+    public:
+        
+        // If a cache path is given the model is loaded from it (if valid) or else calibrated and saved to it
+        // N.B. calibration takes a few seconds and so should not be done on the audio thread
+        
+        PartitionOptimizer(const char *cachePath = nullptr);
+        
+        // Calibration is repeated if the timings give costs that do not increase with size
+        // If no attempt is consistent the costs are made to increase (and false is returned so that the model is not saved)
+        
+        bool calibrate();
+        
+        bool load(const char *path);
+        bool save(const char *path) const;
+        
+        // Find the scheme with the lowest cost for an impulse length and host block size with at most maxLatency samples of latency
+        // The cost of each scheme is a weighted sum of the average and worst case costs per block (worstWeight is from zero to one)
+        
+        PartitionScheme optimize(uintptr_t length, uintptr_t blockSize, uintptr_t maxLatency = 0, double worstWeight = 0.5) const;
+        
+        // Estimate the cost of a given scheme (the sizes must be valid and in increasing order)
+        
+        PartitionScheme evaluate(uintptr_t length, uintptr_t blockSize, bool zeroLatency, uint32_t A, uint32_t B = 0, uint32_t C = 0, uint32_t D = 0) const;
+    
+    private:
+        
+        void measure();
+        bool isValid() const { return isValid(mFFTCosts, mPartitionCosts, mTimeSampleCost, mTimeTapCost); }
+        
+        static bool isValid(const double *FFTCosts, const double *partitionCosts, double timeSampleCost, double timeTapCost);
+        
+        void addLevel(PartitionScheme& scheme, uintptr_t length, uintptr_t blockSize, int sizeIdx, uintptr_t start, uintptr_t end) const;
+        
+        // Model (fixed costs per FFT hop and costs per partition per hop for each size plus costs per sample and per tap for time domain convolution)
+        
+        double mFFTCosts[NUM_SIZES];
+        double mPartitionCosts[NUM_SIZES];
+        
+        double mTimeSampleCost;
+        double mTimeTapCost;
+    };
+}
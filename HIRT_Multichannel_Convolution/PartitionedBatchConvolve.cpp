@@ -0,0 +1,463 @@
+
+/*
+ *  PartitionedBatchConvolve
+ *
+ *    PartitionedBatchConvolve performs FFT-based partitioned convolution for several independent channels at a single partition size.
+ *
+ *    The frequency-domain delay lines and impulse spectra of all channels are stored together per partition (rather than per channel).
+ *    A single multiply-accumulate then covers a partition of every channel, giving long runs of full-width vectors even for small partition sizes.
+ *    The ffts read from and write to the spectra directly, so the layout costs nothing beyond the multiply-accumulates.
+ *    Note that all channels share scheduling (and the number of partitions processed is that of the longest impulse).
+ *
+ */
+
+#include "ConvolveKernels.h"
+#include "PartitionedBatchConvolve.h"
+
+#include <algorithm>
+#include <new>
+
+template <class T>
+HISSTools::PartitionedBatchConvolve<T>::PartitionedBatchConvolve(uint32_t numChans, uintptr_t FFTSize, uintptr_t maxLength, uintptr_t offset, uintptr_t length)
+: mNumChans(numChans)
+, mOffset(offset)
+, mLength(length)
+, mMaxLength(0)
+, mFFTSizeLog2(MIN_FFT_SIZE_LOG2)
+, mRWCounter(0)
+, mInputPosition(0)
+, mPartitionsDone(0)
+, mNumPartitions(0)
+, mNumSlots(0)
+, mChanPartitions(numChans, 0)
+, mNumSignalSlots(0)
+, mHopSilent(numChans, true)
+, mLastHopSilent(numChans, true)
+, mResetOffset(-1)
+, mResetFlag(true)
+, mRandGenerator(std::random_device()())
+{
+    // Set the FFT size (rounding up to the nearest power of two within range)
+    
+    while ((getFFTSize() < FFTSize) && (mFFTSizeLog2 < MAX_FFT_SIZE_LOG2))
+        mFFTSizeLog2++;
+    
+    FFTSize = getFFTSize();
+    mRandDistribution = std::uniform_int_distribution<uintptr_t>(0, (FFTSize >> 1) - 1);
+    
+    // Allocate input and output buffers (inputs require two fft buffers per channel) and temporary buffers
+    
+    mInputBuffers = (T *) ALIGNED_MALLOC((mNumChans * FFTSize * 2 * sizeof(T)));
+    mOutputBuffers = (T *) ALIGNED_MALLOC((mNumChans * FFTSize * sizeof(T)));
+    mTempBuffer = (T *) ALIGNED_MALLOC((FFTSize * sizeof(T)));
+    
+    mAccumSpectrum.realp = (T *) ALIGNED_MALLOC((mNumChans * FFTSize * sizeof(T)));
+    
+    // Allocate impulse buffers and the frequency-domain delay line to match
+    
+    mInputSpectra.realp = nullptr;
+    mInputSpectra.imagp = nullptr;
+    mImpulseSpectra.realp = nullptr;
+    mImpulseSpectra.imagp = nullptr;
+    
+    // N.B. the destructor is not called if construction fails, so free any buffer that was allocated
+    
+    if (!mInputBuffers || !mOutputBuffers || !mTempBuffer || !mAccumSpectrum.realp || resize(maxLength) != CONVOLVE_ERR_NONE)
+    {
+        ALIGNED_FREE(mInputBuffers);
+        ALIGNED_FREE(mOutputBuffers);
+        ALIGNED_FREE(mTempBuffer);
+        ALIGNED_FREE(mAccumSpectrum.realp);
+        throw std::bad_alloc();
+    }
+    
+    mAccumSpectrum.imagp = mAccumSpectrum.realp + (mNumChans * (FFTSize >> 1));
+    
+    mFFTSetup = SharedFFTSetup<T>::acquire(mFFTSizeLog2);
+}
+
+template <class T>
+HISSTools::PartitionedBatchConvolve<T>::~PartitionedBatchConvolve()
+{
+    ALIGNED_FREE(mInputBuffers);
+    ALIGNED_FREE(mOutputBuffers);
+    ALIGNED_FREE(mTempBuffer);
+    ALIGNED_FREE(mAccumSpectrum.realp);
+    ALIGNED_FREE(mInputSpectra.realp);
+    ALIGNED_FREE(mImpulseSpectra.realp);
+}
+
+template <class T>
+ConvolveError HISSTools::PartitionedBatchConvolve<T>::resize(uintptr_t maxLength)
+{
+    uintptr_t FFTSizeHalved = getFFTSize() >> 1;
+    uintptr_t numSlots = (maxLength + FFTSizeHalved - 1) / FFTSizeHalved;
+    uintptr_t slotSize = mNumChans * FFTSizeHalved;
+    
+    if (numSlots == mNumSlots)
+        return CONVOLVE_ERR_NONE;
+    
+    // Keep the impulses up to the new length (the layout of each partition does not depend on the number of partitions)
+    
+    Split impulse { nullptr, nullptr };
+    
+    ALIGNED_FREE(mInputSpectra.realp);
+    mInputSpectra = impulse;
+    
+    if (numSlots)
+    {
+        impulse.realp = (T *) ALIGNED_MALLOC((numSlots * slotSize * 2 * sizeof(T)));
+        mInputSpectra.realp = (T *) ALIGNED_MALLOC((numSlots * slotSize * 2 * sizeof(T)));
+        
+        // If either allocation fails then release both (the impulses are lost and the length is zero)
+        
+        if (impulse.realp && mInputSpectra.realp)
+        {
+            impulse.imagp = impulse.realp + (numSlots * slotSize);
+            mInputSpectra.imagp = mInputSpectra.realp + (numSlots * slotSize);
+        }
+        else
+        {
+            ALIGNED_FREE(impulse.realp);
+            ALIGNED_FREE(mInputSpectra.realp);
+            impulse.realp = nullptr;
+            mInputSpectra.realp = nullptr;
+            numSlots = 0;
+        }
+    }
+    
+    // N.B. the remainder must be zeroed, as channels with shorter impulses are processed to the longest length
+    
+    uintptr_t keep = std::min(numSlots, mNumSlots) * slotSize;
+    
+    if (numSlots)
+    {
+        std::copy_n(mImpulseSpectra.realp, keep, impulse.realp);
+        std::copy_n(mImpulseSpectra.imagp, keep, impulse.imagp);
+        std::fill_n(impulse.realp + keep, (numSlots * slotSize) - keep, T(0));
+        std::fill_n(impulse.imagp + keep, (numSlots * slotSize) - keep, T(0));
+    }
+    
+    ALIGNED_FREE(mImpulseSpectra.realp);
+    mImpulseSpectra = impulse;
+    
+    mNumSlots = numSlots;
+    mMaxLength = numSlots * FFTSizeHalved;
+    mSilentSlots.resize(numSlots);
+    
+    // Update the partition counts
+    
+    mNumPartitions = 0;
+    
+    for (uint32_t i = 0; i < mNumChans; i++)
+    {
+        mChanPartitions[i] = std::min(mChanPartitions[i], mNumSlots);
+        mNumPartitions = std::max(mNumPartitions, mChanPartitions[i]);
+    }
+    
+    reset();
+    
+    return (mMaxLength >= maxLength) ? CONVOLVE_ERR_NONE : CONVOLVE_ERR_MEM_UNAVAILABLE;
+}
+
+template <class T>
+void HISSTools::PartitionedBatchConvolve<T>::setResetOffset(intptr_t offset)
+{
+    mResetOffset = offset;
+}
+
+template <class T>
+ConvolveError HISSTools::PartitionedBatchConvolve<T>::set(uint32_t chan, const float *input, uintptr_t length)
+{
+    return setImpulse(chan, input, length);
+}
+
+template <class T>
+ConvolveError HISSTools::PartitionedBatchConvolve<T>::set(uint32_t chan, const double *input, uintptr_t length)
+{
+    return setImpulse(chan, input, length);
+}
+
+template <class T>
+void HISSTools::PartitionedBatchConvolve<T>::clearChannel(Split& spectrum, uintptr_t partition, uint32_t chan)
+{
+    uintptr_t FFTSizeHalved = getFFTSize() >> 1;
+    
+    std::fill_n(spectrum.realp + getOffset(partition, chan), FFTSizeHalved, T(0));
+    std::fill_n(spectrum.imagp + getOffset(partition, chan), FFTSizeHalved, T(0));
+}
+
+template <class T>
+template <class U>
+ConvolveError HISSTools::PartitionedBatchConvolve<T>::setImpulse(uint32_t chan, const U *input, uintptr_t length)
+{
+    if (chan >= mNumChans)
+        return CONVOLVE_ERR_IN_CHAN_OUT_OF_RANGE;
+    
+    ConvolveError error = CONVOLVE_ERR_NONE;
+    
+    // FFT variables / attributes
+    
+    uintptr_t bufferPosition;
+    uintptr_t FFTSizeHalved = getFFTSize() >> 1;
+    
+    // Partition variables
+    
+    Split bufferTemp;
+    
+    uintptr_t numPartitions;
+    
+    // Calculate how much of the buffer to load
+    
+    length = (!input || length <= mOffset) ? 0 : length - mOffset;
+    length = (mLength && mLength < length) ? mLength : length;
+    
+    if (length > mMaxLength)
+    {
+        length = mMaxLength;
+        error = CONVOLVE_ERR_MEM_ALLOC_TOO_SMALL;
+    }
+    
+    // Partition / load the impulse
+    
+    for (bufferPosition = mOffset, numPartitions = 0; length > 0; bufferPosition += FFTSizeHalved, numPartitions++)
+    {
+        // Get samples up to half the fft size
+        
+        uintptr_t numSamps = (length > FFTSizeHalved) ? FFTSizeHalved : length;
+        length -= numSamps;
+        
+        // Get samples, convert and zero pad and then do the fft in place
+        
+        offsetSplitPointer(bufferTemp, mImpulseSpectra, getOffset(numPartitions, chan));
+        hisstools_unzip_zero(input + bufferPosition, &bufferTemp, numSamps, mFFTSizeLog2);
+        hisstools_rfft(mFFTSetup->get(), &bufferTemp, mFFTSizeLog2);
+    }
+    
+    // Clear any partitions of a previous impulse
+    
+    for (uintptr_t i = numPartitions; i < mChanPartitions[chan]; i++)
+        clearChannel(mImpulseSpectra, i, chan);
+    
+    mChanPartitions[chan] = numPartitions;
+    mNumPartitions = *std::max_element(mChanPartitions.begin(), mChanPartitions.end());
+    
+    return error;
+}
+
+template <class T>
+void HISSTools::PartitionedBatchConvolve<T>::reset()
+{
+    mResetFlag = true;
+}
+
+template <class T>
+bool HISSTools::PartitionedBatchConvolve<T>::process(const T * const* ins, T **outs, uintptr_t numSamples)
+{
+    Split impulseTemp;
+    Split audioInTemp;
+    
+    // FFT variables
+    
+    uintptr_t FFTSize = getFFTSize();
+    uintptr_t FFTSizeHalved = FFTSize >> 1;
+    
+    uintptr_t RWCounter = mRWCounter;
+    uintptr_t hopMask = FFTSizeHalved - 1;
+    
+    uintptr_t samplesRemaining = numSamples;
+    uintptr_t samplesDone = 0;
+    
+    if (!mNumPartitions)
+        return false;
+    
+    // If we need to reset everything we do that here - happens when the delay line is reallocated or on request
+    
+    if (mResetFlag)
+    {
+        // Reset fft buffers, delay line, output buffers and accum buffer
+        
+        std::fill_n(mInputBuffers, mNumChans * FFTSize * 2, T(0));
+        std::fill_n(mInputSpectra.realp, mNumSlots * mNumChans * FFTSize, T(0));
+        std::fill_n(mOutputBuffers, mNumChans * FFTSize, T(0));
+        std::fill_n(mAccumSpectrum.realp, mNumChans * FFTSize, T(0));
+        
+        // Reset silence detection (the buffers are now silent)
+        
+        std::fill(mSilentSlots.begin(), mSilentSlots.end(), true);
+        std::fill(mHopSilent.begin(), mHopSilent.end(), true);
+        std::fill(mLastHopSilent.begin(), mLastHopSilent.end(), true);
+        mNumSignalSlots = 0;
+        
+        // Reset fft RWCounter (randomly or by fixed amount)
+        
+        if (mResetOffset < 0)
+            RWCounter = mRandDistribution(mRandGenerator);
+        else
+            RWCounter = mResetOffset % FFTSizeHalved;
+        
+        // Reset scheduling variables
+        
+        mInputPosition = 0;
+        mPartitionsDone = 0;
+        
+        // Set reset flag off
+        
+        mResetFlag = false;
+    }
+    
+    // Main loop
+    
+    while (samplesRemaining > 0)
+    {
+        // Calculate how many IO samples to deal with this loop (depending on whether there is an fft to do before the end of the signal block)
+        
+        uintptr_t tillNextFFT = (FFTSizeHalved - (RWCounter & hopMask));
+        uintptr_t loopSize = samplesRemaining < tillNextFFT ? samplesRemaining : tillNextFFT;
+        uintptr_t hiCounter = (RWCounter + FFTSizeHalved) & (FFTSize - 1);
+        
+        // Load inputs into buffers (twice) and accumulate outputs from the output buffers
+        
+        for (uint32_t i = 0; i < mNumChans; i++)
+        {
+            T *buffer = mInputBuffers + (i * FFTSize * 2);
+            
+            if (ins[i])
+            {
+                std::copy_n(ins[i] + samplesDone, loopSize, buffer + RWCounter);
+                std::copy_n(ins[i] + samplesDone, loopSize, buffer + FFTSize + hiCounter);
+                
+                if (mHopSilent[i])
+                    mHopSilent[i] = isSilent(ins[i] + samplesDone, loopSize);
+            }
+            else
+            {
+                std::fill_n(buffer + RWCounter, loopSize, T(0));
+                std::fill_n(buffer + FFTSize + hiCounter, loopSize, T(0));
+            }
+            
+            if (outs[i])
+            {
+                const T *output = mOutputBuffers + (i * FFTSize) + RWCounter;
+                T *out = outs[i] + samplesDone;
+                
+                for (uintptr_t j = 0; j < loopSize; j++)
+                    out[j] += output[j];
+            }
+        }
+        
+        // Updates to counters
+        
+        samplesRemaining -= loopSize;
+        samplesDone += loopSize;
+        RWCounter += loopSize;
+        
+        bool FFTNow = !(RWCounter & hopMask);
+        
+        // Work loop and scheduling - this is where most of the convolution is done
+        // How many partitions to do by now? (make sure that all partitions are done before we need to do the next fft)
+        
+        uintptr_t partitionsTarget = mNumPartitions - 1;
+        
+        if (!FFTNow)
+            partitionsTarget = (partitionsTarget * (RWCounter & hopMask)) / FFTSizeHalved;
+        
+        // Do the ffts into the delay line (a slot is marked if all channels are silent for the last two hops)
+        
+        if (FFTNow)
+        {
+            bool silent = true;
+            
+            for (uint32_t i = 0; i < mNumChans; i++)
+                silent = silent && mHopSilent[i] && mLastHopSilent[i];
+            
+            if (mSilentSlots[mInputPosition] != silent)
+            {
+                mSilentSlots[mInputPosition] = silent;
+                mNumSignalSlots = silent ? mNumSignalSlots - 1 : mNumSignalSlots + 1;
+            }
+            
+            for (uint32_t i = 0; i < mNumChans; i++)
+            {
+                if (!silent && mHopSilent[i] && mLastHopSilent[i])
+                    clearChannel(mInputSpectra, mInputPosition, i);
+                else if (!silent)
+                {
+                    T *buffer = mInputBuffers + (i * FFTSize * 2) + ((RWCounter == FFTSize) ? FFTSize : 0);
+                    
+                    offsetSplitPointer(audioInTemp, mInputSpectra, getOffset(mInputPosition, i));
+                    hisstools_rfft(mFFTSetup->get(), buffer, &audioInTemp, FFTSize, mFFTSizeLog2);
+                }
+                
+                mLastHopSilent[i] = mHopSilent[i];
+                mHopSilent[i] = true;
+            }
+        }
+        
+        // Accumulate partitions for all channels at once (if there is no signal in the delay line there is nothing to accumulate)
+        
+        for (; mNumSignalSlots && mPartitionsDone < partitionsTarget; mPartitionsDone++)
+        {
+            uintptr_t partition = mPartitionsDone + 1;
+            uintptr_t slot = (mInputPosition + partition) % mNumSlots;
+            
+            if (mSilentSlots[slot])
+                continue;
+            
+            offsetSplitPointer(impulseTemp, mImpulseSpectra, getOffset(partition, 0));
+            offsetSplitPointer(audioInTemp, mInputSpectra, getOffset(slot, 0));
+            processPartition<WideVector<T>>(audioInTemp, impulseTemp, mAccumSpectrum, FFTSizeHalved, mNumChans);
+        }
+        
+        mPartitionsDone = std::max(mPartitionsDone, partitionsTarget);
+        
+        if (FFTNow)
+        {
+            // Add the first partitions, then do the iffts, scale and store (overlap-save)
+            
+            if (!mSilentSlots[mInputPosition])
+            {
+                offsetSplitPointer(audioInTemp, mInputSpectra, getOffset(mInputPosition, 0));
+                processPartition<WideVector<T>>(audioInTemp, mImpulseSpectra, mAccumSpectrum, FFTSizeHalved, mNumChans);
+            }
+            
+            for (uint32_t i = 0; i < mNumChans; i++)
+            {
+                T *output = mOutputBuffers + (i * FFTSize);
+                
+                if (mNumSignalSlots)
+                {
+                    offsetSplitPointer(audioInTemp, mAccumSpectrum, getOffset(0, i));
+                    hisstools_rifft(mFFTSetup->get(), &audioInTemp, mTempBuffer, mFFTSizeLog2);
+                    scaleStore<WideVector<T>>(output, mTempBuffer, FFTSize, (RWCounter != FFTSize));
+                }
+                else
+                    std::fill_n(output + ((RWCounter != FFTSize) ? FFTSizeHalved : 0), FFTSizeHalved, T(0));
+            }
+            
+            // Clear accumulation buffer
+            
+            std::fill_n(mAccumSpectrum.realp, mNumChans * FFTSize, T(0));
+            
+            // Update RWCounter
+            
+            RWCounter = RWCounter & (FFTSize - 1);
+            
+            // Set scheduling variables
+            
+            mInputPosition = mInputPosition ? mInputPosition - 1 : mNumSlots - 1;
+            mPartitionsDone = 0;
+        }
+    }
+    
+    // Write counter back into the object
+    
+    mRWCounter = RWCounter;
+    
+    return true;
+}
+
+// Explicit instantiations
+
+template class HISSTools::PartitionedBatchConvolve<float>;
+template class HISSTools::PartitionedBatchConvolve<double>;
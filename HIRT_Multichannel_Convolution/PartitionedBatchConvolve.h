@@ -0,0 +1,114 @@
+
+#pragma once
+
+#include "ConvolveErrors.h"
+#include "ConvolveFFTTypes.h"
+#include "SharedSpectra.h"
+
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace HISSTools
+{
+    template <class T>
+    class PartitionedBatchConvolve
+    {
+        typedef typename FFTTypes<T>::Split Split;
+        
+        // N.B. MIN_FFT_SIZE_LOG2 should never be smaller than 4, as below code assumes loop unroll of vectors (4 vals) by 4 (== 16 or 2^4)
+        
+        static constexpr int MIN_FFT_SIZE_LOG2 = 5;
+        static constexpr int MAX_FFT_SIZE_LOG2 = 20;
+    
+    public:
+        
+        PartitionedBatchConvolve(uint32_t numChans, uintptr_t FFTSize, uintptr_t maxLength, uintptr_t offset, uintptr_t length);
+        ~PartitionedBatchConvolve();
+        
+        // Non-moveable and copyable
+        
+        PartitionedBatchConvolve(PartitionedBatchConvolve& obj) = delete;
+        PartitionedBatchConvolve& operator = (PartitionedBatchConvolve& obj) = delete;
+        PartitionedBatchConvolve(PartitionedBatchConvolve&& obj) = delete;
+        PartitionedBatchConvolve& operator = (PartitionedBatchConvolve&& obj) = delete;
+        
+        // The maximum length is shared by all channels (impulses are kept up to the new length)
+        
+        ConvolveError resize(uintptr_t maxLength);
+        void setResetOffset(intptr_t offset = -1);
+        
+        ConvolveError set(uint32_t chan, const float *input, uintptr_t length);
+        ConvolveError set(uint32_t chan, const double *input, uintptr_t length);
+        void reset();
+        
+        // Inputs may be null (silent) and outputs may be null (not required) - output is accumulated
+        
+        bool process(const T * const* ins, T **outs, uintptr_t numSamples);
+    
+    private:
+        
+        uintptr_t getFFTSize()  { return uintptr_t(1) << mFFTSizeLog2; }
+        
+        // Offset of a channel within a partition or slot (the channels of each partition are stored together)
+        
+        uintptr_t getOffset(uintptr_t partition, uint32_t chan) { return ((partition * mNumChans) + chan) * (getFFTSize() >> 1); }
+        
+        void clearChannel(Split& spectrum, uintptr_t partition, uint32_t chan);
+        
+        template <class U>
+        ConvolveError setImpulse(uint32_t chan, const U *input, uintptr_t length);
+        
+        // Parameters
+        
+        uint32_t mNumChans;
+        
+        uintptr_t mOffset;
+        uintptr_t mLength;
+        uintptr_t mMaxLength;
+        
+        // FFT variables
+        
+        std::shared_ptr<const SharedFFTSetup<T>> mFFTSetup;
+        
+        uintptr_t mFFTSizeLog2;
+        uintptr_t mRWCounter;
+        
+        // Scheduling variables
+        
+        uintptr_t mInputPosition;
+        uintptr_t mPartitionsDone;
+        uintptr_t mNumPartitions;
+        uintptr_t mNumSlots;
+        
+        std::vector<uintptr_t> mChanPartitions;
+        
+        // Internal buffers (the delay line, impulse and accumulation spectra hold all channels of each partition contiguously)
+        
+        T *mInputBuffers;
+        T *mOutputBuffers;
+        T *mTempBuffer;
+        
+        Split mInputSpectra;
+        Split mImpulseSpectra;
+        Split mAccumSpectrum;
+        
+        // Input silence (a delay line slot is marked if all channels are silent, otherwise silent channels are zeroed)
+        
+        std::vector<bool> mSilentSlots;
+        uintptr_t mNumSignalSlots;
+        std::vector<bool> mHopSilent;
+        std::vector<bool> mLastHopSilent;
+        
+        // Flags
+        
+        intptr_t mResetOffset;
+        bool mResetFlag;
+        
+        // Random number generation
+        
+        std::default_random_engine mRandGenerator;
+        std::uniform_int_distribution<uintptr_t> mRandDistribution;
+    };
+}
@@ -10,20 +10,14 @@
  *
  */
 
-#include "ConvolveSIMD.h"
+#include "ConvolveKernels.h"
 #include "PartitionedConvolve.h"
 
 #include <algorithm>
+#include <new>
 
-// Pointer Utility
-
-void offsetSplitPointer(FFT_SPLIT_COMPLEX_F &complex1, const FFT_SPLIT_COMPLEX_F &complex2, uintptr_t offset)
-{
-    complex1.realp = complex2.realp + offset;
-    complex1.imagp = complex2.imagp + offset;
-}
-
-ConvolveError HISSTools::PartitionedConvolve::setMaxFFTSize(uintptr_t maxFFTSize)
+template <class T>
+ConvolveError HISSTools::PartitionedConvolveT<T>::setMaxFFTSize(uintptr_t maxFFTSize)
 {
     uintptr_t maxFFTSizeLog2 = log2(maxFFTSize);
     
@@ -49,14 +43,29 @@ ConvolveError HISSTools::PartitionedConvolve::setMaxFFTSize(uintptr_t maxFFTSize
     return error;
 }
 
-HISSTools::PartitionedConvolve::PartitionedConvolve(uintptr_t maxFFTSize, uintptr_t maxLength, uintptr_t offset, uintptr_t length)
+template <class T>
+HISSTools::PartitionedConvolveT<T>::PartitionedConvolveT(uintptr_t maxFFTSize, uintptr_t maxLength, uintptr_t offset, uintptr_t length, AllocatorPtr allocator)
 : mMaxImpulseLength(maxLength)
+, mSilenceThreshold(0.0)
+, mTrimTail(false)
+, mHalfPrecision(false)
+, mDistributed(false)
+, mMirrored(false)
 , mFFTSizeLog2(0)
 , mInputPosition(0)
 , mPartitionsDone(0)
-, mLastPartition(0)
+, mStagesDone(0)
 , mNumPartitions(0)
 , mValidPartitions(0)
+, mValidActive(0)
+, mFirstActive(false)
+, mNumFFTs(0)
+, mNumMACs(0)
+, mNumSignalSlots(0)
+, mHopSilent(true)
+, mLastHopSilent(true)
+, mAllocator(ConvolveAllocator::select(allocator))
+, mImpulseCached(false)
 , mResetOffset(-1)
 , mResetFlag(true)
 , mRandGenerator(std::random_device()())
@@ -68,7 +77,7 @@ HISSTools::PartitionedConvolve::PartitionedConvolve(uintptr_t maxFFTSize, uintpt
     setOffset(offset);
     setLength(length);
     
-    // Allocate impulse buffer and input buffer
+    // Allocate input buffer (the impulse spectrum is allocated when it is set)
     
     maxFFTSize = getMaxFFTSize();
     
@@ -81,37 +90,46 @@ HISSTools::PartitionedConvolve::PartitionedConvolve(uintptr_t maxFFTSize, uintpt
         mMaxImpulseLength *= (maxFFTSize >> 1);
     }
     
-    mImpulseBuffer.realp = (float *) ALIGNED_MALLOC((mMaxImpulseLength * 4 * sizeof(float)));
-    mImpulseBuffer.imagp = mImpulseBuffer.realp + mMaxImpulseLength;
-    mInputBuffer.realp = mImpulseBuffer.imagp + mMaxImpulseLength;
+    updateImpulseBuffers();
+    mInputBuffer.realp = mAllocator->allocate<T>(mMaxImpulseLength * 2);
     mInputBuffer.imagp = mInputBuffer.realp + mMaxImpulseLength;
     
     // Allocate fft and temporary buffers
     
-    mFFTBuffers[0] = (float *) ALIGNED_MALLOC((maxFFTSize * 6 * sizeof(float)));
+    mFFTBuffers[0] = mAllocator->allocate<T>(maxFFTSize * 5);
+    
+    // N.B. the destructor is not called if construction fails, so free any buffer that was allocated
+    
+    if (!mInputBuffer.realp || !mFFTBuffers[0])
+    {
+        mAllocator->deallocate(mInputBuffer.realp);
+        mAllocator->deallocate(mFFTBuffers[0]);
+        throw std::bad_alloc();
+    }
+    
     mFFTBuffers[1] = mFFTBuffers[0] + maxFFTSize;
     mFFTBuffers[2] = mFFTBuffers[1] + maxFFTSize;
     mFFTBuffers[3] = mFFTBuffers[2] + maxFFTSize;
     
     mAccumBuffer.realp = mFFTBuffers[3] + maxFFTSize;
     mAccumBuffer.imagp = mAccumBuffer.realp + (maxFFTSize >> 1);
-    mPartitionTemp.realp = mAccumBuffer.imagp + (maxFFTSize >> 1);
-    mPartitionTemp.imagp = mPartitionTemp.realp + (maxFFTSize >> 1);
     
-    hisstools_create_setup(&mFFTSetup, mMaxFFTSizeLog2);
+    mActivePartitions.reserve(mMaxImpulseLength / (maxFFTSize >> 1));
+    
+    mFFTSetup = SharedFFTSetup<T>::acquire(mMaxFFTSizeLog2);
 }
 
-HISSTools::PartitionedConvolve::~PartitionedConvolve()
+template <class T>
+HISSTools::PartitionedConvolveT<T>::~PartitionedConvolveT()
 {
-    hisstools_destroy_setup(mFFTSetup);
-    
     // FIX - try to do better here...
     
-    ALIGNED_FREE(mImpulseBuffer.realp);
-    ALIGNED_FREE(mFFTBuffers[0]);
+    mAllocator->deallocate(mInputBuffer.realp);
+    mAllocator->deallocate(mFFTBuffers[0]);
 }
 
-uintptr_t HISSTools::PartitionedConvolve::log2(uintptr_t value)
+template <class T>
+uintptr_t HISSTools::PartitionedConvolveT<T>::log2(uintptr_t value)
 {
     uintptr_t bitShift = value;
     uintptr_t bitCount = 0;
@@ -128,7 +146,8 @@ uintptr_t HISSTools::PartitionedConvolve::log2(uintptr_t value)
         return bitCount;
 }
 
-ConvolveError HISSTools::PartitionedConvolve::setFFTSize(uintptr_t FFTSize)
+template <class T>
+ConvolveError HISSTools::PartitionedConvolveT<T>::setFFTSize(uintptr_t FFTSize)
 {
     uintptr_t FFTSizeLog2 = log2(FFTSize);
     
@@ -146,6 +165,9 @@ ConvolveError HISSTools::PartitionedConvolve::setFFTSize(uintptr_t FFTSize)
     {
         mNumPartitions = 0;
         mFFTSizeLog2 = FFTSizeLog2;
+        mImpulse.reset();
+        updateImpulseBuffers();
+        updateSchedule();
     }
     
     mRandDistribution = std::uniform_int_distribution<uintptr_t>(0, (FFTSize >> 1) - 1);
@@ -153,101 +175,436 @@ ConvolveError HISSTools::PartitionedConvolve::setFFTSize(uintptr_t FFTSize)
     return error;
 }
 
-ConvolveError HISSTools::PartitionedConvolve::setLength(uintptr_t length)
+template <class T>
+ConvolveError HISSTools::PartitionedConvolveT<T>::setLength(uintptr_t length)
 {
     mLength = std::min(length, mMaxImpulseLength);
     
     return (length > mMaxImpulseLength) ? CONVOLVE_ERR_PARTITION_LENGTH_TOO_LARGE : CONVOLVE_ERR_NONE;
 }
 
-void HISSTools::PartitionedConvolve::setOffset(uintptr_t offset)
+template <class T>
+void HISSTools::PartitionedConvolveT<T>::setOffset(uintptr_t offset)
 {
     mOffset = offset;
 }
 
-void HISSTools::PartitionedConvolve::setResetOffset(intptr_t offset)
+template <class T>
+void HISSTools::PartitionedConvolveT<T>::setResetOffset(intptr_t offset)
 {
     mResetOffset = offset;
 }
 
-ConvolveError HISSTools::PartitionedConvolve::set(const float *input, uintptr_t length)
+template <class T>
+void HISSTools::PartitionedConvolveT<T>::setScheduled(bool scheduled)
 {
-    ConvolveError error = CONVOLVE_ERR_NONE;
+    if (scheduled && !mSchedule)
+    {
+        mSchedule = PhaseScheduler::add();
+        updateSchedule();
+    }
+    else if (!scheduled)
+        mSchedule.reset();
+}
+
+template <class T>
+void HISSTools::PartitionedConvolveT<T>::updateSchedule()
+{
+    if (!mSchedule)
+        return;
     
-    // FFT variables / attributes
+    // Costs are estimated in floating point operations (roughly 5N log2(N) for the ffts and 4N to process a partition)
     
-    uintptr_t bufferPosition;
-    uintptr_t FFTSize = getFFTSize();
-    uintptr_t FFTSizeHalved = FFTSize >> 1;
+    double FFTSize = static_cast<double>(getFFTSize());
+    double partitionCost = 4.0 * FFTSize;
+    double boundaryCost = 5.0 * FFTSize * mFFTSizeLog2 + (mFirstActive ? partitionCost : 0.0);
+    double spreadCost = partitionCost * mActivePartitions.size();
     
-    // Partition variables
+    if (!mNumPartitions)
+        mSchedule->update(0, 0.0, 0.0);
+    else if (mDistributed)
+        mSchedule->update(getFFTSize() >> 1, 0.0, boundaryCost + spreadCost);
+    else
+        mSchedule->update(getFFTSize() >> 1, boundaryCost, spreadCost);
+}
+
+template <class T>
+void HISSTools::PartitionedConvolveT<T>::setSilenceThreshold(double threshold, bool trimTail)
+{
+    mSilenceThreshold = threshold;
+    mTrimTail = trimTail;
+}
+
+template <class T>
+void HISSTools::PartitionedConvolveT<T>::setHalfPrecision(bool halfPrecision)
+{
+    mHalfPrecision = halfPrecision;
+}
+
+template <class T>
+void HISSTools::PartitionedConvolveT<T>::setDistributed(bool distributed)
+{
+    if (distributed != mDistributed)
+    {
+        mDistributed = distributed;
+        mResetFlag = true;
+        updateSchedule();
+    }
+}
+
+template <class T>
+ConvolveError HISSTools::PartitionedConvolveT<T>::setMirrored(bool mirrored)
+{
+    if (mirrored == mMirrored)
+        return CONVOLVE_ERR_NONE;
     
-    float *bufferTemp1 = (float *) mPartitionTemp.realp;
-    FFT_SPLIT_COMPLEX_F bufferTemp2;
+    // Allocate the new delay line before freeing the old one (so that the object is left unchanged on failure)
     
-    uintptr_t numPartitions;
+    uintptr_t size = mMaxImpulseLength * (mirrored ? 4 : 2);
+    T *buffer = mAllocator->allocate<T>(size);
     
-    // Calculate how much of the buffer to load
+    if (!buffer)
+        return CONVOLVE_ERR_MEM_UNAVAILABLE;
     
-    length = (!input || length <= mOffset) ? 0 : length - mOffset;
-    length = (mLength && mLength < length) ? mLength : length;
+    mAllocator->deallocate(mInputBuffer.realp);
+    mInputBuffer.realp = buffer;
+    mInputBuffer.imagp = buffer + (size >> 1);
     
-    if (length > mMaxImpulseLength)
-    {
-        length = mMaxImpulseLength;
-        error = CONVOLVE_ERR_MEM_ALLOC_TOO_SMALL;
-    }
+    mMirrored = mirrored;
+    mSilentSlots.resize(mNumPartitions * (mMirrored ? 2 : 1));
+    mResetFlag = true;
     
-    // Partition / load the impulse
+    return CONVOLVE_ERR_NONE;
+}
+
+template <class T>
+void HISSTools::PartitionedConvolveT<T>::mirrorSlot(uintptr_t slot)
+{
+    uintptr_t FFTSizeHalved = getFFTSize() >> 1;
+    uintptr_t offset = slot * FFTSizeHalved;
+    uintptr_t mirrorOffset = (slot + mNumPartitions) * FFTSizeHalved;
     
-    for (bufferPosition = mOffset, bufferTemp2 = mImpulseBuffer, numPartitions = 0; length > 0; bufferPosition += FFTSizeHalved, numPartitions++)
-    {
-        // Get samples up to half the fft size
+    std::copy_n(mInputBuffer.realp + offset, FFTSizeHalved, mInputBuffer.realp + mirrorOffset);
+    std::copy_n(mInputBuffer.imagp + offset, FFTSizeHalved, mInputBuffer.imagp + mirrorOffset);
+}
+
+template <class T>
+ConvolveError HISSTools::PartitionedConvolveT<T>::set(const float *input, uintptr_t length)
+{
+    return setImpulse(input, length);
+}
+    
+template <class T>
+ConvolveError HISSTools::PartitionedConvolveT<T>::set(const double *input, uintptr_t length)
+{
+    return setImpulse(input, length);
+}
+
+template <class T>
+template <class U>
+ConvolveError HISSTools::PartitionedConvolveT<T>::setImpulse(const U *input, uintptr_t length)
+{
+    length = input ? length : 0;
+    
+    // Partition / load the impulse (unless the spectrum is already loaded elsewhere)
+    
+    for (uintptr_t i = 0, numPartitions = prepareImpulse(input, length); i < numPartitions; i++)
+        loadPartition(input, length, i);
         
-        uintptr_t numSamps = (length > FFTSizeHalved) ? FFTSizeHalved : length;
-        length -= numSamps;
+    return completeSet(length);
+}
         
-        // Get samples and zero pad
+template <class T>
+uintptr_t HISSTools::PartitionedConvolveT<T>::getLoadLength(uintptr_t length)
+{
+    // Calculate how much of the buffer to load (before limiting to the memory allocated)
         
-        std::copy_n(input + bufferPosition, numSamps, bufferTemp1);
-        std::fill_n(bufferTemp1 + numSamps, FFTSize - numSamps, 0.f);
+    length = (length <= mOffset) ? 0 : length - mOffset;
         
-        // Do fft straight into position
+    return (mLength && mLength < length) ? mLength : length;
+}
         
-        hisstools_rfft(mFFTSetup, bufferTemp1, &bufferTemp2, FFTSize, mFFTSizeLog2);
-        offsetSplitPointer(bufferTemp2, bufferTemp2, FFTSizeHalved);
+template <class T>
+uintptr_t HISSTools::PartitionedConvolveT<T>::getNumPartitions(uintptr_t length)
+{
+    uintptr_t FFTSizeHalved = getFFTSize() >> 1;
+    
+    return (std::min(getLoadLength(length), mMaxImpulseLength) + FFTSizeHalved - 1) / FFTSizeHalved;
+}
+
+template <class T>
+uintptr_t HISSTools::PartitionedConvolveT<T>::prepareSet(const float *input, uintptr_t length)
+{
+    return prepareImpulse(input, length);
+}
+
+template <class T>
+uintptr_t HISSTools::PartitionedConvolveT<T>::prepareSet(const double *input, uintptr_t length)
+{
+    return prepareImpulse(input, length);
+}
+
+template <class T>
+template <class U>
+uintptr_t HISSTools::PartitionedConvolveT<T>::prepareImpulse(const U *input, uintptr_t length)
+{
+    uintptr_t numPartitions = getNumPartitions(input ? length : 0);
+    
+    mImpulse.reset();
+    mImpulseCached = false;
+    
+    if (numPartitions)
+    {
+        // Use a matching spectrum if one is in use (otherwise allocate a new one to load)
+        
+        mImpulseKey = SpectrumCache<T>::makeKey(input + mOffset, std::min(getLoadLength(length), mMaxImpulseLength), mFFTSizeLog2);
+        mImpulseKey.mHalfPrecision = mHalfPrecision;
+        mImpulse = SpectrumCache<T>::find(mImpulseKey);
+        
+        if (mImpulse)
+            mImpulseCached = true;
+        else
+            mImpulse = std::make_shared<ImpulseSpectrum<T>>(mFFTSizeLog2, numPartitions, mAllocator);
+        
+        if (!mImpulse->mBuffer.realp && !mImpulse->mHalfBuffer.realp)
+            mImpulse.reset();
+    }
+    
+    updateImpulseBuffers();
+    
+    return (mImpulse && !mImpulseCached) ? numPartitions : 0;
+}
+
+template <class T>
+void HISSTools::PartitionedConvolveT<T>::setPartition(const float *input, uintptr_t length, uintptr_t partition)
+{
+    loadPartition(input, length, partition);
+}
+
+template <class T>
+void HISSTools::PartitionedConvolveT<T>::setPartition(const double *input, uintptr_t length, uintptr_t partition)
+{
+    loadPartition(input, length, partition);
+}
+
+template <class T>
+template <class U>
+void HISSTools::PartitionedConvolveT<T>::loadPartition(const U *input, uintptr_t length, uintptr_t partition)
+{
+    uintptr_t FFTSizeHalved = getFFTSize() >> 1;
+    uintptr_t bufferPosition = partition * FFTSizeHalved;
+    
+    length = std::min(getLoadLength(length), mMaxImpulseLength);
+    
+    if (!mImpulse || mImpulseCached || bufferPosition >= length)
+        return;
+    
+    // Get samples up to half the fft size (zero padding and conversion happen whilst unzipping)
+    
+    uintptr_t numSamps = std::min(length - bufferPosition, FFTSizeHalved);
+    Split bufferTemp;
+    
+    offsetSplitPointer(bufferTemp, mImpulseBuffer, bufferPosition);
+    
+    // Do fft straight into position
+    
+    hisstools_unzip_zero(input + mOffset + bufferPosition, &bufferTemp, numSamps, mFFTSizeLog2);
+    hisstools_rfft(mFFTSetup->get(), &bufferTemp, mFFTSizeLog2);
+}
+
+template <class T>
+ConvolveError HISSTools::PartitionedConvolveT<T>::completeSet(uintptr_t length)
+{
+    ConvolveError error = getLoadLength(length) > mMaxImpulseLength ? CONVOLVE_ERR_MEM_ALLOC_TOO_SMALL : CONVOLVE_ERR_NONE;
+    
+    mNumPartitions = getNumPartitions(length);
+    
+    if (mNumPartitions && !mImpulse)
+        error = CONVOLVE_ERR_MEM_UNAVAILABLE;
+    
+    mNumPartitions = mImpulse ? std::min(mNumPartitions, mImpulse->mNumPartitions) : 0;
+    
+    // Once loaded the spectrum can be converted and shared (it is never modified after this point)
+    
+    if (mImpulse && !mImpulseCached)
+    {
+        if (mHalfPrecision)
+            mImpulse->convertToHalf();
+        
+        SpectrumCache<T>::insert(mImpulseKey, mImpulse);
+        mImpulseCached = true;
     }
     
-    mNumPartitions = numPartitions;
+    updateImpulseBuffers();
+    
+    indexPartitions();
+    mSilentSlots.resize(mNumPartitions * (mMirrored ? 2 : 1));
+    updateSchedule();
     reset();
     
     return error;
 }
 
-void HISSTools::PartitionedConvolve::reset()
+template <class T>
+void HISSTools::PartitionedConvolveT<T>::indexPartitions()
 {
-    mResetFlag = true;
+    // The forward fft scales the energy of each partition by 2 * FFTSize (so for a hop of samples the threshold scales by FFTSize squared)
+    
+    uintptr_t FFTSize = getFFTSize();
+    uintptr_t FFTSizeHalved = FFTSize >> 1;
+    uintptr_t numPartitions = 0;
+    
+    double threshold = mSilenceThreshold * mSilenceThreshold * static_cast<double>(FFTSize) * static_cast<double>(FFTSize);
+    
+    mActivePartitions.clear();
+    mFirstActive = false;
+    
+    auto square = [](double value) { return value * value; };
+    
+    for (uintptr_t i = 0; i < mNumPartitions; i++)
+    {
+        uintptr_t offset = i * FFTSizeHalved;
+        double energy = 0.0;
+        
+        if (mImpulseHalf.realp)
+        {
+            for (uintptr_t j = offset; j < offset + FFTSizeHalved; j++)
+                energy += square(halfToFloat(mImpulseHalf.realp[j])) + square(halfToFloat(mImpulseHalf.imagp[j]));
+        }
+        else
+        {
+            for (uintptr_t j = offset; j < offset + FFTSizeHalved; j++)
+                energy += square(mImpulseBuffer.realp[j]) + square(mImpulseBuffer.imagp[j]);
+        }
+        
+        if (energy <= threshold)
+            continue;
+        
+        if (i)
+            mActivePartitions.push_back(i);
+        else
+            mFirstActive = true;
+        
+        numPartitions = i + 1;
+    }
+    
+    if (mTrimTail)
+        mNumPartitions = numPartitions;
 }
 
-template<class T>
-void scaleStore(float *out, float *temp, uintptr_t FFTSize, bool offset)
+template <class T>
+void HISSTools::PartitionedConvolveT<T>::updateImpulseBuffers()
 {
-    T *outPtr = reinterpret_cast<T *>(out + (offset ? FFTSize >> 1: 0));
-    T *tempPtr = reinterpret_cast<T *>(temp);
-    T scaleMul(1.f / static_cast<float>(FFTSize << 2));
-    
-    for (uintptr_t i = 0; i < (FFTSize / (T::size * 2)); i++)
-        *(outPtr++) = *(tempPtr++) * scaleMul;
+    mImpulseBuffer.realp = mImpulse ? mImpulse->mBuffer.realp : nullptr;
+    mImpulseBuffer.imagp = mImpulse ? mImpulse->mBuffer.imagp : nullptr;
+    mImpulseHalf.realp = mImpulse ? mImpulse->mHalfBuffer.realp : nullptr;
+    mImpulseHalf.imagp = mImpulse ? mImpulse->mHalfBuffer.imagp : nullptr;
 }
 
-bool HISSTools::PartitionedConvolve::process(const float *in, float *out, uintptr_t numSamples)
+template <class T>
+void HISSTools::PartitionedConvolveT<T>::reset()
 {
-    FFT_SPLIT_COMPLEX_F impulseTemp;
-    FFT_SPLIT_COMPLEX_F audioInTemp;
+    mResetFlag = true;
+}
+
+// A distributed hop of work is the forward fft of the last hop, the partitions (the first then the active ones) and the inverse fft
+// The output is stored in the half of the output buffer that is not being read during this hop
+
+template <class T>
+void HISSTools::PartitionedConvolveT<T>::processStage(uintptr_t stage, bool storeOffset)
+{
+    Split impulseTemp;
+    HalfSplit impulseHalfTemp;
+    Split audioInTemp;
     
-    // Scheduling variables
+    uintptr_t FFTSize = getFFTSize();
+    uintptr_t FFTSizeHalved = FFTSize >> 1;
+    uintptr_t numFFTStages = hisstools_rfft_stages(mFFTSizeLog2);
     
-    intptr_t numPartitionsToDo;
+    // The input of the last hop is the most recent slot of the delay line
+    
+    uintptr_t lastPosition = (mInputPosition + 1 == mNumPartitions) ? 0 : mInputPosition + 1;
+    
+    if (stage < numFFTStages)
+    {
+        if (!mSilentSlots[lastPosition])
+        {
+            offsetSplitPointer(audioInTemp, mInputBuffer, (lastPosition * FFTSizeHalved));
+            hisstools_rfft_stage(mFFTSetup->get(), &audioInTemp, mFFTSizeLog2, stage);
+            
+            if (stage + 1 == numFFTStages)
+            {
+                mNumFFTs++;
+                
+                if (mMirrored)
+                    mirrorSlot(lastPosition);
+            }
+        }
+        
+        return;
+    }
+    
+    stage -= numFFTStages;
+    
+    if (stage <= mValidActive)
+    {
+        if (!stage && !mFirstActive)
+            return;
+        
+        uintptr_t partition = stage ? mActivePartitions[stage - 1] : 0;
+        uintptr_t inputPosition = lastPosition + partition;
+        
+        if (inputPosition >= mNumPartitions && !mMirrored)
+            inputPosition -= mNumPartitions;
+        
+        if (mSilentSlots[inputPosition])
+            return;
+        
+        offsetSplitPointer(audioInTemp, mInputBuffer, (inputPosition * FFTSizeHalved));
+        mNumMACs++;
+        
+        if (mImpulseHalf.realp)
+        {
+            offsetSplitPointer(impulseHalfTemp, mImpulseHalf, (partition * FFTSizeHalved));
+            processPartition<WideVector<T>>(audioInTemp, impulseHalfTemp, mAccumBuffer, FFTSizeHalved);
+        }
+        else
+        {
+            offsetSplitPointer(impulseTemp, mImpulseBuffer, (partition * FFTSizeHalved));
+            processPartition<WideVector<T>>(audioInTemp, impulseTemp, mAccumBuffer, FFTSizeHalved);
+        }
+        
+        return;
+    }
+    
+    stage -= mValidActive + 1;
+    
+    // If there is no signal in the delay line nothing has been accumulated, so the output is silent
+    
+    if (!mNumSignalSlots)
+    {
+        if (stage == numFFTStages)
+            std::fill_n(mFFTBuffers[3] + (storeOffset ? FFTSizeHalved : 0), FFTSizeHalved, T(0));
+    }
+    else if (stage < numFFTStages)
+        hisstools_rifft_stage(mFFTSetup->get(), &mAccumBuffer, mFFTSizeLog2, stage);
+    else
+    {
+        mNumFFTs++;
+        hisstools_zip(&mAccumBuffer, mFFTBuffers[2], mFFTSizeLog2);
+        scaleStore<WideVector<T>>(mFFTBuffers[3], mFFTBuffers[2], FFTSize, storeOffset);
+        
+        std::fill_n(mAccumBuffer.realp, FFTSizeHalved, T(0));
+        std::fill_n(mAccumBuffer.imagp, FFTSizeHalved, T(0));
+    }
+}
+
+template <class T>
+bool HISSTools::PartitionedConvolveT<T>::process(const T *in, T *out, uintptr_t numSamples)
+{
+    Split impulseTemp;
+    HalfSplit impulseHalfTemp;
+    Split audioInTemp;
     
     // FFT variables
     
@@ -259,20 +616,31 @@ bool HISSTools::PartitionedConvolve::process(const float *in, float *out, uintpt
     
     uintptr_t samplesRemaining = numSamples;
     
+    if (mSchedule)
+        mSchedule->advance(numSamples);
+    
     if  (!mNumPartitions)
         return false;
     
+    // If the scheduler has moved the hop phase adopt it when the input and output are silent (so that the reset is inaudible)
+    // When distributed the boundaries carry no cost, so the phase is left until the next reset
+    
+    if (mSchedule && !mDistributed && !mNumSignalSlots && mHopSilent && mLastHopSilent && mSchedule->isMoved())
+        mResetFlag = true;
+    
     // If we need to reset everything we do that here - happens when the fft size changes, or a new buffer is loaded
     
     if (mResetFlag)
     {
         // Reset fft buffers + accum buffer
         
-        std::fill_n(mFFTBuffers[0], getMaxFFTSize() * 5, 0.f);
+        std::fill_n(mFFTBuffers[0], getMaxFFTSize() * 5, T(0));
         
-        // Reset fft RWCounter (randomly or by fixed amount)
+        // Reset fft RWCounter (by the scheduler, randomly or by fixed amount)
         
-        if (mResetOffset < 0)
+        if (mSchedule)
+            RWCounter = mSchedule->getResetCounter(FFTSizeHalved);
+        else if (mResetOffset < 0)
             RWCounter = mRandDistribution(mRandGenerator);
         else
             RWCounter = mResetOffset % FFTSizeHalved;
@@ -281,8 +649,19 @@ bool HISSTools::PartitionedConvolve::process(const float *in, float *out, uintpt
         
         mInputPosition = 0;
         mPartitionsDone = 0;
-        mLastPartition = 0;
-        mValidPartitions = 1;
+        mStagesDone = 0;
+        
+        // When distributed each partition is processed a hop later, so it also becomes valid a hop later
+        
+        mValidPartitions = mDistributed ? 0 : 1;
+        mValidActive = 0;
+        
+        // Reset silence detection (the buffers are now silent)
+        
+        std::fill(mSilentSlots.begin(), mSilentSlots.end(), true);
+        mNumSignalSlots = 0;
+        mHopSilent = true;
+        mLastHopSilent = true;
         
         // Set reset flag off
         
@@ -306,6 +685,9 @@ bool HISSTools::PartitionedConvolve::process(const float *in, float *out, uintpt
         
         std::copy_n(mFFTBuffers[3] + RWCounter, loopSize, out);
         
+        if (mHopSilent)
+            mHopSilent = isSilent(in, loopSize);
+        
         // Updates to pointers and counters
         
         samplesRemaining -= loopSize;
@@ -316,53 +698,145 @@ bool HISSTools::PartitionedConvolve::process(const float *in, float *out, uintpt
         bool FFTNow = !(RWCounter & hopMask);
         
         // Work loop and scheduling - this is where most of the convolution is done
-        // How many partitions to do this block? (make sure that all partitions are done before we need to do the next fft)
+        // How many partitions to do by now? (make sure that all partitions are done before we need to do the next fft)
+        // Only active partitions are scheduled so that the work for those is spread evenly and silent partitions cost nothing
         
-        if (FFTNow)
-            numPartitionsToDo = (mValidPartitions - mPartitionsDone) - 1;
-        else
-            numPartitionsToDo = (((mValidPartitions - 1) * (RWCounter & hopMask)) / FFTSizeHalved) - mPartitionsDone;
+        // When distributed all of the work for the last hop is done in stages instead (including the ffts)
+        
+        uintptr_t partitionsTarget = mDistributed ? 0 : mValidActive;
+        
+        if (!FFTNow)
+            partitionsTarget = (partitionsTarget * (RWCounter & hopMask)) / FFTSizeHalved;
         
-        while (numPartitionsToDo > 0)
+        // If all of the delay line is silent there is nothing to do
+        
+        if (!mNumSignalSlots)
+            mPartitionsDone = std::max(mPartitionsDone, partitionsTarget);
+        
+        while (mPartitionsDone < partitionsTarget)
         {
-            // Calculate buffer wraparounds (if wraparound is in the middle of this set of partitions this loop will run again)
+            // Calculate offsets and pointers (the input for a partition is that many hops back, wrapping around the buffer unless mirrored)
+            
+            uintptr_t partition = mActivePartitions[mPartitionsDone];
+            uintptr_t inputPosition = mInputPosition + partition;
+            uintptr_t numPartitions = 1;
             
-            uintptr_t nextPartition = (mLastPartition < mNumPartitions) ? mLastPartition : 0;
-            mLastPartition = std::min(mNumPartitions, nextPartition + numPartitionsToDo);
-            numPartitionsToDo -= mLastPartition - nextPartition;
+            if (inputPosition >= mNumPartitions && !mMirrored)
+                inputPosition -= mNumPartitions;
             
-            // Calculate offsets and pointers
+            if (mSilentSlots[inputPosition])
+            {
+                mPartitionsDone++;
+                continue;
+            }
+            
+            // Full precision partitions that follow in both the impulse and the delay line (without wrapping) are done in one pass
+            
+            if (!mImpulseHalf.realp)
+            {
+                for (uintptr_t i = mPartitionsDone + 1; i < partitionsTarget; i++, numPartitions++)
+                {
+                    uintptr_t next = inputPosition + numPartitions;
+                    
+                    if (mActivePartitions[i] != partition + numPartitions || (next >= mNumPartitions && !mMirrored) || mSilentSlots[next])
+                        break;
+                }
+            }
             
-            offsetSplitPointer(impulseTemp, mImpulseBuffer, ((mPartitionsDone + 1) * FFTSizeHalved));
-            offsetSplitPointer(audioInTemp, mInputBuffer, (nextPartition * FFTSizeHalved));
+            offsetSplitPointer(audioInTemp, mInputBuffer, (inputPosition * FFTSizeHalved));
+            mPartitionsDone += numPartitions;
+            mNumMACs += numPartitions;
             
-            // Do processing
+            // Do processing (with the impulse at full or half precision)
             
-            for (uintptr_t i = nextPartition; i < mLastPartition; i++)
+            if (mImpulseHalf.realp)
             {
-                processPartition(audioInTemp, impulseTemp, mAccumBuffer, FFTSizeHalved);
-                offsetSplitPointer(impulseTemp, impulseTemp, FFTSizeHalved);
-                offsetSplitPointer(audioInTemp, audioInTemp, FFTSizeHalved);
-                mPartitionsDone++;
+                offsetSplitPointer(impulseHalfTemp, mImpulseHalf, (partition * FFTSizeHalved));
+                processPartition<WideVector<T>>(audioInTemp, impulseHalfTemp, mAccumBuffer, FFTSizeHalved);
+            }
+            else
+            {
+                offsetSplitPointer(impulseTemp, mImpulseBuffer, (partition * FFTSizeHalved));
+                processPartitions<WideVector<T>>(audioInTemp, impulseTemp, mAccumBuffer, FFTSizeHalved, numPartitions);
             }
         }
         
+        if (mDistributed)
+        {
+            uintptr_t stagesTarget = hisstools_rfft_stages(mFFTSizeLog2) * 2 + mValidActive + 2;
+            
+            if (!FFTNow)
+                stagesTarget = (stagesTarget * (RWCounter & hopMask)) / FFTSizeHalved;
+            
+            for (; mStagesDone < stagesTarget; mStagesDone++)
+                processStage(mStagesDone, RWCounter <= FFTSizeHalved);
+        }
+        
         // FFT processing
         
         if (FFTNow)
         {
-            // Do the fft into the input buffer, add first partition (needed now), do ifft, scale and store (overlap-save)
-
-            offsetSplitPointer(audioInTemp, mInputBuffer, (mInputPosition * FFTSizeHalved));
-            hisstools_rfft(mFFTSetup, mFFTBuffers[(RWCounter == FFTSize) ? 1 : 0], &audioInTemp, FFTSize, mFFTSizeLog2);
-            processPartition(audioInTemp, mImpulseBuffer, mAccumBuffer, FFTSizeHalved);
-            hisstools_rifft(mFFTSetup, &mAccumBuffer, mFFTBuffers[2], mFFTSizeLog2);
-            scaleStore<FloatVector>(mFFTBuffers[3], mFFTBuffers[2], FFTSize, (RWCounter != FFTSize));
+            // Mark the slot if the input to the fft is silent (the last two hops) and keep count of the slots with signal
+            
+            bool silent = mHopSilent && mLastHopSilent;
+            
+            if (mSilentSlots[mInputPosition] != silent)
+            {
+                mSilentSlots[mInputPosition] = silent;
+                mNumSignalSlots = silent ? mNumSignalSlots - 1 : mNumSignalSlots + 1;
+                
+                if (mMirrored)
+                    mSilentSlots[mInputPosition + mNumPartitions] = silent;
+            }
             
-            // Clear accumulation buffer
+            mLastHopSilent = mHopSilent;
+            mHopSilent = true;
             
-            std::fill_n(mAccumBuffer.realp, FFTSizeHalved, 0.f);
-            std::fill_n(mAccumBuffer.imagp, FFTSizeHalved, 0.f);
+            // Do the fft into the input buffer, add first partition (needed now), do ifft, scale and store (overlap-save)
+            // If there is no signal in the delay line nothing has been accumulated, so the output is silent
+            // When distributed the input is only unzipped into the delay line (the rest is done in stages over the next hop)
+
+            if (mDistributed)
+            {
+                if (!silent)
+                {
+                    offsetSplitPointer(audioInTemp, mInputBuffer, (mInputPosition * FFTSizeHalved));
+                    hisstools_unzip(mFFTBuffers[(RWCounter == FFTSize) ? 1 : 0], &audioInTemp, mFFTSizeLog2);
+                }
+            }
+            else
+            {
+                if (!silent)
+                {
+                    offsetSplitPointer(audioInTemp, mInputBuffer, (mInputPosition * FFTSizeHalved));
+                    hisstools_rfft(mFFTSetup->get(), mFFTBuffers[(RWCounter == FFTSize) ? 1 : 0], &audioInTemp, FFTSize, mFFTSizeLog2);
+                    mNumFFTs++;
+                    
+                    if (mMirrored)
+                        mirrorSlot(mInputPosition);
+                    
+                    mNumMACs += mFirstActive ? 1 : 0;
+                    
+                    if (mFirstActive && mImpulseHalf.realp)
+                        processPartition<WideVector<T>>(audioInTemp, mImpulseHalf, mAccumBuffer, FFTSizeHalved);
+                    else if (mFirstActive)
+                        processPartition<WideVector<T>>(audioInTemp, mImpulseBuffer, mAccumBuffer, FFTSizeHalved);
+                }
+                
+                if (mNumSignalSlots)
+                {
+                    hisstools_rifft(mFFTSetup->get(), &mAccumBuffer, mFFTBuffers[2], mFFTSizeLog2);
+                    mNumFFTs++;
+                    scaleStore<WideVector<T>>(mFFTBuffers[3], mFFTBuffers[2], FFTSize, (RWCounter != FFTSize));
+                    
+                    // Clear accumulation buffer
+                    
+                    std::fill_n(mAccumBuffer.realp, FFTSizeHalved, T(0));
+                    std::fill_n(mAccumBuffer.imagp, FFTSizeHalved, T(0));
+                }
+                else
+                    std::fill_n(mFFTBuffers[3] + ((RWCounter != FFTSize) ? FFTSizeHalved : 0), FFTSizeHalved, T(0));
+            }
             
             // Update RWCounter
             
@@ -372,8 +846,11 @@ bool HISSTools::PartitionedConvolve::process(const float *in, float *out, uintpt
             
             mValidPartitions = std::min(mNumPartitions, mValidPartitions + 1);
             mInputPosition = mInputPosition ? mInputPosition - 1 : mNumPartitions - 1;
-            mLastPartition = mInputPosition + 1;
             mPartitionsDone = 0;
+            mStagesDone = 0;
+            
+            if (mValidActive < mActivePartitions.size() && mActivePartitions[mValidActive] < mValidPartitions)
+                mValidActive++;
         }
     }
     
@@ -384,43 +861,7 @@ bool HISSTools::PartitionedConvolve::process(const float *in, float *out, uintpt
     return true;
 }
 
-void HISSTools::PartitionedConvolve::processPartition(FFT_SPLIT_COMPLEX_F in1, FFT_SPLIT_COMPLEX_F in2, FFT_SPLIT_COMPLEX_F out, uintptr_t numBins)
-{
-    uintptr_t numVecs = numBins / FloatVector::size;
-    
-    FloatVector *iReal1 = reinterpret_cast<FloatVector *>(in1.realp);
-    FloatVector *iImag1 = reinterpret_cast<FloatVector *>(in1.imagp);
-    FloatVector *iReal2 = reinterpret_cast<FloatVector *>(in2.realp);
-    FloatVector *iImag2 = reinterpret_cast<FloatVector *>(in2.imagp);
-    FloatVector *oReal = reinterpret_cast<FloatVector *>(out.realp);
-    FloatVector *oImag = reinterpret_cast<FloatVector *>(out.imagp);
-    
-    float nyquist1 = in1.imagp[0];
-    float nyquist2 = in2.imagp[0];
-    
-    // Do Nyquist Calculation and then zero these bins
-    
-    out.imagp[0] += nyquist1 * nyquist2;
-    
-    in1.imagp[0] = 0.f;
-    in2.imagp[0] = 0.f;
-    
-    // Do other bins (loop unrolled)
-    
-    for (uintptr_t i = 0; i + 3 < numVecs; i += 4)
-    {
-        *oReal++ += (iReal1[i + 0] * iReal2[i + 0]) - (iImag1[i + 0] * iImag2[i + 0]);
-        *oImag++ += (iReal1[i + 0] * iImag2[i + 0]) + (iImag1[i + 0] * iReal2[i + 0]);
-        *oReal++ += (iReal1[i + 1] * iReal2[i + 1]) - (iImag1[i + 1] * iImag2[i + 1]);
-        *oImag++ += (iReal1[i + 1] * iImag2[i + 1]) + (iImag1[i + 1] * iReal2[i + 1]);
-        *oReal++ += (iReal1[i + 2] * iReal2[i + 2]) - (iImag1[i + 2] * iImag2[i + 2]);
-        *oImag++ += (iReal1[i + 2] * iImag2[i + 2]) + (iImag1[i + 2] * iReal2[i + 2]);
-        *oReal++ += (iReal1[i + 3] * iReal2[i + 3]) - (iImag1[i + 3] * iImag2[i + 3]);
-        *oImag++ += (iReal1[i + 3] * iImag2[i + 3]) + (iImag1[i + 3] * iReal2[i + 3]);
-    }
-    
-    // Replace nyquist bins
-    
-    in1.imagp[0] = nyquist1;
-    in2.imagp[0] = nyquist2;
-}
+// Explicit instantiations
+
+template class HISSTools::PartitionedConvolveT<float>;
+template class HISSTools::PartitionedConvolveT<double>;
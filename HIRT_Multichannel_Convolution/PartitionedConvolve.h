@@ -1,17 +1,23 @@
 
 #pragma once
 
-#include "../HISSTools_FFT/HISSTools_FFT.h"
-
 #include "ConvolveErrors.h"
+#include "ConvolveFFTTypes.h"
+#include "PhaseScheduler.h"
+#include "SharedSpectra.h"
 
 #include <cstdint>
+#include <memory>
 #include <random>
+#include <vector>
 
 namespace HISSTools
 {
-    class PartitionedConvolve
+    template <class T>
+    class PartitionedConvolveT
     {
+        typedef typename FFTTypes<T>::Split Split;
+        
         // N.B. MIN_FFT_SIZE_LOG2 should never be smaller than 4, as below code assumes loop unroll of vectors (4 vals) by 4 (== 16 or 2^4)
         // MAX_FFT_SIZE_LOG2 is perhaps conservative right now, but it is easy to increase this if necessary
         
@@ -20,32 +26,97 @@ namespace HISSTools
         
     public:
         
-        PartitionedConvolve(uintptr_t maxFFTSize, uintptr_t maxLength, uintptr_t offset, uintptr_t length);
-        ~PartitionedConvolve();
+        // Buffers (and impulse spectra) are taken from the allocator (or the system if it is null)
+        
+        PartitionedConvolveT(uintptr_t maxFFTSize, uintptr_t maxLength, uintptr_t offset, uintptr_t length, AllocatorPtr allocator = nullptr);
+        ~PartitionedConvolveT();
         
         // Non-moveable and copyable
 
-        PartitionedConvolve(PartitionedConvolve& obj) = delete;
-        PartitionedConvolve& operator = (PartitionedConvolve& obj) = delete;
-        PartitionedConvolve(PartitionedConvolve&& obj) = delete;
-        PartitionedConvolve& operator = (PartitionedConvolve&& obj) = delete;
+        PartitionedConvolveT(PartitionedConvolveT& obj) = delete;
+        PartitionedConvolveT& operator = (PartitionedConvolveT& obj) = delete;
+        PartitionedConvolveT(PartitionedConvolveT&& obj) = delete;
+        PartitionedConvolveT& operator = (PartitionedConvolveT&& obj) = delete;
         
         ConvolveError setFFTSize(uintptr_t FFTSize);
+        uintptr_t getFFTSize() const { return uintptr_t(1) << mFFTSizeLog2; }
         ConvolveError setLength(uintptr_t length);
         void setOffset(uintptr_t offset);
         void setResetOffset(intptr_t offset = -1);
+        
+        // If set the hop phase is assigned by the PhaseScheduler when reset (replacing the reset offset) to balance load across the process
+        // A new phase from the scheduler is also adopted once the object is silent (when a reset makes no difference to the output)
+        // N.B. this should not be changed whilst processing
+        
+        void setScheduled(bool scheduled);
 
+        // Partitions with an RMS level at or below the threshold are skipped (the default of zero skips only silent partitions)
+        // If trimTail is set any trailing skipped partitions are removed - both settings take effect when the impulse is next set
+        
+        void setSilenceThreshold(double threshold, bool trimTail = false);
+        uintptr_t getNumActivePartitions() const { return mActivePartitions.size() + (mFirstActive ? 1 : 0); }
+        
+        // If set the impulse spectrum is stored as bfloat16 from the next set (halving its memory and the bandwidth needed to process it)
+        // The relative error of each bin is at most 2^-8, so the error in the output is at least 48dB below the output of this object
+        
+        void setHalfPrecision(bool halfPrecision);
+        
+        // If set the ffts are performed in stages spread over the following hop along with the partitions (and a reset is triggered)
+        // The cost of each block is then near constant, but the output is delayed by a further hop (half the fft size)
+        
+        void setDistributed(bool distributed);
+        bool getDistributed() const { return mDistributed; }
+        
+        // If set each input spectrum is stored twice (doubling the delay line) so the partitions of a hop read it without wrapping
+        // The input for the partitions is then one ascending pass in memory alongside the impulse (this triggers a reset)
+        // N.B. this doubles the memory of the delay line (which is reallocated, so this should not be changed whilst processing)
+        
+        ConvolveError setMirrored(bool mirrored);
+        
         ConvolveError set(const float *input, uintptr_t length);
+        ConvolveError set(const double *input, uintptr_t length);
+        
+        // Loading in stages - partitions can be set in any order (and concurrently) before completing the load
+        // prepareSet() returns the number of partitions to set (zero if the spectrum is shared with another object)
+        // N.B. the object must not be processed between preparing and completing the load
+        
+        uintptr_t prepareSet(const float *input, uintptr_t length);
+        uintptr_t prepareSet(const double *input, uintptr_t length);
+        void setPartition(const float *input, uintptr_t length, uintptr_t partition);
+        void setPartition(const double *input, uintptr_t length, uintptr_t partition);
+        ConvolveError completeSet(uintptr_t length);
+        
         void reset();
         
-        bool process(const float *in, float *out, uintptr_t numSamples);
+        bool process(const T *in, T *out, uintptr_t numSamples);
 
+        // Running counts of the transforms and partition multiply-accumulates performed by process() (for instrumentation)
+        
+        uint64_t getFFTCount() const { return mNumFFTs; }
+        uint64_t getMACCount() const { return mNumMACs; }
+    
     private:
         
-        uintptr_t getFFTSize()      { return uintptr_t(1) << mFFTSizeLog2; }
         uintptr_t getMaxFFTSize()   { return uintptr_t(1) << mMaxFFTSizeLog2; }
         
-        void processPartition(FFT_SPLIT_COMPLEX_F in1, FFT_SPLIT_COMPLEX_F in2, FFT_SPLIT_COMPLEX_F out, uintptr_t numBins);
+        uintptr_t getLoadLength(uintptr_t length);
+        uintptr_t getNumPartitions(uintptr_t length);
+        
+        template <class U>
+        uintptr_t prepareImpulse(const U *input, uintptr_t length);
+        
+        template <class U>
+        ConvolveError setImpulse(const U *input, uintptr_t length);
+        
+        template <class U>
+        void loadPartition(const U *input, uintptr_t length, uintptr_t partition);
+        
+        void indexPartitions();
+        void processStage(uintptr_t stage, bool storeOffset);
+        void updateImpulseBuffers();
+        void updateSchedule();
+        void mirrorSlot(uintptr_t slot);
+        
         ConvolveError setMaxFFTSize(uintptr_t max_fft_size);
         uintptr_t log2(uintptr_t value);
 
@@ -55,9 +126,15 @@ namespace HISSTools
         uintptr_t mLength;
         uintptr_t mMaxImpulseLength;
         
+        double mSilenceThreshold;
+        bool mTrimTail;
+        bool mHalfPrecision;
+        bool mDistributed;
+        bool mMirrored;
+        
         // FFT variables
         
-        FFT_SETUP_F mFFTSetup;
+        std::shared_ptr<const SharedFFTSetup<T>> mFFTSetup;
         
         uintptr_t mMaxFFTSizeLog2;
         uintptr_t mFFTSizeLog2;
@@ -67,21 +144,48 @@ namespace HISSTools
         
         uintptr_t mInputPosition;
         uintptr_t mPartitionsDone;
-        uintptr_t mLastPartition;
+        uintptr_t mStagesDone;
         uintptr_t mNumPartitions;
         uintptr_t mValidPartitions;
+        uintptr_t mValidActive;
+        
+        // Index of the partitions above the silence threshold (the first partition is processed with the fft so is flagged separately)
+        
+        std::vector<uintptr_t> mActivePartitions;
+        bool mFirstActive;
+        
+        // Work counters (only used by the processing thread)
+        
+        uint64_t mNumFFTs;
+        uint64_t mNumMACs;
+        
+        // Input silence (slots of the frequency-domain delay line with silent input are marked rather than transformed)
+        
+        std::vector<bool> mSilentSlots;
+        uintptr_t mNumSignalSlots;
+        bool mHopSilent;
+        bool mLastHopSilent;
         
         // Internal buffers
         
-        float *mFFTBuffers[4];
+        AllocatorPtr mAllocator;
+        
+        T *mFFTBuffers[4];
+        
+        // The impulse spectrum may be shared with other objects (mImpulseBuffer or mImpulseHalf points into it)
+        
+        std::shared_ptr<ImpulseSpectrum<T>> mImpulse;
+        SpectrumKey mImpulseKey;
+        bool mImpulseCached;
         
-        FFT_SPLIT_COMPLEX_F mImpulseBuffer;
-        FFT_SPLIT_COMPLEX_F	mInputBuffer;
-        FFT_SPLIT_COMPLEX_F	mAccumBuffer;
-        FFT_SPLIT_COMPLEX_F	mPartitionTemp;
+        Split mImpulseBuffer;
+        HalfSplit mImpulseHalf;
+        Split mInputBuffer;
+        Split mAccumBuffer;
         
         // Flags
         
+        std::unique_ptr<PhaseScheduler::Entry> mSchedule;
         intptr_t mResetOffset;
         bool mResetFlag;
         
@@ -90,4 +194,6 @@ namespace HISSTools
         std::default_random_engine mRandGenerator;
         std::uniform_int_distribution<uintptr_t> mRandDistribution;
     };
+    
+    typedef PartitionedConvolveT<float> PartitionedConvolve;
 }
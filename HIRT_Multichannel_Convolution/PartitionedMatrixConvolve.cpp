@@ -0,0 +1,785 @@
+
+/*
+ *  PartitionedMatrixConvolve
+ *
+ *    PartitionedMatrixConvolve performs FFT-based partitioned convolution for a matrix of inputs and outputs at a single partition size.
+ *
+ *    Each input is transformed once per hop and its spectra are stored in a single frequency-domain delay line shared by all outputs.
+ *    Each output accumulates the spectral products for all of its inputs and requires only one inverse FFT per hop.
+ *    Note that all input / output pairs share scheduling, so setting an individual impulse (or growing the delay lines) does not reset the other pairs.
+ *    Routing is sparse - only pairs with an impulse are allocated and visited, and inputs that feed no output are not transformed.
+ *
+ *  Copyright 2012 Alex Harker. All rights reserved.
+ *
+ */
+
+#include "ConvolveKernels.h"
+#include "PartitionedMatrixConvolve.h"
+
+#include <algorithm>
+#include <new>
+
+template <class T>
+HISSTools::PartitionedMatrixConvolve<T>::PartitionedMatrixConvolve(uint32_t numIns, uint32_t numOuts, uintptr_t FFTSize, uintptr_t maxLength, uintptr_t offset, uintptr_t length, AllocatorPtr allocator)
+: mNumIns(numIns)
+, mNumOuts(numOuts)
+, mOffset(offset)
+, mLength(length)
+, mAllocator(ConvolveAllocator::select(allocator))
+, mFFTSizeLog2(MIN_FFT_SIZE_LOG2)
+, mRWCounter(0)
+, mInputPosition(0)
+, mPartitionsDone(0)
+, mNumPartitions(0)
+, mNumSlots(0)
+, mInputFFTBuffers(numIns, nullptr)
+, mInputSpectra(numIns)
+, mResetFrame(nullptr)
+, mNumSignalSlots(numIns, 0)
+, mHopSilent(numIns, true)
+, mLastHopSilent(numIns, true)
+, mOutputFFTBuffers(numOuts, nullptr)
+, mOutputActive(numOuts, false)
+, mImpulses(numIns * numOuts)
+, mRoutes(numOuts)
+, mInputActive(numIns, false)
+, mResetOffset(-1)
+, mResetFlag(true)
+, mRandGenerator(std::random_device()())
+{
+    // Set the FFT size (rounding up to the nearest power of two within range)
+    
+    while ((getFFTSize() < FFTSize) && (mFFTSizeLog2 < MAX_FFT_SIZE_LOG2))
+        mFFTSizeLog2++;
+    
+    FFTSize = getFFTSize();
+    mRandDistribution = std::uniform_int_distribution<uintptr_t>(0, (FFTSize >> 1) - 1);
+    
+    // Allocate fft and temporary buffers (inputs require two fft buffers and outputs an ifft buffer, output buffer and accumulation buffer)
+    
+    for (uint32_t i = 0; i < mNumIns; i++)
+    {
+        mInputFFTBuffers[i] = mAllocator->allocate<T>(FFTSize * 2);
+        mInputSpectra[i].realp = nullptr;
+        mInputSpectra[i].imagp = nullptr;
+    }
+    
+    for (uint32_t i = 0; i < mNumOuts; i++)
+        mOutputFFTBuffers[i] = mAllocator->allocate<T>(FFTSize * 3);
+    
+    mResetFrame = mAllocator->allocate<T>(FFTSize);
+    
+    // Reserve the impulse lengths (and allocate the frequency-domain delay lines to match)
+    
+    for (auto it = mImpulses.begin(); it != mImpulses.end(); it++)
+    {
+        it->mBuffer.realp = nullptr;
+        it->mBuffer.imagp = nullptr;
+        it->mMaxLength = 0;
+        it->mNumPartitions = 0;
+        it->mResetSpectra.realp = nullptr;
+        it->mResetSpectra.imagp = nullptr;
+        it->mResetPoint = 0;
+        it->mResetHops = NOT_RESET;
+    }
+    
+    bool failed = !mResetFrame;
+    
+    for (uint32_t i = 0; i < mNumIns; i++)
+        failed = failed || !mInputFFTBuffers[i];
+    
+    for (uint32_t i = 0; i < mNumOuts; i++)
+        failed = failed || !mOutputFFTBuffers[i];
+    
+    for (uint32_t i = 0; i < mNumOuts && !failed; i++)
+        for (uint32_t j = 0; j < mNumIns && !failed; j++)
+            failed = resize(j, i, maxLength) == CONVOLVE_ERR_MEM_UNAVAILABLE;
+    
+    // N.B. the destructor is not called if construction fails, so free any buffer that was allocated
+    
+    if (failed)
+    {
+        freeBuffers();
+        throw std::bad_alloc();
+    }
+    
+    mFFTSetup = SharedFFTSetup<T>::acquire(mFFTSizeLog2);
+}
+
+template <class T>
+HISSTools::PartitionedMatrixConvolve<T>::~PartitionedMatrixConvolve()
+{
+    freeBuffers();
+}
+
+template <class T>
+void HISSTools::PartitionedMatrixConvolve<T>::freeBuffers()
+{
+    for (auto it = mImpulses.begin(); it != mImpulses.end(); it++)
+    {
+        mAllocator->deallocate(it->mBuffer.realp);
+    }
+    
+    mAllocator->deallocate(mResetFrame);
+    
+    for (uint32_t i = 0; i < mNumIns; i++)
+    {
+        mAllocator->deallocate(mInputFFTBuffers[i]);
+        mAllocator->deallocate(mInputSpectra[i].realp);
+    }
+    
+    for (uint32_t i = 0; i < mNumOuts; i++)
+        mAllocator->deallocate(mOutputFFTBuffers[i]);
+}
+
+template <class T>
+ConvolveError HISSTools::PartitionedMatrixConvolve<T>::allocateInputs(uintptr_t numSlots)
+{
+    uintptr_t FFTSizeHalved = getFFTSize() >> 1;
+    uintptr_t size = numSlots * FFTSizeHalved;
+    
+    std::vector<Split> spectra(mNumIns);
+    std::vector<bool> silentSlots(numSlots * mNumIns, true);
+    
+    // Allocate all of the new delay lines first (keeping the current ones if any allocation fails)
+    
+    bool failed = false;
+    
+    for (uint32_t i = 0; i < mNumIns; i++)
+    {
+        spectra[i].realp = mAllocator->allocate<T>(size * 2);
+        spectra[i].imagp = spectra[i].realp + size;
+        failed = failed || !spectra[i].realp;
+    }
+    
+    if (failed)
+    {
+        for (uint32_t i = 0; i < mNumIns; i++)
+            mAllocator->deallocate(spectra[i].realp);
+        
+        return CONVOLVE_ERR_MEM_UNAVAILABLE;
+    }
+    
+    // Copy the slots in use so that the current position becomes the first slot (the new slots are silent)
+    
+    for (uint32_t i = 0; i < mNumIns; i++)
+    {
+        for (uintptr_t j = 0; j < mNumSlots; j++)
+        {
+            uintptr_t slot = (mInputPosition + j) % mNumSlots;
+            
+            std::copy_n(mInputSpectra[i].realp + slot * FFTSizeHalved, FFTSizeHalved, spectra[i].realp + j * FFTSizeHalved);
+            std::copy_n(mInputSpectra[i].imagp + slot * FFTSizeHalved, FFTSizeHalved, spectra[i].imagp + j * FFTSizeHalved);
+            silentSlots[j * mNumIns + i] = isSlotSilent(i, slot);
+        }
+        
+        std::fill_n(spectra[i].realp + mNumSlots * FFTSizeHalved, size - mNumSlots * FFTSizeHalved, T(0));
+        std::fill_n(spectra[i].imagp + mNumSlots * FFTSizeHalved, size - mNumSlots * FFTSizeHalved, T(0));
+        
+        mAllocator->deallocate(mInputSpectra[i].realp);
+        mInputSpectra[i] = spectra[i];
+    }
+    
+    mSilentSlots.swap(silentSlots);
+    mInputPosition = 0;
+    mNumSlots = numSlots;
+    
+    return CONVOLVE_ERR_NONE;
+}
+
+template <class T>
+void HISSTools::PartitionedMatrixConvolve<T>::updateRoutes()
+{
+    uintptr_t FFTSize = getFFTSize();
+    
+    mNumPartitions = 0;
+    mActiveOutputs.clear();
+    std::fill(mInputActive.begin(), mInputActive.end(), false);
+    
+    for (uint32_t i = 0; i < mNumOuts; i++)
+    {
+        mRoutes[i].clear();
+        
+        for (uint32_t j = 0; j < mNumIns; j++)
+        {
+            uintptr_t numPartitions = getImpulse(j, i).mNumPartitions;
+            
+            if (numPartitions)
+            {
+                mNumPartitions = std::max(mNumPartitions, numPartitions);
+                mRoutes[i].push_back(j);
+                mInputActive[j] = true;
+            }
+        }
+        
+        bool active = !mRoutes[i].empty();
+        
+        // Outputs that become active should not output stale data
+        
+        if (active && !mOutputActive[i])
+            std::fill_n(mOutputFFTBuffers[i], FFTSize * 3, T(0));
+        
+        if (active)
+            mActiveOutputs.push_back(i);
+        
+        mOutputActive[i] = active;
+    }
+}
+
+template <class T>
+ConvolveError HISSTools::PartitionedMatrixConvolve<T>::resize(uint32_t inChan, uint32_t outChan, uintptr_t maxLength)
+{
+    if (inChan >= mNumIns)
+        return CONVOLVE_ERR_IN_CHAN_OUT_OF_RANGE;
+    
+    if (outChan >= mNumOuts)
+        return CONVOLVE_ERR_OUT_CHAN_OUT_OF_RANGE;
+    
+    Impulse& impulse = getImpulse(inChan, outChan);
+    uintptr_t FFTSizeHalved = getFFTSize() >> 1;
+    uintptr_t numSlots = 0;
+    
+    // This is designed to make sure we can load the max impulse length (the buffer is allocated when an impulse is set)
+    
+    maxLength = ((maxLength + FFTSizeHalved - 1) / FFTSizeHalved) * FFTSizeHalved;
+    
+    // The delay lines must be long enough to serve the longest impulse (the pair is left unchanged if they cannot grow)
+    
+    for (auto it = mImpulses.begin(); it != mImpulses.end(); it++)
+        numSlots = std::max(numSlots, (&*it == &impulse ? maxLength : it->mMaxLength) / FFTSizeHalved);
+    
+    if (numSlots > mNumSlots && allocateInputs(numSlots) != CONVOLVE_ERR_NONE)
+        return CONVOLVE_ERR_MEM_UNAVAILABLE;
+    
+    if (maxLength != impulse.mMaxLength)
+    {
+        mAllocator->deallocate(impulse.mBuffer.realp);
+        
+        impulse.mBuffer.realp = nullptr;
+        impulse.mBuffer.imagp = nullptr;
+        impulse.mResetSpectra.realp = nullptr;
+        impulse.mResetSpectra.imagp = nullptr;
+        impulse.mResetHops = NOT_RESET;
+        impulse.mMaxLength = maxLength;
+        impulse.mNumPartitions = 0;
+    }
+    
+    updateRoutes();
+    
+    return CONVOLVE_ERR_NONE;
+}
+
+template <class T>
+void HISSTools::PartitionedMatrixConvolve<T>::setResetOffset(intptr_t offset)
+{
+    mResetOffset = offset;
+}
+
+template <class T>
+ConvolveError HISSTools::PartitionedMatrixConvolve<T>::set(uint32_t inChan, uint32_t outChan, const float *input, uintptr_t length)
+{
+    return setImpulse(inChan, outChan, input, length);
+}
+
+template <class T>
+ConvolveError HISSTools::PartitionedMatrixConvolve<T>::set(uint32_t inChan, uint32_t outChan, const double *input, uintptr_t length)
+{
+    return setImpulse(inChan, outChan, input, length);
+}
+
+template <class T>
+ConvolveError HISSTools::PartitionedMatrixConvolve<T>::prepare(uint32_t inChan, uint32_t outChan, const float *input, uintptr_t length, Prepared& prepared)
+{
+    return prepareImpulse(inChan, outChan, input, length, prepared);
+}
+
+template <class T>
+ConvolveError HISSTools::PartitionedMatrixConvolve<T>::prepare(uint32_t inChan, uint32_t outChan, const double *input, uintptr_t length, Prepared& prepared)
+{
+    return prepareImpulse(inChan, outChan, input, length, prepared);
+}
+
+template <class T>
+template <class U>
+ConvolveError HISSTools::PartitionedMatrixConvolve<T>::setImpulse(uint32_t inChan, uint32_t outChan, const U *input, uintptr_t length)
+{
+    Prepared prepared;
+    ConvolveError error = prepareImpulse(inChan, outChan, input, length, prepared);
+    
+    if (error == CONVOLVE_ERR_IN_CHAN_OUT_OF_RANGE || error == CONVOLVE_ERR_OUT_CHAN_OUT_OF_RANGE)
+        return error;
+    
+    publish(prepared);
+    release(prepared);
+    
+    return error;
+}
+
+template <class T>
+template <class U>
+ConvolveError HISSTools::PartitionedMatrixConvolve<T>::prepareImpulse(uint32_t inChan, uint32_t outChan, const U *input, uintptr_t length, Prepared& prepared)
+{
+    if (inChan >= mNumIns)
+        return CONVOLVE_ERR_IN_CHAN_OUT_OF_RANGE;
+    
+    if (outChan >= mNumOuts)
+        return CONVOLVE_ERR_OUT_CHAN_OUT_OF_RANGE;
+    
+    ConvolveError error = CONVOLVE_ERR_NONE;
+    Impulse& impulse = getImpulse(inChan, outChan);
+    
+    // FFT variables / attributes
+    
+    uintptr_t bufferPosition;
+    uintptr_t FFTSize = getFFTSize();
+    uintptr_t FFTSizeHalved = FFTSize >> 1;
+    
+    // Partition variables
+    
+    Split bufferTemp;
+    
+    uintptr_t numPartitions;
+    
+    // Calculate how much of the buffer to load
+    
+    length = (!input || length <= mOffset) ? 0 : length - mOffset;
+    length = (mLength && mLength < length) ? mLength : length;
+    
+    if (length > impulse.mMaxLength)
+    {
+        length = impulse.mMaxLength;
+        error = CONVOLVE_ERR_MEM_ALLOC_TOO_SMALL;
+    }
+    
+    // Allocate a new buffer for a pair with an impulse (a pair without one has no buffer)
+    // The two frames that are transformed again when the pair is reset follow the impulse in the same allocation
+    
+    release(prepared);
+    prepared.mInChan = inChan;
+    prepared.mOutChan = outChan;
+    
+    if (length)
+    {
+        prepared.mBuffer.realp = mAllocator->allocate<T>((impulse.mMaxLength + FFTSizeHalved * 2) * 2);
+        
+        if (prepared.mBuffer.realp)
+        {
+            prepared.mBuffer.imagp = prepared.mBuffer.realp + impulse.mMaxLength;
+            prepared.mResetSpectra.realp = prepared.mBuffer.realp + impulse.mMaxLength * 2;
+            prepared.mResetSpectra.imagp = prepared.mResetSpectra.realp + FFTSizeHalved * 2;
+        }
+        else
+        {
+            length = 0;
+            error = CONVOLVE_ERR_MEM_UNAVAILABLE;
+        }
+    }
+    
+    // Partition / load the impulse
+    
+    for (bufferPosition = mOffset, bufferTemp = prepared.mBuffer, numPartitions = 0; length > 0; bufferPosition += FFTSizeHalved, numPartitions++)
+    {
+        // Get samples up to half the fft size
+        
+        uintptr_t numSamps = (length > FFTSizeHalved) ? FFTSizeHalved : length;
+        length -= numSamps;
+        
+        // Get samples, convert and zero pad straight into position and then do fft
+        
+        hisstools_unzip_zero(input + bufferPosition, &bufferTemp, numSamps, mFFTSizeLog2);
+        hisstools_rfft(mFFTSetup->get(), &bufferTemp, mFFTSizeLog2);
+        offsetSplitPointer(bufferTemp, bufferTemp, FFTSizeHalved);
+    }
+    
+    prepared.mNumPartitions = numPartitions;
+    
+    return error;
+}
+
+template <class T>
+void HISSTools::PartitionedMatrixConvolve<T>::publish(Prepared& prepared)
+{
+    Impulse& impulse = getImpulse(prepared.mInChan, prepared.mOutChan);
+    
+    std::swap(impulse.mBuffer, prepared.mBuffer);
+    std::swap(impulse.mResetSpectra, prepared.mResetSpectra);
+    std::swap(impulse.mNumPartitions, prepared.mNumPartitions);
+    
+    // A reset in progress continues with the frames already transformed (or is dropped if the pair no longer has an impulse)
+    
+    if (impulse.mResetHops != NOT_RESET)
+    {
+        if (impulse.mResetSpectra.realp)
+        {
+            uintptr_t size = getFFTSize() * 2;
+            
+            std::copy_n(prepared.mResetSpectra.realp, size, impulse.mResetSpectra.realp);
+        }
+        else
+            impulse.mResetHops = NOT_RESET;
+    }
+    
+    updateRoutes();
+}
+
+template <class T>
+void HISSTools::PartitionedMatrixConvolve<T>::release(Prepared& prepared)
+{
+    mAllocator->deallocate(prepared.mBuffer.realp);
+    prepared.mBuffer.realp = nullptr;
+    prepared.mBuffer.imagp = nullptr;
+    prepared.mResetSpectra.realp = nullptr;
+    prepared.mResetSpectra.imagp = nullptr;
+    prepared.mNumPartitions = 0;
+}
+
+template <class T>
+ConvolveError HISSTools::PartitionedMatrixConvolve<T>::reset(uint32_t inChan, uint32_t outChan)
+{
+    if (inChan >= mNumIns)
+        return CONVOLVE_ERR_IN_CHAN_OUT_OF_RANGE;
+    
+    if (outChan >= mNumOuts)
+        return CONVOLVE_ERR_OUT_CHAN_OUT_OF_RANGE;
+    
+    Impulse& impulse = getImpulse(inChan, outChan);
+    
+    // The point is the number of samples of the current hop that precede the reset
+    
+    if (impulse.mResetSpectra.realp)
+    {
+        impulse.mResetPoint = mRWCounter & ((getFFTSize() >> 1) - 1);
+        impulse.mResetHops = RESET_PENDING;
+    }
+    
+    return CONVOLVE_ERR_NONE;
+}
+
+template <class T>
+bool HISSTools::PartitionedMatrixConvolve<T>::getPartitionInput(Impulse& impulse, uint32_t inChan, uintptr_t partition, Split& spectrum)
+{
+    uintptr_t FFTSizeHalved = getFFTSize() >> 1;
+    uintptr_t hops = impulse.mResetHops;
+    uintptr_t slot = (mInputPosition + partition) % mNumSlots;
+    
+    // Frames from before the reset are skipped and those straddling it are replaced (once they have been transformed)
+    
+    if (hops != NOT_RESET && partition + 1 >= hops)
+    {
+        if (hops == RESET_PENDING || partition > hops)
+            return false;
+        
+        if (partition == hops || impulse.mResetPoint)
+        {
+            offsetSplitPointer(spectrum, impulse.mResetSpectra, (partition == hops ? 0 : FFTSizeHalved));
+            return true;
+        }
+    }
+    
+    offsetSplitPointer(spectrum, mInputSpectra[inChan], slot * FFTSizeHalved);
+    
+    return !isSlotSilent(inChan, slot);
+}
+
+template <class T>
+void HISSTools::PartitionedMatrixConvolve<T>::transformResetFrame(Impulse& impulse, const T *frame, uintptr_t numZeros, uintptr_t index)
+{
+    Split spectrum;
+    uintptr_t FFTSize = getFFTSize();
+    uintptr_t FFTSizeHalved = FFTSize >> 1;
+    
+    // Frames hold the latest hop before the previous one, so the earliest input begins half way through (and wraps around)
+    
+    std::copy_n(frame, FFTSize, mResetFrame);
+    std::fill_n(mResetFrame + FFTSizeHalved, std::min(numZeros, FFTSizeHalved), T(0));
+    std::fill_n(mResetFrame, numZeros - std::min(numZeros, FFTSizeHalved), T(0));
+    
+    offsetSplitPointer(spectrum, impulse.mResetSpectra, index * (FFTSize >> 1));
+    hisstools_rfft(mFFTSetup->get(), mResetFrame, &spectrum, FFTSize, mFFTSizeLog2);
+}
+
+template <class T>
+void HISSTools::PartitionedMatrixConvolve<T>::reset()
+{
+    mResetFlag = true;
+}
+
+template <class T>
+bool HISSTools::PartitionedMatrixConvolve<T>::process(const T * const* ins, T **outs, uintptr_t numSamples, ConvolveThreadPool *pool)
+{
+    // FFT variables
+    
+    uintptr_t FFTSize = getFFTSize();
+    uintptr_t FFTSizeHalved = FFTSize >> 1;
+    
+    uintptr_t RWCounter = mRWCounter;
+    uintptr_t hopMask = FFTSizeHalved - 1;
+    
+    uintptr_t samplesRemaining = numSamples;
+    uintptr_t samplesDone = 0;
+    
+    if (!mNumPartitions)
+        return false;
+    
+    // If we need to reset everything we do that here - happens when a new delay line is allocated or on request
+    
+    if (mResetFlag)
+    {
+        // Reset fft buffers, delay lines, output buffers and accum buffers
+        
+        for (uint32_t i = 0; i < mNumIns; i++)
+        {
+            std::fill_n(mInputFFTBuffers[i], FFTSize * 2, T(0));
+            std::fill_n(mInputSpectra[i].realp, mNumSlots * FFTSize, T(0));
+        }
+        
+        for (uint32_t i = 0; i < mNumOuts; i++)
+            std::fill_n(mOutputFFTBuffers[i], FFTSize * 3, T(0));
+        
+        // Reset silence detection (the buffers are now silent)
+        
+        std::fill(mSilentSlots.begin(), mSilentSlots.end(), true);
+        std::fill(mNumSignalSlots.begin(), mNumSignalSlots.end(), 0);
+        std::fill(mHopSilent.begin(), mHopSilent.end(), true);
+        std::fill(mLastHopSilent.begin(), mLastHopSilent.end(), true);
+        
+        for (auto it = mImpulses.begin(); it != mImpulses.end(); it++)
+            it->mResetHops = NOT_RESET;
+        
+        // Reset fft RWCounter (randomly or by fixed amount)
+        
+        if (mResetOffset < 0)
+            RWCounter = mRandDistribution(mRandGenerator);
+        else
+            RWCounter = mResetOffset % FFTSizeHalved;
+        
+        // Reset scheduling variables
+        
+        mInputPosition = 0;
+        mPartitionsDone = 0;
+        
+        // Set reset flag off
+        
+        mResetFlag = false;
+    }
+    
+    // Main loop
+    
+    while (samplesRemaining > 0)
+    {
+        // Calculate how many IO samples to deal with this loop (depending on whether there is an fft to do before the end of the signal block)
+        
+        uintptr_t tillNextFFT = (FFTSizeHalved - (RWCounter & hopMask));
+        uintptr_t loopSize = samplesRemaining < tillNextFFT ? samplesRemaining : tillNextFFT;
+        uintptr_t hiCounter = (RWCounter + FFTSizeHalved) & (FFTSize - 1);
+        
+        // Load inputs into buffers (twice) and accumulate outputs from the output buffers
+        
+        for (uint32_t i = 0; i < mNumIns; i++)
+        {
+            if (ins[i])
+            {
+                std::copy_n(ins[i] + samplesDone, loopSize, mInputFFTBuffers[i] + RWCounter);
+                std::copy_n(ins[i] + samplesDone, loopSize, mInputFFTBuffers[i] + FFTSize + hiCounter);
+                
+                if (mHopSilent[i])
+                    mHopSilent[i] = isSilent(ins[i] + samplesDone, loopSize);
+            }
+            else
+            {
+                std::fill_n(mInputFFTBuffers[i] + RWCounter, loopSize, T(0));
+                std::fill_n(mInputFFTBuffers[i] + FFTSize + hiCounter, loopSize, T(0));
+            }
+        }
+        
+        for (uint32_t i = 0; i < mNumOuts; i++)
+        {
+            if (outs[i] && mOutputActive[i])
+            {
+                const T *buffer = mOutputFFTBuffers[i] + FFTSize + RWCounter;
+                T *out = outs[i] + samplesDone;
+                
+                for (uintptr_t j = 0; j < loopSize; j++)
+                    out[j] += buffer[j];
+            }
+        }
+        
+        // Updates to counters
+        
+        samplesRemaining -= loopSize;
+        samplesDone += loopSize;
+        RWCounter += loopSize;
+        
+        bool FFTNow = !(RWCounter & hopMask);
+        
+        // Work loop and scheduling - this is where most of the convolution is done
+        // How many partitions to do by now? (make sure that all partitions are done before we need to do the next fft)
+        
+        uintptr_t partitionsFrom = mPartitionsDone + 1;
+        uintptr_t partitionsTarget = mNumPartitions - 1;
+        
+        if (!FFTNow)
+            partitionsTarget = (partitionsTarget * (RWCounter & hopMask)) / FFTSizeHalved;
+        
+        // Do the ffts into the input delay lines (once per input)
+        // Slots for silent inputs (the last two hops) are marked rather than transformed (the flags are only written serially)
+        // Inputs that feed no output are treated as silent, so they cost nothing and leave no stale spectra if they become active
+        
+        if (FFTNow)
+        {
+            for (uint32_t i = 0; i < mNumIns; i++)
+            {
+                bool silent = (mHopSilent[i] && mLastHopSilent[i]) || !mInputActive[i];
+                
+                if (isSlotSilent(i, mInputPosition) != silent)
+                {
+                    mSilentSlots[mInputPosition * mNumIns + i] = silent;
+                    mNumSignalSlots[i] = silent ? mNumSignalSlots[i] - 1 : mNumSignalSlots[i] + 1;
+                }
+                
+                mLastHopSilent[i] = mHopSilent[i];
+                mHopSilent[i] = true;
+            }
+            
+            auto transformInput = [&](uint32_t i)
+            {
+                Split audioInTemp;
+                
+                if (isSlotSilent(i, mInputPosition))
+                    return;
+                
+                offsetSplitPointer(audioInTemp, mInputSpectra[i], (mInputPosition * FFTSizeHalved));
+                hisstools_rfft(mFFTSetup->get(), mInputFFTBuffers[i] + ((RWCounter == FFTSize) ? FFTSize : 0), &audioInTemp, FFTSize, mFFTSizeLog2);
+            };
+            
+            parallelFor(pool, mNumIns, transformInput);
+            
+            // Transform the frames of any reset pairs without the input from before the reset
+            
+            for (uint32_t i = 0; i < mNumOuts; i++)
+            {
+                for (uint32_t j = 0; j < mNumIns; j++)
+                {
+                    Impulse& impulse = getImpulse(j, i);
+                    const T *frame = mInputFFTBuffers[j] + ((RWCounter == FFTSize) ? FFTSize : 0);
+                    
+                    if (impulse.mResetHops == RESET_PENDING)
+                    {
+                        transformResetFrame(impulse, frame, FFTSizeHalved + impulse.mResetPoint, 0);
+                        impulse.mResetHops = 0;
+                    }
+                    else if (impulse.mResetHops == 1 && impulse.mResetPoint)
+                        transformResetFrame(impulse, frame, impulse.mResetPoint, 1);
+                }
+            }
+        }
+        
+        // For each output accumulate partitions and when needed add first partitions, do ifft, scale and store (overlap-save)
+        // N.B. each output is processed in a single task in a fixed order so that results do not depend on threading
+        
+        if (FFTNow || partitionsTarget >= partitionsFrom)
+        {
+            auto processOutput = [&](uint32_t output)
+            {
+                Split impulseTemp;
+                Split audioInTemp;
+                Split accumTemp;
+                
+                uint32_t i = mActiveOutputs[output];
+                const std::vector<uint32_t>& routes = mRoutes[i];
+                
+                T *buffer = mOutputFFTBuffers[i];
+                accumTemp.realp = buffer + (FFTSize * 2);
+                accumTemp.imagp = accumTemp.realp + FFTSizeHalved;
+                
+                // If no input to this output has signal in its delay line nothing is accumulated and the output is silent
+                
+                bool signal = false;
+                
+                for (auto it = routes.begin(); it != routes.end(); it++)
+                    signal = signal || mNumSignalSlots[*it];
+                
+                if (!signal)
+                {
+                    if (FFTNow)
+                    {
+                        std::fill_n(buffer + FFTSize + ((RWCounter != FFTSize) ? FFTSizeHalved : 0), FFTSizeHalved, T(0));
+                        std::fill_n(accumTemp.realp, FFTSize, T(0));
+                    }
+                    return;
+                }
+                
+                for (uintptr_t j = partitionsFrom; j <= partitionsTarget; j++)
+                {
+                    for (auto it = routes.begin(); it != routes.end(); it++)
+                    {
+                        uint32_t k = *it;
+                        Impulse& impulse = getImpulse(k, i);
+                        
+                        if (j < impulse.mNumPartitions && getPartitionInput(impulse, k, j, audioInTemp))
+                        {
+                            offsetSplitPointer(impulseTemp, impulse.mBuffer, j * FFTSizeHalved);
+                            processPartition<WideVector<T>>(audioInTemp, impulseTemp, accumTemp, FFTSizeHalved);
+                        }
+                    }
+                }
+                
+                if (FFTNow)
+                {
+                    for (auto it = routes.begin(); it != routes.end(); it++)
+                    {
+                        uint32_t j = *it;
+                        Impulse& impulse = getImpulse(j, i);
+                        
+                        if (getPartitionInput(impulse, j, 0, audioInTemp))
+                            processPartition<WideVector<T>>(audioInTemp, impulse.mBuffer, accumTemp, FFTSizeHalved);
+                    }
+                    
+                    hisstools_rifft(mFFTSetup->get(), &accumTemp, buffer, mFFTSizeLog2);
+                    scaleStore<WideVector<T>>(buffer + FFTSize, buffer, FFTSize, (RWCounter != FFTSize));
+                    
+                    // Clear accumulation buffer
+                    
+                    std::fill_n(accumTemp.realp, FFTSize, T(0));
+                }
+            };
+            
+            parallelFor(pool, static_cast<uint32_t>(mActiveOutputs.size()), processOutput);
+            
+            mPartitionsDone = std::max(mPartitionsDone, partitionsTarget);
+        }
+        
+        if (FFTNow)
+        {
+            // Update RWCounter
+            
+            RWCounter = RWCounter & (FFTSize - 1);
+            
+            // Set scheduling variables
+            
+            mInputPosition = mInputPosition ? mInputPosition - 1 : mNumSlots - 1;
+            mPartitionsDone = 0;
+            
+            // Count the hops since reset pairs were transformed (until the delay line holds no input from before the reset)
+            
+            for (auto it = mImpulses.begin(); it != mImpulses.end(); it++)
+            {
+                if (it->mResetHops <= mNumSlots)
+                    it->mResetHops++;
+                else if (it->mResetHops != RESET_PENDING)
+                    it->mResetHops = NOT_RESET;
+            }
+        }
+    }
+    
+    // Write counter back into the object
+    
+    mRWCounter = RWCounter;
+    
+    return true;
+}
+
+// Explicit instantiations
+
+template class HISSTools::PartitionedMatrixConvolve<float>;
+template class HISSTools::PartitionedMatrixConvolve<double>;
@@ -0,0 +1,176 @@
+
+#pragma once
+
+#include "ConvolveErrors.h"
+#include "ConvolveFFTTypes.h"
+#include "ConvolveThreadPool.h"
+#include "SharedSpectra.h"
+
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace HISSTools
+{
+    template <class T>
+    class PartitionedMatrixConvolve
+    {
+        typedef typename FFTTypes<T>::Split Split;
+        
+        // N.B. MIN_FFT_SIZE_LOG2 should never be smaller than 4, as below code assumes loop unroll of vectors (4 vals) by 4 (== 16 or 2^4)
+        
+        static constexpr int MIN_FFT_SIZE_LOG2 = 5;
+        static constexpr int MAX_FFT_SIZE_LOG2 = 20;
+        
+        // After a pair is reset the two frames that straddle the reset point are transformed again without the earlier input
+        // The count of hops since the first of these frames then selects the spectrum for each partition (older frames are skipped)
+        
+        static constexpr uintptr_t NOT_RESET = ~uintptr_t(0);
+        static constexpr uintptr_t RESET_PENDING = NOT_RESET - 1;
+        
+        struct Impulse
+        {
+            Split mBuffer;
+            uintptr_t mMaxLength;
+            uintptr_t mNumPartitions;
+            
+            Split mResetSpectra;
+            uintptr_t mResetPoint;
+            uintptr_t mResetHops;
+        };
+    
+    public:
+        
+        // An impulse transformed for a pair but not yet in use (or the impulse it replaced once published)
+        // The space for the pair's reset frames is allocated with the impulse, so only pairs with an impulse hold it
+        
+        struct Prepared
+        {
+            Prepared() : mNumPartitions(0), mInChan(0), mOutChan(0) { mBuffer.realp = mBuffer.imagp = mResetSpectra.realp = mResetSpectra.imagp = nullptr; }
+            
+            Split mBuffer;
+            Split mResetSpectra;
+            uintptr_t mNumPartitions;
+            uint32_t mInChan;
+            uint32_t mOutChan;
+        };
+        
+        PartitionedMatrixConvolve(uint32_t numIns, uint32_t numOuts, uintptr_t FFTSize, uintptr_t maxLength, uintptr_t offset, uintptr_t length, AllocatorPtr allocator = nullptr);
+        ~PartitionedMatrixConvolve();
+        
+        // Non-moveable and copyable
+        
+        PartitionedMatrixConvolve(PartitionedMatrixConvolve& obj) = delete;
+        PartitionedMatrixConvolve& operator = (PartitionedMatrixConvolve& obj) = delete;
+        PartitionedMatrixConvolve(PartitionedMatrixConvolve&& obj) = delete;
+        PartitionedMatrixConvolve& operator = (PartitionedMatrixConvolve&& obj) = delete;
+        
+        // Growing the delay lines keeps their contents (so the other pairs continue uninterrupted)
+        
+        ConvolveError resize(uint32_t inChan, uint32_t outChan, uintptr_t maxLength);
+        void setResetOffset(intptr_t offset = -1);
+        
+        ConvolveError set(uint32_t inChan, uint32_t outChan, const float *input, uintptr_t length);
+        ConvolveError set(uint32_t inChan, uint32_t outChan, const double *input, uintptr_t length);
+        
+        // Setting in stages - prepare() transforms the impulse into a new buffer and may be called whilst processing
+        // publish() swaps it in (so must not be called whilst processing) and the replaced buffer is then freed by release()
+        
+        ConvolveError prepare(uint32_t inChan, uint32_t outChan, const float *input, uintptr_t length, Prepared& prepared);
+        ConvolveError prepare(uint32_t inChan, uint32_t outChan, const double *input, uintptr_t length, Prepared& prepared);
+        void publish(Prepared& prepared);
+        void release(Prepared& prepared);
+        
+        // Resetting a pair drops its input from before the reset (the input state is shared so the other pairs are unaffected)
+        // N.B. output already scheduled from the earlier input may continue for up to two hops
+        
+        ConvolveError reset(uint32_t inChan, uint32_t outChan);
+        void reset();
+        
+        // Inputs may be null (silent) and outputs may be null (not required) - output is accumulated
+        // If a thread pool is provided inputs and outputs are processed in parallel
+        
+        bool process(const T * const* ins, T **outs, uintptr_t numSamples, ConvolveThreadPool *pool = nullptr);
+    
+    private:
+        
+        uintptr_t getFFTSize()  { return uintptr_t(1) << mFFTSizeLog2; }
+        
+        Impulse& getImpulse(uint32_t inChan, uint32_t outChan) { return mImpulses[outChan * mNumIns + inChan]; }
+        
+        bool isSlotSilent(uint32_t inChan, uintptr_t slot) { return mSilentSlots[slot * mNumIns + inChan]; }
+        bool getPartitionInput(Impulse& impulse, uint32_t inChan, uintptr_t partition, Split& spectrum);
+        void transformResetFrame(Impulse& impulse, const T *frame, uintptr_t numZeros, uintptr_t index);
+        
+        ConvolveError allocateInputs(uintptr_t numSlots);
+        void freeBuffers();
+        void updateRoutes();
+        
+        template <class U>
+        ConvolveError setImpulse(uint32_t inChan, uint32_t outChan, const U *input, uintptr_t length);
+        
+        template <class U>
+        ConvolveError prepareImpulse(uint32_t inChan, uint32_t outChan, const U *input, uintptr_t length, Prepared& prepared);
+        
+        // Parameters
+        
+        uint32_t mNumIns;
+        uint32_t mNumOuts;
+        
+        uintptr_t mOffset;
+        uintptr_t mLength;
+        
+        AllocatorPtr mAllocator;
+        
+        // FFT variables
+        
+        std::shared_ptr<const SharedFFTSetup<T>> mFFTSetup;
+        
+        uintptr_t mFFTSizeLog2;
+        uintptr_t mRWCounter;
+        
+        // Scheduling variables
+        
+        uintptr_t mInputPosition;
+        uintptr_t mPartitionsDone;
+        uintptr_t mNumPartitions;
+        uintptr_t mNumSlots;
+        
+        // Internal buffers (per input, per output and per input / output pair)
+        
+        std::vector<T *> mInputFFTBuffers;
+        std::vector<Split> mInputSpectra;
+        T *mResetFrame;
+        
+        // Input silence (delay line slots with silent input are marked rather than transformed)
+        
+        std::vector<bool> mSilentSlots;
+        std::vector<uintptr_t> mNumSignalSlots;
+        std::vector<bool> mHopSilent;
+        std::vector<bool> mLastHopSilent;
+        
+        std::vector<T *> mOutputFFTBuffers;
+        std::vector<bool> mOutputActive;
+        
+        // Impulse buffers are only allocated for pairs with an impulse (each pair reserves a maximum length)
+        
+        std::vector<Impulse> mImpulses;
+        
+        // Sparse routing (the inputs with an impulse for each output) so that only active pairs are visited
+        
+        std::vector<std::vector<uint32_t>> mRoutes;
+        std::vector<uint32_t> mActiveOutputs;
+        std::vector<bool> mInputActive;
+        
+        // Flags
+        
+        intptr_t mResetOffset;
+        bool mResetFlag;
+        
+        // Random number generation
+        
+        std::default_random_engine mRandGenerator;
+        std::uniform_int_distribution<uintptr_t> mRandDistribution;
+    };
+}
@@ -0,0 +1,323 @@
+
+/*
+ *  PhaseScheduler
+ *
+ *    Process-wide placement of the hop boundaries of partitioned convolution objects.
+ *
+ *    Each object reports its hop size, the cost of the work at its hop boundaries and the cost spread evenly over each hop.
+ *    The schedule is a cycle of blocks over the longest hop, and the boundaries of an object fall in every (hop / block size) blocks.
+ *    Objects are placed in the blocks that minimise the predicted peak, so placement is deterministic for a given order of updates.
+ *    Placement is against the phases that objects will adopt, but the reported load (and the decision to rebalance) uses the phases in use.
+ *
+ */
+
+#include "PhaseScheduler.h"
+
+#include <algorithm>
+
+// The active phase of an entry that has not yet been reset
+
+static const uintptr_t sNoPhase = ~uintptr_t(0);
+
+// Entry
+
+HISSTools::PhaseScheduler::Entry::Entry(uint64_t ID)
+: mID(ID)
+, mHopSize(0)
+, mBoundaryCost(0.0)
+, mSpreadCost(0.0)
+, mPhase(0)
+, mActivePhase(sNoPhase)
+, mLastClock(~uintptr_t(0))
+{}
+
+HISSTools::PhaseScheduler::Entry::~Entry()
+{
+    std::lock_guard<std::mutex> lock(getState().mMutex);
+    
+    remove(this);
+}
+
+void HISSTools::PhaseScheduler::Entry::update(uintptr_t hopSize, double boundaryCost, double spreadCost)
+{
+    State& state = getState();
+    std::lock_guard<std::mutex> lock(state.mMutex);
+    
+    mHopSize = hopSize;
+    mBoundaryCost = boundaryCost;
+    mSpreadCost = spreadCost;
+    
+    mPhase.store(place(makeHistogram(state, this, false), *this, state.mBlockSize), std::memory_order_relaxed);
+}
+
+void HISSTools::PhaseScheduler::Entry::advance(uintptr_t numSamples)
+{
+    if (!numSamples)
+        return;
+    
+    std::atomic<Entry *>& owner = getOwner();
+    std::atomic<uintptr_t>& clock = getClock();
+    
+    Entry *current = owner.load(std::memory_order_relaxed);
+    uintptr_t time = clock.load(std::memory_order_relaxed);
+    
+    // Take the clock if there is no owner or the owner has stopped (the clock has not moved for a block of this entry)
+    
+    if (current != this && (!current || time == mLastClock))
+    {
+        if (owner.compare_exchange_strong(current, this, std::memory_order_relaxed))
+            current = this;
+    }
+    
+    if (current == this)
+        time = clock.fetch_add(numSamples, std::memory_order_relaxed) + numSamples;
+    
+    mLastClock = time;
+}
+
+uintptr_t HISSTools::PhaseScheduler::Entry::getResetCounter(uintptr_t hopSize)
+{
+    // The counter reaches a boundary when the clock is at the phase (modulo the hop size)
+    
+    uintptr_t clock = getClock().load(std::memory_order_relaxed);
+    uintptr_t phase = mPhase.load(std::memory_order_relaxed);
+    
+    mActivePhase.store(phase, std::memory_order_relaxed);
+    
+    return (clock - phase) & (hopSize - 1);
+}
+
+bool HISSTools::PhaseScheduler::Entry::isMoved() const
+{
+    uintptr_t activePhase = mActivePhase.load(std::memory_order_relaxed);
+    
+    return activePhase != sNoPhase && activePhase != mPhase.load(std::memory_order_relaxed);
+}
+
+// Public Interface
+
+std::unique_ptr<HISSTools::PhaseScheduler::Entry> HISSTools::PhaseScheduler::add()
+{
+    State& state = getState();
+    std::lock_guard<std::mutex> lock(state.mMutex);
+    
+    std::unique_ptr<Entry> entry(new Entry(state.mNextID++));
+    state.mEntries.push_back(entry.get());
+    
+    return entry;
+}
+
+void HISSTools::PhaseScheduler::setBlockSize(uintptr_t blockSize)
+{
+    State& state = getState();
+    std::lock_guard<std::mutex> lock(state.mMutex);
+    
+    uintptr_t size = 1;
+    
+    while (size < blockSize)
+        size <<= 1;
+    
+    if (size != state.mBlockSize)
+    {
+        state.mBlockSize = size;
+        rebalance(state, true);
+    }
+}
+
+uintptr_t HISSTools::PhaseScheduler::getBlockSize()
+{
+    State& state = getState();
+    std::lock_guard<std::mutex> lock(state.mMutex);
+    
+    return state.mBlockSize;
+}
+
+void HISSTools::PhaseScheduler::rebalance()
+{
+    State& state = getState();
+    std::lock_guard<std::mutex> lock(state.mMutex);
+    
+    rebalance(state, false);
+}
+
+std::vector<double> HISSTools::PhaseScheduler::getHistogram()
+{
+    State& state = getState();
+    std::lock_guard<std::mutex> lock(state.mMutex);
+    
+    return makeHistogram(state, nullptr, true);
+}
+
+// Storage
+
+HISSTools::PhaseScheduler::State& HISSTools::PhaseScheduler::getState()
+{
+    // The state is never destroyed, so that entries may safely outlive other static objects
+    
+    static State *state = new State();
+    
+    return *state;
+}
+
+std::atomic<uintptr_t>& HISSTools::PhaseScheduler::getClock()
+{
+    static std::atomic<uintptr_t> clock(0);
+    
+    return clock;
+}
+
+std::atomic<HISSTools::PhaseScheduler::Entry *>& HISSTools::PhaseScheduler::getOwner()
+{
+    static std::atomic<Entry *> owner(nullptr);
+    
+    return owner;
+}
+
+// Scheduling
+
+void HISSTools::PhaseScheduler::remove(Entry *entry)
+{
+    State& state = getState();
+    
+    // If the entry owns the clock the next entry to advance takes it
+    
+    Entry *owner = entry;
+    
+    getOwner().compare_exchange_strong(owner, nullptr, std::memory_order_relaxed);
+    
+    state.mEntries.erase(std::remove(state.mEntries.begin(), state.mEntries.end(), entry), state.mEntries.end());
+    rebalance(state, false);
+}
+
+void HISSTools::PhaseScheduler::rebalance(State& state, bool force)
+{
+    std::vector<Entry *> order(state.mEntries);
+    std::vector<uintptr_t> phases(order.size());
+    
+    // Place the most costly boundaries first (longest hops and then the order of registration break ties)
+    
+    auto compare = [](const Entry *a, const Entry *b)
+    {
+        if (a->mBoundaryCost != b->mBoundaryCost)
+            return a->mBoundaryCost > b->mBoundaryCost;
+        
+        if (a->mHopSize != b->mHopSize)
+            return a->mHopSize > b->mHopSize;
+        
+        return a->mID < b->mID;
+    };
+    
+    std::sort(order.begin(), order.end(), compare);
+    
+    std::vector<double> current = makeHistogram(state, nullptr, true);
+    std::vector<double> histogram(current.size(), 0.0);
+    
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        phases[i] = place(histogram, *order[i], state.mBlockSize);
+        accumulate(histogram, *order[i], phases[i], state.mBlockSize);
+    }
+    
+    // Only move objects if the peak in use is lowered (they will not adopt the new phase until they are reset)
+    
+    if (force || getPeak(histogram) < getPeak(current) * (1.0 - 1e-9))
+    {
+        for (size_t i = 0; i < order.size(); i++)
+            order[i]->mPhase.store(phases[i], std::memory_order_relaxed);
+    }
+}
+
+std::vector<double> HISSTools::PhaseScheduler::makeHistogram(const State& state, const Entry *exclude, bool active)
+{
+    uintptr_t cycle = state.mBlockSize;
+    
+    for (auto it = state.mEntries.begin(); it != state.mEntries.end(); it++)
+        cycle = std::max(cycle, (*it)->mHopSize);
+    
+    std::vector<double> histogram(cycle / state.mBlockSize, 0.0);
+    
+    // Entries are counted at the phase in use if requested (and they have one) or otherwise at the phase they will adopt
+    
+    for (auto it = state.mEntries.begin(); it != state.mEntries.end(); it++)
+    {
+        uintptr_t phase = (*it)->mPhase.load(std::memory_order_relaxed);
+        uintptr_t activePhase = (*it)->mActivePhase.load(std::memory_order_relaxed);
+        
+        if (active && activePhase != sNoPhase)
+            phase = activePhase;
+        
+        if (*it != exclude)
+            accumulate(histogram, **it, phase, state.mBlockSize);
+    }
+    
+    return histogram;
+}
+
+void HISSTools::PhaseScheduler::accumulate(std::vector<double>& histogram, const Entry& entry, uintptr_t phase, uintptr_t blockSize)
+{
+    uintptr_t hopSize = entry.mHopSize;
+    
+    if (!hopSize)
+        return;
+    
+    // Hops no longer than a block have boundaries in every block
+    
+    double spreadCost = entry.mSpreadCost * blockSize / hopSize;
+    
+    if (hopSize <= blockSize)
+        spreadCost += entry.mBoundaryCost * blockSize / hopSize;
+    
+    for (auto it = histogram.begin(); it != histogram.end(); it++)
+        *it += spreadCost;
+    
+    if (hopSize <= blockSize)
+        return;
+    
+    // Otherwise a phase of (n + 1) blocks places the boundaries at the end of block n of each hop
+    
+    uintptr_t hopBlocks = hopSize / blockSize;
+    uintptr_t block = ((phase / blockSize) + hopBlocks - 1) % hopBlocks;
+    
+    for (uintptr_t i = block; i < histogram.size(); i += hopBlocks)
+        histogram[i] += entry.mBoundaryCost;
+}
+
+uintptr_t HISSTools::PhaseScheduler::place(const std::vector<double>& histogram, const Entry& entry, uintptr_t blockSize)
+{
+    uintptr_t hopSize = entry.mHopSize;
+    
+    if (hopSize <= blockSize)
+        return 0;
+    
+    // Find the block in the hop whose worst repetition over the cycle is least loaded
+    
+    uintptr_t hopBlocks = hopSize / blockSize;
+    uintptr_t bestBlock = 0;
+    double bestPeak = 0.0;
+    
+    for (uintptr_t i = 0; i < hopBlocks; i++)
+    {
+        double peak = 0.0;
+        
+        for (uintptr_t j = i; j < histogram.size(); j += hopBlocks)
+            peak = std::max(peak, histogram[j]);
+        
+        if (!i || peak < bestPeak)
+        {
+            bestBlock = i;
+            bestPeak = peak;
+        }
+    }
+    
+    return ((bestBlock + 1) * blockSize) & (hopSize - 1);
+}
+
+double HISSTools::PhaseScheduler::getPeak(const std::vector<double>& histogram)
+{
+    double peak = 0.0;
+    
+    for (auto it = histogram.begin(); it != histogram.end(); it++)
+        peak = std::max(peak, *it);
+    
+    return peak;
+}
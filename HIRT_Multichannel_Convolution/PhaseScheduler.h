@@ -0,0 +1,113 @@
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace HISSTools
+{
+    // PhaseScheduler assigns the hop phases of partitioned convolution objects across the whole process
+    // The ffts at each hop boundary are a spike in cost, so boundaries are placed to equalise the predicted cost of each block
+    // Phases are measured on a process-wide clock which is advanced each block by one of the scheduled objects (see Entry::advance())
+    // N.B. an object adopts a new phase when it is next reset, which the engines also do when an object that has been moved is silent
+    
+    class PhaseScheduler
+    {
+    public:
+        
+        // An object's place in the schedule (which is removed on destruction)
+        
+        class Entry
+        {
+            friend class PhaseScheduler;
+        
+        public:
+            
+            ~Entry();
+            
+            // Non-moveable and copyable
+            
+            Entry(Entry& obj) = delete;
+            Entry& operator = (Entry& obj) = delete;
+            Entry(Entry&& obj) = delete;
+            Entry& operator = (Entry&& obj) = delete;
+            
+            // Set the hop size (a power of two), the cost at each hop boundary and the cost spread over each hop (in any consistent units)
+            // The entry is then placed again without moving other entries
+            
+            void update(uintptr_t hopSize, double boundaryCost, double spreadCost);
+            
+            // Advance the clock at the start of each block (from the audio thread) - only the entry that owns the clock moves it
+            // The first entry to advance takes the clock, as does any entry that finds it has not moved since its own last block
+            // N.B. objects must share the blocks of a single stream, and those processed before the owner see the clock a block behind
+            
+            void advance(uintptr_t numSamples);
+            
+            // The hop counter for an object of the given hop size reset now, which adopts the current phase (safe to call from the audio thread)
+            
+            uintptr_t getResetCounter(uintptr_t hopSize);
+            
+            // True if the entry has been placed again since the phase in use was adopted (so it should be reset when convenient)
+            
+            bool isMoved() const;
+        
+        private:
+            
+            Entry(uint64_t ID);
+            
+            uint64_t mID;
+            uintptr_t mHopSize;
+            double mBoundaryCost;
+            double mSpreadCost;
+            
+            std::atomic<uintptr_t> mPhase;
+            std::atomic<uintptr_t> mActivePhase;
+            uintptr_t mLastClock;
+        };
+        
+        // A new entry has no cost until it is updated
+        
+        static std::unique_ptr<Entry> add();
+        
+        // The host block size used for prediction (rounded up to a power of two) - all entries are placed again when it changes
+        
+        static void setBlockSize(uintptr_t blockSize);
+        static uintptr_t getBlockSize();
+        
+        // Place all entries again (those with the most costly boundaries first) keeping the result only if it lowers the peak in use
+        // This happens automatically when an entry is removed
+        
+        static void rebalance();
+        
+        // The predicted cost of each block over one cycle of the longest hop with the phases in use (in the units of the entries)
+        // Entries that have not yet been reset are counted at the phase they will adopt
+        
+        static std::vector<double> getHistogram();
+    
+    private:
+        
+        struct State
+        {
+            std::mutex mMutex;
+            std::vector<Entry *> mEntries;
+            uintptr_t mBlockSize = 64;
+            uint64_t mNextID = 0;
+        };
+        
+        static State& getState();
+        static std::atomic<uintptr_t>& getClock();
+        static std::atomic<Entry *>& getOwner();
+        
+        // N.B. the following require the state to be locked
+        
+        static void remove(Entry *entry);
+        static void rebalance(State& state, bool force);
+        static std::vector<double> makeHistogram(const State& state, const Entry *exclude, bool active);
+        static void accumulate(std::vector<double>& histogram, const Entry& entry, uintptr_t phase, uintptr_t blockSize);
+        static uintptr_t place(const std::vector<double>& histogram, const Entry& entry, uintptr_t blockSize);
+        static double getPeak(const std::vector<double>& histogram);
+    };
+}
@@ -0,0 +1,617 @@
+
+/*
+ *  SharedSpectra
+ *
+ *    Sharing of FFT setups and impulse spectra between convolution engines.
+ *
+ *    Engines loading identical impulse segments (for example the same impulse on several channels) reference one immutable copy of the spectra.
+ *    Spectra are matched on a SHA-256 digest of the samples transformed, their length, the FFT size and the input sample type.
+ *    Spectra can also be kept in files between sessions, which are mapped read-only into memory rather than recomputed.
+ *
+ */
+
+#include "SharedSpectra.h"
+#include "ConvolveKernels.h"
+#include "ConvolveSIMD.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <tuple>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Spectrum file format (a 128 byte header followed by the real and then the imaginary values of all partitions)
+// The type size is that of the stored values (two for bfloat16)
+
+struct SpectrumFileHeader
+{
+    char mMagic[4];
+    uint32_t mVersion;
+    uint32_t mByteOrder;
+    uint32_t mTypeSize;
+    uint64_t mHash;
+    uint64_t mLength;
+    uint64_t mFFTSizeLog2;
+    uint64_t mSampleSize;
+    uint64_t mNumPartitions;
+    uint64_t mPadding;
+    uint8_t mDigest[32];
+    uint8_t mReserved[32];
+};
+
+static_assert(sizeof(SpectrumFileHeader) == 128, "spectrum file header must be 128 bytes");
+
+static const char sSpectrumFileMagic[4] = { 'H', 'S', 'P', 'C' };
+static const uint32_t sSpectrumFileVersion = 2;
+
+// SHA-256 (FIPS 180-4) of the bytes of the samples transformed
+
+class SHA256
+{
+public:
+    
+    SHA256() : mState { 0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19 }, mTotal(0), mFill(0) {}
+    
+    void update(const void *data, uintptr_t size)
+    {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        
+        mTotal += size;
+        
+        while (size)
+        {
+            uintptr_t loopSize = std::min(size, uintptr_t(64) - mFill);
+            
+            std::memcpy(mBuffer + mFill, bytes, loopSize);
+            
+            bytes += loopSize;
+            size -= loopSize;
+            mFill += loopSize;
+            
+            if (mFill == 64)
+            {
+                processBlock();
+                mFill = 0;
+            }
+        }
+    }
+    
+    void finish(uint8_t *digest)
+    {
+        uint64_t bits = mTotal * 8;
+        uint8_t padding = 0x80;
+        
+        // Pad with a one bit and then zeros until there are eight bytes left in the block for the length
+        
+        update(&padding, 1);
+        padding = 0;
+        
+        while (mFill != 56)
+            update(&padding, 1);
+        
+        for (int i = 7; i >= 0; i--)
+            mBuffer[mFill++] = static_cast<uint8_t>(bits >> (i * 8));
+        
+        processBlock();
+        
+        for (int i = 0; i < 32; i++)
+            digest[i] = static_cast<uint8_t>(mState[i >> 2] >> (24 - (i & 3) * 8));
+    }
+
+private:
+    
+    static uint32_t rotate(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+    
+    void processBlock()
+    {
+        static const uint32_t k[64] =
+        {
+            0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+            0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+            0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+            0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+            0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+            0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+            0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+            0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+        };
+        
+        uint32_t w[64];
+        
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t(mBuffer[i * 4]) << 24) | (uint32_t(mBuffer[i * 4 + 1]) << 16) | (uint32_t(mBuffer[i * 4 + 2]) << 8) | uint32_t(mBuffer[i * 4 + 3]);
+        
+        for (int i = 16; i < 64; i++)
+        {
+            uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        
+        uint32_t a = mState[0], b = mState[1], c = mState[2], d = mState[3];
+        uint32_t e = mState[4], f = mState[5], g = mState[6], h = mState[7];
+        
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t t1 = h + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        
+        mState[0] += a;
+        mState[1] += b;
+        mState[2] += c;
+        mState[3] += d;
+        mState[4] += e;
+        mState[5] += f;
+        mState[6] += g;
+        mState[7] += h;
+    }
+    
+    uint32_t mState[8];
+    uint8_t mBuffer[64];
+    uint64_t mTotal;
+    uintptr_t mFill;
+};
+static const uint32_t sSpectrumFileByteOrder = 0x01020304;
+
+// Read-only file mapping
+
+static void *mapFile(const std::string& path, uintptr_t& size)
+{
+#ifdef _WIN32
+    void *mapping = nullptr;
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    
+    if (file == INVALID_HANDLE_VALUE)
+        return nullptr;
+    
+    LARGE_INTEGER fileSize;
+    
+    if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart)
+    {
+        HANDLE map = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        
+        if (map)
+        {
+            mapping = MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+            size = static_cast<uintptr_t>(fileSize.QuadPart);
+            CloseHandle(map);
+        }
+    }
+    
+    CloseHandle(file);
+    
+    return mapping;
+#else
+    void *mapping = nullptr;
+    int file = open(path.c_str(), O_RDONLY);
+    
+    if (file < 0)
+        return nullptr;
+    
+    struct stat fileStats;
+    
+    if (!fstat(file, &fileStats) && fileStats.st_size)
+    {
+#ifdef MAP_POPULATE
+        mapping = mmap(nullptr, fileStats.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, file, 0);
+#else
+        mapping = mmap(nullptr, fileStats.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+#endif
+        mapping = mapping == MAP_FAILED ? nullptr : mapping;
+        size = static_cast<uintptr_t>(fileStats.st_size);
+    }
+    
+    close(file);
+    
+    return mapping;
+#endif
+}
+
+// Fault in every page of a mapping on the calling thread so that the audio thread never waits on the disk
+// N.B. a 4 KB stride touches every page whatever the page size
+
+static void prefaultFile(void *mapping, uintptr_t size)
+{
+#if !defined(_WIN32) && !defined(MAP_POPULATE)
+    madvise(mapping, size, MADV_WILLNEED);
+#endif
+    const volatile char *bytes = static_cast<const volatile char *>(mapping);
+    char touch = 0;
+    
+    for (uintptr_t i = 0; i < size; i += 4096)
+        touch ^= bytes[i];
+    
+    touch ^= bytes[size - 1];
+    static_cast<void>(touch);
+}
+
+static void unmapFile(void *mapping, uintptr_t size)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(mapping);
+#else
+    munmap(mapping, size);
+#endif
+}
+
+// SharedFFTSetup
+
+template <class T>
+std::shared_ptr<const HISSTools::SharedFFTSetup<T>> HISSTools::SharedFFTSetup<T>::acquire(uintptr_t FFTSizeLog2)
+{
+    static std::mutex mutex;
+    static std::map<uintptr_t, std::weak_ptr<const SharedFFTSetup>> setups;
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    std::shared_ptr<const SharedFFTSetup> setup = setups[FFTSizeLog2].lock();
+    
+    if (!setup)
+    {
+        setup = std::make_shared<const SharedFFTSetup>(FFTSizeLog2);
+        setups[FFTSizeLog2] = setup;
+    }
+    
+    return setup;
+}
+
+template <class T>
+HISSTools::SharedFFTSetup<T>::SharedFFTSetup(uintptr_t FFTSizeLog2)
+{
+    hisstools_create_setup(&mSetup, FFTSizeLog2);
+}
+
+template <class T>
+HISSTools::SharedFFTSetup<T>::~SharedFFTSetup()
+{
+    hisstools_destroy_setup(mSetup);
+}
+
+// ImpulseSpectrum
+
+template <class T>
+HISSTools::ImpulseSpectrum<T>::ImpulseSpectrum(uintptr_t FFTSizeLog2, uintptr_t numPartitions, AllocatorPtr allocator)
+: mFFTSizeLog2(FFTSizeLog2)
+, mNumPartitions(numPartitions)
+, mAllocator(ConvolveAllocator::select(allocator))
+{
+    uintptr_t size = numPartitions << (FFTSizeLog2 - 1);
+    
+    mBuffer.realp = mAllocator->allocate<T>(size * 2);
+    mBuffer.imagp = mBuffer.realp + size;
+    mHalfBuffer.realp = nullptr;
+    mHalfBuffer.imagp = nullptr;
+    mMapping = nullptr;
+    mMappingSize = 0;
+}
+
+template <class T>
+HISSTools::ImpulseSpectrum<T>::ImpulseSpectrum(uintptr_t FFTSizeLog2, uintptr_t numPartitions, void *data, bool halfPrecision, void *mapping, uintptr_t mappingSize)
+: mFFTSizeLog2(FFTSizeLog2)
+, mNumPartitions(numPartitions)
+, mMapping(mapping)
+, mMappingSize(mappingSize)
+, mAllocator(ConvolveAllocator::getDefault())
+{
+    uintptr_t size = numPartitions << (FFTSizeLog2 - 1);
+    
+    mBuffer.realp = halfPrecision ? nullptr : static_cast<T *>(data);
+    mBuffer.imagp = halfPrecision ? nullptr : static_cast<T *>(data) + size;
+    mHalfBuffer.realp = halfPrecision ? static_cast<uint16_t *>(data) : nullptr;
+    mHalfBuffer.imagp = halfPrecision ? static_cast<uint16_t *>(data) + size : nullptr;
+}
+
+template <class T>
+HISSTools::ImpulseSpectrum<T>::~ImpulseSpectrum()
+{
+    if (mMapping)
+        unmapFile(mMapping, mMappingSize);
+    else
+    {
+        mAllocator->deallocate(mBuffer.realp);
+        mAllocator->deallocate(mHalfBuffer.realp);
+    }
+}
+
+template <class T>
+bool HISSTools::ImpulseSpectrum<T>::convertToHalf()
+{
+    if (mMapping || !mBuffer.realp)
+        return false;
+    
+    uintptr_t size = mNumPartitions << (mFFTSizeLog2 - 1);
+    uint16_t *buffer = mAllocator->allocate<uint16_t>(size * 2);
+    
+    if (!buffer)
+        return false;
+    
+    for (uintptr_t i = 0; i < size * 2; i++)
+        buffer[i] = floatToHalf(static_cast<float>(mBuffer.realp[i]));
+    
+    mAllocator->deallocate(mBuffer.realp);
+    
+    mBuffer.realp = nullptr;
+    mBuffer.imagp = nullptr;
+    mHalfBuffer.realp = buffer;
+    mHalfBuffer.imagp = buffer + size;
+    
+    return true;
+}
+
+// SpectrumKey
+
+bool HISSTools::SpectrumKey::operator < (const SpectrumKey& b) const
+{
+    return std::tie(mHash, mDigest, mLength, mFFTSizeLog2, mSampleSize, mHalfPrecision) < std::tie(b.mHash, b.mDigest, b.mLength, b.mFFTSizeLog2, b.mSampleSize, b.mHalfPrecision);
+}
+
+// SpectrumFiles
+
+void HISSTools::SpectrumFiles::setDirectory(const char *path)
+{
+    std::lock_guard<std::mutex> lock(getMutex());
+    
+    getStorage() = path ? path : "";
+}
+
+std::string HISSTools::SpectrumFiles::getDirectory()
+{
+    std::lock_guard<std::mutex> lock(getMutex());
+    
+    return getStorage();
+}
+
+std::string HISSTools::SpectrumFiles::getPath(const SpectrumKey& key, uintptr_t typeSize)
+{
+    std::string directory = getDirectory();
+    
+    if (directory.empty())
+        return directory;
+    
+    char name[128];
+    
+    snprintf(name, sizeof(name), "%016llx-%llx-%u-%u-%u.hspec",
+             static_cast<unsigned long long>(key.mHash),
+             static_cast<unsigned long long>(key.mLength),
+             static_cast<unsigned>(key.mFFTSizeLog2),
+             static_cast<unsigned>(key.mSampleSize),
+             static_cast<unsigned>(typeSize));
+    
+    char last = directory.back();
+    
+    return (last == '/' || last == '\\') ? directory + name : directory + "/" + name;
+}
+
+std::mutex& HISSTools::SpectrumFiles::getMutex()
+{
+    static std::mutex mutex;
+    
+    return mutex;
+}
+
+std::string& HISSTools::SpectrumFiles::getStorage()
+{
+    static std::string directory;
+    
+    return directory;
+}
+
+// SpectrumCache
+
+template <class T>
+HISSTools::SpectrumKey HISSTools::SpectrumCache<T>::makeKey(const float *input, uintptr_t length, uintptr_t FFTSizeLog2)
+{
+    return makeKeyTyped(input, length, FFTSizeLog2);
+}
+
+template <class T>
+HISSTools::SpectrumKey HISSTools::SpectrumCache<T>::makeKey(const double *input, uintptr_t length, uintptr_t FFTSizeLog2)
+{
+    return makeKeyTyped(input, length, FFTSizeLog2);
+}
+
+template <class T>
+template <class U>
+HISSTools::SpectrumKey HISSTools::SpectrumCache<T>::makeKeyTyped(const U *input, uintptr_t length, uintptr_t FFTSizeLog2)
+{
+    SpectrumKey key;
+    
+    key.mLength = length;
+    key.mFFTSizeLog2 = FFTSizeLog2;
+    key.mSampleSize = sizeof(U);
+    
+    // Digest the bit patterns of the samples (the hash naming spectrum files is the start of the digest)
+    
+    SHA256 digest;
+    
+    digest.update(input, length * sizeof(U));
+    digest.finish(key.mDigest.data());
+        
+    for (int i = 0; i < 8; i++)
+        key.mHash = (key.mHash << 8) | key.mDigest[i];
+    
+    return key;
+}
+
+template <class T>
+std::shared_ptr<HISSTools::ImpulseSpectrum<T>> HISSTools::SpectrumCache<T>::find(const SpectrumKey& key)
+{
+    std::lock_guard<std::mutex> lock(getMutex());
+    
+    auto it = getMap().find(key);
+    
+    std::shared_ptr<ImpulseSpectrum<T>> spectrum = it != getMap().end() ? it->second.lock() : nullptr;
+    
+    // If the spectrum is not in use try to load it from a file
+    
+    if (!spectrum && (spectrum = load(key)))
+        getMap()[key] = spectrum;
+    
+    return spectrum;
+}
+
+template <class T>
+void HISSTools::SpectrumCache<T>::insert(const SpectrumKey& key, const std::shared_ptr<ImpulseSpectrum<T>>& spectrum)
+{
+    std::lock_guard<std::mutex> lock(getMutex());
+    
+    Map& map = getMap();
+    
+    // Remove any entries that have lapsed
+    
+    for (auto it = map.begin(); it != map.end(); )
+    {
+        if (it->second.expired())
+            it = map.erase(it);
+        else
+            it++;
+    }
+    
+    map[key] = spectrum;
+    
+    if (spectrum && (spectrum->mBuffer.realp || spectrum->mHalfBuffer.realp))
+        store(key, *spectrum);
+}
+
+template <class T>
+std::shared_ptr<HISSTools::ImpulseSpectrum<T>> HISSTools::SpectrumCache<T>::load(const SpectrumKey& key)
+{
+    uintptr_t typeSize = key.mHalfPrecision ? sizeof(uint16_t) : sizeof(T);
+    std::string path = SpectrumFiles::getPath(key, typeSize);
+    
+    if (path.empty())
+        return nullptr;
+    
+    uintptr_t size = 0;
+    void *mapping = mapFile(path, size);
+    
+    if (!mapping)
+        return nullptr;
+    
+    // Check that the file matches the key and that its size is correct before using it
+    
+    SpectrumFileHeader header;
+    
+    if (size >= sizeof(SpectrumFileHeader))
+    {
+        std::memcpy(&header, mapping, sizeof(SpectrumFileHeader));
+        
+        bool valid = !std::memcmp(header.mMagic, sSpectrumFileMagic, sizeof(sSpectrumFileMagic))
+                  && header.mVersion == sSpectrumFileVersion
+                  && header.mByteOrder == sSpectrumFileByteOrder
+                  && header.mTypeSize == typeSize
+                  && header.mHash == key.mHash
+                  && !std::memcmp(header.mDigest, key.mDigest.data(), sizeof(header.mDigest))
+                  && header.mLength == key.mLength
+                  && header.mFFTSizeLog2 == key.mFFTSizeLog2
+                  && header.mSampleSize == key.mSampleSize
+                  && header.mNumPartitions
+                  && size == sizeof(SpectrumFileHeader) + (header.mNumPartitions << header.mFFTSizeLog2) * typeSize;
+        
+        if (valid)
+        {
+            void *data = static_cast<char *>(mapping) + sizeof(SpectrumFileHeader);
+            
+            // Fault the spectrum in here before it can reach the audio thread
+            
+            prefaultFile(mapping, size);
+            
+            try
+            {
+                return std::make_shared<ImpulseSpectrum<T>>(key.mFFTSizeLog2, header.mNumPartitions, data, key.mHalfPrecision, mapping, size);
+            }
+            catch (std::bad_alloc&) {}
+        }
+    }
+    
+    unmapFile(mapping, size);
+    
+    return nullptr;
+}
+
+template <class T>
+void HISSTools::SpectrumCache<T>::store(const SpectrumKey& key, const ImpulseSpectrum<T>& spectrum)
+{
+    uintptr_t typeSize = key.mHalfPrecision ? sizeof(uint16_t) : sizeof(T);
+    std::string path = SpectrumFiles::getPath(key, typeSize);
+    
+    if (path.empty() || key.mHalfPrecision != (spectrum.mHalfBuffer.realp != nullptr))
+        return;
+    
+    SpectrumFileHeader header;
+    
+    std::memcpy(header.mMagic, sSpectrumFileMagic, sizeof(sSpectrumFileMagic));
+    header.mVersion = sSpectrumFileVersion;
+    header.mByteOrder = sSpectrumFileByteOrder;
+    header.mTypeSize = static_cast<uint32_t>(typeSize);
+    header.mHash = key.mHash;
+    header.mLength = key.mLength;
+    header.mFFTSizeLog2 = key.mFFTSizeLog2;
+    header.mSampleSize = key.mSampleSize;
+    header.mNumPartitions = spectrum.mNumPartitions;
+    header.mPadding = 0;
+    std::memcpy(header.mDigest, key.mDigest.data(), sizeof(header.mDigest));
+    std::memset(header.mReserved, 0, sizeof(header.mReserved));
+    
+    // Write to a temporary file and then rename it so that a partial file is never seen by another process
+    
+    uintptr_t size = spectrum.mNumPartitions << (spectrum.mFFTSizeLog2 - 1);
+    std::string tempPath = path + "." + std::to_string(std::random_device()()) + ".tmp";
+    FILE *file = fopen(tempPath.c_str(), "wb");
+    
+    if (!file)
+        return;
+    
+    bool written = fwrite(&header, sizeof(SpectrumFileHeader), 1, file) == 1
+                && fwrite(key.mHalfPrecision ? static_cast<const void *>(spectrum.mHalfBuffer.realp) : spectrum.mBuffer.realp, typeSize, size, file) == size
+                && fwrite(key.mHalfPrecision ? static_cast<const void *>(spectrum.mHalfBuffer.imagp) : spectrum.mBuffer.imagp, typeSize, size, file) == size;
+    
+    if (fclose(file) || !written || std::rename(tempPath.c_str(), path.c_str()))
+        std::remove(tempPath.c_str());
+}
+
+template <class T>
+typename HISSTools::SpectrumCache<T>::Map& HISSTools::SpectrumCache<T>::getMap()
+{
+    static Map map;
+    
+    return map;
+}
+
+template <class T>
+std::mutex& HISSTools::SpectrumCache<T>::getMutex()
+{
+    static std::mutex mutex;
+    
+    return mutex;
+}
+
+// Explicit instantiations
+
+template class HISSTools::SharedFFTSetup<float>;
+template class HISSTools::SharedFFTSetup<double>;
+
+template struct HISSTools::ImpulseSpectrum<float>;
+template struct HISSTools::ImpulseSpectrum<double>;
+
+template class HISSTools::SpectrumCache<float>;
+template class HISSTools::SpectrumCache<double>;
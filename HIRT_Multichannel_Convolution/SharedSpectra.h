@@ -0,0 +1,144 @@
+
+#pragma once
+
+#include "ConvolveFFTTypes.h"
+#include "ConvolveAllocator.h"
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace HISSTools
+{
+    // FFT setups are read-only once created, so one setup per size is shared by all engines of a sample type
+    // A setup is destroyed when the last engine using it is destroyed
+    
+    template <class T>
+    class SharedFFTSetup
+    {
+        typedef typename FFTTypes<T>::Setup Setup;
+    
+    public:
+        
+        static std::shared_ptr<const SharedFFTSetup> acquire(uintptr_t FFTSizeLog2);
+        
+        SharedFFTSetup(uintptr_t FFTSizeLog2);
+        ~SharedFFTSetup();
+        
+        // Non-moveable and copyable
+        
+        SharedFFTSetup(SharedFFTSetup& obj) = delete;
+        SharedFFTSetup& operator = (SharedFFTSetup& obj) = delete;
+        SharedFFTSetup(SharedFFTSetup&& obj) = delete;
+        SharedFFTSetup& operator = (SharedFFTSetup&& obj) = delete;
+        
+        Setup get() const { return mSetup; }
+    
+    private:
+        
+        Setup mSetup;
+    };
+    
+    // The partition spectra of one impulse (the buffer may be null if memory could not be allocated)
+    // The buffer is either allocated or a read-only mapping of a spectrum file (data points into the mapping)
+    // Spectra are loaded at full precision and may then be converted to bfloat16 (only one of the buffers is valid)
+    // An allocated buffer keeps its allocator alive (as the spectrum may be shared with objects using other allocators)
+    
+    template <class T>
+    struct ImpulseSpectrum
+    {
+        typedef typename FFTTypes<T>::Split Split;
+        
+        ImpulseSpectrum(uintptr_t FFTSizeLog2, uintptr_t numPartitions, AllocatorPtr allocator = nullptr);
+        ImpulseSpectrum(uintptr_t FFTSizeLog2, uintptr_t numPartitions, void *data, bool halfPrecision, void *mapping, uintptr_t mappingSize);
+        ~ImpulseSpectrum();
+        
+        // Non-moveable and copyable
+        
+        ImpulseSpectrum(ImpulseSpectrum& obj) = delete;
+        ImpulseSpectrum& operator = (ImpulseSpectrum& obj) = delete;
+        ImpulseSpectrum(ImpulseSpectrum&& obj) = delete;
+        ImpulseSpectrum& operator = (ImpulseSpectrum&& obj) = delete;
+        
+        // Returns false if memory cannot be allocated (in which case the spectrum remains at full precision)
+        
+        bool convertToHalf();
+        
+        Split mBuffer;
+        HalfSplit mHalfBuffer;
+        uintptr_t mFFTSizeLog2;
+        uintptr_t mNumPartitions;
+        
+        void *mMapping;
+        uintptr_t mMappingSize;
+        
+        AllocatorPtr mAllocator;
+    };
+    
+    // Identifies the samples an impulse spectrum was made from (by content, so that copies of an impulse also match)
+    // Samples are compared by their SHA-256 digest (the hash is the start of the digest and names spectrum files)
+    
+    struct SpectrumKey
+    {
+        bool operator < (const SpectrumKey& b) const;
+        
+        uint64_t mHash = 0;
+        std::array<uint8_t, 32> mDigest = {};
+        uintptr_t mLength = 0;
+        uintptr_t mFFTSizeLog2 = 0;
+        uintptr_t mSampleSize = 0;
+        bool mHalfPrecision = false;
+    };
+    
+    // An optional directory of spectrum files, so that impulses loaded in a previous session need no FFTs
+    // Spectra are written when first computed and mapped straight into memory when next needed (an empty path disables files)
+    // N.B. files are named by key and are only used if they match the key, sample type and byte order of the process
+    
+    class SpectrumFiles
+    {
+    public:
+        
+        static void setDirectory(const char *path);
+        static std::string getDirectory();
+        
+        static std::string getPath(const SpectrumKey& key, uintptr_t typeSize);
+    
+    private:
+        
+        static std::mutex& getMutex();
+        static std::string& getStorage();
+    };
+    
+    // A process-wide cache of the spectra in use, so that engines loading the same impulse reference a single copy
+    // The cache does not own the spectra (an entry lapses when the last engine referencing it drops it)
+    // Spectra not in use are looked for in the spectrum files (if a directory is set) and new spectra are written there
+    // N.B. a spectrum must not be modified once it has been inserted
+    
+    template <class T>
+    class SpectrumCache
+    {
+        typedef std::map<SpectrumKey, std::weak_ptr<ImpulseSpectrum<T>>> Map;
+    
+    public:
+        
+        static SpectrumKey makeKey(const float *input, uintptr_t length, uintptr_t FFTSizeLog2);
+        static SpectrumKey makeKey(const double *input, uintptr_t length, uintptr_t FFTSizeLog2);
+        
+        static std::shared_ptr<ImpulseSpectrum<T>> find(const SpectrumKey& key);
+        static void insert(const SpectrumKey& key, const std::shared_ptr<ImpulseSpectrum<T>>& spectrum);
+    
+    private:
+        
+        template <class U>
+        static SpectrumKey makeKeyTyped(const U *input, uintptr_t length, uintptr_t FFTSizeLog2);
+        
+        static std::shared_ptr<ImpulseSpectrum<T>> load(const SpectrumKey& key);
+        static void store(const SpectrumKey& key, const ImpulseSpectrum<T>& spectrum);
+        
+        static Map& getMap();
+        static std::mutex& getMutex();
+    };
+}
@@ -4,7 +4,7 @@
  *
  *    TimeDomainConvolve performs real-time zero latency time-based convolution.
  *
- *    Typically TimeDomainConvolve is suitable for use in conjunction with PartitionedConvolve for zero-latency convolution with longer impulses (time_domain_convolve use apple's vDSP and the IR length is limited to 2044 samples).
+ *    Typically TimeDomainConvolve is suitable for use in conjunction with PartitionedConvolve for zero-latency convolution with longer impulses (time_domain_convolve use apple's vDSP where available and the maximum IR length is set on construction).
  *    Note that in fact the algorithms process correlation with reversed impulse response coeffients - which is equivalent to convolution.
  *
  *  Copyright 2012 Alex Harker. All rights reserved.
@@ -12,9 +12,10 @@
  */
 
 #include "TimeDomainConvolve.h"
-#include "ConvolveSIMD.h"
+#include "ConvolveKernels.h"
 
 #include <algorithm>
+#include <new>
 
 #ifdef __APPLE__
 #include <Accelerate/Accelerate.h>
@@ -30,8 +31,18 @@ uintptr_t padded_length(uintptr_t length)
 }
 #endif
 
-HISSTools::TimeDomainConvolve::TimeDomainConvolve(uintptr_t offset, uintptr_t length) : mInputPosition(0), mImpulseLength(0)
+template <class T>
+HISSTools::TimeDomainConvolveT<T>::TimeDomainConvolveT(uintptr_t offset, uintptr_t length, AllocatorPtr allocator)
+: mAllocator(ConvolveAllocator::select(allocator)), mInputPosition(0), mImpulseLength(0), mSilentSamples(0)
 {
+    // The maximum length is the length requested (but never less than the default)
+    
+    mMaxLength = std::max(length, uintptr_t(DEFAULT_MAX_LENGTH));
+    
+    // The input is stored twice so the buffer size must allow for the longest impulse plus the largest loop size
+    
+    mBufferSize = std::max(uintptr_t(4096), padded_length(mMaxLength) * 2);
+    
     // Set default initial variables
     
     setOffset(offset);
@@ -39,34 +50,60 @@ HISSTools::TimeDomainConvolve::TimeDomainConvolve(uintptr_t offset, uintptr_t le
     
     // Allocate impulse buffer and input bufferr
     
-    mImpulseBuffer = (float *) ALIGNED_MALLOC(sizeof(float) * 2048);
-    mInputBuffer = (float *) ALIGNED_MALLOC(sizeof(float) * 8192);
+    mImpulseBuffer = mAllocator->allocate<T>(padded_length(mMaxLength));
+    mInputBuffer = mAllocator->allocate<T>(mBufferSize * 2);
+    
+    // N.B. the destructor is not called if construction fails, so free any buffer that was allocated
+    
+    if (!mImpulseBuffer || !mInputBuffer)
+    {
+        mAllocator->deallocate(mImpulseBuffer);
+        mAllocator->deallocate(mInputBuffer);
+        throw std::bad_alloc();
+    }
     
     // Zero buffers
     
-    std::fill_n(mImpulseBuffer, 2048, 0.f);
-    std::fill_n(mInputBuffer, 8192, 0.f);
+    std::fill_n(mImpulseBuffer, padded_length(mMaxLength), T(0));
+    std::fill_n(mInputBuffer, mBufferSize * 2, T(0));
 }
 
-HISSTools::TimeDomainConvolve::~TimeDomainConvolve()
+template <class T>
+HISSTools::TimeDomainConvolveT<T>::~TimeDomainConvolveT()
 {
-    ALIGNED_FREE(mImpulseBuffer);
-    ALIGNED_FREE(mInputBuffer);
+    mAllocator->deallocate(mImpulseBuffer);
+    mAllocator->deallocate(mInputBuffer);
 }
 
-void HISSTools::TimeDomainConvolve::setOffset(uintptr_t offset)
+template <class T>
+void HISSTools::TimeDomainConvolveT<T>::setOffset(uintptr_t offset)
 {
     mOffset = offset;
 }
 
-ConvolveError HISSTools::TimeDomainConvolve::setLength(uintptr_t length)
+template <class T>
+ConvolveError HISSTools::TimeDomainConvolveT<T>::setLength(uintptr_t length)
 {
-    mLength = std::min(length, uintptr_t(2044));
+    mLength = std::min(length, mMaxLength);
     
-    return length > 2044 ? CONVOLVE_ERR_TIME_LENGTH_OUT_OF_RANGE : CONVOLVE_ERR_NONE;
+    return length > mMaxLength ? CONVOLVE_ERR_TIME_LENGTH_OUT_OF_RANGE : CONVOLVE_ERR_NONE;
+}
+
+template <class T>
+ConvolveError HISSTools::TimeDomainConvolveT<T>::set(const float *input, uintptr_t length)
+{
+    return setImpulse(input, length);
+}
+
+template <class T>
+ConvolveError HISSTools::TimeDomainConvolveT<T>::set(const double *input, uintptr_t length)
+{
+    return setImpulse(input, length);
 }
 
-ConvolveError HISSTools::TimeDomainConvolve::set(const float *input, uintptr_t length)
+template <class T>
+template <class U>
+ConvolveError HISSTools::TimeDomainConvolveT<T>::setImpulse(const U *input, uintptr_t length)
 {
     mImpulseLength = 0;
     
@@ -74,19 +111,20 @@ ConvolveError HISSTools::TimeDomainConvolve::set(const float *input, uintptr_t l
     {
         // Calculate impulse length
         
-        mImpulseLength = std::min(length - mOffset, (mLength ? mLength : 2044));
+        mImpulseLength = std::min(length - mOffset, (mLength ? mLength : mMaxLength));
     
         uintptr_t pad = padded_length(mImpulseLength) - mImpulseLength;
-        std::fill_n(mImpulseBuffer, pad, 0.f);
+        std::fill_n(mImpulseBuffer, pad, T(0));
         std::reverse_copy(input + mOffset, input + mOffset + mImpulseLength, mImpulseBuffer + pad);
     }
     
     reset();
     
-    return (!mLength && (length - mOffset) > 2044) ? CONVOLVE_ERR_TIME_IMPULSE_TOO_LONG : CONVOLVE_ERR_NONE;
+    return (!mLength && (length - mOffset) > mMaxLength) ? CONVOLVE_ERR_TIME_IMPULSE_TOO_LONG : CONVOLVE_ERR_NONE;
 }
 
-void HISSTools::TimeDomainConvolve::reset()
+template <class T>
+void HISSTools::TimeDomainConvolveT<T>::reset()
 {
     mReset = true;
 }
@@ -96,61 +134,124 @@ void convolve(const float *in, const float *impulse, float *output, uintptr_t N,
 {
     vDSP_conv(in + 1 - L,  1, impulse, 1, output, 1, N, L);
 }
+
+void convolve(const double *in, const double *impulse, double *output, uintptr_t N, uintptr_t L)
+{
+    vDSP_convD(in + 1 - L,  1, impulse, 1, output, 1, N, L);
+}
 #else
-void convolve(const float *in, const float *impulse, float *output, uintptr_t N, uintptr_t L)
+
+// Several vectors of outputs are calculated together so that the partial sums remain in registers
+// Each impulse sample is broadcast and multiplied with the input, so no horizontal sums are required
+
+template <class T, class S = typename T::scalar_type>
+void convolveBlock4(const S *in, const S *impulse, S *output, uintptr_t L)
 {
-    constexpr int size = FloatVector::size;
+    T outputAccum1(S(0));
+    T outputAccum2(S(0));
+    T outputAccum3(S(0));
+    T outputAccum4(S(0));
     
-    L = padded_length(L);
+    for (uintptr_t j = 0; j < L; j++, in++)
+    {
+        const T impulseValue(impulse[j]);
+        
+        outputAccum1 = fmadd(impulseValue, T::unaligned_load(in + T::size * 0), outputAccum1);
+        outputAccum2 = fmadd(impulseValue, T::unaligned_load(in + T::size * 1), outputAccum2);
+        outputAccum3 = fmadd(impulseValue, T::unaligned_load(in + T::size * 2), outputAccum3);
+        outputAccum4 = fmadd(impulseValue, T::unaligned_load(in + T::size * 3), outputAccum4);
+    }
     
-    const FloatVector *impulse_vector = reinterpret_cast<const FloatVector *>(impulse);
+    outputAccum1.unaligned_store(output + T::size * 0);
+    outputAccum2.unaligned_store(output + T::size * 1);
+    outputAccum3.unaligned_store(output + T::size * 2);
+    outputAccum4.unaligned_store(output + T::size * 3);
+}
+
+template <class T, class S = typename T::scalar_type>
+void convolveBlock1(const S *in, const S *impulse, S *output, uintptr_t L)
+{
+    T outputAccum(S(0));
+    
+    for (uintptr_t j = 0; j < L; j++, in++)
+        outputAccum = fmadd(T(impulse[j]), T::unaligned_load(in), outputAccum);
+    
+    outputAccum.unaligned_store(output);
+}
+
+template <class T>
+void convolve(const T *in, const T *impulse, T *output, uintptr_t N, uintptr_t L)
+{
+    typedef WideVector<T> VecType;
+    
+    constexpr uintptr_t size = VecType::size;
+    constexpr uintptr_t blockSize = size * 4;
+    
+    // The impulse is zero padded at the start so skip the padding
+    
+    impulse += padded_length(L) - L;
+    in += 1 - L;
+    
+    uintptr_t i = 0;
+    
+    for (; i + blockSize <= N; i += blockSize)
+        convolveBlock4<VecType>(in + i, impulse, output + i, L);
     
-    for (uintptr_t i = 0; i < N; i++)
+    for (; i + size <= N; i += size)
+        convolveBlock1<VecType>(in + i, impulse, output + i, L);
+    
+    for (; i < N; i++)
     {
-        FloatVector outputAccum(0.f);
-        const float *input = in - L + 1 + i - size;
+        T outputAccum = 0;
         
-        for (uintptr_t j = 0; j < L >> 2; j += 4)
-        {
-            // Load vals
+        for (uintptr_t j = 0; j < L; j++)
+            outputAccum += impulse[j] * in[i + j];
             
-            outputAccum += (impulse_vector[j + 0] * FloatVector::unaligned_load(input += size));
-            outputAccum += (impulse_vector[j + 1] * FloatVector::unaligned_load(input += size));
-            outputAccum += (impulse_vector[j + 2] * FloatVector::unaligned_load(input += size));
-            outputAccum += (impulse_vector[j + 3] * FloatVector::unaligned_load(input += size));
-        }
-        
-        *output++ = outputAccum.sum();
+        output[i] = outputAccum;
     }
 }
 #endif
 
-bool HISSTools::TimeDomainConvolve::process(const float *in, float *out, uintptr_t numSamples)
+template <class T>
+bool HISSTools::TimeDomainConvolveT<T>::process(const T *in, T *out, uintptr_t numSamples)
 {
     if (mReset)
     {
-        std::fill_n(mInputBuffer, 8192, 0.f);
+        std::fill_n(mInputBuffer, mBufferSize * 2, T(0));
+        mSilentSamples = mBufferSize;
         mReset = false;
     }
     
-    uintptr_t currentLoop;
+    // N.B. the loop size is limited so that input is never overwritten before it has been read
+    
+    uintptr_t maxLoop = mBufferSize - padded_length(mMaxLength);
     
-    while ((currentLoop = (mInputPosition + numSamples) > 4096 ? (4096 - mInputPosition) : ((numSamples > 2048) ? 2048 : numSamples)))
+    while (numSamples)
     {
+        uintptr_t currentLoop = std::min(numSamples, std::min(mBufferSize - mInputPosition, maxLoop));
+        
         // Copy input twice (allows us to read input out in one go)
         
         std::copy_n(in, currentLoop, mInputBuffer + mInputPosition);
-        std::copy_n(in, currentLoop, mInputBuffer + mInputPosition + 4096);
+        std::copy_n(in, currentLoop, mInputBuffer + mInputPosition + mBufferSize);
+        
+        // Do convolution (unless the input has been silent for long enough that the output must be silent)
+        
+        if (isSilent(in, currentLoop))
+            mSilentSamples = std::min(mSilentSamples + currentLoop, mBufferSize);
+        else
+            mSilentSamples = 0;
+        
+        if (mSilentSamples + 1 >= currentLoop + mImpulseLength)
+            std::fill_n(out, currentLoop, T(0));
+        else
+            convolve(mInputBuffer + mBufferSize + mInputPosition, mImpulseBuffer, out, currentLoop, mImpulseLength);
 
         // Advance pointer
         
         mInputPosition += currentLoop;
-        if (mInputPosition >= 4096)
-            mInputPosition -= 4096;
-        
-        // Do convolution
-        
-        convolve(mInputBuffer + 4096 + (mInputPosition - currentLoop), mImpulseBuffer, out, currentLoop, mImpulseLength);
+        if (mInputPosition >= mBufferSize)
+            mInputPosition -= mBufferSize;
         
         // Updates
         
@@ -161,3 +262,8 @@ bool HISSTools::TimeDomainConvolve::process(const float *in, float *out, uintptr
     
     return mImpulseLength;
 }
+
+// Explicit instantiations
+
+template class HISSTools::TimeDomainConvolveT<float>;
+template class HISSTools::TimeDomainConvolveT<double>;
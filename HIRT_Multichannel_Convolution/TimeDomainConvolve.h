@@ -2,49 +2,71 @@
 #pragma once
 
 #include "ConvolveErrors.h"
+#include "ConvolveAllocator.h"
 
 #include <cstdint>
 
 namespace HISSTools
 {
-    class TimeDomainConvolve
+    template <class T>
+    class TimeDomainConvolveT
     {
+        // The default maximum length (a longer length may be requested on construction)
+        
+        static constexpr int DEFAULT_MAX_LENGTH = 2044;
         
     public:
         
-        TimeDomainConvolve(uintptr_t offset, uintptr_t length);
-        ~TimeDomainConvolve();
+        // The length given on construction is the maximum length (if it is longer than the default)
+        // Buffers are taken from the allocator (or the system if it is null)
+        
+        TimeDomainConvolveT(uintptr_t offset, uintptr_t length, AllocatorPtr allocator = nullptr);
+        ~TimeDomainConvolveT();
         
         // Non-moveable and copyable
         
-        TimeDomainConvolve(TimeDomainConvolve& obj) = delete;
-        TimeDomainConvolve& operator = (TimeDomainConvolve& obj) = delete;
-        TimeDomainConvolve(TimeDomainConvolve&& obj) = delete;
-        TimeDomainConvolve& operator = (TimeDomainConvolve&& obj) = delete;
+        TimeDomainConvolveT(TimeDomainConvolveT& obj) = delete;
+        TimeDomainConvolveT& operator = (TimeDomainConvolveT& obj) = delete;
+        TimeDomainConvolveT(TimeDomainConvolveT&& obj) = delete;
+        TimeDomainConvolveT& operator = (TimeDomainConvolveT&& obj) = delete;
         
         ConvolveError setLength(uintptr_t length);
         void setOffset(uintptr_t offset);
         
         ConvolveError set(const float *input, uintptr_t length);
+        ConvolveError set(const double *input, uintptr_t length);
         void reset();
         
-        bool process(const float *in, float *out, uintptr_t numSamples);
+        bool process(const T *in, T *out, uintptr_t numSamples);
         
     private:
         
+        template <class U>
+        ConvolveError setImpulse(const U *input, uintptr_t length);
+        
         // Internal buffers
         
-        float *mImpulseBuffer;
-        float *mInputBuffer;
+        AllocatorPtr mAllocator;
         
+        T *mImpulseBuffer;
+        T *mInputBuffer;
+        
+        uintptr_t mBufferSize;
         uintptr_t mInputPosition;
         uintptr_t mImpulseLength;
+        uintptr_t mMaxLength;
         
         uintptr_t mOffset;
         uintptr_t mLength;
         
+        // The number of silent samples at the end of the input
+        
+        uintptr_t mSilentSamples;
+        
         // Flags
         
         bool mReset;
     };
+    
+    typedef TimeDomainConvolveT<float> TimeDomainConvolve;
 }
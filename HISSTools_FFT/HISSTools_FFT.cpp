@@ -48,6 +48,33 @@ void hisstools_rifft(FFT_SETUP_F setup, FFT_SPLIT_COMPLEX_F *input, uintptr_t lo
     vDSP_fft_zrip(setup, input, (vDSP_Stride) 1, log2n, FFT_INVERSE);
 }
 
+// Staged FFT Routines (the Apple FFT cannot be split so each transform is a single stage)
+
+uintptr_t hisstools_rfft_stages(uintptr_t log2n)
+{
+    return 1;
+}
+
+void hisstools_rfft_stage(FFT_SETUP_D setup, FFT_SPLIT_COMPLEX_D *input, uintptr_t log2n, uintptr_t stage)
+{
+    hisstools_rfft(setup, input, log2n);
+}
+
+void hisstools_rfft_stage(FFT_SETUP_F setup, FFT_SPLIT_COMPLEX_F *input, uintptr_t log2n, uintptr_t stage)
+{
+    hisstools_rfft(setup, input, log2n);
+}
+
+void hisstools_rifft_stage(FFT_SETUP_D setup, FFT_SPLIT_COMPLEX_D *input, uintptr_t log2n, uintptr_t stage)
+{
+    hisstools_rifft(setup, input, log2n);
+}
+
+void hisstools_rifft_stage(FFT_SETUP_F setup, FFT_SPLIT_COMPLEX_F *input, uintptr_t log2n, uintptr_t stage)
+{
+    hisstools_rifft(setup, input, log2n);
+}
+
 // Zip and Unzip
 
 void hisstools_unzip(const double *input, FFT_SPLIT_COMPLEX_D *output, uintptr_t log2n)
@@ -150,6 +177,33 @@ void hisstools_rifft(FFT_SETUP_F setup, FFT_SPLIT_COMPLEX_F *input, uintptr_t lo
     hisstools_fft_impl::hisstools_rifft(input, setup, log2n);
 }
 
+// Staged FFT Routines
+
+uintptr_t hisstools_rfft_stages(uintptr_t log2n)
+{
+    return hisstools_fft_impl::hisstools_rfft_stages(log2n);
+}
+
+void hisstools_rfft_stage(FFT_SETUP_D setup, FFT_SPLIT_COMPLEX_D *input, uintptr_t log2n, uintptr_t stage)
+{
+    hisstools_fft_impl::hisstools_rfft_stage(input, setup, log2n, stage);
+}
+
+void hisstools_rfft_stage(FFT_SETUP_F setup, FFT_SPLIT_COMPLEX_F *input, uintptr_t log2n, uintptr_t stage)
+{
+    hisstools_fft_impl::hisstools_rfft_stage(input, setup, log2n, stage);
+}
+
+void hisstools_rifft_stage(FFT_SETUP_D setup, FFT_SPLIT_COMPLEX_D *input, uintptr_t log2n, uintptr_t stage)
+{
+    hisstools_fft_impl::hisstools_rifft_stage(input, setup, log2n, stage);
+}
+
+void hisstools_rifft_stage(FFT_SETUP_F setup, FFT_SPLIT_COMPLEX_F *input, uintptr_t log2n, uintptr_t stage)
+{
+    hisstools_fft_impl::hisstools_rifft_stage(input, setup, log2n, stage);
+}
+
 // Zip and Unzip
 
 void hisstools_unzip(const double *input, FFT_SPLIT_COMPLEX_D *output, uintptr_t log2n)
@@ -215,6 +269,13 @@ void hisstools_unzip_zero(const float *input, FFT_SPLIT_COMPLEX_D *output, uintp
     hisstools_fft_impl::unzip_zero<double>(input, output, in_length, log2n);
 }
 
+// N.B This routine specifically deals with unzipping double data into a single precision complex split format
+
+void hisstools_unzip_zero(const double *input, FFT_SPLIT_COMPLEX_F *output, uintptr_t in_length, uintptr_t log2n)
+{
+    hisstools_fft_impl::unzip_zero<float>(input, output, in_length, log2n);
+}
+
 // Convenience Real FFT Functions
 
 void hisstools_rfft(FFT_SETUP_D setup, const double *input, FFT_SPLIT_COMPLEX_D *output, uintptr_t in_length, uintptr_t log2n)
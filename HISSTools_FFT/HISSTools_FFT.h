@@ -281,6 +281,68 @@ void hisstools_rifft(FFT_SETUP_D setup, FFT_SPLIT_COMPLEX_D *input, double *outp
 
 void hisstools_rifft(FFT_SETUP_F setup, FFT_SPLIT_COMPLEX_F *input, float *output, uintptr_t log2n);
 
+/**
+    hisstools_rfft_stages() returns the number of stages used to perform a real FFT or iFFT of a given size in stages.
+
+	@param	log2n		The log base 2 of the FFT size.
+
+	@remark             Each stage is of similar cost, so that the work of a large transform can be spread over time. Smaller FFTs (and those using the Apple FFT) are performed in a single stage.
+ */
+
+uintptr_t hisstools_rfft_stages(uintptr_t log2n);
+
+/**
+    hisstools_rfft_stage() performs a single stage of an in-place real Fast Fourier Transform.
+
+	@param	setup		A FFT_SETUP_D that has been created to deal with an appropriate maximum size of FFT.
+	@param	input		A pointer to a FFT_SPLIT_COMPLEX_D structure containing a complex input.
+	@param	log2n		The log base 2 of the FFT size.
+	@param	stage		The stage to perform (from zero to one less than the result of hisstools_rfft_stages()).
+
+	@remark             Performing every stage in order gives exactly the same result as hisstools_rfft(). The input should not be altered until all stages have been performed.
+ */
+
+void hisstools_rfft_stage(FFT_SETUP_D setup, FFT_SPLIT_COMPLEX_D *input, uintptr_t log2n, uintptr_t stage);
+
+/**
+    hisstools_rfft_stage() performs a single stage of an in-place real Fast Fourier Transform.
+
+	@param	setup		A FFT_SETUP_F that has been created to deal with an appropriate maximum size of FFT.
+	@param	input		A pointer to a FFT_SPLIT_COMPLEX_F structure containing a complex input.
+	@param	log2n		The log base 2 of the FFT size.
+	@param	stage		The stage to perform (from zero to one less than the result of hisstools_rfft_stages()).
+
+	@remark             Performing every stage in order gives exactly the same result as hisstools_rfft(). The input should not be altered until all stages have been performed.
+ */
+
+void hisstools_rfft_stage(FFT_SETUP_F setup, FFT_SPLIT_COMPLEX_F *input, uintptr_t log2n, uintptr_t stage);
+
+/**
+    hisstools_rifft_stage() performs a single stage of an in-place inverse real Fast Fourier Transform.
+
+	@param	setup		A FFT_SETUP_D that has been created to deal with an appropriate maximum size of FFT.
+	@param	input		A pointer to a FFT_SPLIT_COMPLEX_D structure containing a complex input.
+	@param	log2n		The log base 2 of the FFT size.
+	@param	stage		The stage to perform (from zero to one less than the result of hisstools_rfft_stages()).
+
+	@remark             Performing every stage in order gives exactly the same result as hisstools_rifft(). The input should not be altered until all stages have been performed.
+ */
+
+void hisstools_rifft_stage(FFT_SETUP_D setup, FFT_SPLIT_COMPLEX_D *input, uintptr_t log2n, uintptr_t stage);
+
+/**
+    hisstools_rifft_stage() performs a single stage of an in-place inverse real Fast Fourier Transform.
+
+	@param	setup		A FFT_SETUP_F that has been created to deal with an appropriate maximum size of FFT.
+	@param	input		A pointer to a FFT_SPLIT_COMPLEX_F structure containing a complex input.
+	@param	log2n		The log base 2 of the FFT size.
+	@param	stage		The stage to perform (from zero to one less than the result of hisstools_rfft_stages()).
+
+	@remark             Performing every stage in order gives exactly the same result as hisstools_rifft(). The input should not be altered until all stages have been performed.
+ */
+
+void hisstools_rifft_stage(FFT_SETUP_F setup, FFT_SPLIT_COMPLEX_F *input, uintptr_t log2n, uintptr_t stage);
+
 /**
  hisstools_unzip_zero() performs unzipping and zero-padding prior to an in-place real FFT.
  
@@ -320,6 +382,19 @@ void hisstools_unzip_zero(const float *input, FFT_SPLIT_COMPLEX_F *output, uintp
 
 void hisstools_unzip_zero(const float *input, FFT_SPLIT_COMPLEX_D *output, uintptr_t in_length, uintptr_t log2n);
 
+/**
+    hisstools_unzip_zero() performs unzipping and zero-padding prior to an in-place real FFT.
+ 
+	@param	input		A pointer to the real double-precision input.
+	@param	output		A pointer to a FFT_SPLIT_COMPLEX_F structure to unzip to.
+	@param	in_length   The actual length of the input
+	@param	log2n		The log base 2 of the FFT size.
+	
+	@remark             Prior to running a real FFT the data must be unzipped from a contiguous memory location into a complex split structure. This function performs unzipping, and zero-pads any remaining input for inputs that may not match the length of the FFT. This version allows a double-precision input to be unzipped directly to a single-precision complex split structure.
+ */
+
+void hisstools_unzip_zero(const double *input, FFT_SPLIT_COMPLEX_F *output, uintptr_t in_length, uintptr_t log2n);
+
 /**
     hisstools_unzip() performs unzipping prior to an in-place real FFT.
  
@@ -279,14 +279,20 @@ namespace hisstools_fft_impl{
         
         static void deinterleave(const SIMDVector *input, SIMDVector *outReal, SIMDVector *outImag)
         {
-            *outReal = _mm512_unpacklo_pd(input[0].mVal, input[1].mVal);
-            *outImag = _mm512_unpackhi_pd(input[0].mVal, input[1].mVal);
+            const __m512i real = _mm512_setr_epi64(0, 2, 4, 6, 8, 10, 12, 14);
+            const __m512i imag = _mm512_setr_epi64(1, 3, 5, 7, 9, 11, 13, 15);
+            
+            *outReal = _mm512_permutex2var_pd(input[0].mVal, real, input[1].mVal);
+            *outImag = _mm512_permutex2var_pd(input[0].mVal, imag, input[1].mVal);
         }
         
         static void interleave(const SIMDVector *inReal, const SIMDVector *inImag, SIMDVector *output)
         {
-            output[0] = _mm512_unpacklo_pd(inReal->mVal, inImag->mVal);
-            output[1] = _mm512_unpackhi_pd(inReal->mVal, inImag->mVal);
+            const __m512i lo = _mm512_setr_epi64(0, 8, 1, 9, 2, 10, 3, 11);
+            const __m512i hi = _mm512_setr_epi64(4, 12, 5, 13, 6, 14, 7, 15);
+            
+            output[0] = _mm512_permutex2var_pd(inReal->mVal, lo, inImag->mVal);
+            output[1] = _mm512_permutex2var_pd(inReal->mVal, hi, inImag->mVal);
         }
     };
     
@@ -301,14 +307,20 @@ namespace hisstools_fft_impl{
         
         static void deinterleave(const SIMDVector *input, SIMDVector *outReal, SIMDVector *outImag)
         {
-            *outReal = _mm512_unpacklo_ps(input[0].mVal, input[1].mVal);
-            *outImag = _mm512_unpackhi_ps(input[0].mVal, input[1].mVal);
+            const __m512i real = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+            const __m512i imag = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31);
+            
+            *outReal = _mm512_permutex2var_ps(input[0].mVal, real, input[1].mVal);
+            *outImag = _mm512_permutex2var_ps(input[0].mVal, imag, input[1].mVal);
         }
         
         static void interleave(const SIMDVector *inReal, const SIMDVector *inImag, SIMDVector *output)
         {
-            output[0] = _mm512_unpacklo_ps(inReal->mVal, inImag->mVal);
-            output[1] = _mm512_unpackhi_ps(inReal->mVal, inImag->mVal);
+            const __m512i lo = _mm512_setr_epi32(0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23);
+            const __m512i hi = _mm512_setr_epi32(8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31);
+            
+            output[0] = _mm512_permutex2var_ps(inReal->mVal, lo, inImag->mVal);
+            output[1] = _mm512_permutex2var_ps(inReal->mVal, hi, inImag->mVal);
         }
     };
     
@@ -1178,6 +1190,19 @@ namespace hisstools_fft_impl{
         }
     }
     
+    template<>
+    void unzip_complex(const double *input, DSPSplitComplex *output, uintptr_t half_length)
+    {
+        float *realp = output->realp;
+        float *imagp = output->imagp;
+        
+        for (uintptr_t i = 0; i < half_length; i++)
+        {
+            *realp++ = static_cast<float>(*input++);
+            *imagp++ = static_cast<float>(*input++);
+        }
+    }
+    
 #endif
     
     // Unzip
@@ -1373,4 +1398,79 @@ namespace hisstools_fft_impl{
             small_real_fft<true>(input, fft_log2);
     }
     
+    // ******************** Staged Calls ******************** //
+    
+    // Real FFTs can be performed in stages of similar cost (one per pass) so that the work may be spread over time
+    // Smaller FFTs are performed in a single stage
+    
+    inline uintptr_t hisstools_rfft_stages(uintptr_t fft_log2)
+    {
+        return fft_log2 >= 5 ? fft_log2 - 1 : 1;
+    }
+    
+    // A Single Pass of a Complex FFT (the passes match those of fft_passes)
+    
+    template <class T, int max_vec_size>
+    void fft_pass(Split<T> *input, Setup<T> *setup, uintptr_t fft_log2, uintptr_t pass)
+    {
+        const int A = max_vec_size <  4 ? max_vec_size :  4;
+        const int B = max_vec_size <  8 ? max_vec_size :  8;
+        const int C = max_vec_size < 16 ? max_vec_size : 16;
+        const uintptr_t length = static_cast<uintptr_t>(1u) << fft_log2;
+        const uintptr_t i = pass + 1;
+        
+        if (pass == 0)
+            pass_1_2_reorder<T, A>(input, length);
+        else if (pass == 1 && fft_log2 > 5)
+            pass_3_reorder<T, A>(input, length);
+        else if (pass == 1)
+            pass_3<T, A>(input, length);
+        else if (i == 3 && 3 < (fft_log2 >> 1))
+            pass_trig_table_reorder<T, B>(input, setup, length, 3);
+        else if (i == 3)
+            pass_trig_table<T, B>(input, setup, length, 3);
+        else if (i < (fft_log2 >> 1))
+            pass_trig_table_reorder<T, C>(input, setup, length, i);
+        else
+            pass_trig_table<T, C>(input, setup, length, i);
+    }
+    
+    template <class T>
+    void hisstools_fft_pass(Split<T> *input, Setup<T> *setup, uintptr_t fft_log2, uintptr_t pass)
+    {
+        if (!is_aligned(input->realp) || !is_aligned(input->imagp))
+            fft_pass<T, 1>(input, setup, fft_log2, pass);
+        else
+            fft_pass<T, SIMDLimits<T>::max_size>(input, setup, fft_log2, pass);
+    }
+    
+    // A Stage of a Real FFT
+    
+    template <class T>
+    void hisstools_rfft_stage(Split<T> *input, Setup<T> *setup, uintptr_t fft_log2, uintptr_t stage)
+    {
+        if (fft_log2 < 5)
+            hisstools_rfft(input, setup, fft_log2);
+        else if (stage < fft_log2 - 2)
+            hisstools_fft_pass(input, setup, fft_log2 - 1, stage);
+        else
+            pass_real_trig_table<false>(input, setup, fft_log2);
+    }
+    
+    // A Stage of a Real iFFT
+    
+    template <class T>
+    void hisstools_rifft_stage(Split<T> *input, Setup<T> *setup, uintptr_t fft_log2, uintptr_t stage)
+    {
+        if (fft_log2 < 5)
+            hisstools_rifft(input, setup, fft_log2);
+        else if (!stage)
+            pass_real_trig_table<true>(input, setup, fft_log2);
+        else
+        {
+            Split<T> swap(input->imagp, input->realp);
+            hisstools_fft_pass(&swap, setup, fft_log2 - 1, stage - 1);
+        }
+    }
+    
 } /* hisstools_fft_impl */